@@ -0,0 +1,44 @@
+#!/usr/bin/ruby
+
+# Benchmark listing a large number of domains, which builds one
+# Libvirt::Domain per entry
+
+$: << File.dirname(__FILE__)
+
+require 'libvirt'
+require 'bench_utils.rb'
+
+set_bench_suite("conn")
+
+NDOMAINS = (ENV['BENCH_DOMAINS'] || 1000).to_i
+ITERATIONS = (ENV['BENCH_ITERATIONS'] || 200).to_i
+
+conn = Libvirt::open(BENCH_URI)
+
+doms = []
+NDOMAINS.times do |i|
+  doms << conn.define_domain_xml(bench_domain_xml("rb-libvirt-bench-#{i}"))
+end
+names = conn.list_defined_domains
+
+# BENCHGROUP: listing
+if bench_supported?("conn.list_all_domains", conn, :list_all_domains)
+  bench("conn.list_all_domains #{NDOMAINS}", ITERATIONS) {
+    conn.list_all_domains
+  }
+end
+bench("conn.list_defined_domains #{NDOMAINS}", ITERATIONS) {
+  conn.list_defined_domains
+}
+bench("conn.lookup_domain_by_name", ITERATIONS * 100) {
+  conn.lookup_domain_by_name(names[0])
+}
+bench("conn.find_domain_by_name missing", ITERATIONS * 100) {
+  conn.find_domain_by_name("rb-libvirt-bench-missing")
+}
+
+doms.each { |dom| dom.undefine }
+
+conn.close
+
+finish_bench
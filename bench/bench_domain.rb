@@ -0,0 +1,50 @@
+#!/usr/bin/ruby
+
+# Benchmark the per-call overhead of the domain stats and typed-parameter
+# getters, which go through the result-object builders and the typed
+# parameter conversion in common.c
+
+$: << File.dirname(__FILE__)
+
+require 'libvirt'
+require 'bench_utils.rb'
+
+set_bench_suite("domain")
+
+ITERATIONS = (ENV['BENCH_ITERATIONS'] || 20000).to_i
+
+conn = Libvirt::open(BENCH_URI)
+
+dom = conn.create_domain_xml(bench_domain_xml("rb-libvirt-bench"))
+
+# BENCHGROUP: result objects
+bench("dom.info", ITERATIONS) { dom.info }
+bench("dom.block_stats", ITERATIONS) { dom.block_stats("vda") }
+if bench_supported?("dom.memory_stats", dom, :memory_stats)
+  bench("dom.memory_stats", ITERATIONS) { dom.memory_stats }
+end
+if bench_supported?("dom.cpu_stats", dom, :cpu_stats)
+  bench("dom.cpu_stats total", ITERATIONS) { dom.cpu_stats }
+  bench("dom.cpu_stats per-cpu", ITERATIONS) { dom.cpu_stats(0, 2) }
+end
+
+# BENCHGROUP: typed parameters
+bench("dom.scheduler_parameters", ITERATIONS) { dom.scheduler_parameters }
+bench("dom.scheduler_parameters symbols", ITERATIONS) {
+  dom.scheduler_parameters(0, :keys => :symbol)
+}
+if bench_supported?("dom.memory_parameters", dom, :memory_parameters)
+  bench("dom.memory_parameters", ITERATIONS) { dom.memory_parameters }
+  bench("dom.memory_parameters symbols", ITERATIONS) {
+    dom.memory_parameters(0, :keys => :symbol)
+  }
+end
+if bench_supported?("dom.blkio_parameters", dom, :blkio_parameters)
+  bench("dom.blkio_parameters", ITERATIONS) { dom.blkio_parameters }
+end
+
+dom.destroy
+
+conn.close
+
+finish_bench
@@ -0,0 +1,55 @@
+#!/usr/bin/ruby
+
+# Benchmark how quickly domain events are dispatched to Ruby callbacks
+# through libvirt's default event loop
+
+$: << File.dirname(__FILE__)
+
+require 'libvirt'
+require 'bench_utils.rb'
+
+set_bench_suite("events")
+
+ITERATIONS = (ENV['BENCH_ITERATIONS'] || 2000).to_i
+
+# each transient domain emits a started and a stopped lifecycle event
+EVENTS = ITERATIONS * 2
+
+conn = Libvirt::open(BENCH_URI)
+
+if not bench_supported?("lifecycle events", conn, :domain_event_register_any)
+  conn.close
+  finish_bench
+  exit
+end
+
+Libvirt::event_run_default_impl_in_thread
+
+$events = 0
+$events_done = Queue.new
+
+callback = lambda { |c, dom, event, detail, opaque|
+  $events += 1
+  $events_done << true if $events == EVENTS
+}
+
+id = conn.domain_event_register_any(Libvirt::Connect::DOMAIN_EVENT_ID_LIFECYCLE,
+                                    callback)
+xml = bench_domain_xml("rb-libvirt-bench")
+
+# BENCHGROUP: event dispatch
+GC.start
+allocated = bench_allocated
+start = bench_now
+ITERATIONS.times { conn.create_domain_xml(xml).destroy }
+$events_done.pop
+elapsed = bench_now - start
+allocated = bench_allocated - allocated
+bench_record("lifecycle events", EVENTS, elapsed, allocated)
+puts sprintf("%-40s %10.0f events/s", "", EVENTS / elapsed)
+
+conn.domain_event_deregister_any(id)
+
+conn.close
+
+finish_bench
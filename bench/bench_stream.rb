@@ -0,0 +1,72 @@
+#!/usr/bin/ruby
+
+# Benchmark stream throughput, both through stream.recv_into/stream.send
+# from Ruby and through vol.download_to/vol.upload_from, which pump the data
+# in C
+
+$: << File.dirname(__FILE__)
+
+require 'libvirt'
+require 'bench_utils.rb'
+
+set_bench_suite("stream")
+
+VOL_MB = (ENV['BENCH_VOL_MB'] || 64).to_i
+VOL_SIZE = VOL_MB * 1024 * 1024
+CHUNK = 256 * 1024
+ITERATIONS = (ENV['BENCH_ITERATIONS'] || 5).to_i
+
+conn = Libvirt::open(BENCH_URI)
+
+if not bench_supported?("streams", conn, :list_all_storage_pools, :stream)
+  conn.close
+  finish_bench
+  exit
+end
+
+pool = conn.list_all_storage_pools.find { |p| p.active? }
+vol = pool.create_volume_xml(<<EOF)
+<volume>
+  <name>rb-libvirt-bench.img</name>
+  <capacity>#{VOL_SIZE}</capacity>
+</volume>
+EOF
+
+# BENCHGROUP: Ruby-level streams
+buffer = String.new(:capacity => CHUNK)
+bench("stream.recv_into #{VOL_MB}MB", ITERATIONS, VOL_SIZE) {
+  st = conn.stream
+  vol.download(st, 0, VOL_SIZE)
+  while st.recv_into(buffer, 0, CHUNK) > 0
+  end
+  st.finish
+}
+
+data = "\0" * CHUNK
+bench("stream.send #{VOL_MB}MB", ITERATIONS, VOL_SIZE) {
+  st = conn.stream
+  vol.upload(st, 0, VOL_SIZE)
+  sent = 0
+  while sent < VOL_SIZE
+    sent += st.send(data, 0, [CHUNK, VOL_SIZE - sent].min)
+  end
+  st.finish
+}
+
+# BENCHGROUP: C-level pumps
+if bench_supported?("vol.download_to", vol, :download_to)
+  bench("vol.download_to #{VOL_MB}MB", ITERATIONS, VOL_SIZE) {
+    vol.download_to(File::NULL)
+  }
+end
+if File.exist?("/dev/zero") and bench_supported?("vol.upload_from", vol, :upload_from)
+  bench("vol.upload_from #{VOL_MB}MB", ITERATIONS, VOL_SIZE) {
+    vol.upload_from("/dev/zero", 0, VOL_SIZE)
+  }
+end
+
+vol.delete
+
+conn.close
+
+finish_bench
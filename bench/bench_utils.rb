@@ -0,0 +1,149 @@
+# Shared harness for the benchmarks in this directory.
+#
+# Each bench_*.rb script runs a set of named benchmarks against
+# RUBY_LIBVIRT_BENCH_URI (test:///default unless set), reporting for each
+# the wall time per operation, the Ruby objects allocated per operation and,
+# where a byte count is given, the throughput.  finish_bench then compares
+# the results with the stored baseline for the script, or with BENCH_SAVE=1
+# in the environment, replaces that baseline with them.
+
+require 'json'
+require 'fileutils'
+
+BENCH_URI = ENV['RUBY_LIBVIRT_BENCH_URI'] || "test:///default"
+
+$BENCH_BASELINE_DIR = File.join(File.dirname(__FILE__), 'baselines')
+
+# results slower than the baseline by more than this percentage are flagged
+$BENCH_THRESHOLD = (ENV['BENCH_THRESHOLD'] || 10).to_f
+
+$bench_suite = "unknown"
+$bench_results = {}
+$bench_regressions = 0
+
+def set_bench_suite(suite)
+  $bench_suite = suite
+end
+
+def bench_now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def bench_allocated
+  GC.stat(:total_allocated_objects)
+end
+
+# Run the block +iterations+ times (after a short warm-up) and record the
+# result under +name+.  If the block is expected to move data, +bytes+ is
+# the number of bytes moved by one iteration.  A Libvirt::Error from the
+# warm-up (usually an API the driver does not implement) skips the
+# benchmark; methods missing from the build are checked for up front with
+# bench_supported?.
+def bench(name, iterations, bytes = nil)
+  begin
+    [iterations / 10, 1].max.times { yield }
+  rescue Libvirt::Error => e
+    bench_skipped(name, e.to_s)
+    return
+  end
+
+  GC.start
+  allocated = bench_allocated
+  start = bench_now
+  iterations.times { yield }
+  elapsed = bench_now - start
+  allocated = bench_allocated - allocated
+
+  bench_record(name, iterations, elapsed, allocated, bytes)
+end
+
+# Record a benchmark whose timing was done by the caller, for those (like
+# event dispatch) that can't be expressed as a block run in a loop.
+def bench_record(name, iterations, elapsed, allocated, bytes = nil)
+  result = {
+    'iterations' => iterations,
+    'usec_per_op' => elapsed * 1_000_000 / iterations,
+    'allocs_per_op' => allocated.to_f / iterations,
+  }
+  line = sprintf("%-40s %10.2f us/op %10.1f allocs/op", name,
+                 result['usec_per_op'], result['allocs_per_op'])
+  if not bytes.nil?
+    result['mb_per_sec'] = bytes * iterations / elapsed / (1024 * 1024)
+    line += sprintf(" %10.1f MB/s", result['mb_per_sec'])
+  end
+  puts line
+
+  $bench_results[name] = result
+end
+
+def bench_skipped(name, reason)
+  puts sprintf("%-40s skipped: %s", name, reason)
+end
+
+# Return true if +obj+ responds to all of +methods+, which are missing when
+# ruby-libvirt was built against a libvirt without the matching API.
+# Otherwise report the benchmark +name+ as skipped and return false.
+def bench_supported?(name, obj, *methods)
+  missing = methods.reject { |m| obj.respond_to?(m) }
+  return true if missing.empty?
+
+  bench_skipped(name, "#{obj.class} has no #{missing.join(', ')}")
+  false
+end
+
+def bench_baseline_file
+  File.join($BENCH_BASELINE_DIR, "#{$bench_suite}.json")
+end
+
+def bench_compare(name, result, base)
+  changes = []
+  { 'usec_per_op' => 1, 'allocs_per_op' => 1, 'mb_per_sec' => -1 }.each do |key, sign|
+    next if result[key].nil? or base[key].nil? or base[key] == 0
+    change = (result[key] - base[key]) * 100.0 / base[key]
+    regressed = change * sign > $BENCH_THRESHOLD
+    $bench_regressions += 1 if regressed
+    changes << sprintf("%s %+.1f%%%s", key, change, regressed ? " (REGRESSION)" : "")
+  end
+  puts sprintf("%-40s %s", name, changes.join(", "))
+end
+
+def finish_bench
+  file = bench_baseline_file
+
+  if ENV['BENCH_SAVE']
+    FileUtils.mkdir_p($BENCH_BASELINE_DIR)
+    File.open(file, 'w') { |f| f.write(JSON.pretty_generate($bench_results)) }
+    puts "Saved #{$bench_results.length} results as the baseline in #{file}"
+  elsif File.exist?(file)
+    baseline = JSON.parse(File.read(file))
+    puts "Compared with the baseline in #{file}:"
+    $bench_results.each do |name, result|
+      next if baseline[name].nil?
+      bench_compare(name, result, baseline[name])
+    end
+    puts "#{$bench_regressions} regressions over #{$BENCH_THRESHOLD}%"
+  else
+    puts "No baseline in #{file}; run with BENCH_SAVE=1 to store one"
+  end
+end
+
+# A minimal domain the test driver will accept; optionally with a disk so
+# that there is a block device for block_stats.
+def bench_domain_xml(name)
+  <<EOF
+<domain type='test'>
+  <name>#{name}</name>
+  <memory>8192</memory>
+  <vcpu>2</vcpu>
+  <os>
+    <type>hvm</type>
+  </os>
+  <devices>
+    <disk type='file' device='disk'>
+      <source file='/guest/#{name}.img'/>
+      <target dev='vda' bus='virtio'/>
+    </disk>
+  </devices>
+</domain>
+EOF
+end
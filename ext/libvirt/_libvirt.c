@@ -38,6 +38,11 @@
 #include "interface.h"
 #include "domain.h"
 #include "stream.h"
+#include "cpumap.h"
+#include "sampler.h"
+#include "pool.h"
+#include "console.h"
+#include "xmlcache.h"
 
 static VALUE c_libvirt_version;
 
@@ -86,12 +91,24 @@ static VALUE libvirt_version(int argc, VALUE *argv,
     return result;
 }
 
+/* set while Libvirt::event_register_impl has Ruby callbacks in place */
+static int ruby_event_impl_registered;
+
+void ruby_libvirt_event_impl_check(const char *method)
+{
+    if (ruby_event_impl_registered) {
+        ruby_libvirt_main_ractor_only(method);
+    }
+}
+
 /*
  * call-seq:
  *   Libvirt::open(uri=nil) -> Libvirt::Connect
  *
  * Call virConnectOpen[http://www.libvirt.org/html/libvirt-libvirt-host.html#virConnectOpen]
- * to open a connection to a URL.
+ * to open a connection to a URL.  While Ruby event callbacks are registered
+ * with Libvirt::event_register_impl, this can only be called from the main
+ * Ractor.
  */
 static VALUE libvirt_open(int argc, VALUE *argv, VALUE RUBY_LIBVIRT_UNUSED(m))
 {
@@ -100,6 +117,8 @@ static VALUE libvirt_open(int argc, VALUE *argv, VALUE RUBY_LIBVIRT_UNUSED(m))
 
     rb_scan_args(argc, argv, "01", &uri);
 
+    ruby_libvirt_event_impl_check("Libvirt::open");
+
     conn = virConnectOpen(ruby_libvirt_get_cstring_or_null(uri));
     ruby_libvirt_raise_error_if(conn == NULL, e_ConnectionError,
                                 "virConnectOpen", NULL);
@@ -112,7 +131,8 @@ static VALUE libvirt_open(int argc, VALUE *argv, VALUE RUBY_LIBVIRT_UNUSED(m))
  *   Libvirt::open_read_only(uri=nil) -> Libvirt::Connect
  *
  * Call virConnectOpenReadOnly[http://www.libvirt.org/html/libvirt-libvirt-host.html#virConnectOpenReadOnly]
- * to open a read-only connection to a URL.
+ * to open a read-only connection to a URL.  As with Libvirt::open, only the
+ * main Ractor can call this while Ruby event callbacks are registered.
  */
 static VALUE libvirt_open_read_only(int argc, VALUE *argv,
                                     VALUE RUBY_LIBVIRT_UNUSED(m))
@@ -122,6 +142,8 @@ static VALUE libvirt_open_read_only(int argc, VALUE *argv,
 
     rb_scan_args(argc, argv, "01", &uri);
 
+    ruby_libvirt_event_impl_check("Libvirt::open_read_only");
+
     conn = virConnectOpenReadOnly(ruby_libvirt_get_cstring_or_null(uri));
 
     ruby_libvirt_raise_error_if(conn == NULL, e_ConnectionError,
@@ -213,6 +235,8 @@ static int libvirt_auth_callback_wrapper(virConnectCredentialPtr cred,
  *
  * The authentication block should return the result of collecting the
  * information; these results will then be sent to libvirt for authentication.
+ * As with Libvirt::open, only the main Ractor can call this while Ruby event
+ * callbacks are registered.
  */
 static VALUE libvirt_open_auth(int argc, VALUE *argv,
                                VALUE RUBY_LIBVIRT_UNUSED(m))
@@ -254,6 +278,8 @@ static VALUE libvirt_open_auth(int argc, VALUE *argv,
         auth = virConnectAuthPtrDefault;
     }
 
+    ruby_libvirt_event_impl_check("Libvirt::open_auth");
+
     conn = virConnectOpenAuth(ruby_libvirt_get_cstring_or_null(uri), auth,
                               ruby_libvirt_value_to_uint(flags));
 
@@ -264,6 +290,138 @@ static VALUE libvirt_open_auth(int argc, VALUE *argv,
 }
 #endif
 
+/*
+ * call-seq:
+ *   Libvirt::call_stats_enabled = [true|false]
+ *
+ * Turn collection of Libvirt::call_stats on or off.  It is off by default,
+ * and costs next to nothing while off.
+ */
+static VALUE libvirt_call_stats_enabled_equal(VALUE RUBY_LIBVIRT_UNUSED(m),
+                                              VALUE enabled)
+{
+    ruby_libvirt_call_stats_on = RTEST(enabled);
+
+    return enabled;
+}
+
+/*
+ * call-seq:
+ *   Libvirt::call_stats_enabled? -> [true|false]
+ *
+ * Return whether Libvirt::call_stats are being collected.
+ */
+static VALUE libvirt_call_stats_enabled_p(VALUE RUBY_LIBVIRT_UNUSED(m))
+{
+    return ruby_libvirt_call_stats_on ? Qtrue : Qfalse;
+}
+
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+/*
+ * call-seq:
+ *   Libvirt::fiber_scheduler_enabled = [true|false]
+ *
+ * Turn cooperation with the Fiber scheduler on or off.  While it is on, a
+ * libvirt call made from a non-blocking fiber that the bindings would
+ * otherwise make without the GVL is handed to a native worker thread, and
+ * the fiber waits for it through the scheduler's io_wait, so that other
+ * fibers on the same thread keep running.  It is off by default.
+ */
+static VALUE libvirt_fiber_scheduler_enabled_equal(VALUE RUBY_LIBVIRT_UNUSED(m),
+                                                   VALUE enabled)
+{
+    ruby_libvirt_fiber_scheduler_on = RTEST(enabled);
+
+    return enabled;
+}
+
+/*
+ * call-seq:
+ *   Libvirt::fiber_scheduler_enabled? -> [true|false]
+ *
+ * Return whether libvirt calls from non-blocking fibers go through the
+ * Fiber scheduler.
+ */
+static VALUE libvirt_fiber_scheduler_enabled_p(VALUE RUBY_LIBVIRT_UNUSED(m))
+{
+    return ruby_libvirt_fiber_scheduler_on ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   Libvirt::fiber_scheduler_workers = Fixnum
+ *
+ * Set how many idle native threads are kept to make calls for non-blocking
+ * fibers (16 by default).  More are started whenever every worker is busy,
+ * since a call can be waiting on another fiber's (a connection pool
+ * checkout, say), and those exit again once they have nothing to do.
+ */
+static VALUE libvirt_fiber_scheduler_workers_equal(VALUE RUBY_LIBVIRT_UNUSED(m),
+                                                   VALUE workers)
+{
+    int n = NUM2INT(workers);
+
+    if (n < 1) {
+        rb_raise(rb_eArgError, "workers must be at least 1");
+    }
+    ruby_libvirt_fiber_scheduler_workers = n;
+
+    return workers;
+}
+
+/*
+ * call-seq:
+ *   Libvirt::fiber_scheduler_workers -> Fixnum
+ *
+ * Return how many idle native threads are kept to make calls for
+ * non-blocking fibers.
+ */
+static VALUE libvirt_fiber_scheduler_workers(VALUE RUBY_LIBVIRT_UNUSED(m))
+{
+    return INT2NUM(ruby_libvirt_fiber_scheduler_workers);
+}
+#endif
+
+/*
+ * call-seq:
+ *   Libvirt::call_stats -> Hash
+ *
+ * Return the statistics collected since Libvirt::call_stats_enabled was set
+ * (or Libvirt::reset_call_stats was last called), keyed by libvirt function
+ * name.  Each value is a hash with:
+ *
+ * calls - the number of calls made
+ *
+ * errors - how many of those failed
+ *
+ * timed_calls - how many of those were timed; the "time", "max_time" and "histogram" entries cover only these
+ *
+ * time - the total time, in seconds, spent in the timed calls
+ *
+ * max_time - the longest timed call, in seconds
+ *
+ * gvl_wait - the total time, in seconds, spent waiting to get the GVL back after calls made with the GVL released
+ *
+ * histogram - an array of [upper bound in seconds, count] pairs counting the timed calls by duration, in powers of two from one microsecond; the last bound is Infinity
+ */
+static VALUE libvirt_call_stats(VALUE RUBY_LIBVIRT_UNUSED(m))
+{
+    return ruby_libvirt_call_stats();
+}
+
+/*
+ * call-seq:
+ *   Libvirt::reset_call_stats -> nil
+ *
+ * Throw away all of the statistics collected for Libvirt::call_stats.
+ */
+static VALUE libvirt_reset_call_stats(VALUE RUBY_LIBVIRT_UNUSED(m))
+{
+    ruby_libvirt_call_stats_reset();
+
+    return Qnil;
+}
+
 #if HAVE_VIREVENTREGISTERIMPL
 static VALUE add_handle, update_handle, remove_handle;
 static VALUE add_timeout, update_timeout, remove_timeout;
@@ -362,12 +520,27 @@ static VALUE libvirt_event_invoke_timeout_callback(VALUE RUBY_LIBVIRT_UNUSED(m),
     return Qnil;
 }
 
+/* The callbacks belong to the main Ractor, but libvirt calls these from
+ * whichever thread registers a handle or timeout, from inside its own
+ * locked code.  Raising from here would unwind through libvirt, so a call
+ * from any other Ractor (which the entry points that can get here already
+ * refuse, see ruby_libvirt_event_impl_check()) just fails.
+ */
+static int internal_event_impl_ok(void)
+{
+    return ruby_libvirt_main_ractor_p();
+}
+
 static int internal_add_handle_func(int fd, int events,
                                     virEventHandleCallback cb, void *opaque,
                                     virFreeCallback ff)
 {
     VALUE rubyargs, res;
 
+    if (!internal_event_impl_ok()) {
+        return -1;
+    }
+
     rubyargs = rb_hash_new();
     rb_hash_aset(rubyargs, rb_str_new2("libvirt_cb"),
                  Data_Wrap_Struct(rb_class_of(add_handle), NULL, NULL, cb));
@@ -400,6 +573,10 @@ static int internal_add_handle_func(int fd, int events,
 
 static void internal_update_handle_func(int watch, int event)
 {
+    if (!internal_event_impl_ok()) {
+        return;
+    }
+
     /* call out to the ruby object */
     if (strcmp(rb_obj_classname(update_handle), "Symbol") == 0) {
         rb_funcall(rb_class_of(update_handle), rb_to_id(update_handle), 2,
@@ -421,6 +598,10 @@ static int internal_remove_handle_func(int watch)
     virFreeCallback ff_cb;
     void *op;
 
+    if (!internal_event_impl_ok()) {
+        return -1;
+    }
+
     /* call out to the ruby object */
     if (strcmp(rb_obj_classname(remove_handle), "Symbol") == 0) {
         res = rb_funcall(rb_class_of(remove_handle), rb_to_id(remove_handle),
@@ -462,6 +643,10 @@ static int internal_add_timeout_func(int interval, virEventTimeoutCallback cb,
 {
     VALUE rubyargs, res;
 
+    if (!internal_event_impl_ok()) {
+        return -1;
+    }
+
     rubyargs = rb_hash_new();
 
     rb_hash_aset(rubyargs, rb_str_new2("libvirt_cb"),
@@ -496,6 +681,10 @@ static int internal_add_timeout_func(int interval, virEventTimeoutCallback cb,
 
 static void internal_update_timeout_func(int timer, int timeout)
 {
+    if (!internal_event_impl_ok()) {
+        return;
+    }
+
     /* call out to the ruby object */
     if (strcmp(rb_obj_classname(update_timeout), "Symbol") == 0) {
         rb_funcall(rb_class_of(update_timeout), rb_to_id(update_timeout), 2,
@@ -517,6 +706,10 @@ static int internal_remove_timeout_func(int timer)
     virFreeCallback ff_cb;
     void *op;
 
+    if (!internal_event_impl_ok()) {
+        return -1;
+    }
+
     /* call out to the ruby object */
     if (strcmp(rb_obj_classname(remove_timeout), "Symbol") == 0) {
         res = rb_funcall(rb_class_of(remove_timeout), rb_to_id(remove_timeout),
@@ -602,6 +795,8 @@ static int is_symbol_proc_or_nil(VALUE handle)
  * without modification.  The values passed to the callbacks are meant to be
  * passed to the event_invoke_handle_callback and event_invoke_timeout_callback
  * module methods; see the documentation for those methods for more details.
+ * The callbacks belong to the main Ractor, so this can only be called from
+ * there.
  */
 static VALUE libvirt_conn_event_register_impl(int argc, VALUE *argv,
                                               VALUE RUBY_LIBVIRT_UNUSED(c))
@@ -613,6 +808,8 @@ static VALUE libvirt_conn_event_register_impl(int argc, VALUE *argv,
     virEventUpdateTimeoutFunc update_timeout_temp;
     virEventRemoveTimeoutFunc remove_timeout_temp;
 
+    ruby_libvirt_main_ractor_only("Libvirt::event_register_impl");
+
     /*
      * subtle; we put the arguments (callbacks) directly into the global
      * add_handle, update_handle, etc. variables.  Then we register the
@@ -638,6 +835,11 @@ static VALUE libvirt_conn_event_register_impl(int argc, VALUE *argv,
     set_event_func_or_null(update_timeout);
     set_event_func_or_null(remove_timeout);
 
+    ruby_event_impl_registered = !NIL_P(add_handle) ||
+        !NIL_P(update_handle) || !NIL_P(remove_handle) ||
+        !NIL_P(add_timeout) || !NIL_P(update_timeout) ||
+        !NIL_P(remove_timeout);
+
     /* virEventRegisterImpl returns void, so no error checking here */
     virEventRegisterImpl(add_handle_temp, update_handle_temp,
                          remove_handle_temp, add_timeout_temp,
@@ -647,6 +849,113 @@ static VALUE libvirt_conn_event_register_impl(int argc, VALUE *argv,
 }
 #endif
 
+#if HAVE_VIREVENTREGISTERDEFAULTIMPL && HAVE_VIREVENTRUNDEFAULTIMPL && HAVE_VIREVENTADDTIMEOUT && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static VALUE event_loop_thread = RUBY_Qnil;
+static int event_default_impl_registered;
+static int event_wakeup_timer = -1;
+
+struct event_loop_arg {
+    int ret;
+};
+
+static void event_loop_wakeup_cb(int timer, void *RUBY_LIBVIRT_UNUSED(opaque))
+{
+    virEventUpdateTimeout(timer, -1);
+}
+
+/* called from another Ruby thread to interrupt the loop thread; firing the
+ * wakeup timer makes virEventRunDefaultImpl return
+ */
+static void event_loop_wakeup(void *RUBY_LIBVIRT_UNUSED(p))
+{
+    virEventUpdateTimeout(event_wakeup_timer, 0);
+}
+
+static void *event_loop_run_nogvl(void *p)
+{
+    struct event_loop_arg *arg = (struct event_loop_arg *)p;
+
+    ruby_libvirt_event_loop_enter();
+    arg->ret = virEventRunDefaultImpl();
+    ruby_libvirt_event_loop_leave();
+
+    return NULL;
+}
+
+static VALUE event_loop_run(VALUE RUBY_LIBVIRT_UNUSED(arg))
+{
+    struct event_loop_arg arg;
+
+    for (;;) {
+        arg.ret = -1;
+        ruby_libvirt_without_gvl(event_loop_run_nogvl, &arg,
+                                 event_loop_wakeup, NULL);
+        ruby_libvirt_event_batch_run(ruby_libvirt_event_batch_take());
+        ruby_libvirt_raise_error_if(arg.ret < 0, e_Error,
+                                    "virEventRunDefaultImpl", NULL);
+    }
+
+    return Qnil;
+}
+
+static VALUE event_loop_done(VALUE RUBY_LIBVIRT_UNUSED(arg))
+{
+    ruby_libvirt_event_loop_leave();
+
+    return Qnil;
+}
+
+static VALUE event_loop_thread_func(void *RUBY_LIBVIRT_UNUSED(arg))
+{
+    return rb_ensure(event_loop_run, Qnil, event_loop_done, Qnil);
+}
+
+/*
+ * call-seq:
+ *   Libvirt::event_run_default_impl_in_thread -> Thread
+ *
+ * Call virEventRegisterDefaultImpl[http://www.libvirt.org/html/libvirt-libvirt-event.html#virEventRegisterDefaultImpl]
+ * to use libvirt's own event loop, and start a Ruby Thread that runs
+ * virEventRunDefaultImpl[http://www.libvirt.org/html/libvirt-libvirt-event.html#virEventRunDefaultImpl]
+ * over and over with the GVL released.  Unlike Libvirt::event_register_impl,
+ * the application does not need to poll file descriptors or timers itself.
+ * Callbacks registered with domain_event_register_any, stream.event_add_callback
+ * and so on are collected while libvirt dispatches events, and are then run
+ * in a batch on the returned thread after each iteration of the loop.  An
+ * exception raised by a callback ends the thread; calling this method again
+ * starts a new one.  If the thread is already running, it is returned.  This
+ * must not be combined with Libvirt::event_register_impl, and, since the
+ * callbacks run on it, can only be called from the main Ractor.
+ */
+static VALUE libvirt_event_run_default_impl_in_thread(VALUE RUBY_LIBVIRT_UNUSED(m))
+{
+    int ret;
+
+    ruby_libvirt_main_ractor_only("Libvirt::event_run_default_impl_in_thread");
+
+    if (!NIL_P(event_loop_thread) &&
+        RTEST(rb_funcall(event_loop_thread, rb_intern("alive?"), 0))) {
+        return event_loop_thread;
+    }
+
+    if (!event_default_impl_registered) {
+        ret = virEventRegisterDefaultImpl();
+        ruby_libvirt_raise_error_if(ret < 0, e_Error,
+                                    "virEventRegisterDefaultImpl", NULL);
+        event_default_impl_registered = 1;
+
+        event_wakeup_timer = virEventAddTimeout(-1, event_loop_wakeup_cb,
+                                                NULL, NULL);
+        ruby_libvirt_raise_error_if(event_wakeup_timer < 0, e_Error,
+                                    "virEventAddTimeout", NULL);
+    }
+
+    event_loop_thread = rb_thread_create(event_loop_thread_func, NULL);
+
+    return event_loop_thread;
+}
+#endif
+
 #if HAVE_VIRDOMAINLXCENTERSECURITYLABEL
 /*
  * call-seq:
@@ -708,6 +1017,10 @@ static VALUE libvirt_domain_lxc_enter_security_label(int argc, VALUE *argv,
  */
 void Init__libvirt(void)
 {
+#if RUBY_LIBVIRT_RACTOR
+    rb_ext_ractor_safe(true);
+#endif
+
     m_libvirt = rb_define_module("Libvirt");
     c_libvirt_version = rb_define_class_under(m_libvirt, "Version",
                                               rb_cObject);
@@ -984,6 +1297,24 @@ void Init__libvirt(void)
     rb_define_module_function(m_libvirt, "open_auth", libvirt_open_auth, -1);
 #endif
 
+    rb_define_module_function(m_libvirt, "call_stats_enabled=",
+                              libvirt_call_stats_enabled_equal, 1);
+    rb_define_module_function(m_libvirt, "call_stats_enabled?",
+                              libvirt_call_stats_enabled_p, 0);
+    rb_define_module_function(m_libvirt, "call_stats", libvirt_call_stats, 0);
+    rb_define_module_function(m_libvirt, "reset_call_stats",
+                              libvirt_reset_call_stats, 0);
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+    rb_define_module_function(m_libvirt, "fiber_scheduler_enabled=",
+                              libvirt_fiber_scheduler_enabled_equal, 1);
+    rb_define_module_function(m_libvirt, "fiber_scheduler_enabled?",
+                              libvirt_fiber_scheduler_enabled_p, 0);
+    rb_define_module_function(m_libvirt, "fiber_scheduler_workers=",
+                              libvirt_fiber_scheduler_workers_equal, 1);
+    rb_define_module_function(m_libvirt, "fiber_scheduler_workers",
+                              libvirt_fiber_scheduler_workers, 0);
+#endif
+
 #if HAVE_VIREVENTREGISTERIMPL
     rb_define_const(m_libvirt, "EVENT_HANDLE_READABLE",
                     INT2NUM(VIR_EVENT_HANDLE_READABLE));
@@ -1010,11 +1341,23 @@ void Init__libvirt(void)
                               libvirt_event_invoke_timeout_callback, 2);
 #endif
 
+#if HAVE_VIREVENTREGISTERDEFAULTIMPL && HAVE_VIREVENTRUNDEFAULTIMPL && HAVE_VIREVENTADDTIMEOUT && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_global_variable(&event_loop_thread);
+    rb_define_module_function(m_libvirt, "event_run_default_impl_in_thread",
+                              libvirt_event_run_default_impl_in_thread, 0);
+#endif
+
 #if HAVE_VIRDOMAINLXCENTERSECURITYLABEL
     rb_define_method(m_libvirt, "lxc_enter_security_label",
                      libvirt_domain_lxc_enter_security_label, -1);
 #endif
 
+    ruby_libvirt_common_init();
+    ruby_libvirt_cpumap_init();
+    ruby_libvirt_sampler_init();
+    ruby_libvirt_pool_init();
+    ruby_libvirt_console_init();
+    ruby_libvirt_xml_cache_init();
     ruby_libvirt_connect_init();
     ruby_libvirt_storage_init();
     ruby_libvirt_network_init();
@@ -23,11 +23,32 @@
 #define _GNU_SOURCE 1
 #endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
 #include <ruby.h>
 #include <st.h>
 #include <libvirt/libvirt.h>
 #include <libvirt/virterror.h>
+#include "extconf.h"
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <pthread.h>
+#include <ruby/thread.h>
+#endif
 #include "common.h"
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <ruby/io.h>
+#include <ruby/fiber/scheduler.h>
+#endif
+#if RUBY_LIBVIRT_RACTOR
+#include <ruby/ractor.h>
+#endif
 #include "connect.h"
 
 struct rb_exc_new2_arg {
@@ -39,146 +60,1369 @@ static VALUE ruby_libvirt_exc_new2_wrap(VALUE arg)
 {
     struct rb_exc_new2_arg *e = (struct rb_exc_new2_arg *)arg;
 
-    return rb_exc_new2(e->error, e->msg);
+    return rb_exc_new2(e->error, e->msg);
+}
+
+VALUE ruby_libvirt_ary_new2_wrap(VALUE arg)
+{
+    return rb_ary_new2(*((int *)arg));
+}
+
+VALUE ruby_libvirt_ary_push_wrap(VALUE arg)
+{
+    struct ruby_libvirt_ary_push_arg *e = (struct ruby_libvirt_ary_push_arg *)arg;
+
+    return rb_ary_push(e->arr, e->value);
+}
+
+VALUE ruby_libvirt_ary_store_wrap(VALUE arg)
+{
+    struct ruby_libvirt_ary_store_arg *e = (struct ruby_libvirt_ary_store_arg *)arg;
+
+    rb_ary_store(e->arr, e->index, e->elem);
+
+    return Qnil;
+}
+
+VALUE ruby_libvirt_str_new2_wrap(VALUE arg)
+{
+    char **str = (char **)arg;
+
+    return rb_str_new2(*str);
+}
+
+VALUE ruby_libvirt_str_new_wrap(VALUE arg)
+{
+    struct ruby_libvirt_str_new_arg *e = (struct ruby_libvirt_str_new_arg *)arg;
+
+    return rb_str_new(e->val, e->size);
+}
+
+VALUE ruby_libvirt_hash_aset_wrap(VALUE arg)
+{
+    struct ruby_libvirt_hash_aset_arg *e = (struct ruby_libvirt_hash_aset_arg *)arg;
+
+    return rb_hash_aset(e->hash, rb_str_new2(e->name), e->val);
+}
+
+VALUE ruby_libvirt_str_new2_and_ary_store_wrap(VALUE arg)
+{
+    struct ruby_libvirt_str_new2_and_ary_store_arg *e = (struct ruby_libvirt_str_new2_and_ary_store_arg *)arg;
+
+    rb_ary_store(e->arr, e->index, rb_str_new2(e->value));
+
+    return Qnil;
+}
+
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+/* The error of the last failed call made through a nogvl trampoline on this
+ * thread.  The trampoline drops its reference on the handle after the
+ * call, which resets the thread's own libvirt error, so the error is kept
+ * here for ruby_libvirt_last_error() instead.
+ */
+static pthread_key_t nogvl_error_key;
+
+void ruby_libvirt_nogvl_error_keep(void)
+{
+    virErrorPtr old = pthread_getspecific(nogvl_error_key);
+    virErrorPtr err = NULL;
+
+    if (virGetLastError() != NULL) {
+        err = virSaveLastError();
+    }
+    if (old != NULL) {
+        virFreeError(old);
+    }
+    pthread_setspecific(nogvl_error_key, err);
+}
+
+/* hand over (and forget) the error kept by the last trampoline call */
+static virErrorPtr nogvl_error_take(void)
+{
+    virErrorPtr err = pthread_getspecific(nogvl_error_key);
+
+    pthread_setspecific(nogvl_error_key, NULL);
+
+    return err;
+}
+#endif
+
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+/*
+ * Fiber scheduler support.  When Libvirt.fiber_scheduler_enabled is set and
+ * the calling fiber is non-blocking, a call that would otherwise be made
+ * without the GVL is instead handed to a native worker thread, and the fiber
+ * waits through rb_fiber_scheduler_io_wait() on a
+ * pipe the worker writes a byte to when the call is done.  The scheduler
+ * can run other fibers on this thread in the meantime.  The workers never
+ * touch Ruby objects; func and data live on the waiting fiber's stack,
+ * which is why the fiber always waits for the worker to finish, even when
+ * the wait is interrupted.
+ */
+int ruby_libvirt_fiber_scheduler_on = 0;
+int ruby_libvirt_fiber_scheduler_workers = 16;
+
+struct fiber_job {
+    void *(*func)(void *);
+    void *data;
+    int fd;
+    int done;
+    /* the worker's last error if the call failed; libvirt keeps that per
+     * thread, so it has to be carried back to the caller's
+     */
+    virErrorPtr err;
+    struct fiber_job *next;
+};
+
+static pthread_mutex_t fiber_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fiber_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fiber_done_cond = PTHREAD_COND_INITIALIZER;
+static struct fiber_job *fiber_head, *fiber_tail;
+static int fiber_nworkers, fiber_nidle, fiber_nqueued;
+
+/* [reader, writer] IO.pipe pairs not currently in use; IO objects cannot
+ * be shared between Ractors, so each Ractor has its own
+ */
+#if RUBY_LIBVIRT_RACTOR
+static rb_ractor_local_key_t fiber_pipes_key;
+#else
+static VALUE fiber_pipes;
+#endif
+
+/* The error of the last failed call made for this thread by a worker,
+ * which ruby_libvirt_last_error() hands out in place of the thread's own
+ */
+static pthread_key_t fiber_error_key;
+
+static void fiber_error_set(virErrorPtr err)
+{
+    virErrorPtr old = pthread_getspecific(fiber_error_key);
+
+    if (old != NULL) {
+        virFreeError(old);
+    }
+    pthread_setspecific(fiber_error_key, err);
+}
+
+static VALUE fiber_pipes_get(void)
+{
+#if RUBY_LIBVIRT_RACTOR
+    VALUE pipes;
+
+    if (!rb_ractor_local_storage_value_lookup(fiber_pipes_key, &pipes)) {
+        pipes = rb_ary_new();
+        rb_ractor_local_storage_value_set(fiber_pipes_key, pipes);
+    }
+    return pipes;
+#else
+    return fiber_pipes;
+#endif
+}
+
+static void *fiber_worker(void *RUBY_LIBVIRT_UNUSED(arg))
+{
+    struct fiber_job *job;
+    int fd;
+    char c = 0;
+
+    pthread_mutex_lock(&fiber_lock);
+    for (;;) {
+        while (fiber_head == NULL) {
+            /* only ruby_libvirt_fiber_scheduler_workers are kept waiting
+             * for work; the rest were started for a burst and go again
+             */
+            if (fiber_nidle >= ruby_libvirt_fiber_scheduler_workers) {
+                fiber_nworkers--;
+                pthread_mutex_unlock(&fiber_lock);
+                return NULL;
+            }
+            fiber_nidle++;
+            pthread_cond_wait(&fiber_work_cond, &fiber_lock);
+            fiber_nidle--;
+        }
+        job = fiber_head;
+        fiber_head = job->next;
+        if (fiber_head == NULL) {
+            fiber_tail = NULL;
+        }
+        fiber_nqueued--;
+        pthread_mutex_unlock(&fiber_lock);
+
+        job->func(job->data);
+        job->err = nogvl_error_take();
+        if (virGetLastError() != NULL) {
+            if (job->err == NULL) {
+                job->err = virSaveLastError();
+            }
+            virResetLastError();
+        }
+
+        /* job may be gone as soon as done is set, so take the fd first; the
+         * byte is written after done so that a woken fiber always sees it
+         */
+        fd = job->fd;
+        pthread_mutex_lock(&fiber_lock);
+        job->done = 1;
+        pthread_cond_broadcast(&fiber_done_cond);
+        pthread_mutex_unlock(&fiber_lock);
+        while (write(fd, &c, 1) < 0 && errno == EINTR);
+
+        pthread_mutex_lock(&fiber_lock);
+    }
+
+    return NULL;
+}
+
+/* the workers don't survive fork(), so start over in the child */
+static void fiber_atfork_child(void)
+{
+    pthread_mutex_init(&fiber_lock, NULL);
+    pthread_cond_init(&fiber_work_cond, NULL);
+    pthread_cond_init(&fiber_done_cond, NULL);
+    fiber_head = fiber_tail = NULL;
+    fiber_nworkers = fiber_nidle = fiber_nqueued = 0;
+}
+
+/* queue JOB, starting another worker unless an idle one is left for it;
+ * returns -1 if there are no workers and none could be started.  Many of
+ * the calls are waits (DomainEventQueue#pop, a ConnectionPool checkout, a
+ * ConsoleMux dispatch) that may only end once another fiber's call has
+ * run, so a job is never left queued behind busy workers.
+ */
+static int fiber_submit(struct fiber_job *job)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    pthread_mutex_lock(&fiber_lock);
+    if (fiber_nqueued >= fiber_nidle) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, fiber_worker, NULL) == 0) {
+            fiber_nworkers++;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (fiber_nworkers == 0) {
+        pthread_mutex_unlock(&fiber_lock);
+        return -1;
+    }
+    job->next = NULL;
+    if (fiber_tail) {
+        fiber_tail->next = job;
+    }
+    else {
+        fiber_head = job;
+    }
+    fiber_tail = job;
+    fiber_nqueued++;
+    pthread_cond_signal(&fiber_work_cond);
+    pthread_mutex_unlock(&fiber_lock);
+
+    return 0;
+}
+
+static int fiber_job_done(struct fiber_job *job)
+{
+    int done;
+
+    pthread_mutex_lock(&fiber_lock);
+    done = job->done;
+    pthread_mutex_unlock(&fiber_lock);
+
+    return done;
+}
+
+/* read the byte the worker writes once the job is done; the pipe is
+ * non-blocking, so this returns 0 if it isn't there (yet)
+ */
+static int fiber_pipe_drain(int fd)
+{
+    char c;
+    ssize_t r;
+
+    do {
+        r = read(fd, &c, 1);
+    } while (r < 0 && errno == EINTR);
+
+    return r == 1;
+}
+
+static void fiber_pipe_nonblock(VALUE io)
+{
+    int fd = NUM2INT(rb_funcall(io, rb_intern("fileno"), 0));
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+struct fiber_finish_arg {
+    struct fiber_job *job;
+    int fd;
+};
+
+/* wait for an abandoned job, without the GVL but also without any ubf:
+ * the call has already been asked to stop, and until the worker is done
+ * with it the caller's stack can't be unwound
+ */
+static void *fiber_finish_nogvl(void *in)
+{
+    struct fiber_finish_arg *arg = (struct fiber_finish_arg *)in;
+    struct pollfd pfd;
+
+    pthread_mutex_lock(&fiber_lock);
+    while (!arg->job->done) {
+        pthread_cond_wait(&fiber_done_cond, &fiber_lock);
+    }
+    pthread_mutex_unlock(&fiber_lock);
+
+    while (!fiber_pipe_drain(arg->fd)) {
+        pfd.fd = arg->fd;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, -1);
+    }
+
+    return NULL;
+}
+
+struct fiber_wait_arg {
+    VALUE scheduler;
+    VALUE io;
+    struct fiber_job *job;
+    int fd;
+};
+
+static VALUE fiber_wait(VALUE in)
+{
+    struct fiber_wait_arg *arg = (struct fiber_wait_arg *)in;
+
+    for (;;) {
+        rb_fiber_scheduler_io_wait(arg->scheduler, arg->io,
+                                   RB_INT2NUM(RUBY_IO_READABLE), Qnil);
+        if (fiber_pipe_drain(arg->fd)) {
+            return Qnil;
+        }
+    }
+}
+
+/* Run FUNC(DATA) on a worker while the scheduler runs other fibers.  If the
+ * wait is interrupted, the call is still waited for; then the exception is
+ * raised, or for a non-NULL STATE left there for the caller to raise.
+ * Returns 0 without having run FUNC if no worker could be used.
+ */
+struct fiber_pipe_arg {
+    VALUE pipes;
+    VALUE pair;
+    int rfd;
+    int wfd;
+};
+
+static VALUE fiber_pipe_take(VALUE in)
+{
+    struct fiber_pipe_arg *arg = (struct fiber_pipe_arg *)in;
+
+    arg->pipes = fiber_pipes_get();
+    arg->pair = rb_ary_pop(arg->pipes);
+    if (NIL_P(arg->pair)) {
+        arg->pair = rb_funcall(rb_cIO, rb_intern("pipe"), 0);
+        fiber_pipe_nonblock(rb_ary_entry(arg->pair, 0));
+        fiber_pipe_nonblock(rb_ary_entry(arg->pair, 1));
+    }
+    arg->rfd = NUM2INT(rb_funcall(rb_ary_entry(arg->pair, 0),
+                                  rb_intern("fileno"), 0));
+    arg->wfd = NUM2INT(rb_funcall(rb_ary_entry(arg->pair, 1),
+                                  rb_intern("fileno"), 0));
+
+    return Qnil;
+}
+
+static int fiber_call(VALUE scheduler, void *(*func)(void *), void *data,
+                      void (*ubf)(void *), void *ubfdata, int *state,
+                      int *pending)
+{
+    struct fiber_job job;
+    struct fiber_wait_arg arg;
+    struct fiber_finish_arg finish;
+    struct fiber_pipe_arg pipe;
+    VALUE pipes, pair;
+    int exception = 0;
+
+    /* FUNC may hold a reference that only running it drops, so if this
+     * raises, leave the exception in PENDING and let the caller make the
+     * call itself
+     */
+    rb_protect(fiber_pipe_take, (VALUE)&pipe, pending);
+    if (*pending) {
+        return 0;
+    }
+    pipes = pipe.pipes;
+    pair = pipe.pair;
+
+    arg.scheduler = scheduler;
+    arg.io = rb_ary_entry(pair, 0);
+    arg.fd = pipe.rfd;
+    arg.job = &job;
+
+    memset(&job, 0, sizeof(job));
+    job.func = func;
+    job.data = data;
+    job.fd = pipe.wfd;
+    if (fiber_submit(&job) < 0) {
+        rb_ary_push(pipes, pair);
+        return 0;
+    }
+
+    rb_protect(fiber_wait, (VALUE)&arg, &exception);
+    if (exception) {
+        /* the fiber was interrupted or the scheduler failed: the same as
+         * an interrupt without the GVL, ask the call to stop, then wait
+         */
+        if (ubf && !fiber_job_done(&job)) {
+            ubf(ubfdata);
+        }
+        finish.job = &job;
+        finish.fd = arg.fd;
+        rb_thread_call_without_gvl(fiber_finish_nogvl, &finish, NULL, NULL);
+        rb_ary_push(pipes, pair);
+        if (job.err != NULL) {
+            virFreeError(job.err);
+        }
+        if (state) {
+            *state = exception;
+            return 1;
+        }
+        rb_jump_tag(exception);
+    }
+    rb_ary_push(pipes, pair);
+    fiber_error_set(job.err);
+
+    return 1;
+}
+#endif
+
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static VALUE check_ints(VALUE unused)
+{
+    rb_thread_check_ints();
+
+    return Qnil;
+}
+#endif
+
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+struct owned_nogvl_arg {
+    void *(*func)(void *);
+    void *data;
+    int ran;
+};
+
+static void *owned_nogvl(void *p)
+{
+    struct owned_nogvl_arg *arg = (struct owned_nogvl_arg *)p;
+
+    arg->ran = 1;
+
+    return arg->func(arg->data);
+}
+#endif
+
+/* FUNC is always run exactly once, since a trampoline drops the reference
+ * its caller took on the handle when it runs.  An exception that comes
+ * before that is only raised (or for OWNED returned) afterwards.
+ */
+static int without_gvl(void *(*func)(void *), void *data,
+                       void (*ubf)(void *), void *ubfdata, int owned)
+{
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    struct owned_nogvl_arg arg;
+    int caught;
+#endif
+    int pending = 0;
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+    VALUE scheduler;
+    int state = 0;
+
+    if (ruby_libvirt_fiber_scheduler_on) {
+        /* an error left by an earlier worker call is stale now */
+        fiber_error_set(NULL);
+        /* only non-nil for a non-blocking fiber */
+        scheduler = rb_fiber_scheduler_current();
+        if (!NIL_P(scheduler) &&
+            fiber_call(scheduler, func, data, ubf, ubfdata,
+                       owned ? &state : NULL, &pending)) {
+            return state;
+        }
+    }
+#endif
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    if (owned) {
+        /* rb_thread_call_without_gvl2 never raises once FUNC has run, but
+         * may return without running it at all if an interrupt is already
+         * pending; take that one and try again
+         */
+        arg.func = func;
+        arg.data = data;
+        arg.ran = 0;
+        for (;;) {
+            rb_thread_call_without_gvl2(owned_nogvl, &arg, ubf, ubfdata);
+            if (arg.ran) {
+                return pending;
+            }
+            caught = 0;
+            rb_protect(check_ints, Qnil, &caught);
+            if (!pending) {
+                pending = caught;
+            }
+        }
+    }
+#endif
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    /* this one always runs FUNC, and raises any interrupt afterwards */
+    rb_thread_call_without_gvl(func, data, ubf, ubfdata);
+#else
+    /* older rubies have no way to release the GVL, so just make the call */
+    func(data);
+#endif
+
+    if (pending) {
+        if (owned) {
+            return pending;
+        }
+        rb_jump_tag(pending);
+    }
+
+    return 0;
+}
+
+void ruby_libvirt_without_gvl(void *(*func)(void *), void *data,
+                              void (*ubf)(void *), void *ubfdata)
+{
+    without_gvl(func, data, ubf, ubfdata, 0);
+}
+
+int ruby_libvirt_without_gvl_owned(void *(*func)(void *), void *data,
+                                   void (*ubf)(void *), void *ubfdata)
+{
+    return without_gvl(func, data, ubf, ubfdata, 1);
+}
+
+void ruby_libvirt_raise_pending(int state)
+{
+    if (state) {
+        rb_jump_tag(state);
+    }
+    rb_thread_check_ints();
+}
+
+#define PARALLEL_MAX_THREADS 64
+
+struct parallel_arg {
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    pthread_mutex_t lock;
+#endif
+    long count;
+    long next;
+    int nthreads;
+    int cancelled;
+    void (*func)(long, void *);
+    void *data;
+};
+
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void *parallel_worker(void *p)
+{
+    struct parallel_arg *arg = (struct parallel_arg *)p;
+    long i;
+
+    for (;;) {
+        pthread_mutex_lock(&arg->lock);
+        if (arg->cancelled || arg->next >= arg->count) {
+            pthread_mutex_unlock(&arg->lock);
+            return NULL;
+        }
+        i = arg->next++;
+        pthread_mutex_unlock(&arg->lock);
+
+        arg->func(i, arg->data);
+    }
+}
+
+static void *parallel_run(void *p)
+{
+    struct parallel_arg *arg = (struct parallel_arg *)p;
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    int i, n = 0;
+
+    for (i = 1; i < arg->nthreads && i < arg->count; i++) {
+        if (pthread_create(&threads[n], NULL, parallel_worker, arg) == 0) {
+            n++;
+        }
+    }
+    parallel_worker(arg);
+    for (i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return NULL;
+}
+
+static void parallel_cancel(void *p)
+{
+    struct parallel_arg *arg = (struct parallel_arg *)p;
+
+    pthread_mutex_lock(&arg->lock);
+    arg->cancelled = 1;
+    pthread_mutex_unlock(&arg->lock);
+}
+#endif
+
+long ruby_libvirt_parallel_nogvl(long count, int nthreads,
+                                 void (*func)(long, void *), void *data)
+{
+    struct parallel_arg arg;
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    int state;
+#endif
+
+    arg.count = count;
+    arg.next = 0;
+    arg.nthreads = nthreads < 1 ? 1 : nthreads;
+    if (arg.nthreads > PARALLEL_MAX_THREADS) {
+        arg.nthreads = PARALLEL_MAX_THREADS;
+    }
+    arg.cancelled = 0;
+    arg.func = func;
+    arg.data = data;
+
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    pthread_mutex_init(&arg.lock, NULL);
+    /* owned, so that nothing is raised until every worker is done with the
+     * slots; the caller makes this call inside rb_ensure, so that whatever
+     * is raised here or later the slots are still cleaned up
+     */
+    state = ruby_libvirt_without_gvl_owned(parallel_run, &arg,
+                                           parallel_cancel, &arg);
+    pthread_mutex_destroy(&arg.lock);
+    if (state) {
+        rb_jump_tag(state);
+    }
+#else
+    for (; arg.next < count; arg.next++) {
+        func(arg.next, data);
+    }
+#endif
+
+    return arg.next;
+}
+
+/*
+ * Per-API call statistics for Libvirt.call_stats.  Every call that goes
+ * through ruby_libvirt_raise_error_if() is counted, and calls made through
+ * the generator macros are also timed; for the ones made without the GVL
+ * the time spent getting the GVL back afterwards is kept separately.  The
+ * bookkeeping happens with the GVL held, but every Ractor has a GVL of its
+ * own, so the table has a lock too.  Nothing that can raise is done while
+ * it is held, which is why entries are malloc()ed and never removed; a
+ * reset only zeroes them.
+ */
+#define CALL_STATS_BUCKETS 22
+
+struct call_stat {
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long timed;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long gvl_ns;
+    /* bucket i counts calls that took at most 2^i microseconds; the last
+     * bucket counts everything slower
+     */
+    unsigned long long buckets[CALL_STATS_BUCKETS];
+};
+
+int ruby_libvirt_call_stats_on;
+static st_table *call_stats;
+#if RUBY_LIBVIRT_RACTOR
+static pthread_mutex_t call_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void call_stats_lock(void)
+{
+#if RUBY_LIBVIRT_RACTOR
+    pthread_mutex_lock(&call_stats_mutex);
+#endif
+}
+
+static void call_stats_unlock(void)
+{
+#if RUBY_LIBVIRT_RACTOR
+    pthread_mutex_unlock(&call_stats_mutex);
+#endif
+}
+
+unsigned long long ruby_libvirt_call_stats_now(void)
+{
+    unsigned long long now;
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    now = (unsigned long long)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+
+    /* 0 means "not being timed" to the macros in common.h */
+    return now ? now : 1;
+}
+
+/* called with the lock held; returns NULL if out of memory */
+static struct call_stat *call_stat_get(const char *method)
+{
+    st_data_t entry;
+    struct call_stat *stat;
+    char *key;
+
+    if (st_lookup(call_stats, (st_data_t)method, &entry)) {
+        return (struct call_stat *)entry;
+    }
+
+    stat = calloc(1, sizeof(*stat));
+    key = strdup(method);
+    if (stat == NULL || key == NULL) {
+        free(stat);
+        free(key);
+        return NULL;
+    }
+    st_insert(call_stats, (st_data_t)key, (st_data_t)stat);
+
+    return stat;
+}
+
+static void call_stats_count(const char *method, int failed)
+{
+    struct call_stat *stat;
+
+    call_stats_lock();
+    stat = call_stat_get(method);
+    if (stat != NULL) {
+        stat->calls++;
+        if (failed) {
+            stat->errors++;
+        }
+    }
+    call_stats_unlock();
+}
+
+/* record a call to method that started at start; if it ran without the GVL,
+ * returned is when it finished, and the rest is time spent waiting for the
+ * GVL
+ */
+void ruby_libvirt_call_stats_time(const char *method, unsigned long long start,
+                                  unsigned long long returned)
+{
+    struct call_stat *stat;
+    unsigned long long now, ns, usec;
+    int i;
+
+    now = ruby_libvirt_call_stats_now();
+    if (returned == 0 || returned < start || returned > now) {
+        returned = now;
+    }
+    ns = returned - start;
+
+    usec = (ns + 999) / 1000;
+    i = 0;
+    while (i < CALL_STATS_BUCKETS - 1 && (1ULL << i) < usec) {
+        i++;
+    }
+
+    call_stats_lock();
+    stat = call_stat_get(method);
+    if (stat != NULL) {
+        stat->timed++;
+        stat->total_ns += ns;
+        stat->gvl_ns += now - returned;
+        if (ns > stat->max_ns) {
+            stat->max_ns = ns;
+        }
+        stat->buckets[i]++;
+    }
+    call_stats_unlock();
+}
+
+struct timed_nogvl_arg {
+    void *(*func)(void *);
+    void *data;
+    unsigned long long returned;
+};
+
+static void *timed_nogvl(void *p)
+{
+    struct timed_nogvl_arg *arg = (struct timed_nogvl_arg *)p;
+
+    arg->func(arg->data);
+    arg->returned = ruby_libvirt_call_stats_now();
+
+    return NULL;
+}
+
+static int without_gvl_timed(const char *method, void *(*func)(void *),
+                             void *data, void (*ubf)(void *), void *ubfdata,
+                             int owned)
+{
+    struct timed_nogvl_arg arg;
+    unsigned long long start;
+    int state;
+
+    if (!ruby_libvirt_call_stats_on) {
+        return without_gvl(func, data, ubf, ubfdata, owned);
+    }
+
+    arg.func = func;
+    arg.data = data;
+    arg.returned = 0;
+    start = ruby_libvirt_call_stats_now();
+    state = without_gvl(timed_nogvl, &arg, ubf, ubfdata, owned);
+    ruby_libvirt_call_stats_time(method, start, arg.returned);
+
+    return state;
+}
+
+void ruby_libvirt_without_gvl_timed(const char *method,
+                                    void *(*func)(void *), void *data,
+                                    void (*ubf)(void *), void *ubfdata)
+{
+    without_gvl_timed(method, func, data, ubf, ubfdata, 0);
+}
+
+int ruby_libvirt_without_gvl_owned_timed(const char *method,
+                                         void *(*func)(void *), void *data,
+                                         void (*ubf)(void *), void *ubfdata)
+{
+    return without_gvl_timed(method, func, data, ubf, ubfdata, 1);
+}
+
+static VALUE call_stats_ns(unsigned long long ns)
+{
+    return rb_float_new(ns / 1e9);
+}
+
+struct call_stats_copy {
+    const char *method;
+    struct call_stat stat;
+};
+
+struct call_stats_snapshot {
+    struct call_stats_copy *copies;
+    long n;
+};
+
+static int call_stats_copy_one(st_data_t key, st_data_t val, st_data_t in)
+{
+    struct call_stats_snapshot *snap = (struct call_stats_snapshot *)in;
+    struct call_stat *stat = (struct call_stat *)val;
+
+    /* skip the ones that have not been used since a reset */
+    if (stat->calls || stat->timed) {
+        snap->copies[snap->n].method = (const char *)key;
+        snap->copies[snap->n].stat = *stat;
+        snap->n++;
+    }
+
+    return ST_CONTINUE;
+}
+
+static VALUE call_stats_to_hash(VALUE in)
+{
+    struct call_stats_snapshot *snap = (struct call_stats_snapshot *)in;
+    struct call_stat *stat;
+    VALUE result, hash, buckets;
+    long j;
+    int i;
+
+    result = rb_hash_new();
+    for (j = 0; j < snap->n; j++) {
+        stat = &snap->copies[j].stat;
+
+        hash = rb_hash_new();
+        rb_hash_aset(hash, rb_str_new2("calls"), ULL2NUM(stat->calls));
+        rb_hash_aset(hash, rb_str_new2("errors"), ULL2NUM(stat->errors));
+        rb_hash_aset(hash, rb_str_new2("timed_calls"), ULL2NUM(stat->timed));
+        rb_hash_aset(hash, rb_str_new2("time"), call_stats_ns(stat->total_ns));
+        rb_hash_aset(hash, rb_str_new2("max_time"),
+                     call_stats_ns(stat->max_ns));
+        rb_hash_aset(hash, rb_str_new2("gvl_wait"),
+                     call_stats_ns(stat->gvl_ns));
+
+        buckets = rb_ary_new2(CALL_STATS_BUCKETS);
+        for (i = 0; i < CALL_STATS_BUCKETS; i++) {
+            rb_ary_push(buckets,
+                        rb_assoc_new(i < CALL_STATS_BUCKETS - 1 ?
+                                     rb_float_new((1ULL << i) / 1e6) :
+                                     rb_float_new(HUGE_VAL),
+                                     ULL2NUM(stat->buckets[i])));
+        }
+        rb_hash_aset(hash, rb_str_new2("histogram"), buckets);
+
+        rb_hash_aset(result, rb_str_new2(snap->copies[j].method), hash);
+    }
+
+    return result;
+}
+
+static VALUE call_stats_snapshot_free(VALUE in)
+{
+    free(((struct call_stats_snapshot *)in)->copies);
+
+    return Qnil;
+}
+
+VALUE ruby_libvirt_call_stats(void)
+{
+    struct call_stats_snapshot snap;
+
+    /* copy the table out under the lock, and only then build the Hash */
+    snap.n = 0;
+    call_stats_lock();
+    snap.copies = malloc((call_stats->num_entries + 1) * sizeof(*snap.copies));
+    if (snap.copies != NULL) {
+        st_foreach(call_stats, call_stats_copy_one, (st_data_t)&snap);
+    }
+    call_stats_unlock();
+    if (snap.copies == NULL) {
+        rb_memerror();
+    }
+
+    return rb_ensure(call_stats_to_hash, (VALUE)&snap,
+                     call_stats_snapshot_free, (VALUE)&snap);
+}
+
+static int call_stats_zero(st_data_t RUBY_LIBVIRT_UNUSED(key), st_data_t val,
+                           st_data_t RUBY_LIBVIRT_UNUSED(arg))
+{
+    memset((void *)val, 0, sizeof(struct call_stat));
+
+    return ST_CONTINUE;
+}
+
+void ruby_libvirt_call_stats_reset(void)
+{
+    call_stats_lock();
+    st_foreach(call_stats, call_stats_zero, 0);
+    call_stats_unlock();
+}
+
+#if RUBY_LIBVIRT_RACTOR
+/* set to true in the main Ractor only */
+static rb_ractor_local_key_t main_ractor_key;
+#endif
+
+int ruby_libvirt_main_ractor_p(void)
+{
+#if RUBY_LIBVIRT_RACTOR
+    return RTEST(rb_ractor_local_storage_value(main_ractor_key));
+#else
+    return 1;
+#endif
+}
+
+void ruby_libvirt_main_ractor_only(const char *method)
+{
+    if (!ruby_libvirt_main_ractor_p()) {
+        rb_raise(rb_path2class("Ractor::UnsafeError"),
+                 "%s can only be called from the main Ractor", method);
+    }
+}
+
+/* Build (but don't raise) an instance of error for a failed call to method,
+ * carrying the details of err if there are any
+ */
+VALUE ruby_libvirt_error_new(VALUE error, const char *method, virErrorPtr err)
+{
+    VALUE ruby_errinfo;
+    char *msg;
+    int rc;
+    struct rb_exc_new2_arg arg;
+    int exception = 0;
+
+    if (err != NULL && err->message != NULL) {
+        rc = asprintf(&msg, "Call to %s failed: %s", method, err->message);
+    }
+    else {
+        rc = asprintf(&msg, "Call to %s failed", method);
+    }
+
+    if (rc < 0) {
+        /* there's not a whole lot we can do here; try to raise an
+         * out-of-memory message */
+        rb_memerror();
+    }
+
+    arg.error = error;
+    arg.msg = msg;
+    ruby_errinfo = rb_protect(ruby_libvirt_exc_new2_wrap, (VALUE)&arg,
+                              &exception);
+    free(msg);
+    if (exception) {
+        rb_jump_tag(exception);
+    }
+
+    rb_iv_set(ruby_errinfo, "@libvirt_function_name", rb_str_new2(method));
+
+    if (err != NULL) {
+        rb_iv_set(ruby_errinfo, "@libvirt_code", INT2NUM(err->code));
+        rb_iv_set(ruby_errinfo, "@libvirt_component", INT2NUM(err->domain));
+        rb_iv_set(ruby_errinfo, "@libvirt_level", INT2NUM(err->level));
+        if (err->message != NULL) {
+            rb_iv_set(ruby_errinfo, "@libvirt_message",
+                      rb_str_new2(err->message));
+        }
+    }
+
+    return ruby_errinfo;
+}
+
+/* The last libvirt error on this thread, or if the last call was made by a
+ * fiber scheduler worker, the one it left there
+ */
+virErrorPtr ruby_libvirt_last_error(void)
+{
+    virErrorPtr err;
+
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+    err = pthread_getspecific(fiber_error_key);
+    if (err != NULL) {
+        return err;
+    }
+#endif
+    err = virGetLastError();
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if (err == NULL) {
+        err = pthread_getspecific(nogvl_error_key);
+    }
+#endif
+
+    return err;
+}
+
+/* Reset the error ruby_libvirt_last_error() returns */
+void ruby_libvirt_reset_last_error(void)
+{
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+    fiber_error_set(NULL);
+#endif
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    virFreeError(nogvl_error_take());
+#endif
+    virResetLastError();
+}
+
+void ruby_libvirt_raise_error_if(const int condition, VALUE error,
+                                 const char *method, virConnectPtr conn)
+{
+    virErrorPtr err;
+    VALUE exc;
+
+    if (ruby_libvirt_call_stats_on) {
+        call_stats_count(method, condition);
+    }
+
+    if (!condition) {
+        return;
+    }
+
+    if (conn == NULL) {
+        err = ruby_libvirt_last_error();
+    }
+    else {
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+        err = pthread_getspecific(fiber_error_key);
+        if (err == NULL) {
+            err = virConnGetLastError(conn);
+        }
+#else
+        err = virConnGetLastError(conn);
+#endif
+    }
+
+    exc = ruby_libvirt_error_new(error, method, err);
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+    fiber_error_set(NULL);
+#endif
+    rb_exc_raise(exc);
+};
+
+/*
+ * Return 1, and clear the error, if condition is set and the last libvirt
+ * error on this thread is code; the exception-free lookups use this to turn
+ * "no such object" into nil without building a Libvirt::Error for it.
+ */
+int ruby_libvirt_error_missing(const int condition, int code,
+                               virConnectPtr conn)
+{
+    virErrorPtr err;
+
+    if (!condition || code == VIR_ERR_OK) {
+        return 0;
+    }
+
+    err = ruby_libvirt_last_error();
+    if (err == NULL || err->code != code) {
+        return 0;
+    }
+
+    ruby_libvirt_reset_last_error();
+    if (conn != NULL) {
+        virConnResetLastError(conn);
+    }
+
+    return 1;
+}
+
+char *ruby_libvirt_get_cstring_or_null(VALUE arg)
+{
+    if (TYPE(arg) == T_NIL) {
+        return NULL;
+    }
+    else if (TYPE(arg) == T_STRING) {
+        return StringValueCStr(arg);
+    }
+    else {
+        rb_raise(rb_eTypeError, "wrong argument type (expected String or nil)");
+    }
+
+    return NULL;
+}
+
+void ruby_libvirt_handle_mark(void *p)
+{
+    struct ruby_libvirt_handle *h = p;
+
+#if HAVE_RB_GC_MARK_MOVABLE
+    rb_gc_mark_movable(h->conn);
+#else
+    rb_gc_mark(h->conn);
+#endif
+}
+
+size_t ruby_libvirt_handle_memsize(const void *RUBY_LIBVIRT_UNUSED(p))
+{
+    return sizeof(struct ruby_libvirt_handle);
+}
+
+#if HAVE_RB_GC_MARK_MOVABLE
+void ruby_libvirt_handle_compact(void *p)
+{
+    struct ruby_libvirt_handle *h = p;
+
+    h->conn = rb_gc_location(h->conn);
+}
+#endif
+
+const rb_data_type_t ruby_libvirt_handle_data_type = {
+    "Libvirt handle",
+    RUBY_LIBVIRT_HANDLE_FUNCTIONS(RUBY_TYPED_DEFAULT_FREE),
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+VALUE ruby_libvirt_new_class(VALUE klass, const rb_data_type_t *type,
+                             void *ptr, VALUE conn)
+{
+    struct ruby_libvirt_handle *h;
+    VALUE result;
+
+    result = TypedData_Make_Struct(klass, struct ruby_libvirt_handle, type, h);
+    h->ptr = ptr;
+    h->conn = conn;
+
+    return result;
 }
 
-VALUE ruby_libvirt_ary_new2_wrap(VALUE arg)
+/*
+ * call-seq:
+ *   obj.connection -> Libvirt::Connect
+ *
+ * Return the Libvirt::Connect object this object was obtained from.
+ */
+VALUE ruby_libvirt_handle_connection(VALUE obj)
 {
-    return rb_ary_new2(*((int *)arg));
+    return ((struct ruby_libvirt_handle *)RTYPEDDATA_DATA(obj))->conn;
 }
 
-VALUE ruby_libvirt_ary_push_wrap(VALUE arg)
+int ruby_libvirt_is_symbol_or_proc(VALUE handle)
 {
-    struct ruby_libvirt_ary_push_arg *e = (struct ruby_libvirt_ary_push_arg *)arg;
-
-    return rb_ary_push(e->arr, e->value);
+    return ((strcmp(rb_obj_classname(handle), "Symbol") == 0) ||
+            (strcmp(rb_obj_classname(handle), "Proc") == 0));
 }
 
-VALUE ruby_libvirt_ary_store_wrap(VALUE arg)
+static ID id_call, id_nparams_cache, id_maxcpus;
+
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+/*
+ * While Libvirt.event_run_default_impl_in_thread is waiting in
+ * virEventRunDefaultImpl, callbacks arrive on that native thread without the
+ * GVL.  They take the GVL just long enough to turn their arguments into Ruby
+ * objects and append them to event_batch; the loop thread runs the whole
+ * batch once virEventRunDefaultImpl returns, so the Ruby callbacks never run
+ * underneath libvirt's own stack.
+ */
+static VALUE event_batch = RUBY_Qnil;
+static volatile int event_loop_active;
+static pthread_t event_loop_thread;
+
+struct event_callback_arg {
+    void *(*func)(void *);
+    void *data;
+};
+
+static VALUE event_callback_run(VALUE in)
 {
-    struct ruby_libvirt_ary_store_arg *e = (struct ruby_libvirt_ary_store_arg *)arg;
+    struct event_callback_arg *arg = (struct event_callback_arg *)in;
 
-    rb_ary_store(e->arr, e->index, e->elem);
+    arg->func(arg->data);
 
     return Qnil;
 }
 
-VALUE ruby_libvirt_str_new2_wrap(VALUE arg)
+static void *event_callback_protect(void *p)
 {
-    char **str = (char **)arg;
+    int exception = 0;
+    VALUE err;
 
-    return rb_str_new2(*str);
+    rb_protect(event_callback_run, (VALUE)p, &exception);
+    if (exception) {
+        /* raising here would unwind through libvirt; hand the exception to
+         * the loop thread instead
+         */
+        err = rb_errinfo();
+        rb_set_errinfo(Qnil);
+        if (rb_obj_is_kind_of(err, rb_eException) == Qtrue) {
+            rb_ary_push(event_batch, err);
+        }
+    }
+
+    return NULL;
 }
 
-VALUE ruby_libvirt_str_new_wrap(VALUE arg)
+void ruby_libvirt_event_loop_enter(void)
 {
-    struct ruby_libvirt_str_new_arg *e = (struct ruby_libvirt_str_new_arg *)arg;
-
-    return rb_str_new(e->val, e->size);
+    event_loop_thread = pthread_self();
+    event_loop_active = 1;
 }
 
-VALUE ruby_libvirt_hash_aset_wrap(VALUE arg)
+void ruby_libvirt_event_loop_leave(void)
 {
-    struct ruby_libvirt_hash_aset_arg *e = (struct ruby_libvirt_hash_aset_arg *)arg;
-
-    return rb_hash_aset(e->hash, rb_str_new2(e->name), e->val);
+    event_loop_active = 0;
 }
 
-VALUE ruby_libvirt_str_new2_and_ary_store_wrap(VALUE arg)
+VALUE ruby_libvirt_event_batch_take(void)
 {
-    struct ruby_libvirt_str_new2_and_ary_store_arg *e = (struct ruby_libvirt_str_new2_and_ary_store_arg *)arg;
+    VALUE batch = event_batch;
 
-    rb_ary_store(e->arr, e->index, rb_str_new2(e->value));
+    event_batch = rb_ary_new();
 
-    return Qnil;
+    return batch;
 }
 
-void ruby_libvirt_raise_error_if(const int condition, VALUE error,
-                                 const char *method, virConnectPtr conn)
+void ruby_libvirt_event_batch_run(VALUE batch)
 {
-    VALUE ruby_errinfo;
-    virErrorPtr err;
-    char *msg;
-    int rc;
-    struct rb_exc_new2_arg arg;
-    int exception = 0;
-
-    if (!condition) {
-        return;
-    }
+    VALUE entry;
+    long i;
 
-    if (conn == NULL) {
-        err = virGetLastError();
-    }
-    else {
-        err = virConnGetLastError(conn);
+    for (i = 0; i < RARRAY_LEN(batch); i++) {
+        entry = rb_ary_entry(batch, i);
+        if (rb_obj_is_kind_of(entry, rb_eException) == Qtrue) {
+            rb_exc_raise(entry);
+        }
+        ruby_libvirt_event_callback_call(rb_ary_entry(entry, 0), NULL,
+                                         (int)RARRAY_LEN(rb_ary_entry(entry, 1)),
+                                         RARRAY_PTR(rb_ary_entry(entry, 1)));
     }
+}
 
-    if (err != NULL && err->message != NULL) {
-        rc = asprintf(&msg, "Call to %s failed: %s", method, err->message);
-    }
-    else {
-        rc = asprintf(&msg, "Call to %s failed", method);
-    }
+static int event_batching(void)
+{
+    return event_loop_active && pthread_equal(pthread_self(),
+                                              event_loop_thread);
+}
+#endif
 
-    if (rc < 0) {
-        /* there's not a whole lot we can do here; try to raise an
-         * out-of-memory message */
-        rb_memerror();
-    }
+/* Run func(data), which delivers a libvirt callback to Ruby.  From the
+ * native event loop thread this takes the GVL first, and anything func
+ * passes to ruby_libvirt_event_callback_call is queued rather than called.
+ */
+void ruby_libvirt_event_callback_enter(void *(*func)(void *), void *data)
+{
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    struct event_callback_arg arg;
 
-    arg.error = error;
-    arg.msg = msg;
-    ruby_errinfo = rb_protect(ruby_libvirt_exc_new2_wrap, (VALUE)&arg,
-                              &exception);
-    free(msg);
-    if (exception) {
-        rb_jump_tag(exception);
+    if (event_batching()) {
+        arg.func = func;
+        arg.data = data;
+        rb_thread_call_with_gvl(event_callback_protect, &arg);
+        return;
     }
+#endif
 
-    rb_iv_set(ruby_errinfo, "@libvirt_function_name", rb_str_new2(method));
+    func(data);
+}
 
-    if (err != NULL) {
-        rb_iv_set(ruby_errinfo, "@libvirt_code", INT2NUM(err->code));
-        rb_iv_set(ruby_errinfo, "@libvirt_component", INT2NUM(err->domain));
-        rb_iv_set(ruby_errinfo, "@libvirt_level", INT2NUM(err->level));
-        if (err->message != NULL) {
-            rb_iv_set(ruby_errinfo, "@libvirt_message",
-                      rb_str_new2(err->message));
-        }
+/* Call the Symbol or Proc cb with argv, or queue the call if we are in the
+ * middle of an event loop iteration on the native loop thread.  what names
+ * the callback in the TypeError raised for anything else.
+ */
+void ruby_libvirt_event_callback_call(VALUE cb, const char *what, int argc,
+                                      VALUE *argv)
+{
+    if (!SYMBOL_P(cb) && rb_obj_is_proc(cb) != Qtrue) {
+        rb_raise(rb_eTypeError, "wrong %s callback (expected Symbol or Proc)",
+                 what ? what : "event");
     }
 
-    rb_exc_raise(ruby_errinfo);
-};
-
-char *ruby_libvirt_get_cstring_or_null(VALUE arg)
-{
-    if (TYPE(arg) == T_NIL) {
-        return NULL;
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    if (event_batching()) {
+        rb_ary_push(event_batch, rb_assoc_new(cb, rb_ary_new4(argc, argv)));
+        return;
     }
-    else if (TYPE(arg) == T_STRING) {
-        return StringValueCStr(arg);
+#endif
+
+    if (SYMBOL_P(cb)) {
+        rb_funcall2(rb_class_of(cb), SYM2ID(cb), argc, argv);
     }
     else {
-        rb_raise(rb_eTypeError, "wrong argument type (expected String or nil)");
+        rb_funcall2(cb, id_call, argc, argv);
     }
-
-    return NULL;
-}
-
-VALUE ruby_libvirt_new_class(VALUE klass, void *ptr, VALUE conn,
-                             RUBY_DATA_FUNC free_func)
-{
-    VALUE result;
-    result = Data_Wrap_Struct(klass, NULL, free_func, ptr);
-    rb_iv_set(result, "@connection", conn);
-    return result;
 }
 
-int ruby_libvirt_is_symbol_or_proc(VALUE handle)
+void ruby_libvirt_common_init(void)
 {
-    return ((strcmp(rb_obj_classname(handle), "Symbol") == 0) ||
-            (strcmp(rb_obj_classname(handle), "Proc") == 0));
+    id_call = rb_intern("call");
+    call_stats = st_init_strtable();
+#if RUBY_LIBVIRT_RACTOR
+    main_ractor_key = rb_ractor_local_storage_value_newkey();
+    rb_ractor_local_storage_value_set(main_ractor_key, Qtrue);
+#endif
+    /* no leading @, so the cache is invisible from Ruby */
+    id_nparams_cache = rb_intern("nparams_cache");
+    id_maxcpus = rb_intern("maxcpus");
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    event_batch = rb_ary_new();
+    rb_global_variable(&event_batch);
+    pthread_key_create(&nogvl_error_key, NULL);
+#endif
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+#if RUBY_LIBVIRT_RACTOR
+    fiber_pipes_key = rb_ractor_local_storage_value_newkey();
+#else
+    fiber_pipes = rb_ary_new();
+    rb_global_variable(&fiber_pipes);
+#endif
+    pthread_key_create(&fiber_error_key, NULL);
+    pthread_atfork(NULL, NULL, fiber_atfork_child);
+#endif
 }
 
 /* this is an odd function, because it has massive side-effects.
@@ -228,7 +1472,83 @@ exception:
     return Qnil;
 }
 
-void ruby_libvirt_typed_params_to_hash(void *voidparams, int i, VALUE hash)
+/*
+ * Parameter names come from a small fixed set per driver, so by default they
+ * are returned as interned frozen strings; every hash built for the same
+ * getter then shares the same key objects instead of allocating a new String
+ * per key per call.  With symbol_keys set they are returned as Symbols.
+ */
+VALUE ruby_libvirt_param_key(const char *name, int symbol_keys)
+{
+    if (symbol_keys) {
+        return ID2SYM(rb_intern(name));
+    }
+
+#if HAVE_RB_INTERNED_STR_CSTR
+    return rb_interned_str_cstr(name);
+#else
+    /* a frozen key is stored as-is by rb_hash_aset instead of being dup'ed */
+    return rb_obj_freeze(rb_str_new2(name));
+#endif
+}
+
+static int check_options_one(VALUE key, VALUE val, VALUE in)
+{
+    const char *const *names = (const char *const *)in;
+
+    for (; *names != NULL; names++) {
+        if (key == ID2SYM(rb_intern(*names))) {
+            return ST_CONTINUE;
+        }
+    }
+
+    rb_raise(rb_eArgError, "unknown option %s",
+             StringValueCStr(rb_inspect(key)));
+
+    /* not needed, but here to shut the compiler up */
+    return ST_STOP;
+}
+
+void ruby_libvirt_check_options(VALUE opts, const char *const *names)
+{
+    rb_hash_foreach(opts, check_options_one, (VALUE)names);
+}
+
+/*
+ * Strip a trailing options hash of the form {:keys => :string|:symbol} from
+ * argv, returning 1 if Symbol keys were asked for.  Any other key in the hash
+ * raises ArgumentError, so a misspelled option is not silently ignored.
+ */
+int ruby_libvirt_keys_option(int *argc, VALUE *argv)
+{
+    static const char *const keys_option_names[] = { "keys", NULL };
+    VALUE opts, keys;
+
+    if (*argc == 0 || TYPE(argv[*argc - 1]) != T_HASH) {
+        return 0;
+    }
+
+    opts = argv[*argc - 1];
+    (*argc)--;
+
+    ruby_libvirt_check_options(opts, keys_option_names);
+
+    keys = rb_hash_aref(opts, ID2SYM(rb_intern("keys")));
+    if (NIL_P(keys) || keys == ID2SYM(rb_intern("string"))) {
+        return 0;
+    }
+    if (keys == ID2SYM(rb_intern("symbol"))) {
+        return 1;
+    }
+
+    rb_raise(rb_eArgError, "keys must be :string or :symbol");
+
+    /* not needed, but here to shut the compiler up */
+    return 0;
+}
+
+void ruby_libvirt_typed_params_to_hash(void *voidparams, int i, VALUE hash,
+                                       int symbol_keys)
 {
     virTypedParameterPtr params = (virTypedParameterPtr)voidparams;
     VALUE val;
@@ -259,33 +1579,98 @@ void ruby_libvirt_typed_params_to_hash(void *voidparams, int i, VALUE hash)
         rb_raise(rb_eArgError, "Invalid parameter type");
     }
 
-    rb_hash_aset(hash, rb_str_new2(params[i].field), val);
+    rb_hash_aset(hash, ruby_libvirt_param_key(params[i].field, symbol_keys),
+                 val);
 }
 
-VALUE ruby_libvirt_get_parameters(VALUE d, unsigned int flags, void *opaque,
-                                  unsigned int typesize,
-                                  const char *(*nparams_cb)(VALUE d,
-                                                            unsigned int flags,
-                                                            void *opaque,
-                                                            int *nparams),
-                                  const char *(*get_cb)(VALUE d,
-                                                        unsigned int flags,
-                                                        void *voidparams,
-                                                        int *nparams,
-                                                        void *opaque),
-                                  void (*hash_set)(void *voidparams, int i,
-                                                   VALUE result))
+/*
+ * The number of parameters a getter returns is fixed by the driver, so it is
+ * remembered per connection, keyed by the nparams callback and flags.  With
+ * a cached count the values are fetched in one call instead of two.  The
+ * typed-parameter getters are asked for slack more than the cached count;
+ * they return fewer if there are fewer, so getting the whole buffer back
+ * means the count may have grown.  That, or any error, drops the cached
+ * count and starts again from nparams_cb, which also covers a count that
+ * depends on opaque (the disk or interface) rather than on the driver.  The
+ * stats getters (no slack) insist on the exact count, which can depend on
+ * opaque as well and can't be checked that way, so they are never cached.
+ * None of the getters that come through here has a variant that allocates
+ * the array itself; the ones that do (virDomainGetJobStats) are called
+ * directly, once, and the result freed with virTypedParamsFree().
+ */
+static VALUE nparams_cache_get(VALUE d)
+{
+    VALUE c, cache;
+
+    c = ruby_libvirt_conn_attr(d);
+    cache = rb_ivar_get(c, id_nparams_cache);
+    if (NIL_P(cache)) {
+        cache = rb_hash_new();
+        rb_ivar_set(c, id_nparams_cache, cache);
+    }
+
+    return cache;
+}
+
+static VALUE get_parameters(VALUE d, unsigned int flags, int symbol_keys,
+                            void *opaque, unsigned int typesize,
+                            const char *(*nparams_cb)(VALUE d,
+                                                      unsigned int flags,
+                                                      void *opaque,
+                                                      int *nparams),
+                            const char *(*get_cb)(VALUE d, unsigned int flags,
+                                                  void *voidparams,
+                                                  int *nparams, void *opaque),
+                            void (*hash_set)(void *voidparams, int i,
+                                             VALUE result, int symbol_keys),
+                            int slack)
 {
-    int nparams = 0;
+    int nparams = 0, cached;
     void *params;
-    VALUE result;
+    VALUE result, cache = Qnil, key = Qnil, entry = Qnil;
     const char *errname;
     int i;
 
+    if (slack > 0) {
+        cache = nparams_cache_get(d);
+        key = rb_assoc_new(ULL2NUM((unsigned long long)(uintptr_t)nparams_cb),
+                           UINT2NUM(flags));
+        entry = rb_hash_lookup(cache, key);
+    }
+
+    if (!NIL_P(entry)) {
+        cached = NUM2INT(entry);
+        nparams = cached + slack;
+        if (nparams == 0) {
+            return rb_hash_new();
+        }
+
+        params = alloca(typesize * nparams);
+
+        errname = get_cb(d, flags, params, &nparams, opaque);
+        if (errname == NULL && nparams < cached + slack) {
+            if (nparams != cached) {
+                rb_hash_aset(cache, key, INT2NUM(nparams));
+            }
+            result = rb_hash_new();
+            for (i = 0; i < nparams; i++) {
+                hash_set(params, i, result, symbol_keys);
+            }
+            return result;
+        }
+
+        rb_hash_delete(cache, key);
+        nparams = 0;
+    }
+
     errname = nparams_cb(d, flags, opaque, &nparams);
     ruby_libvirt_raise_error_if(errname != NULL, e_RetrieveError, errname,
                                 ruby_libvirt_connect_get(d));
 
+    if (!NIL_P(cache)) {
+        rb_hash_aset(cache, key, INT2NUM(nparams));
+    }
+
     result = rb_hash_new();
 
     if (nparams == 0) {
@@ -295,18 +1680,41 @@ VALUE ruby_libvirt_get_parameters(VALUE d, unsigned int flags, void *opaque,
     params = alloca(typesize * nparams);
 
     errname = get_cb(d, flags, params, &nparams, opaque);
+    if (errname != NULL && !NIL_P(cache)) {
+        rb_hash_delete(cache, key);
+    }
     ruby_libvirt_raise_error_if(errname != NULL, e_RetrieveError, errname,
                                 ruby_libvirt_connect_get(d));
 
     for (i = 0; i < nparams; i++) {
-        hash_set(params, i, result);
+        hash_set(params, i, result, symbol_keys);
     }
 
     return result;
 }
 
+VALUE ruby_libvirt_get_parameters(VALUE d, unsigned int flags,
+                                  int symbol_keys, void *opaque,
+                                  unsigned int typesize,
+                                  const char *(*nparams_cb)(VALUE d,
+                                                            unsigned int flags,
+                                                            void *opaque,
+                                                            int *nparams),
+                                  const char *(*get_cb)(VALUE d,
+                                                        unsigned int flags,
+                                                        void *voidparams,
+                                                        int *nparams,
+                                                        void *opaque),
+                                  void (*hash_set)(void *voidparams, int i,
+                                                   VALUE result,
+                                                   int symbol_keys))
+{
+    return get_parameters(d, flags, symbol_keys, opaque, typesize, nparams_cb,
+                          get_cb, hash_set, 0);
+}
+
 VALUE ruby_libvirt_get_typed_parameters(VALUE d, unsigned int flags,
-                                        void *opaque,
+                                        int symbol_keys, void *opaque,
                                         const char *(*nparams_cb)(VALUE d,
                                                                   unsigned int flags,
                                                                   void *opaque,
@@ -317,10 +1725,10 @@ VALUE ruby_libvirt_get_typed_parameters(VALUE d, unsigned int flags,
                                                               int *nparams,
                                                               void *opaque))
 {
-    return ruby_libvirt_get_parameters(d, flags, opaque,
-                                       sizeof(virTypedParameter), nparams_cb,
-                                       get_cb,
-                                       ruby_libvirt_typed_params_to_hash);
+    return get_parameters(d, flags, symbol_keys, opaque,
+                          sizeof(virTypedParameter),
+                          nparams_cb, get_cb,
+                          ruby_libvirt_typed_params_to_hash, 1);
 }
 
 void ruby_libvirt_assign_hash_and_flags(VALUE in, VALUE *hash, VALUE *flags)
@@ -349,33 +1757,46 @@ int ruby_libvirt_typed_parameter_assign(VALUE key, VALUE val, VALUE in)
     unsigned int i;
     int found;
 
-    keyname = StringValueCStr(key);
+    if (SYMBOL_P(key)) {
+        keyname = (char *)rb_id2name(SYM2ID(key));
+    }
+    else {
+        keyname = StringValueCStr(key);
+    }
 
     found = 0;
     for (i = 0; i < args->num_allowed; i++) {
         if (strcmp(args->allowed[i].name, keyname) == 0) {
+            if (args->i >= args->nalloc) {
+                rb_raise(rb_eArgError,
+                         "parameter Hash was modified while being read");
+            }
             args->params[args->i].type = args->allowed[i].type;
             switch (args->params[args->i].type) {
             case VIR_TYPED_PARAM_INT:
-                args->params[i].value.i = NUM2INT(val);
+                args->params[args->i].value.i = NUM2INT(val);
                 break;
             case VIR_TYPED_PARAM_UINT:
-                args->params[i].value.ui = NUM2UINT(val);
+                args->params[args->i].value.ui = NUM2UINT(val);
                 break;
             case VIR_TYPED_PARAM_LLONG:
-                args->params[i].value.l = NUM2LL(val);
+                args->params[args->i].value.l = NUM2LL(val);
                 break;
             case VIR_TYPED_PARAM_ULLONG:
                 args->params[args->i].value.ul = NUM2ULL(val);
                 break;
             case VIR_TYPED_PARAM_DOUBLE:
-                args->params[i].value.d = NUM2DBL(val);
+                args->params[args->i].value.d = NUM2DBL(val);
                 break;
             case VIR_TYPED_PARAM_BOOLEAN:
-                args->params[i].value.b = (val == Qtrue) ? 1 : 0;
+                args->params[args->i].value.b = (val == Qtrue) ? 1 : 0;
                 break;
             case VIR_TYPED_PARAM_STRING:
-                args->params[args->i].value.s = StringValueCStr(val);
+                /* a copy, since the call may be made without the GVL while
+                 * other threads change or drop the String; freed by
+                 * ruby_libvirt_typed_params_ensure()
+                 */
+                args->params[args->i].value.s = xstrdup(StringValueCStr(val));
                 break;
             default:
                 rb_raise(rb_eArgError, "Invalid parameter type");
@@ -397,6 +1818,54 @@ int ruby_libvirt_typed_parameter_assign(VALUE key, VALUE val, VALUE in)
     return ST_CONTINUE;
 }
 
+static VALUE typed_params_free(VALUE in)
+{
+    struct ruby_libvirt_parameter_assign_args *args = (struct ruby_libvirt_parameter_assign_args *)in;
+    int j;
+
+    for (j = 0; j < args->i; j++) {
+        if (args->params[j].type == VIR_TYPED_PARAM_STRING) {
+            xfree(args->params[j].value.s);
+            args->params[j].value.s = NULL;
+        }
+    }
+
+    return Qnil;
+}
+
+VALUE ruby_libvirt_typed_params_ensure(VALUE (*body)(VALUE), VALUE data,
+                                       struct ruby_libvirt_parameter_assign_args *args)
+{
+    return rb_ensure(body, data, typed_params_free, (VALUE)args);
+}
+
+struct set_typed_parameters_arg {
+    VALUE d;
+    VALUE input;
+    unsigned int flags;
+    void *opaque;
+    struct ruby_libvirt_parameter_assign_args *args;
+    const char *(*set_cb)(VALUE d, unsigned int flags,
+                          virTypedParameterPtr params, int nparams,
+                          void *opaque);
+};
+
+static VALUE set_typed_parameters_body(VALUE in)
+{
+    struct set_typed_parameters_arg *set = (struct set_typed_parameters_arg *)in;
+    const char *errname;
+
+    rb_hash_foreach(set->input, ruby_libvirt_typed_parameter_assign,
+                    (VALUE)set->args);
+
+    errname = set->set_cb(set->d, set->flags, set->args->params, set->args->i,
+                          set->opaque);
+    ruby_libvirt_raise_error_if(errname != NULL, e_RetrieveError, errname,
+                                ruby_libvirt_connect_get(set->d));
+
+    return Qnil;
+}
+
 VALUE ruby_libvirt_set_typed_parameters(VALUE d, VALUE input,
                                         unsigned int flags, void *opaque,
                                         struct ruby_libvirt_typed_param *allowed,
@@ -407,8 +1876,8 @@ VALUE ruby_libvirt_set_typed_parameters(VALUE d, VALUE input,
                                                               int nparams,
                                                               void *opaque))
 {
-    const char *errname;
     struct ruby_libvirt_parameter_assign_args args;
+    struct set_typed_parameters_arg set;
     unsigned long hashsize;
 
     /* make sure input is a hash */
@@ -423,15 +1892,18 @@ VALUE ruby_libvirt_set_typed_parameters(VALUE d, VALUE input,
     args.allowed = allowed;
     args.num_allowed = num_allowed;
     args.params = alloca(sizeof(virTypedParameter) * hashsize);
+    args.nalloc = hashsize;
     args.i = 0;
 
-    rb_hash_foreach(input, ruby_libvirt_typed_parameter_assign, (VALUE)&args);
-
-    errname = set_cb(d, flags, args.params, args.i, opaque);
-    ruby_libvirt_raise_error_if(errname != NULL, e_RetrieveError, errname,
-                                ruby_libvirt_connect_get(d));
+    set.d = d;
+    set.input = input;
+    set.flags = flags;
+    set.opaque = opaque;
+    set.args = &args;
+    set.set_cb = set_cb;
 
-    return Qnil;
+    return ruby_libvirt_typed_params_ensure(set_typed_parameters_body,
+                                            (VALUE)&set, &args);
 }
 
 unsigned int ruby_libvirt_value_to_uint(VALUE in)
@@ -470,7 +1942,7 @@ unsigned long long ruby_libvirt_value_to_ulonglong(VALUE in)
     return NUM2ULL(in);
 }
 
-int ruby_libvirt_get_maxcpus(virConnectPtr conn)
+static int query_maxcpus(virConnectPtr conn)
 {
     int maxcpu = -1;
     virNodeInfo nodeinfo;
@@ -488,3 +1960,36 @@ int ruby_libvirt_get_maxcpus(virConnectPtr conn)
 
     return maxcpu;
 }
+
+/*
+ * The number of host CPUs only changes on CPU hotplug, so it is looked up
+ * once per connection and remembered on the Connect object; every vcpu and
+ * pinning query would otherwise pay an extra RPC just to size its cpumaps.
+ * ruby_libvirt_set_maxcpus() replaces the remembered value, either with a
+ * count the caller already has or, given -1, with a fresh lookup.
+ */
+int ruby_libvirt_get_maxcpus(VALUE d)
+{
+    VALUE c, cached;
+
+    c = ruby_libvirt_conn_attr(d);
+    cached = rb_ivar_get(c, id_maxcpus);
+    if (!NIL_P(cached)) {
+        return NUM2INT(cached);
+    }
+
+    return ruby_libvirt_set_maxcpus(c, -1);
+}
+
+int ruby_libvirt_set_maxcpus(VALUE d, int maxcpus)
+{
+    VALUE c;
+
+    c = ruby_libvirt_conn_attr(d);
+    if (maxcpus < 0) {
+        maxcpus = query_maxcpus(ruby_libvirt_connect_get(c));
+    }
+    rb_ivar_set(c, id_maxcpus, INT2NUM(maxcpus));
+
+    return maxcpus;
+}
@@ -1,33 +1,86 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+/* the HAVE_ macros below must be known whatever the include order */
+#include "extconf.h"
+
+/* Every wrapped libvirt object (Libvirt::Connect, Libvirt::Domain, ...) is
+ * a TypedData object holding one of these.  PTR is the libvirt object, or
+ * NULL once it has been freed; CONN is the Libvirt::Connect it came from
+ * (the object itself for a Libvirt::Connect), kept alive by marking it from
+ * here rather than through an instance variable.
+ */
+struct ruby_libvirt_handle {
+    void *ptr;
+    VALUE conn;
+};
+
+/* The common parent of the data types of all wrapped objects; see
+ * ruby_libvirt_handle_type.
+ */
+extern const rb_data_type_t ruby_libvirt_handle_data_type;
+
+void ruby_libvirt_handle_mark(void *p);
+size_t ruby_libvirt_handle_memsize(const void *p);
+#if HAVE_RB_GC_MARK_MOVABLE
+void ruby_libvirt_handle_compact(void *p);
+#define RUBY_LIBVIRT_HANDLE_FUNCTIONS(dfree)                            \
+    { ruby_libvirt_handle_mark, dfree, ruby_libvirt_handle_memsize,     \
+      ruby_libvirt_handle_compact, }
+#else
+#define RUBY_LIBVIRT_HANDLE_FUNCTIONS(dfree)                            \
+    { ruby_libvirt_handle_mark, dfree, ruby_libvirt_handle_memsize, }
+#endif
+
 /* Macros to ease some of the boilerplate */
-VALUE ruby_libvirt_new_class(VALUE klass, void *ptr, VALUE conn,
-                             RUBY_DATA_FUNC free_func);
+
+/* Declare KIND##_handle_data_type, the data type of the Ruby class CLASSNAME
+ * wrapping a vir##KIND##Ptr.  Dropping the last reference to one of these
+ * only drops a reference inside libvirt, so it is freed immediately by the
+ * garbage collector.
+ */
+#define ruby_libvirt_handle_type(kind, classname)                       \
+    static void kind##_handle_free(void *p)                             \
+    {                                                                   \
+        struct ruby_libvirt_handle *h = p;                              \
+                                                                        \
+        /* there is no way to report a failure from here */             \
+        if (h->ptr) {                                                   \
+            vir##kind##Free((vir##kind##Ptr) h->ptr);                   \
+        }                                                               \
+        xfree(h);                                                       \
+    }                                                                   \
+                                                                        \
+    static const rb_data_type_t kind##_handle_data_type = {             \
+        classname,                                                      \
+        RUBY_LIBVIRT_HANDLE_FUNCTIONS(kind##_handle_free),              \
+        &ruby_libvirt_handle_data_type, NULL, RUBY_TYPED_FREE_IMMEDIATELY \
+    };
+
+VALUE ruby_libvirt_new_class(VALUE klass, const rb_data_type_t *type,
+                             void *ptr, VALUE conn);
+VALUE ruby_libvirt_handle_connection(VALUE obj);
 
 #define RUBY_LIBVIRT_UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
 
 #define ruby_libvirt_get_struct(kind, v)                                \
     do {                                                                \
-        vir##kind##Ptr ptr;                                             \
-        Data_Get_Struct(v, vir##kind, ptr);                             \
-        if (!ptr) {                                                     \
+        struct ruby_libvirt_handle *h;                                  \
+        TypedData_Get_Struct(v, struct ruby_libvirt_handle,             \
+                             &kind##_handle_data_type, h);              \
+        if (!h->ptr) {                                                  \
             rb_raise(rb_eArgError, #kind " has been freed");            \
         }                                                               \
-        return ptr;                                                     \
+        return (vir##kind##Ptr) h->ptr;                                 \
     } while (0);
 
-#define ruby_libvirt_free_struct(kind, p)                               \
-    do {                                                                \
-        int r;                                                          \
-        r = vir##kind##Free((vir##kind##Ptr) p);                        \
-        if (r < 0) {                                                    \
-            rb_raise(rb_eSystemCallError, # kind " free failed");       \
-        }                                                               \
-    } while(0);
-
+VALUE ruby_libvirt_error_new(VALUE error, const char *method, virErrorPtr err);
+virErrorPtr ruby_libvirt_last_error(void);
+void ruby_libvirt_reset_last_error(void);
 void ruby_libvirt_raise_error_if(const int condition, VALUE error,
                                  const char *method, virConnectPtr conn);
+int ruby_libvirt_error_missing(const int condition, int code,
+                               virConnectPtr conn);
 
 /*
  * Code generating macros.
@@ -45,8 +98,10 @@ void ruby_libvirt_raise_error_if(const int condition, VALUE error,
         const char *str;                                                 \
         VALUE result;                                                    \
         int exception;                                                   \
+        unsigned long long _t_##func = ruby_libvirt_call_stats_start();  \
                                                                          \
         str = func(args);                                                \
+        ruby_libvirt_call_stats_end(#func, _t_##func);                   \
         ruby_libvirt_raise_error_if(str == NULL, e_Error, # func, conn); \
         if (dealloc) {                                                   \
             result = rb_protect(ruby_libvirt_str_new2_wrap, (VALUE)&str, &exception); \
@@ -66,12 +121,13 @@ void ruby_libvirt_raise_error_if(const int condition, VALUE error,
  */
 #define ruby_libvirt_generate_call_free(kind, s)                        \
     do {                                                                \
-        vir##kind##Ptr ptr;                                             \
-        Data_Get_Struct(s, vir##kind, ptr);                             \
-        if (ptr != NULL) {                                              \
-            int r = vir##kind##Free(ptr);                               \
+        struct ruby_libvirt_handle *h;                                  \
+        TypedData_Get_Struct(s, struct ruby_libvirt_handle,             \
+                             &kind##_handle_data_type, h);              \
+        if (h->ptr != NULL) {                                           \
+            int r = vir##kind##Free((vir##kind##Ptr) h->ptr);           \
             ruby_libvirt_raise_error_if(r < 0, e_Error, "vir" #kind "Free", ruby_libvirt_connect_get(s)); \
-            DATA_PTR(s) = NULL;                                         \
+            h->ptr = NULL;                                              \
         }                                                               \
         return Qnil;                                                    \
     } while (0)
@@ -83,7 +139,9 @@ void ruby_libvirt_raise_error_if(const int condition, VALUE error,
 #define ruby_libvirt_generate_call_nil(func, conn, args...)               \
     do {                                                                  \
         int _r_##func;                                                    \
+        unsigned long long _t_##func = ruby_libvirt_call_stats_start();   \
         _r_##func = func(args);                                           \
+        ruby_libvirt_call_stats_end(#func, _t_##func);                    \
         ruby_libvirt_raise_error_if(_r_##func < 0, e_Error, #func, conn); \
         return Qnil;                                                      \
     } while(0)
@@ -94,7 +152,9 @@ void ruby_libvirt_raise_error_if(const int condition, VALUE error,
 #define ruby_libvirt_generate_call_truefalse(func, conn, args...)         \
     do {                                                                  \
         int _r_##func;                                                    \
+        unsigned long long _t_##func = ruby_libvirt_call_stats_start();   \
         _r_##func = func(args);                                           \
+        ruby_libvirt_call_stats_end(#func, _t_##func);                    \
         ruby_libvirt_raise_error_if(_r_##func < 0, e_Error, #func, conn); \
         return _r_##func ? Qtrue : Qfalse;                                \
     } while(0)
@@ -106,11 +166,359 @@ void ruby_libvirt_raise_error_if(const int condition, VALUE error,
 #define ruby_libvirt_generate_call_int(func, conn, args...)             \
     do {                                                                \
         int _r_##func;                                                  \
+        unsigned long long _t_##func = ruby_libvirt_call_stats_start(); \
         _r_##func = func(args);                                         \
+        ruby_libvirt_call_stats_end(#func, _t_##func);                  \
         ruby_libvirt_raise_error_if(_r_##func < 0, e_RetrieveError, #func, conn); \
         return INT2NUM(_r_##func);                                      \
     } while(0)
 
+/* Run FUNC(DATA) with the Ruby GVL released, so that other Ruby threads can
+ * make progress while a (potentially slow) libvirt call is in flight.  If the
+ * calling thread is interrupted while FUNC is running, UBF(UBFDATA) is called
+ * from another thread to try and make FUNC return early; UBF may be NULL if
+ * there is no way to do that.  Neither FUNC nor UBF may touch Ruby objects.
+ */
+void ruby_libvirt_without_gvl(void *(*func)(void *), void *data,
+                              void (*ubf)(void *), void *ubfdata);
+
+/* As ruby_libvirt_without_gvl(), for a FUNC that hands back something the
+ * caller has to free or wrap: nothing is raised once FUNC has run, so the
+ * result can't be lost to an interrupt that arrives meanwhile.  Instead the
+ * return value is the state of an exception to raise later (as from
+ * rb_protect), or 0, and once the result is safe the caller passes it to
+ * ruby_libvirt_raise_pending(), which raises that or any pending interrupt.
+ */
+int ruby_libvirt_without_gvl_owned(void *(*func)(void *), void *data,
+                                   void (*ubf)(void *), void *ubfdata);
+void ruby_libvirt_raise_pending(int state);
+
+/* With a Ruby that has a fiber scheduler interface, and once
+ * Libvirt.fiber_scheduler_enabled is set, ruby_libvirt_without_gvl() called
+ * from a non-blocking fiber runs FUNC on a native worker thread (of which
+ * ruby_libvirt_fiber_scheduler_workers are kept around between calls) and
+ * lets the scheduler run other fibers until it is done.
+ */
+#define RUBY_LIBVIRT_FIBER_SCHEDULER (HAVE_RB_THREAD_CALL_WITHOUT_GVL && \
+                                      HAVE_RB_FIBER_SCHEDULER_CURRENT)
+#if RUBY_LIBVIRT_FIBER_SCHEDULER
+extern int ruby_libvirt_fiber_scheduler_on;
+extern int ruby_libvirt_fiber_scheduler_workers;
+#endif
+
+/* With a Ruby that has Ractors the extension is marked Ractor-safe, so any
+ * Ractor can use its own connections.  libvirt's event loop is global to
+ * the process, though, so everything that calls back into Ruby (the event
+ * implementation, the default event loop thread and the callbacks
+ * registered on connections and streams) stays with the main Ractor; those
+ * entry points call ruby_libvirt_main_ractor_only(), which raises
+ * Ractor::UnsafeError from any other Ractor.
+ */
+#define RUBY_LIBVIRT_RACTOR (HAVE_RB_EXT_RACTOR_SAFE &&                 \
+                             HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY && \
+                             HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+int ruby_libvirt_main_ractor_p(void);
+void ruby_libvirt_main_ractor_only(const char *method);
+/* Raise as ruby_libvirt_main_ractor_only() does, but only once Ruby event
+ * callbacks are registered; for calls that can make libvirt add handles or
+ * timeouts, which only the main Ractor may service.
+ */
+void ruby_libvirt_event_impl_check(const char *method);
+
+/* Call FUNC(I, DATA) for every I from 0 to COUNT - 1 with the GVL released,
+ * shared out between the calling thread and up to NTHREADS - 1 more native
+ * threads, so that independent libvirt calls (which a remote connection
+ * handles concurrently) overlap.  FUNC may not touch Ruby objects, and
+ * should only touch its own slot of DATA.  An interrupt stops any more
+ * indices from being handed out; the return value is how many (from 0 up)
+ * were run, and if that is short the caller calls rb_thread_check_ints().
+ * Something may still be raised from here (from the fiber scheduler path),
+ * so call it from the body of an rb_ensure that frees DATA.
+ */
+long ruby_libvirt_parallel_nogvl(long count, int nthreads,
+                                 void (*func)(long, void *), void *data);
+
+/* Per-API call statistics, reported by Libvirt.call_stats.  While
+ * ruby_libvirt_call_stats_on is 0 the start/end macros reduce to a test of
+ * that flag.  ruby_libvirt_without_gvl_timed() is ruby_libvirt_without_gvl()
+ * with the call, and the wait for the GVL after it, timed under METHOD.
+ */
+extern int ruby_libvirt_call_stats_on;
+unsigned long long ruby_libvirt_call_stats_now(void);
+void ruby_libvirt_call_stats_time(const char *method, unsigned long long start,
+                                  unsigned long long returned);
+VALUE ruby_libvirt_call_stats(void);
+void ruby_libvirt_call_stats_reset(void);
+void ruby_libvirt_without_gvl_timed(const char *method,
+                                    void *(*func)(void *), void *data,
+                                    void (*ubf)(void *), void *ubfdata);
+int ruby_libvirt_without_gvl_owned_timed(const char *method,
+                                         void *(*func)(void *), void *data,
+                                         void (*ubf)(void *), void *ubfdata);
+
+#define ruby_libvirt_call_stats_start()                                 \
+    (ruby_libvirt_call_stats_on ? ruby_libvirt_call_stats_now() : 0)
+
+#define ruby_libvirt_call_stats_end(method, start)                      \
+    do {                                                                \
+        if (start) {                                                    \
+            ruby_libvirt_call_stats_time(method, start, 0);             \
+        }                                                               \
+    } while (0)
+
+/* Declare a trampoline that allows the libvirt function FUNC to be called
+ * through ruby_libvirt_without_gvl().  This generates a
+ * "struct FUNC_nogvl_args", containing the arguments to FUNC in order
+ * (a0, a1, ...) followed by the return value (ret), and a function FUNC_nogvl
+ * that makes the call.  Since the arguments come first, the structure can be
+ * initialized with the same argument list FUNC would be called with.  The
+ * number at the end of the macro name is the number of arguments FUNC takes.
+ *
+ * The first argument must be a libvirt handle (a virConnectPtr,
+ * virDomainPtr, ...).  Another Ruby thread could free it (with dom.free or
+ * conn.close) while the call is in flight, so FUNC_nogvl_hold() takes a
+ * reference on it with the GVL held, and FUNC_nogvl drops it again once
+ * FUNC has returned.  Dropping it resets the thread's libvirt error, so
+ * that is kept first for ruby_libvirt_last_error() to find.
+ *
+ * The _as variants call FUNC, but name everything (including what errors
+ * and Libvirt.call_stats report) after NAME, for calls that used to report
+ * the name of a different libvirt function.
+ */
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+void ruby_libvirt_nogvl_error_keep(void);
+
+#define ruby_libvirt_nogvl_hold_virConnectPtr(p) virConnectRef(p)
+#define ruby_libvirt_nogvl_drop_virConnectPtr(p) virConnectClose(p)
+#define ruby_libvirt_nogvl_hold_virDomainPtr(p) virDomainRef(p)
+#define ruby_libvirt_nogvl_drop_virDomainPtr(p) virDomainFree(p)
+#define ruby_libvirt_nogvl_hold_virStoragePoolPtr(p) virStoragePoolRef(p)
+#define ruby_libvirt_nogvl_drop_virStoragePoolPtr(p) virStoragePoolFree(p)
+#define ruby_libvirt_nogvl_hold_virStorageVolPtr(p) virStorageVolRef(p)
+#define ruby_libvirt_nogvl_drop_virStorageVolPtr(p) virStorageVolFree(p)
+#define ruby_libvirt_nogvl_hold_virStreamPtr(p) virStreamRef(p)
+#define ruby_libvirt_nogvl_drop_virStreamPtr(p) virStreamFree(p)
+
+#define ruby_libvirt_nogvl_hold(type, p) ruby_libvirt_nogvl_hold_##type(p)
+#define ruby_libvirt_nogvl_drop(type, p)                                \
+    do {                                                                \
+        ruby_libvirt_nogvl_error_keep();                                \
+        ruby_libvirt_nogvl_drop_##type(p);                              \
+    } while (0)
+#define ruby_libvirt_nogvl_drop2(t0, p0, t1, p1)                        \
+    do {                                                                \
+        ruby_libvirt_nogvl_error_keep();                                \
+        ruby_libvirt_nogvl_drop_##t0(p0);                               \
+        ruby_libvirt_nogvl_drop_##t1(p1);                               \
+    } while (0)
+#else
+/* the call is made with the GVL held, so nothing can free the handle */
+#define ruby_libvirt_nogvl_hold(type, p) ((void)0)
+#define ruby_libvirt_nogvl_drop(type, p) ((void)0)
+#define ruby_libvirt_nogvl_drop2(t0, p0, t1, p1) ((void)0)
+#endif
+
+#define ruby_libvirt_nogvl_trampoline(name, rettype, fields, call, hold, drop) \
+    struct name##_nogvl_args {                                          \
+        fields                                                          \
+        rettype ret;                                                    \
+    };                                                                  \
+    static void name##_nogvl_hold(struct name##_nogvl_args *a)          \
+    {                                                                   \
+        hold;                                                           \
+    }                                                                   \
+    static void *name##_nogvl(void *p)                                  \
+    {                                                                   \
+        struct name##_nogvl_args *a = (struct name##_nogvl_args *)p;    \
+        a->ret = call;                                                  \
+        drop;                                                           \
+        return NULL;                                                    \
+    }
+
+#define ruby_libvirt_nogvl_trampoline_held(name, rettype, t0, fields, call) \
+    ruby_libvirt_nogvl_trampoline(name, rettype, fields, call,          \
+                                  ruby_libvirt_nogvl_hold(t0, a->a0),   \
+                                  ruby_libvirt_nogvl_drop(t0, a->a0))
+
+/* as ruby_libvirt_nogvl_trampoline_held, for a FUNC that takes a second
+ * handle (such as the destination connection of a migration) as a1
+ */
+#define ruby_libvirt_nogvl_trampoline_held2(name, rettype, t0, t1, fields, call) \
+    ruby_libvirt_nogvl_trampoline(name, rettype, fields, call,          \
+                                  ruby_libvirt_nogvl_hold(t0, a->a0);   \
+                                  ruby_libvirt_nogvl_hold(t1, a->a1),   \
+                                  ruby_libvirt_nogvl_drop2(t0, a->a0,   \
+                                                           t1, a->a1))
+
+#define ruby_libvirt_declare_nogvl1_as(rettype, name, func, t0)         \
+    ruby_libvirt_nogvl_trampoline_held(name, rettype, t0, t0 a0;,       \
+                                       func(a->a0))
+#define ruby_libvirt_declare_nogvl2_as(rettype, name, func, t0, t1)     \
+    ruby_libvirt_nogvl_trampoline_held(name, rettype, t0, t0 a0; t1 a1;, \
+                                       func(a->a0, a->a1))
+#define ruby_libvirt_declare_nogvl3_as(rettype, name, func, t0, t1, t2) \
+    ruby_libvirt_nogvl_trampoline_held(name, rettype, t0,               \
+                                       t0 a0; t1 a1; t2 a2;,            \
+                                       func(a->a0, a->a1, a->a2))
+#define ruby_libvirt_declare_nogvl4_as(rettype, name, func, t0, t1, t2, t3) \
+    ruby_libvirt_nogvl_trampoline_held(name, rettype, t0,               \
+                                       t0 a0; t1 a1; t2 a2; t3 a3;,     \
+                                       func(a->a0, a->a1, a->a2, a->a3))
+#define ruby_libvirt_declare_nogvl5_as(rettype, name, func, t0, t1, t2, t3, t4) \
+    ruby_libvirt_nogvl_trampoline_held(name, rettype, t0,               \
+                                       t0 a0; t1 a1; t2 a2; t3 a3; t4 a4;, \
+                                       func(a->a0, a->a1, a->a2, a->a3, \
+                                            a->a4))
+#define ruby_libvirt_declare_nogvl6_as(rettype, name, func, t0, t1, t2, t3, t4, t5) \
+    ruby_libvirt_nogvl_trampoline_held(name, rettype, t0,               \
+                                       t0 a0; t1 a1; t2 a2; t3 a3; t4 a4; \
+                                       t5 a5;,                          \
+                                       func(a->a0, a->a1, a->a2, a->a3, \
+                                            a->a4, a->a5))
+#define ruby_libvirt_declare_nogvl7_as(rettype, name, func, t0, t1, t2, t3, t4, t5, t6) \
+    ruby_libvirt_nogvl_trampoline_held(name, rettype, t0,               \
+                                       t0 a0; t1 a1; t2 a2; t3 a3; t4 a4; \
+                                       t5 a5; t6 a6;,                   \
+                                       func(a->a0, a->a1, a->a2, a->a3, \
+                                            a->a4, a->a5, a->a6))
+
+#define ruby_libvirt_declare_nogvl1(rettype, func, t0)                  \
+    ruby_libvirt_declare_nogvl1_as(rettype, func, func, t0)
+#define ruby_libvirt_declare_nogvl2(rettype, func, t0, t1)              \
+    ruby_libvirt_declare_nogvl2_as(rettype, func, func, t0, t1)
+#define ruby_libvirt_declare_nogvl3(rettype, func, t0, t1, t2)          \
+    ruby_libvirt_declare_nogvl3_as(rettype, func, func, t0, t1, t2)
+#define ruby_libvirt_declare_nogvl4(rettype, func, t0, t1, t2, t3)      \
+    ruby_libvirt_declare_nogvl4_as(rettype, func, func, t0, t1, t2, t3)
+#define ruby_libvirt_declare_nogvl5(rettype, func, t0, t1, t2, t3, t4)  \
+    ruby_libvirt_declare_nogvl5_as(rettype, func, func, t0, t1, t2, t3, t4)
+#define ruby_libvirt_declare_nogvl6(rettype, func, t0, t1, t2, t3, t4, t5) \
+    ruby_libvirt_declare_nogvl6_as(rettype, func, func, t0, t1, t2, t3, t4, \
+                                   t5)
+#define ruby_libvirt_declare_nogvl7(rettype, func, t0, t1, t2, t3, t4, t5, t6) \
+    ruby_libvirt_declare_nogvl7_as(rettype, func, func, t0, t1, t2, t3, t4, \
+                                   t5, t6)
+
+/* Call FUNC, previously declared with ruby_libvirt_declare_nogvlN, without
+ * the GVL.  The result is left in VAR.ret.
+ */
+#define ruby_libvirt_call_nogvl(var, func, ubf, ubfdata, args...)       \
+    struct func##_nogvl_args var = { args };                            \
+    func##_nogvl_hold(&var);                                            \
+    ruby_libvirt_without_gvl_timed(#func, func##_nogvl, &var, ubf, ubfdata)
+
+/* As ruby_libvirt_call_nogvl, for a FUNC whose result the caller owns; see
+ * ruby_libvirt_without_gvl_owned().  STATE is declared to hold what has to
+ * be passed to ruby_libvirt_raise_pending() once the result is safe.
+ */
+#define ruby_libvirt_call_nogvl_owned(var, state, func, ubf, ubfdata, args...) \
+    struct func##_nogvl_args var = { args };                            \
+    int state = (func##_nogvl_hold(&var),                               \
+                 ruby_libvirt_without_gvl_owned_timed(#func, func##_nogvl, \
+                                                      &var, ubf, ubfdata))
+
+/* The following are the same as the ruby_libvirt_generate_call_* macros
+ * above, except that FUNC is called with the GVL released.  FUNC must first
+ * be declared with ruby_libvirt_declare_nogvlN.  All of the arguments are
+ * evaluated before the GVL is released, so it is safe to convert Ruby
+ * objects in the argument list.
+ */
+#define ruby_libvirt_generate_call_string_nogvl(func, conn, dealloc, args...) \
+    do {                                                                 \
+        VALUE result;                                                    \
+        int exception;                                                   \
+        ruby_libvirt_call_nogvl_owned(_a_##func, _s_##func, func, NULL,  \
+                                      NULL, args);                       \
+                                                                         \
+        if (_a_##func.ret == NULL) {                                     \
+            ruby_libvirt_raise_pending(_s_##func);                       \
+        }                                                                \
+        ruby_libvirt_raise_error_if(_a_##func.ret == NULL, e_Error, # func, conn); \
+        if (dealloc) {                                                   \
+            result = rb_protect(ruby_libvirt_str_new2_wrap, (VALUE)&_a_##func.ret, &exception); \
+            xfree((void *) _a_##func.ret);                               \
+            if (exception) {                                             \
+                rb_jump_tag(exception);                                  \
+            }                                                            \
+        }                                                                \
+        else {                                                           \
+            result = rb_str_new2(_a_##func.ret);                         \
+        }                                                                \
+        ruby_libvirt_raise_pending(_s_##func);                           \
+        return result;                                                   \
+    } while(0)
+
+#define ruby_libvirt_generate_call_nil_nogvl(func, conn, args...)         \
+    ruby_libvirt_generate_call_nil_nogvl_ubf(func, conn, NULL, NULL, args)
+
+/* As ruby_libvirt_generate_call_nil_nogvl, but UBF(UBFDATA) is called if the
+ * Ruby thread is interrupted while FUNC is running.
+ */
+#define ruby_libvirt_generate_call_nil_nogvl_ubf(func, conn, ubf, ubfdata, args...) \
+    do {                                                                  \
+        ruby_libvirt_call_nogvl(_a_##func, func, ubf, ubfdata, args);     \
+        ruby_libvirt_raise_error_if(_a_##func.ret < 0, e_Error, #func, conn); \
+        return Qnil;                                                      \
+    } while(0)
+
+/* Generate a call to a function FUNC which returns a new libvirt object, or
+ * NULL on error, with the GVL released.  On success the object is wrapped
+ * with NEWFUNC(object, VAL) and returned, otherwise ERROR is raised.
+ */
+#define ruby_libvirt_generate_call_object_nogvl(func, conn, error, newfunc, val, args...) \
+    ruby_libvirt_generate_call_object_nogvl_ubf(func, conn, error, newfunc, \
+                                                val, NULL, NULL, args)
+
+#define ruby_libvirt_generate_call_object_nogvl_ubf(func, conn, error, newfunc, val, ubf, ubfdata, args...) \
+    do {                                                                  \
+        VALUE _v_##func;                                                  \
+        ruby_libvirt_call_nogvl_owned(_a_##func, _s_##func, func, ubf,    \
+                                      ubfdata, args);                     \
+        if (_a_##func.ret == NULL) {                                      \
+            ruby_libvirt_raise_pending(_s_##func);                        \
+        }                                                                 \
+        ruby_libvirt_raise_error_if(_a_##func.ret == NULL, error, #func, conn); \
+        _v_##func = newfunc(_a_##func.ret, val);                          \
+        ruby_libvirt_raise_pending(_s_##func);                            \
+        return _v_##func;                                                 \
+    } while(0)
+
+/* Like ruby_libvirt_generate_call_object_nogvl(), but return nil instead of
+ * raising when FUNC fails with the libvirt error code MISSING.  Passing
+ * VIR_ERR_OK for MISSING makes every failure raise.
+ */
+#define ruby_libvirt_generate_call_object_missing_nogvl(func, conn, error, missing, newfunc, val, args...) \
+    do {                                                                  \
+        VALUE _v_##func;                                                  \
+        ruby_libvirt_call_nogvl_owned(_a_##func, _s_##func, func, NULL,   \
+                                      NULL, args);                        \
+        if (_a_##func.ret == NULL) {                                      \
+            ruby_libvirt_raise_pending(_s_##func);                        \
+        }                                                                 \
+        if (ruby_libvirt_error_missing(_a_##func.ret == NULL, missing,    \
+                                       conn)) {                           \
+            return Qnil;                                                  \
+        }                                                                 \
+        ruby_libvirt_raise_error_if(_a_##func.ret == NULL, error, #func, conn); \
+        _v_##func = newfunc(_a_##func.ret, val);                          \
+        ruby_libvirt_raise_pending(_s_##func);                            \
+        return _v_##func;                                                 \
+    } while(0)
+
+#define ruby_libvirt_generate_call_truefalse_nogvl(func, conn, args...)   \
+    do {                                                                  \
+        ruby_libvirt_call_nogvl(_a_##func, func, NULL, NULL, args);       \
+        ruby_libvirt_raise_error_if(_a_##func.ret < 0, e_Error, #func, conn); \
+        return _a_##func.ret ? Qtrue : Qfalse;                            \
+    } while(0)
+
+#define ruby_libvirt_generate_call_int_nogvl(func, conn, args...)       \
+    do {                                                                \
+        ruby_libvirt_call_nogvl(_a_##func, func, NULL, NULL, args);     \
+        ruby_libvirt_raise_error_if(_a_##func.ret < 0, e_RetrieveError, #func, conn); \
+        return INT2NUM(_a_##func.ret);                                  \
+    } while(0)
+
 #define ruby_libvirt_generate_uuid(func, conn, obj)                     \
     do {                                                                \
         char uuid[VIR_UUID_STRING_BUFLEN];                              \
@@ -162,7 +570,122 @@ void ruby_libvirt_raise_error_if(const int condition, VALUE error,
         return Qnil;                                                    \
     } while(0)
 
+/* The same as ruby_libvirt_generate_call_list_all, except that LISTFUNC is
+ * called with the GVL released.  LISTFUNC must first be declared with
+ * ruby_libvirt_declare_nogvl3.
+ */
+#define ruby_libvirt_generate_call_list_all_nogvl(type, argc, argv, listfunc, object, val, newfunc, freefunc) \
+    do {                                                                \
+        VALUE flags = RUBY_Qnil;                                        \
+        type *list = NULL;                                              \
+        int i;                                                          \
+        int ret;                                                        \
+        VALUE result;                                                   \
+        int exception = 0;                                              \
+        int state;                                                      \
+        struct ruby_libvirt_ary_push_arg arg;                           \
+                                                                        \
+        rb_scan_args(argc, argv, "01", &flags);                         \
+        {                                                               \
+            ruby_libvirt_call_nogvl_owned(_a_##listfunc, _s_##listfunc, \
+                                          listfunc, NULL, NULL,         \
+                                          object, &list,                \
+                                          ruby_libvirt_value_to_uint(flags)); \
+            ret = _a_##listfunc.ret;                                    \
+            state = _s_##listfunc;                                      \
+        }                                                               \
+        if (ret < 0) {                                                  \
+            ruby_libvirt_raise_pending(state);                          \
+        }                                                               \
+        ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError, #listfunc, ruby_libvirt_connect_get(val)); \
+        result = rb_protect(ruby_libvirt_ary_new2_wrap, (VALUE)&ret, &exception); \
+        if (exception) {                                                \
+            goto exception;                                             \
+        }                                                               \
+        for (i = 0; i < ret; i++) {                                     \
+            arg.arr = result;                                           \
+            arg.value = newfunc(list[i], val);                          \
+            rb_protect(ruby_libvirt_ary_push_wrap, (VALUE)&arg, &exception); \
+            if (exception) {                                            \
+                goto exception;                                         \
+            }                                                           \
+        }                                                               \
+                                                                        \
+        free(list);                                                     \
+        ruby_libvirt_raise_pending(state);                              \
+                                                                        \
+        return result;                                                  \
+                                                                        \
+    exception:                                                          \
+        for (i = 0; i < ret; i++) {                                     \
+            freefunc(list[i]);                                          \
+        }                                                               \
+        free(list);                                                     \
+        rb_jump_tag(exception);                                         \
+                                                                        \
+        /* not needed, but here to shut the compiler up */              \
+        return Qnil;                                                    \
+    } while(0)
+
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+
+/* Generate the plumbing for a result class (Libvirt::Domain::Info and
+ * friends) that is backed by a copy of the libvirt struct TYPE.  Each of
+ * these objects costs a single allocation; the fields are only converted
+ * to Ruby values when a reader is called.  This declares NAME##_data_type,
+ * NAME##_alloc (for use with rb_define_alloc_func), NAME##_new(klass, src)
+ * and NAME##_get(obj).
+ */
+#define ruby_libvirt_struct_type(name, type, classname)                 \
+    static const rb_data_type_t name##_data_type = {                    \
+        classname,                                                      \
+        { NULL, RUBY_TYPED_DEFAULT_FREE, NULL, },                       \
+        NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY                         \
+    };                                                                  \
+                                                                        \
+    static VALUE name##_alloc(VALUE klass)                              \
+    {                                                                   \
+        type *ptr;                                                      \
+        return TypedData_Make_Struct(klass, type, &name##_data_type, ptr); \
+    }                                                                   \
+                                                                        \
+    static VALUE name##_new(VALUE klass, const type *src)               \
+    {                                                                   \
+        type *ptr;                                                      \
+        VALUE result;                                                   \
+                                                                        \
+        result = TypedData_Make_Struct(klass, type, &name##_data_type, ptr); \
+        *ptr = *src;                                                    \
+        return result;                                                  \
+    }                                                                   \
+                                                                        \
+    static type *name##_get(VALUE s)                                    \
+    {                                                                   \
+        type *ptr;                                                      \
+        TypedData_Get_Struct(s, type, &name##_data_type, ptr);          \
+        return ptr;                                                     \
+    }
+
+/* Generate the reader NAME##_##READER for a class declared with
+ * ruby_libvirt_struct_type, returning CONV(field).
+ */
+#define ruby_libvirt_struct_reader(name, reader, field, conv)           \
+    static VALUE name##_##reader(VALUE s)                               \
+    {                                                                   \
+        return conv(name##_get(s)->field);                              \
+    }
+
 int ruby_libvirt_is_symbol_or_proc(VALUE handle);
+void ruby_libvirt_event_callback_enter(void *(*func)(void *), void *data);
+void ruby_libvirt_event_callback_call(VALUE cb, const char *what, int argc,
+                                      VALUE *argv);
+void ruby_libvirt_common_init(void);
+void ruby_libvirt_event_loop_enter(void);
+void ruby_libvirt_event_loop_leave(void);
+VALUE ruby_libvirt_event_batch_take(void);
+void ruby_libvirt_event_batch_run(VALUE batch);
 
 extern VALUE e_RetrieveError;
 extern VALUE e_Error;
@@ -175,7 +698,8 @@ char *ruby_libvirt_get_cstring_or_null(VALUE arg);
 
 VALUE ruby_libvirt_generate_list(int num, char **list);
 
-VALUE ruby_libvirt_get_parameters(VALUE d, unsigned int flags, void *opaque,
+VALUE ruby_libvirt_get_parameters(VALUE d, unsigned int flags,
+                                  int symbol_keys, void *opaque,
                                   unsigned int typesize,
                                   const char *(*nparams_cb)(VALUE d,
                                                             unsigned int flags,
@@ -187,9 +711,10 @@ VALUE ruby_libvirt_get_parameters(VALUE d, unsigned int flags, void *opaque,
                                                         int *nparams,
                                                         void *opaque),
                                   void (*hash_set)(void *voidparams, int i,
-                                                   VALUE result));
+                                                   VALUE result,
+                                                   int symbol_keys));
 VALUE ruby_libvirt_get_typed_parameters(VALUE d, unsigned int flags,
-                                        void *opaque,
+                                        int symbol_keys, void *opaque,
                                         const char *(*nparams_cb)(VALUE d,
                                                                   unsigned int flags,
                                                                   void *opaque,
@@ -208,9 +733,19 @@ struct ruby_libvirt_parameter_assign_args {
     unsigned int num_allowed;
 
     virTypedParameter *params;
+    /* how many params has room for; converting a value can run Ruby code
+     * that changes the Hash, so this is checked rather than trusted
+     */
+    int nalloc;
     int i;
 };
 int ruby_libvirt_typed_parameter_assign(VALUE key, VALUE val, VALUE in);
+/* Call BODY(DATA), which fills ARGS with ruby_libvirt_typed_parameter_assign()
+ * and makes the call, then free the copies made of String values whether
+ * or not BODY raises.
+ */
+VALUE ruby_libvirt_typed_params_ensure(VALUE (*body)(VALUE), VALUE data,
+                                       struct ruby_libvirt_parameter_assign_args *args);
 VALUE ruby_libvirt_set_typed_parameters(VALUE d, VALUE input,
                                         unsigned int flags, void *opaque,
                                         struct ruby_libvirt_typed_param *allowed,
@@ -221,9 +756,17 @@ VALUE ruby_libvirt_set_typed_parameters(VALUE d, VALUE input,
                                                               int nparams,
                                                               void *opaque));
 
-int ruby_libvirt_get_maxcpus(virConnectPtr conn);
+int ruby_libvirt_get_maxcpus(VALUE d);
+int ruby_libvirt_set_maxcpus(VALUE d, int maxcpus);
 
-void ruby_libvirt_typed_params_to_hash(void *voidparams, int i, VALUE hash);
+VALUE ruby_libvirt_param_key(const char *name, int symbol_keys);
+int ruby_libvirt_keys_option(int *argc, VALUE *argv);
+/* Raise ArgumentError for any key of the options Hash OPTS that is not the
+ * Symbol for one of NAMES, a NULL-terminated list.
+ */
+void ruby_libvirt_check_options(VALUE opts, const char *const *names);
+void ruby_libvirt_typed_params_to_hash(void *voidparams, int i, VALUE hash,
+                                       int symbol_keys);
 void ruby_libvirt_assign_hash_and_flags(VALUE in, VALUE *hash, VALUE *flags);
 
 unsigned int ruby_libvirt_value_to_uint(VALUE in);
@@ -19,6 +19,7 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
  */
 
+#include <sys/time.h>
 #include <ruby.h>
 #include <libvirt/libvirt.h>
 #if HAVE_VIRDOMAINQEMUATTACH
@@ -26,6 +27,9 @@
 #endif
 #include <libvirt/virterror.h>
 #include "extconf.h"
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <pthread.h>
+#endif
 #include "common.h"
 #include "domain.h"
 #include "network.h"
@@ -34,6 +38,10 @@
 #include "nwfilter.h"
 #include "secret.h"
 #include "stream.h"
+#include "cpumap.h"
+#include "sampler.h"
+#include "console.h"
+#include "xmlcache.h"
 
 /*
  * Generate a call to a virConnectNumOf... function. C is the Ruby VALUE
@@ -86,17 +94,55 @@ static void connect_close(void *c)
                                 c);
 }
 
+static void connect_free(void *p)
+{
+    struct ruby_libvirt_handle *h = p;
+
+    connect_close(h->ptr);
+    xfree(h);
+}
+
+/* Closing a connection can mean a round trip to the daemon, and a failure
+ * is reported by raising, so unlike the other handles a Libvirt::Connect is
+ * not freed from within the garbage collector itself.
+ */
+static const rb_data_type_t connect_data_type = {
+    "Libvirt::Connect",
+    RUBY_LIBVIRT_HANDLE_FUNCTIONS(connect_free),
+    &ruby_libvirt_handle_data_type, NULL, 0
+};
+
+static struct ruby_libvirt_handle *connect_handle(VALUE c)
+{
+    struct ruby_libvirt_handle *h;
+
+    TypedData_Get_Struct(c, struct ruby_libvirt_handle, &connect_data_type,
+                         h);
+
+    return h;
+}
+
 VALUE ruby_libvirt_connect_new(virConnectPtr c)
 {
-    return Data_Wrap_Struct(c_connect, NULL, connect_close, c);
+    VALUE result;
+
+    result = ruby_libvirt_new_class(c_connect, &connect_data_type, c, Qnil);
+    connect_handle(result)->conn = result;
+
+    return result;
 }
 
 VALUE ruby_libvirt_conn_attr(VALUE c)
 {
-    if (rb_obj_is_instance_of(c, c_connect) != Qtrue) {
-        c = rb_iv_get(c, "@connection");
+    if (rb_typeddata_is_kind_of(c, &ruby_libvirt_handle_data_type)) {
+        return ((struct ruby_libvirt_handle *)RTYPEDDATA_DATA(c))->conn;
     }
-    if (rb_obj_is_instance_of(c, c_connect) != Qtrue) {
+
+    /* the helper objects (Libvirt::Sampler and friends) that are not
+     * libvirt handles themselves keep theirs in an instance variable
+     */
+    c = rb_iv_get(c, "@connection");
+    if (!rb_typeddata_is_kind_of(c, &connect_data_type)) {
         rb_raise(rb_eArgError, "Expected Connection object");
     }
     return c;
@@ -104,8 +150,13 @@ VALUE ruby_libvirt_conn_attr(VALUE c)
 
 virConnectPtr ruby_libvirt_connect_get(VALUE c)
 {
-    c = ruby_libvirt_conn_attr(c);
-    ruby_libvirt_get_struct(Connect, c);
+    struct ruby_libvirt_handle *h;
+
+    h = RTYPEDDATA_DATA(ruby_libvirt_conn_attr(c));
+    if (!h->ptr) {
+        rb_raise(rb_eArgError, "Connect has been freed");
+    }
+    return h->ptr;
 }
 
 /*
@@ -117,12 +168,11 @@ virConnectPtr ruby_libvirt_connect_get(VALUE c)
  */
 static VALUE libvirt_connect_close(VALUE c)
 {
-    virConnectPtr conn;
+    struct ruby_libvirt_handle *h = connect_handle(c);
 
-    Data_Get_Struct(c, virConnect, conn);
-    if (conn) {
-        connect_close(conn);
-        DATA_PTR(c) = NULL;
+    if (h->ptr) {
+        connect_close(h->ptr);
+        h->ptr = NULL;
     }
     return Qnil;
 }
@@ -135,10 +185,7 @@ static VALUE libvirt_connect_close(VALUE c)
  */
 static VALUE libvirt_connect_closed_p(VALUE c)
 {
-    virConnectPtr conn;
-
-    Data_Get_Struct(c, virConnect, conn);
-    return (conn == NULL) ? Qtrue : Qfalse;
+    return (connect_handle(c)->ptr == NULL) ? Qtrue : Qfalse;
 }
 
 /*
@@ -244,6 +291,16 @@ static VALUE libvirt_connect_max_vcpus(int argc, VALUE *argv, VALUE c)
                                    ruby_libvirt_get_cstring_or_null(type));
 }
 
+ruby_libvirt_struct_type(node_info, virNodeInfo, "Libvirt::Connect::Nodeinfo")
+ruby_libvirt_struct_reader(node_info, model, model, rb_str_new2)
+ruby_libvirt_struct_reader(node_info, memory, memory, ULONG2NUM)
+ruby_libvirt_struct_reader(node_info, cpus, cpus, UINT2NUM)
+ruby_libvirt_struct_reader(node_info, mhz, mhz, UINT2NUM)
+ruby_libvirt_struct_reader(node_info, nodes, nodes, UINT2NUM)
+ruby_libvirt_struct_reader(node_info, sockets, sockets, UINT2NUM)
+ruby_libvirt_struct_reader(node_info, cores, cores, UINT2NUM)
+ruby_libvirt_struct_reader(node_info, threads, threads, UINT2NUM)
+
 /*
  * call-seq:
  *   conn.node_info -> Libvirt::Connect::Nodeinfo
@@ -255,23 +312,36 @@ static VALUE libvirt_connect_node_info(VALUE c)
 {
     int r;
     virNodeInfo nodeinfo;
-    VALUE result;
 
     r = virNodeGetInfo(ruby_libvirt_connect_get(c), &nodeinfo);
     ruby_libvirt_raise_error_if(r < 0, e_RetrieveError, "virNodeGetInfo",
                                 ruby_libvirt_connect_get(c));
 
-    result = rb_class_new_instance(0, NULL, c_node_info);
-    rb_iv_set(result, "@model", rb_str_new2(nodeinfo.model));
-    rb_iv_set(result, "@memory", ULONG2NUM(nodeinfo.memory));
-    rb_iv_set(result, "@cpus", UINT2NUM(nodeinfo.cpus));
-    rb_iv_set(result, "@mhz", UINT2NUM(nodeinfo.mhz));
-    rb_iv_set(result, "@nodes", UINT2NUM(nodeinfo.nodes));
-    rb_iv_set(result, "@sockets", UINT2NUM(nodeinfo.sockets));
-    rb_iv_set(result, "@cores", UINT2NUM(nodeinfo.cores));
-    rb_iv_set(result, "@threads", UINT2NUM(nodeinfo.threads));
+    return node_info_new(c_node_info, &nodeinfo);
+}
 
-    return result;
+/*
+ * call-seq:
+ *   conn.node_max_cpus(refresh=false) -> Fixnum
+ *
+ * Return the number of CPUs on the host for this connection, as used to size
+ * the cpumaps in dom.vcpus, dom.vcpu_pin_info and friends.  The count is
+ * looked up with virNodeGetCPUMap[http://www.libvirt.org/html/libvirt-libvirt-host.html#virNodeGetCPUMap]
+ * (or virNodeGetInfo[http://www.libvirt.org/html/libvirt-libvirt-host.html#virNodeGetInfo]
+ * on older libvirt) the first time it is needed and remembered; pass
+ * refresh=true to look it up again, e.g. after host CPUs were hotplugged.
+ */
+static VALUE libvirt_connect_node_max_cpus(int argc, VALUE *argv, VALUE c)
+{
+    VALUE refresh;
+
+    rb_scan_args(argc, argv, "01", &refresh);
+
+    if (RTEST(refresh)) {
+        return INT2NUM(ruby_libvirt_set_maxcpus(c, -1));
+    }
+
+    return INT2NUM(ruby_libvirt_get_maxcpus(c));
 }
 
 /*
@@ -498,187 +568,258 @@ static VALUE libvirt_connect_baseline_cpu(int argc, VALUE *argv, VALUE c)
 #endif
 
 #if HAVE_VIRCONNECTDOMAINEVENTREGISTERANY || HAVE_VIRCONNECTDOMAINEVENTREGISTER
-static int domain_event_lifecycle_callback(virConnectPtr conn,
-                                           virDomainPtr dom, int event,
-                                           int detail, void *opaque)
+static ID id_domain_event_callbacks;
+
+/*
+ * The passthrough handed to libvirt for each domain event registration is
+ * [callback, opaque, connection], where connection is the Libvirt::Connect
+ * the callback was registered on.  Events are delivered with that object
+ * rather than a fresh wrapper around the virConnectPtr, so no Connect is
+ * allocated (or closed) per event.  The passthrough is also kept in a hidden
+ * hash on the connection so that it can't be collected while libvirt still
+ * holds a pointer to it.
+ */
+static VALUE domain_event_passthrough_new(VALUE c, VALUE cb, VALUE opaque)
 {
-    VALUE passthrough = (VALUE)opaque;
-    VALUE cb, cb_opaque, newc;
+    VALUE passthrough;
 
-    Check_Type(passthrough, T_ARRAY);
+    passthrough = rb_ary_new2(3);
+    rb_ary_store(passthrough, 0, cb);
+    rb_ary_store(passthrough, 1, opaque);
+    rb_ary_store(passthrough, 2, c);
 
-    if (RARRAY_LEN(passthrough) != 2) {
-        rb_raise(rb_eArgError, "wrong number of arguments (%ld for 2)",
-                 RARRAY_LEN(passthrough));
-    }
+    return passthrough;
+}
 
-    cb = rb_ary_entry(passthrough, 0);
-    cb_opaque = rb_ary_entry(passthrough, 1);
+static void domain_event_passthrough_keep(VALUE c, VALUE key,
+                                          VALUE passthrough)
+{
+    VALUE callbacks;
 
-    newc = ruby_libvirt_connect_new(conn);
-    if (strcmp(rb_obj_classname(cb), "Symbol") == 0) {
-        rb_funcall(rb_class_of(cb), rb_to_id(cb), 5, newc,
-                   ruby_libvirt_domain_new(dom, newc), INT2NUM(event),
-                   INT2NUM(detail), cb_opaque);
-    }
-    else if (strcmp(rb_obj_classname(cb), "Proc") == 0) {
-        rb_funcall(cb, rb_intern("call"), 5, newc,
-                   ruby_libvirt_domain_new(dom, newc), INT2NUM(event),
-                   INT2NUM(detail), cb_opaque);
-    }
-    else {
-        rb_raise(rb_eTypeError,
-                 "wrong domain event lifecycle callback (expected Symbol or Proc)");
+    callbacks = rb_ivar_get(c, id_domain_event_callbacks);
+    if (NIL_P(callbacks)) {
+        callbacks = rb_hash_new();
+        rb_ivar_set(c, id_domain_event_callbacks, callbacks);
     }
+    rb_hash_aset(callbacks, key, passthrough);
+}
 
-    return 0;
+static void domain_event_passthrough_release(VALUE c, VALUE key)
+{
+    VALUE callbacks;
+
+    callbacks = rb_ivar_get(c, id_domain_event_callbacks);
+    if (!NIL_P(callbacks)) {
+        rb_hash_delete(callbacks, key);
+    }
 }
-#endif
 
-#if HAVE_VIRCONNECTDOMAINEVENTREGISTERANY
-static int domain_event_reboot_callback(virConnectPtr conn, virDomainPtr dom,
-                                        void *opaque)
+static VALUE domain_event_passthrough_get(void *opaque, VALUE *cb,
+                                          VALUE *cb_opaque)
 {
     VALUE passthrough = (VALUE)opaque;
-    VALUE cb, cb_opaque, newc;
 
     Check_Type(passthrough, T_ARRAY);
 
-    if (RARRAY_LEN(passthrough) != 2) {
-        rb_raise(rb_eArgError, "wrong number of arguments (%ld for 2)",
+    if (RARRAY_LEN(passthrough) != 3) {
+        rb_raise(rb_eArgError, "wrong number of arguments (%ld for 3)",
                  RARRAY_LEN(passthrough));
     }
 
-    cb = rb_ary_entry(passthrough, 0);
-    cb_opaque = rb_ary_entry(passthrough, 1);
+    *cb = rb_ary_entry(passthrough, 0);
+    *cb_opaque = rb_ary_entry(passthrough, 1);
 
-    newc = ruby_libvirt_connect_new(conn);
-    if (strcmp(rb_obj_classname(cb), "Symbol") == 0) {
-        rb_funcall(rb_class_of(cb), rb_to_id(cb), 3, newc,
-                   ruby_libvirt_domain_new(dom, newc), cb_opaque);
-    }
-    else if (strcmp(rb_obj_classname(cb), "Proc") == 0) {
-        rb_funcall(cb, rb_intern("call"), 3, newc,
-                   ruby_libvirt_domain_new(dom, newc), cb_opaque);
-    }
-    else {
-        rb_raise(rb_eTypeError,
-                 "wrong domain event reboot callback (expected Symbol or Proc)");
-    }
+    return rb_ary_entry(passthrough, 2);
+}
 
-    return 0;
+/* libvirt only guarantees dom for the duration of the callback, so the
+ * Ruby object gets its own reference
+ */
+static VALUE domain_event_domain_new(virDomainPtr dom, VALUE conn)
+{
+    virDomainRef(dom);
+    return ruby_libvirt_domain_new(dom, conn);
 }
 
-static int domain_event_rtc_callback(virConnectPtr conn, virDomainPtr dom,
-                                     long long utc_offset, void *opaque)
+/*
+ * The C arguments of a domain event, gathered up so that they can be turned
+ * into Ruby objects wherever the GVL is available (see
+ * ruby_libvirt_event_callback_enter).  build fills in the event-specific
+ * arguments between the domain and opaque and returns how many there were.
+ */
+struct domain_event_arg {
+    const char *what;
+    void *opaque;
+    virDomainPtr dom;
+    int (*build)(struct domain_event_arg *ev, VALUE *argv);
+    int i1;
+    int i2;
+    long long ll;
+    const char *s1;
+    const char *s2;
+    const char *s3;
+    virDomainEventGraphicsAddressPtr local;
+    virDomainEventGraphicsAddressPtr remote;
+    virDomainEventGraphicsSubjectPtr subject;
+};
+
+static void *domain_event_deliver(void *p)
 {
-    VALUE passthrough = (VALUE)opaque;
-    VALUE cb, cb_opaque, newc;
+    struct domain_event_arg *ev = (struct domain_event_arg *)p;
+    VALUE cb, cb_opaque, c, argv[8];
+    int argc;
 
-    Check_Type(passthrough, T_ARRAY);
+    c = domain_event_passthrough_get(ev->opaque, &cb, &cb_opaque);
 
-    if (RARRAY_LEN(passthrough) != 2) {
-        rb_raise(rb_eArgError, "wrong number of arguments (%ld for 2)",
-                 RARRAY_LEN(passthrough));
-    }
+    argv[0] = c;
+    argv[1] = domain_event_domain_new(ev->dom, c);
+    argc = 2 + ev->build(ev, argv + 2);
+    argv[argc++] = cb_opaque;
 
-    cb = rb_ary_entry(passthrough, 0);
-    cb_opaque = rb_ary_entry(passthrough, 1);
+    ruby_libvirt_event_callback_call(cb, ev->what, argc, argv);
 
-    newc = ruby_libvirt_connect_new(conn);
-    if (strcmp(rb_obj_classname(cb), "Symbol") == 0) {
-        rb_funcall(rb_class_of(cb), rb_to_id(cb), 4, newc,
-                   ruby_libvirt_domain_new(dom, newc), LL2NUM(utc_offset),
-                   cb_opaque);
-    }
-    else if (strcmp(rb_obj_classname(cb), "Proc") == 0) {
-        rb_funcall(cb, rb_intern("call"), 4, newc,
-                   ruby_libvirt_domain_new(dom, newc), LL2NUM(utc_offset),
-                   cb_opaque);
-    }
-    else {
-        rb_raise(rb_eTypeError,
-                 "wrong domain event rtc callback (expected Symbol or Proc)");
-    }
+    return NULL;
+}
+
+static void domain_event_init(struct domain_event_arg *ev, const char *what,
+                              virDomainPtr dom, void *opaque,
+                              int (*build)(struct domain_event_arg *, VALUE *))
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->what = what;
+    ev->dom = dom;
+    ev->opaque = opaque;
+    ev->build = build;
+}
+
+static int domain_event_lifecycle_build(struct domain_event_arg *ev,
+                                        VALUE *argv)
+{
+    argv[0] = INT2NUM(ev->i1);
+    argv[1] = INT2NUM(ev->i2);
+
+    return 2;
+}
+
+static int domain_event_lifecycle_callback(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                           virDomainPtr dom, int event,
+                                           int detail, void *opaque)
+{
+    struct domain_event_arg ev;
+
+    domain_event_init(&ev, "domain event lifecycle", dom, opaque,
+                      domain_event_lifecycle_build);
+    ev.i1 = event;
+    ev.i2 = detail;
+    ruby_libvirt_event_callback_enter(domain_event_deliver, &ev);
 
     return 0;
 }
+#endif
 
-static int domain_event_watchdog_callback(virConnectPtr conn, virDomainPtr dom,
-                                          int action, void *opaque)
+#if HAVE_VIRCONNECTDOMAINEVENTREGISTERANY
+static int domain_event_reboot_build(struct domain_event_arg *RUBY_LIBVIRT_UNUSED(ev),
+                                     VALUE *RUBY_LIBVIRT_UNUSED(argv))
 {
-    VALUE passthrough = (VALUE)opaque;
-    VALUE cb, cb_opaque, newc;
+    return 0;
+}
 
-    Check_Type(passthrough, T_ARRAY);
+static int domain_event_reboot_callback(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                        virDomainPtr dom, void *opaque)
+{
+    struct domain_event_arg ev;
 
-    if (RARRAY_LEN(passthrough) != 2) {
-        rb_raise(rb_eArgError, "wrong number of arguments (%ld for 2)",
-                 RARRAY_LEN(passthrough));
-    }
+    domain_event_init(&ev, "domain event reboot", dom, opaque,
+                      domain_event_reboot_build);
+    ruby_libvirt_event_callback_enter(domain_event_deliver, &ev);
+
+    return 0;
+}
 
-    cb = rb_ary_entry(passthrough, 0);
-    cb_opaque = rb_ary_entry(passthrough, 1);
+static int domain_event_rtc_build(struct domain_event_arg *ev, VALUE *argv)
+{
+    argv[0] = LL2NUM(ev->ll);
 
-    newc = ruby_libvirt_connect_new(conn);
-    if (strcmp(rb_obj_classname(cb), "Symbol") == 0) {
-        rb_funcall(rb_class_of(cb), rb_to_id(cb), 4, newc,
-                   ruby_libvirt_domain_new(dom, newc), INT2NUM(action),
-                   cb_opaque);
-    }
-    else if (strcmp(rb_obj_classname(cb), "Proc") == 0) {
-        rb_funcall(cb, rb_intern("call"), 4, newc,
-                   ruby_libvirt_domain_new(dom, newc), INT2NUM(action),
-                   cb_opaque);
-    }
-    else {
-        rb_raise(rb_eTypeError,
-                 "wrong domain event watchdog callback (expected Symbol or Proc)");
-    }
+    return 1;
+}
+
+static int domain_event_rtc_callback(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                     virDomainPtr dom, long long utc_offset,
+                                     void *opaque)
+{
+    struct domain_event_arg ev;
+
+    domain_event_init(&ev, "domain event rtc", dom, opaque,
+                      domain_event_rtc_build);
+    ev.ll = utc_offset;
+    ruby_libvirt_event_callback_enter(domain_event_deliver, &ev);
+
+    return 0;
+}
+
+static int domain_event_watchdog_build(struct domain_event_arg *ev,
+                                       VALUE *argv)
+{
+    argv[0] = INT2NUM(ev->i1);
+
+    return 1;
+}
+
+static int domain_event_watchdog_callback(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                          virDomainPtr dom, int action,
+                                          void *opaque)
+{
+    struct domain_event_arg ev;
+
+    domain_event_init(&ev, "domain event watchdog", dom, opaque,
+                      domain_event_watchdog_build);
+    ev.i1 = action;
+    ruby_libvirt_event_callback_enter(domain_event_deliver, &ev);
 
     return 0;
 }
 
-static int domain_event_io_error_callback(virConnectPtr conn, virDomainPtr dom,
+static int domain_event_io_error_build(struct domain_event_arg *ev,
+                                       VALUE *argv)
+{
+    argv[0] = rb_str_new2(ev->s1);
+    argv[1] = rb_str_new2(ev->s2);
+    argv[2] = INT2NUM(ev->i1);
+
+    return 3;
+}
+
+static int domain_event_io_error_callback(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                          virDomainPtr dom,
                                           const char *src_path,
                                           const char *dev_alias,
                                           int action,
                                           void *opaque)
 {
-    VALUE passthrough = (VALUE)opaque;
-    VALUE cb, cb_opaque, newc;
+    struct domain_event_arg ev;
 
-    Check_Type(passthrough, T_ARRAY);
-
-    if (RARRAY_LEN(passthrough) != 2) {
-        rb_raise(rb_eArgError, "wrong number of arguments (%ld for 2)",
-                 RARRAY_LEN(passthrough));
-    }
+    domain_event_init(&ev, "domain event IO error", dom, opaque,
+                      domain_event_io_error_build);
+    ev.s1 = src_path;
+    ev.s2 = dev_alias;
+    ev.i1 = action;
+    ruby_libvirt_event_callback_enter(domain_event_deliver, &ev);
 
-    cb = rb_ary_entry(passthrough, 0);
-    cb_opaque = rb_ary_entry(passthrough, 1);
+    return 0;
+}
 
-    newc = ruby_libvirt_connect_new(conn);
-    if (strcmp(rb_obj_classname(cb), "Symbol") == 0) {
-        rb_funcall(rb_class_of(cb), rb_to_id(cb), 6, newc,
-                   ruby_libvirt_domain_new(dom, newc), rb_str_new2(src_path),
-                   rb_str_new2(dev_alias), INT2NUM(action), cb_opaque);
-    }
-    else if (strcmp(rb_obj_classname(cb), "Proc") == 0) {
-        rb_funcall(cb, rb_intern("call"), 6, newc,
-                   ruby_libvirt_domain_new(dom, newc),
-                   rb_str_new2(src_path), rb_str_new2(dev_alias),
-                   INT2NUM(action), cb_opaque);
-    }
-    else {
-        rb_raise(rb_eTypeError,
-                 "wrong domain event IO error callback (expected Symbol or Proc)");
-    }
+static int domain_event_io_error_reason_build(struct domain_event_arg *ev,
+                                              VALUE *argv)
+{
+    argv[0] = rb_str_new2(ev->s1);
+    argv[1] = rb_str_new2(ev->s2);
+    argv[2] = INT2NUM(ev->i1);
+    argv[3] = rb_str_new2(ev->s3);
 
-    return 0;
+    return 4;
 }
 
-static int domain_event_io_error_reason_callback(virConnectPtr conn,
+static int domain_event_io_error_reason_callback(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
                                                  virDomainPtr dom,
                                                  const char *src_path,
                                                  const char *dev_alias,
@@ -686,100 +827,78 @@ static int domain_event_io_error_reason_callback(virConnectPtr conn,
                                                  const char *reason,
                                                  void *opaque)
 {
-    VALUE passthrough = (VALUE)opaque;
-    VALUE cb, cb_opaque, newc;
-
-    Check_Type(passthrough, T_ARRAY);
-
-    if (RARRAY_LEN(passthrough) != 2) {
-        rb_raise(rb_eArgError, "wrong number of arguments (%ld for 2)",
-                 RARRAY_LEN(passthrough));
-    }
-
-    cb = rb_ary_entry(passthrough, 0);
-    cb_opaque = rb_ary_entry(passthrough, 1);
+    struct domain_event_arg ev;
 
-    newc = ruby_libvirt_connect_new(conn);
-    if (strcmp(rb_obj_classname(cb), "Symbol") == 0) {
-        rb_funcall(rb_class_of(cb), rb_to_id(cb), 7, newc,
-                   ruby_libvirt_domain_new(dom, newc), rb_str_new2(src_path),
-                   rb_str_new2(dev_alias), INT2NUM(action),
-                   rb_str_new2(reason), cb_opaque);
-    }
-    else if (strcmp(rb_obj_classname(cb), "Proc") == 0) {
-        rb_funcall(cb, rb_intern("call"), 7, newc,
-                   ruby_libvirt_domain_new(dom, newc),
-                   rb_str_new2(src_path), rb_str_new2(dev_alias),
-                   INT2NUM(action), rb_str_new2(reason), cb_opaque);
-    }
-    else {
-        rb_raise(rb_eTypeError,
-                 "wrong domain event IO error reason callback (expected Symbol or Proc)");
-    }
+    domain_event_init(&ev, "domain event IO error reason", dom, opaque,
+                      domain_event_io_error_reason_build);
+    ev.s1 = src_path;
+    ev.s2 = dev_alias;
+    ev.i1 = action;
+    ev.s3 = reason;
+    ruby_libvirt_event_callback_enter(domain_event_deliver, &ev);
 
     return 0;
 }
 
-static int domain_event_graphics_callback(virConnectPtr conn, virDomainPtr dom,
-                                          int phase,
-                                          virDomainEventGraphicsAddressPtr local,
-                                          virDomainEventGraphicsAddressPtr remote,
-                                          const char *authScheme,
-                                          virDomainEventGraphicsSubjectPtr subject,
-                                          void *opaque)
+static int domain_event_graphics_build(struct domain_event_arg *ev,
+                                       VALUE *argv)
 {
-    VALUE passthrough = (VALUE)opaque;
-    VALUE cb, cb_opaque, newc, local_hash, remote_hash, subject_array, pair;
+    VALUE local_hash, remote_hash, subject_array, pair;
     int i;
 
-    Check_Type(passthrough, T_ARRAY);
-
-    if (RARRAY_LEN(passthrough) != 2) {
-        rb_raise(rb_eArgError, "wrong number of arguments (%ld for 2)",
-                 RARRAY_LEN(passthrough));
-    }
-
-    cb = rb_ary_entry(passthrough, 0);
-    cb_opaque = rb_ary_entry(passthrough, 1);
-
     local_hash = rb_hash_new();
-    rb_hash_aset(local_hash, rb_str_new2("family"), INT2NUM(local->family));
-    rb_hash_aset(local_hash, rb_str_new2("node"), rb_str_new2(local->node));
+    rb_hash_aset(local_hash, rb_str_new2("family"),
+                 INT2NUM(ev->local->family));
+    rb_hash_aset(local_hash, rb_str_new2("node"),
+                 rb_str_new2(ev->local->node));
     rb_hash_aset(local_hash, rb_str_new2("service"),
-                 rb_str_new2(local->service));
+                 rb_str_new2(ev->local->service));
 
     remote_hash = rb_hash_new();
-    rb_hash_aset(remote_hash, rb_str_new2("family"), INT2NUM(remote->family));
-    rb_hash_aset(remote_hash, rb_str_new2("node"), rb_str_new2(remote->node));
+    rb_hash_aset(remote_hash, rb_str_new2("family"),
+                 INT2NUM(ev->remote->family));
+    rb_hash_aset(remote_hash, rb_str_new2("node"),
+                 rb_str_new2(ev->remote->node));
     rb_hash_aset(remote_hash, rb_str_new2("service"),
-                 rb_str_new2(remote->service));
+                 rb_str_new2(ev->remote->service));
 
     subject_array = rb_ary_new();
-    for (i = 0; i < subject->nidentity; i++) {
+    for (i = 0; i < ev->subject->nidentity; i++) {
         pair = rb_ary_new();
-        rb_ary_store(pair, 0, rb_str_new2(subject->identities[i].type));
-        rb_ary_store(pair, 1, rb_str_new2(subject->identities[i].name));
+        rb_ary_store(pair, 0, rb_str_new2(ev->subject->identities[i].type));
+        rb_ary_store(pair, 1, rb_str_new2(ev->subject->identities[i].name));
 
         rb_ary_store(subject_array, i, pair);
     }
 
-    newc = ruby_libvirt_connect_new(conn);
-    if (strcmp(rb_obj_classname(cb), "Symbol") == 0) {
-        rb_funcall(rb_class_of(cb), rb_to_id(cb), 8, newc,
-                   ruby_libvirt_domain_new(dom, newc), INT2NUM(phase),
-                   local_hash, remote_hash, rb_str_new2(authScheme),
-                   subject_array, cb_opaque);
-    }
-    else if (strcmp(rb_obj_classname(cb), "Proc") == 0) {
-        rb_funcall(cb, rb_intern("call"), 8, newc,
-                   ruby_libvirt_domain_new(dom, newc), INT2NUM(phase),
-                   local_hash, remote_hash, rb_str_new2(authScheme),
-                   subject_array, cb_opaque);
-    }
-    else {
-        rb_raise(rb_eTypeError,
-                 "wrong domain event graphics callback (expected Symbol or Proc)");
-    }
+    argv[0] = INT2NUM(ev->i1);
+    argv[1] = local_hash;
+    argv[2] = remote_hash;
+    argv[3] = rb_str_new2(ev->s1);
+    argv[4] = subject_array;
+
+    return 5;
+}
+
+static int domain_event_graphics_callback(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                          virDomainPtr dom,
+                                          int phase,
+                                          virDomainEventGraphicsAddressPtr local,
+                                          virDomainEventGraphicsAddressPtr remote,
+                                          const char *authScheme,
+                                          virDomainEventGraphicsSubjectPtr subject,
+                                          void *opaque)
+{
+    struct domain_event_arg ev;
+
+    domain_event_init(&ev, "domain event graphics", dom, opaque,
+                      domain_event_graphics_build);
+    ev.i1 = phase;
+    ev.local = local;
+    ev.remote = remote;
+    ev.s1 = authScheme;
+    ev.subject = subject;
+    ruby_libvirt_event_callback_enter(domain_event_deliver, &ev);
 
     return 0;
 }
@@ -807,7 +926,10 @@ static int domain_event_graphics_callback(virConnectPtr conn, virDomainPtr dom,
  * domain will be seen.  The opaque parameter can be any valid ruby type, and
  * will be passed into callback as "opaque".  This method returns a
  * libvirt-specific handle, which must be used by the application to
- * deregister the callback later (see domain_event_deregister_any).
+ * deregister the callback later (see domain_event_deregister_any).  The
+ * callback is run by the event loop, which belongs to the main Ractor, so
+ * this can only be called from there; other Ractors can use
+ * conn.domain_event_queue instead.
  */
 static VALUE libvirt_connect_domain_event_register_any(int argc, VALUE *argv,
                                                        VALUE c)
@@ -815,6 +937,7 @@ static VALUE libvirt_connect_domain_event_register_any(int argc, VALUE *argv,
     VALUE eventID, cb, dom, opaque, passthrough;
     virDomainPtr domain;
     virConnectDomainEventGenericCallback internalcb = NULL;
+    int ret;
 
     rb_scan_args(argc, argv, "22", &eventID, &cb, &dom, &opaque);
 
@@ -822,6 +945,7 @@ static VALUE libvirt_connect_domain_event_register_any(int argc, VALUE *argv,
         rb_raise(rb_eTypeError,
                  "wrong argument type (expected Symbol or Proc)");
     }
+    ruby_libvirt_main_ractor_only("Connect#domain_event_register_any");
 
     if (NIL_P(dom)) {
         domain = NULL;
@@ -858,15 +982,18 @@ static VALUE libvirt_connect_domain_event_register_any(int argc, VALUE *argv,
         break;
     }
 
-    passthrough = rb_ary_new();
-    rb_ary_store(passthrough, 0, cb);
-    rb_ary_store(passthrough, 1, opaque);
+    passthrough = domain_event_passthrough_new(c, cb, opaque);
 
-    ruby_libvirt_generate_call_int(virConnectDomainEventRegisterAny,
-                                   ruby_libvirt_connect_get(c),
-                                   ruby_libvirt_connect_get(c), domain,
-                                   NUM2INT(eventID), internalcb,
-                                   (void *)passthrough, NULL);
+    ret = virConnectDomainEventRegisterAny(ruby_libvirt_connect_get(c), domain,
+                                           NUM2INT(eventID), internalcb,
+                                           (void *)passthrough, NULL);
+    ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError,
+                                "virConnectDomainEventRegisterAny",
+                                ruby_libvirt_connect_get(c));
+
+    domain_event_passthrough_keep(c, INT2NUM(ret), passthrough);
+
+    return INT2NUM(ret);
 }
 
 /*
@@ -880,10 +1007,17 @@ static VALUE libvirt_connect_domain_event_register_any(int argc, VALUE *argv,
 static VALUE libvirt_connect_domain_event_deregister_any(VALUE c,
                                                          VALUE callbackID)
 {
-    ruby_libvirt_generate_call_nil(virConnectDomainEventDeregisterAny,
-                                   ruby_libvirt_connect_get(c),
-                                   ruby_libvirt_connect_get(c),
-                                   NUM2INT(callbackID));
+    int ret;
+
+    ret = virConnectDomainEventDeregisterAny(ruby_libvirt_connect_get(c),
+                                             NUM2INT(callbackID));
+    ruby_libvirt_raise_error_if(ret < 0, e_Error,
+                                "virConnectDomainEventDeregisterAny",
+                                ruby_libvirt_connect_get(c));
+
+    domain_event_passthrough_release(c, INT2NUM(NUM2INT(callbackID)));
+
+    return Qnil;
 }
 #endif
 
@@ -911,13 +1045,15 @@ static int domain_event_callback(virConnectPtr conn,
  * or a Proc.  The callback must accept 5 parameters: Libvirt::Connect,
  * Libvirt::Domain, event, detail, opaque.  The opaque parameter to
  * domain_event_register can be any valid ruby type, and will be passed into
- * callback as "opaque".  This method is deprecated in favor of
+ * callback as "opaque".  Like domain_event_register_any, this can only be
+ * called from the main Ractor.  This method is deprecated in favor of
  * domain_event_register_any.
  */
 static VALUE libvirt_connect_domain_event_register(int argc, VALUE *argv,
                                                    VALUE c)
 {
     VALUE cb, opaque, passthrough;
+    int ret;
 
     rb_scan_args(argc, argv, "11", &cb, &opaque);
 
@@ -925,16 +1061,23 @@ static VALUE libvirt_connect_domain_event_register(int argc, VALUE *argv,
         rb_raise(rb_eTypeError,
                  "wrong argument type (expected Symbol or Proc)");
     }
+    ruby_libvirt_main_ractor_only("Connect#domain_event_register");
 
-    passthrough = rb_ary_new();
-    rb_ary_store(passthrough, 0, cb);
-    rb_ary_store(passthrough, 1, opaque);
+    passthrough = domain_event_passthrough_new(c, cb, opaque);
 
-    ruby_libvirt_generate_call_nil(virConnectDomainEventRegister,
-                                   ruby_libvirt_connect_get(c),
-                                   ruby_libvirt_connect_get(c),
-                                   domain_event_callback, (void *)passthrough,
-                                   NULL);
+    ret = virConnectDomainEventRegister(ruby_libvirt_connect_get(c),
+                                        domain_event_callback,
+                                        (void *)passthrough, NULL);
+    ruby_libvirt_raise_error_if(ret < 0, e_Error,
+                                "virConnectDomainEventRegister",
+                                ruby_libvirt_connect_get(c));
+
+    /* only one registration of domain_event_callback is allowed, so it is
+     * kept under nil rather than a callback ID
+     */
+    domain_event_passthrough_keep(c, Qnil, passthrough);
+
+    return Qnil;
 }
 
 /*
@@ -949,36 +1092,868 @@ static VALUE libvirt_connect_domain_event_register(int argc, VALUE *argv,
  */
 static VALUE libvirt_connect_domain_event_deregister(VALUE c)
 {
-    ruby_libvirt_generate_call_nil(virConnectDomainEventDeregister,
-                                   ruby_libvirt_connect_get(c),
-                                   ruby_libvirt_connect_get(c),
-                                   domain_event_callback);
+    int ret;
+
+    ret = virConnectDomainEventDeregister(ruby_libvirt_connect_get(c),
+                                          domain_event_callback);
+    ruby_libvirt_raise_error_if(ret < 0, e_Error,
+                                "virConnectDomainEventDeregister",
+                                ruby_libvirt_connect_get(c));
+
+    domain_event_passthrough_release(c, Qnil);
+
+    return Qnil;
 }
 #endif
 
+#if HAVE_VIRCONNECTDOMAINEVENTREGISTERANY && HAVE_RB_THREAD_CALL_WITHOUT_GVL
 /*
- * call-seq:
- *   conn.num_of_domains -> Fixnum
+ * Libvirt::Connect::DomainEventQueue.  The libvirt callbacks for a queue
+ * never touch Ruby: they copy the event into a malloc'ed record under the
+ * queue lock, so they are equally happy on a Ruby thread or on the native
+ * thread of event_run_default_impl_in_thread.  Ruby only gets involved in
+ * queue.pop, which turns a whole batch of records into Ruby objects at once.
  *
- * Call virConnectNumOfDomains[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virConnectNumOfDomains]
- * to retrieve the number of active domains on this connection.
+ * The queue is freed when both the Ruby object and every libvirt
+ * registration (through the free callback) have let go of it, since libvirt
+ * may still be inside one of our callbacks when deregistration returns.
  */
-static VALUE libvirt_connect_num_of_domains(VALUE c)
+struct domain_event_record {
+    int event_id;
+    virDomainPtr dom;
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    double time;
+    int i1;
+    int i2;
+    long long ll;
+    char *s1;
+    char *s2;
+    virTypedParameterPtr params;
+    int nparams;
+};
+
+struct domain_event_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    virConnectPtr conn;
+    int *callback_ids;
+    int ncallbacks;
+    struct domain_event_record *records;
+    long nrecords;
+    long capacity;
+    long max_batch;
+    double max_latency;
+    int coalesce;
+    unsigned long long coalesced;
+    unsigned long long dropped;
+};
+
+static VALUE c_domain_event_queue;
+
+static double domain_event_queue_now(void)
 {
-    gen_conn_num_of(c, Domains);
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
-/*
- * call-seq:
- *   conn.list_domains -> list
- *
- * Call virConnectListDomains[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virConnectListDomains]
- * to retrieve a list of active domain IDs on this connection.
- */
-static VALUE libvirt_connect_list_domains(VALUE c)
+static void domain_event_record_clear(struct domain_event_record *rec)
 {
-    int i, r, num, *ids;
-    VALUE result;
+    int i;
+
+    if (rec->dom) {
+        virDomainFree(rec->dom);
+    }
+    free(rec->s1);
+    free(rec->s2);
+    for (i = 0; i < rec->nparams; i++) {
+        if (rec->params[i].type == VIR_TYPED_PARAM_STRING) {
+            free(rec->params[i].value.s);
+        }
+    }
+    free(rec->params);
+    memset(rec, 0, sizeof(*rec));
+}
+
+static void domain_event_queue_unref(struct domain_event_queue *q)
+{
+    long i;
+    int refs;
+
+    pthread_mutex_lock(&q->lock);
+    refs = --q->refs;
+    pthread_mutex_unlock(&q->lock);
+
+    if (refs > 0) {
+        return;
+    }
+
+    for (i = 0; i < q->nrecords; i++) {
+        domain_event_record_clear(&q->records[i]);
+    }
+    free(q->records);
+    free(q->callback_ids);
+    if (q->conn) {
+        virConnectClose(q->conn);
+    }
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+static void domain_event_queue_release(void *opaque)
+{
+    domain_event_queue_unref((struct domain_event_queue *)opaque);
+}
+
+/* drop every libvirt registration; the free callbacks do the unrefs */
+static void domain_event_queue_deregister(struct domain_event_queue *q)
+{
+    int i;
+
+    for (i = 0; i < q->ncallbacks; i++) {
+        virConnectDomainEventDeregisterAny(q->conn, q->callback_ids[i]);
+    }
+    q->ncallbacks = 0;
+}
+
+static void domain_event_queue_free(void *p)
+{
+    struct domain_event_queue *q = (struct domain_event_queue *)p;
+
+    if (!q) {
+        return;
+    }
+    domain_event_queue_deregister(q);
+    domain_event_queue_unref(q);
+}
+
+static const rb_data_type_t domain_event_queue_data_type = {
+    "Libvirt::Connect::DomainEventQueue",
+    { NULL, domain_event_queue_free, NULL, },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct domain_event_queue *domain_event_queue_get(VALUE q)
+{
+    struct domain_event_queue *queue;
+
+    TypedData_Get_Struct(q, struct domain_event_queue,
+                         &domain_event_queue_data_type, queue);
+
+    return queue;
+}
+
+/* Called with q->lock held.  With coalescing on, an event that only
+ * reports a new state (lifecycle, RTC, block job) replaces the pending one
+ * for the same domain and disk, since only the latest state is interesting.
+ */
+static struct domain_event_record *domain_event_queue_slot(struct domain_event_queue *q,
+                                                           int event_id,
+                                                           virDomainPtr dom,
+                                                           int coalescible,
+                                                           const char *disk)
+{
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    struct domain_event_record *rec, *grown;
+    long i, capacity;
+
+    if (virDomainGetUUID(dom, uuid) < 0) {
+        memset(uuid, 0, sizeof(uuid));
+    }
+
+    if (q->coalesce && coalescible) {
+        for (i = q->nrecords - 1; i >= 0; i--) {
+            rec = &q->records[i];
+            if (rec->event_id == event_id &&
+                memcmp(rec->uuid, uuid, VIR_UUID_BUFLEN) == 0 &&
+                (disk == NULL || (rec->s1 && strcmp(rec->s1, disk) == 0))) {
+                q->coalesced++;
+                return rec;
+            }
+        }
+    }
+
+    if (q->nrecords == q->capacity) {
+        capacity = q->capacity ? q->capacity * 2 : 64;
+        grown = realloc(q->records, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            q->dropped++;
+            return NULL;
+        }
+        q->records = grown;
+        q->capacity = capacity;
+    }
+
+    rec = &q->records[q->nrecords++];
+    memset(rec, 0, sizeof(*rec));
+    rec->event_id = event_id;
+    virDomainRef(dom);
+    rec->dom = dom;
+    memcpy(rec->uuid, uuid, VIR_UUID_BUFLEN);
+    rec->time = domain_event_queue_now();
+
+    return rec;
+}
+
+static void domain_event_queue_signal(struct domain_event_queue *q)
+{
+    if (q->nrecords >= q->max_batch || q->nrecords == 1) {
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int domain_event_queue_lifecycle(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                        virDomainPtr dom, int event,
+                                        int detail, void *opaque)
+{
+    struct domain_event_queue *q = (struct domain_event_queue *)opaque;
+    struct domain_event_record *rec;
+
+    pthread_mutex_lock(&q->lock);
+    rec = domain_event_queue_slot(q, VIR_DOMAIN_EVENT_ID_LIFECYCLE, dom, 1,
+                                  NULL);
+    if (rec) {
+        rec->i1 = event;
+        rec->i2 = detail;
+    }
+    domain_event_queue_signal(q);
+
+    return 0;
+}
+
+static int domain_event_queue_reboot(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                     virDomainPtr dom, void *opaque)
+{
+    struct domain_event_queue *q = (struct domain_event_queue *)opaque;
+
+    pthread_mutex_lock(&q->lock);
+    domain_event_queue_slot(q, VIR_DOMAIN_EVENT_ID_REBOOT, dom, 0, NULL);
+    domain_event_queue_signal(q);
+
+    return 0;
+}
+
+static int domain_event_queue_rtc(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                  virDomainPtr dom, long long utc_offset,
+                                  void *opaque)
+{
+    struct domain_event_queue *q = (struct domain_event_queue *)opaque;
+    struct domain_event_record *rec;
+
+    pthread_mutex_lock(&q->lock);
+    rec = domain_event_queue_slot(q, VIR_DOMAIN_EVENT_ID_RTC_CHANGE, dom, 1,
+                                  NULL);
+    if (rec) {
+        rec->ll = utc_offset;
+    }
+    domain_event_queue_signal(q);
+
+    return 0;
+}
+
+static int domain_event_queue_watchdog(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                       virDomainPtr dom, int action,
+                                       void *opaque)
+{
+    struct domain_event_queue *q = (struct domain_event_queue *)opaque;
+    struct domain_event_record *rec;
+
+    pthread_mutex_lock(&q->lock);
+    rec = domain_event_queue_slot(q, VIR_DOMAIN_EVENT_ID_WATCHDOG, dom, 0,
+                                  NULL);
+    if (rec) {
+        rec->i1 = action;
+    }
+    domain_event_queue_signal(q);
+
+    return 0;
+}
+
+static int domain_event_queue_io_error(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                       virDomainPtr dom, const char *src_path,
+                                       const char *dev_alias, int action,
+                                       void *opaque)
+{
+    struct domain_event_queue *q = (struct domain_event_queue *)opaque;
+    struct domain_event_record *rec;
+
+    pthread_mutex_lock(&q->lock);
+    rec = domain_event_queue_slot(q, VIR_DOMAIN_EVENT_ID_IO_ERROR, dom, 0,
+                                  NULL);
+    if (rec) {
+        rec->s1 = src_path ? strdup(src_path) : NULL;
+        rec->s2 = dev_alias ? strdup(dev_alias) : NULL;
+        rec->i1 = action;
+    }
+    domain_event_queue_signal(q);
+
+    return 0;
+}
+
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB
+static int domain_event_queue_block_job(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                        virDomainPtr dom, const char *disk,
+                                        int type, int status, void *opaque)
+{
+    struct domain_event_queue *q = (struct domain_event_queue *)opaque;
+    struct domain_event_record *rec;
+
+    pthread_mutex_lock(&q->lock);
+    rec = domain_event_queue_slot(q, VIR_DOMAIN_EVENT_ID_BLOCK_JOB, dom, 1,
+                                  disk ? disk : "");
+    if (rec) {
+        if (rec->s1 == NULL) {
+            rec->s1 = strdup(disk ? disk : "");
+        }
+        rec->i1 = type;
+        rec->i2 = status;
+    }
+    domain_event_queue_signal(q);
+
+    return 0;
+}
+#endif
+
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2
+/* same callback signature as BLOCK_JOB, but the records need telling apart */
+static int domain_event_queue_block_job_2(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                          virDomainPtr dom, const char *disk,
+                                          int type, int status, void *opaque)
+{
+    struct domain_event_queue *q = (struct domain_event_queue *)opaque;
+    struct domain_event_record *rec;
+
+    pthread_mutex_lock(&q->lock);
+    rec = domain_event_queue_slot(q, VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2, dom,
+                                  1, disk ? disk : "");
+    if (rec) {
+        if (rec->s1 == NULL) {
+            rec->s1 = strdup(disk ? disk : "");
+        }
+        rec->i1 = type;
+        rec->i2 = status;
+    }
+    domain_event_queue_signal(q);
+
+    return 0;
+}
+#endif
+
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_JOB_COMPLETED
+static int domain_event_queue_job_completed(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                            virDomainPtr dom,
+                                            virTypedParameterPtr params,
+                                            int nparams, void *opaque)
+{
+    struct domain_event_queue *q = (struct domain_event_queue *)opaque;
+    struct domain_event_record *rec;
+    int i;
+
+    pthread_mutex_lock(&q->lock);
+    rec = domain_event_queue_slot(q, VIR_DOMAIN_EVENT_ID_JOB_COMPLETED, dom,
+                                  0, NULL);
+    if (rec) {
+        rec->params = calloc(nparams, sizeof(*rec->params));
+        if (rec->params) {
+            for (i = 0; i < nparams; i++) {
+                rec->params[i] = params[i];
+                if (params[i].type == VIR_TYPED_PARAM_STRING) {
+                    rec->params[i].value.s = strdup(params[i].value.s);
+                }
+            }
+            rec->nparams = nparams;
+        }
+    }
+    domain_event_queue_signal(q);
+
+    return 0;
+}
+#endif
+
+struct domain_event_queue_wait_arg {
+    struct domain_event_queue *q;
+    double timeout;
+    struct domain_event_record *taken;
+    long ntaken;
+    /* set, under the queue lock, by domain_event_queue_cancel(); each
+     * popper has its own, so one can't clear another's interrupt
+     */
+    int cancelled;
+};
+
+static void domain_event_queue_timedwait(struct domain_event_queue *q,
+                                         double until)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)until;
+    ts.tv_nsec = (long)((until - ts.tv_sec) * 1000000000.0);
+    pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+}
+
+/* wait for a full batch, or for the oldest record to reach max_latency, or
+ * for the caller's timeout, and take up to max_batch records off the front
+ */
+static void *domain_event_queue_wait_nogvl(void *p)
+{
+    struct domain_event_queue_wait_arg *arg = (struct domain_event_queue_wait_arg *)p;
+    struct domain_event_queue *q = arg->q;
+    double now, deadline, due;
+
+    deadline = arg->timeout < 0 ? -1 : domain_event_queue_now() + arg->timeout;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        if (arg->cancelled || q->nrecords >= q->max_batch) {
+            break;
+        }
+        now = domain_event_queue_now();
+        if (q->nrecords > 0) {
+            due = q->records[0].time + q->max_latency;
+            if (now >= due) {
+                break;
+            }
+            if (deadline >= 0 && deadline < due) {
+                due = deadline;
+            }
+            domain_event_queue_timedwait(q, due);
+        }
+        else if (deadline >= 0) {
+            if (now >= deadline) {
+                break;
+            }
+            domain_event_queue_timedwait(q, deadline);
+        }
+        else {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        if (deadline >= 0 && q->nrecords > 0 &&
+            domain_event_queue_now() >= deadline) {
+            break;
+        }
+    }
+
+    arg->ntaken = q->nrecords < q->max_batch ? q->nrecords : q->max_batch;
+    if (arg->ntaken > 0) {
+        arg->taken = malloc(arg->ntaken * sizeof(*arg->taken));
+        if (arg->taken == NULL) {
+            arg->ntaken = 0;
+        }
+        else {
+            memcpy(arg->taken, q->records, arg->ntaken * sizeof(*arg->taken));
+            memmove(q->records, q->records + arg->ntaken,
+                    (q->nrecords - arg->ntaken) * sizeof(*q->records));
+            q->nrecords -= arg->ntaken;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+static void domain_event_queue_cancel(void *p)
+{
+    struct domain_event_queue_wait_arg *arg = (struct domain_event_queue_wait_arg *)p;
+    struct domain_event_queue *q = arg->q;
+
+    pthread_mutex_lock(&q->lock);
+    arg->cancelled = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+struct domain_event_batch_arg {
+    VALUE conn;
+    struct domain_event_record *records;
+    long nrecords;
+};
+
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_JOB_COMPLETED
+static VALUE domain_event_record_params(struct domain_event_record *rec)
+{
+    VALUE hash;
+    int i;
+
+    hash = rb_hash_new();
+    for (i = 0; i < rec->nparams; i++) {
+        ruby_libvirt_typed_params_to_hash(rec->params, i, hash, 0);
+    }
+
+    return hash;
+}
+#endif
+
+static VALUE domain_event_batch_build(VALUE in)
+{
+    struct domain_event_batch_arg *arg = (struct domain_event_batch_arg *)in;
+    struct domain_event_record *rec;
+    VALUE result, entry;
+    long i;
+
+    result = rb_ary_new2(arg->nrecords);
+    for (i = 0; i < arg->nrecords; i++) {
+        rec = &arg->records[i];
+
+        entry = rb_ary_new2(5);
+        rb_ary_push(entry, INT2NUM(rec->event_id));
+        rb_ary_push(entry, ruby_libvirt_domain_new(rec->dom, arg->conn));
+        /* the Domain owns the reference now */
+        rec->dom = NULL;
+
+        switch (rec->event_id) {
+        case VIR_DOMAIN_EVENT_ID_LIFECYCLE:
+            rb_ary_push(entry, INT2NUM(rec->i1));
+            rb_ary_push(entry, INT2NUM(rec->i2));
+            break;
+        case VIR_DOMAIN_EVENT_ID_RTC_CHANGE:
+            rb_ary_push(entry, LL2NUM(rec->ll));
+            break;
+        case VIR_DOMAIN_EVENT_ID_WATCHDOG:
+            rb_ary_push(entry, INT2NUM(rec->i1));
+            break;
+        case VIR_DOMAIN_EVENT_ID_IO_ERROR:
+            rb_ary_push(entry, rb_str_new2(rec->s1 ? rec->s1 : ""));
+            rb_ary_push(entry, rb_str_new2(rec->s2 ? rec->s2 : ""));
+            rb_ary_push(entry, INT2NUM(rec->i1));
+            break;
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB
+        case VIR_DOMAIN_EVENT_ID_BLOCK_JOB:
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2
+        case VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2:
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB || HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2
+            rb_ary_push(entry, rb_str_new2(rec->s1 ? rec->s1 : ""));
+            rb_ary_push(entry, INT2NUM(rec->i1));
+            rb_ary_push(entry, INT2NUM(rec->i2));
+            break;
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_JOB_COMPLETED
+        case VIR_DOMAIN_EVENT_ID_JOB_COMPLETED:
+            rb_ary_push(entry, domain_event_record_params(rec));
+            break;
+#endif
+        default:
+            break;
+        }
+
+        rb_ary_store(result, i, entry);
+    }
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   queue.pop(timeout=nil) -> Array
+ *
+ * Wait, with the GVL released, until max_batch events are waiting or the
+ * oldest waiting event is max_latency seconds old, and return up to
+ * max_batch of them.  If timeout (in seconds) is given and passes first,
+ * whatever has arrived by then is returned, possibly an empty Array.  Each
+ * event is an Array of the event ID, the Libvirt::Domain, and then the
+ * event-specific values:
+ *
+ * - DOMAIN_EVENT_ID_LIFECYCLE: event, detail
+ * - DOMAIN_EVENT_ID_REBOOT: (nothing)
+ * - DOMAIN_EVENT_ID_RTC_CHANGE: utc_offset
+ * - DOMAIN_EVENT_ID_WATCHDOG: action
+ * - DOMAIN_EVENT_ID_IO_ERROR: src_path, dev_alias, action
+ * - DOMAIN_EVENT_ID_BLOCK_JOB, DOMAIN_EVENT_ID_BLOCK_JOB_2: disk, type, status
+ * - DOMAIN_EVENT_ID_JOB_COMPLETED: Hash of job statistics
+ */
+static VALUE libvirt_domain_event_queue_pop(int argc, VALUE *argv, VALUE q)
+{
+    struct domain_event_queue_wait_arg arg;
+    struct domain_event_batch_arg batch;
+    VALUE timeout, result;
+    int exception = 0;
+    long i;
+
+    rb_scan_args(argc, argv, "01", &timeout);
+
+    arg.q = domain_event_queue_get(q);
+    arg.timeout = NIL_P(timeout) ? -1 : NUM2DBL(timeout);
+    arg.taken = NULL;
+    arg.ntaken = 0;
+    arg.cancelled = 0;
+    if (arg.timeout < 0 && !NIL_P(timeout)) {
+        rb_raise(rb_eArgError, "timeout must not be negative");
+    }
+
+    ruby_libvirt_without_gvl(domain_event_queue_wait_nogvl, &arg,
+                             domain_event_queue_cancel, &arg);
+
+    batch.conn = ruby_libvirt_conn_attr(q);
+    batch.records = arg.taken;
+    batch.nrecords = arg.ntaken;
+    result = rb_protect(domain_event_batch_build, (VALUE)&batch, &exception);
+    for (i = 0; i < arg.ntaken; i++) {
+        domain_event_record_clear(&arg.taken[i]);
+    }
+    free(arg.taken);
+    if (exception) {
+        rb_jump_tag(exception);
+    }
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   queue.size -> Fixnum
+ *
+ * Return the number of events waiting in the queue.
+ */
+static VALUE libvirt_domain_event_queue_size(VALUE q)
+{
+    struct domain_event_queue *queue = domain_event_queue_get(q);
+    long n;
+
+    pthread_mutex_lock(&queue->lock);
+    n = queue->nrecords;
+    pthread_mutex_unlock(&queue->lock);
+
+    return LONG2NUM(n);
+}
+
+/*
+ * call-seq:
+ *   queue.coalesced -> Fixnum
+ *
+ * Return how many events have been folded into an event already waiting in
+ * the queue because coalescing was requested.
+ */
+static VALUE libvirt_domain_event_queue_coalesced(VALUE q)
+{
+    struct domain_event_queue *queue = domain_event_queue_get(q);
+    unsigned long long n;
+
+    pthread_mutex_lock(&queue->lock);
+    n = queue->coalesced;
+    pthread_mutex_unlock(&queue->lock);
+
+    return ULL2NUM(n);
+}
+
+/*
+ * call-seq:
+ *   queue.dropped -> Fixnum
+ *
+ * Return how many events were lost because memory for them could not be
+ * allocated.
+ */
+static VALUE libvirt_domain_event_queue_dropped(VALUE q)
+{
+    struct domain_event_queue *queue = domain_event_queue_get(q);
+    unsigned long long n;
+
+    pthread_mutex_lock(&queue->lock);
+    n = queue->dropped;
+    pthread_mutex_unlock(&queue->lock);
+
+    return ULL2NUM(n);
+}
+
+/*
+ * call-seq:
+ *   queue.close -> nil
+ *
+ * Call virConnectDomainEventDeregisterAny[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virConnectDomainEventDeregisterAny]
+ * for every event ID the queue was listening for.  Events already in the
+ * queue can still be popped.
+ */
+static VALUE libvirt_domain_event_queue_close(VALUE q)
+{
+    domain_event_queue_deregister(domain_event_queue_get(q));
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   queue.closed? -> [True|False]
+ *
+ * Return +true+ if the queue has been closed, +false+ otherwise.
+ */
+static VALUE libvirt_domain_event_queue_closed_p(VALUE q)
+{
+    return domain_event_queue_get(q)->ncallbacks == 0 ? Qtrue : Qfalse;
+}
+
+static virConnectDomainEventGenericCallback domain_event_queue_callback(int id)
+{
+    switch (id) {
+    case VIR_DOMAIN_EVENT_ID_LIFECYCLE:
+        return VIR_DOMAIN_EVENT_CALLBACK(domain_event_queue_lifecycle);
+    case VIR_DOMAIN_EVENT_ID_REBOOT:
+        return VIR_DOMAIN_EVENT_CALLBACK(domain_event_queue_reboot);
+    case VIR_DOMAIN_EVENT_ID_RTC_CHANGE:
+        return VIR_DOMAIN_EVENT_CALLBACK(domain_event_queue_rtc);
+    case VIR_DOMAIN_EVENT_ID_WATCHDOG:
+        return VIR_DOMAIN_EVENT_CALLBACK(domain_event_queue_watchdog);
+    case VIR_DOMAIN_EVENT_ID_IO_ERROR:
+        return VIR_DOMAIN_EVENT_CALLBACK(domain_event_queue_io_error);
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB
+    case VIR_DOMAIN_EVENT_ID_BLOCK_JOB:
+        return VIR_DOMAIN_EVENT_CALLBACK(domain_event_queue_block_job);
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2
+    case VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2:
+        return VIR_DOMAIN_EVENT_CALLBACK(domain_event_queue_block_job_2);
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_JOB_COMPLETED
+    case VIR_DOMAIN_EVENT_ID_JOB_COMPLETED:
+        return VIR_DOMAIN_EVENT_CALLBACK(domain_event_queue_job_completed);
+#endif
+    default:
+        rb_raise(rb_eArgError, "invalid eventID argument %d", id);
+    }
+
+    return NULL;
+}
+
+static VALUE domain_event_queue_option(VALUE opts, const char *name,
+                                       VALUE def)
+{
+    VALUE val;
+
+    if (NIL_P(opts)) {
+        return def;
+    }
+    val = rb_hash_aref(opts, ID2SYM(rb_intern(name)));
+
+    return NIL_P(val) ? def : val;
+}
+
+/*
+ * call-seq:
+ *   conn.domain_event_queue(event_ids, max_batch: 256, max_latency: 0.05, coalesce: false, domain: nil) -> Libvirt::Connect::DomainEventQueue
+ *
+ * Call virConnectDomainEventRegisterAny[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virConnectDomainEventRegisterAny]
+ * for each of event_ids (one or an Array of Libvirt::Connect::DOMAIN_EVENT_ID_*
+ * constants), buffering the events in C instead of calling into Ruby for
+ * each one.  Batches of events are fetched with queue.pop; see there for the
+ * layout of each event.  A batch is ready when max_batch events are waiting
+ * or the oldest has waited max_latency seconds.  If coalesce is true, a
+ * lifecycle, RTC change or block job event replaces one still waiting for the
+ * same domain (and disk), so a consumer that falls behind sees only the
+ * latest state.  If domain is a Libvirt::Domain, only its events are queued.
+ * An event loop must be running, as for domain_event_register_any.
+ */
+static VALUE libvirt_connect_domain_event_queue(int argc, VALUE *argv, VALUE c)
+{
+    VALUE event_ids, opts, dom, result;
+    struct domain_event_queue *q;
+    virConnectPtr conn;
+    virDomainPtr domain = NULL;
+    virConnectDomainEventGenericCallback cb;
+    long i, nids, max_batch;
+    double max_latency;
+    int id, ret;
+
+    rb_scan_args(argc, argv, "11", &event_ids, &opts);
+
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+    }
+    if (TYPE(event_ids) != T_ARRAY) {
+        event_ids = rb_ary_new3(1, event_ids);
+    }
+    nids = RARRAY_LEN(event_ids);
+    if (nids == 0) {
+        rb_raise(rb_eArgError, "at least one eventID is required");
+    }
+    for (i = 0; i < nids; i++) {
+        domain_event_queue_callback(NUM2INT(rb_ary_entry(event_ids, i)));
+    }
+
+    dom = domain_event_queue_option(opts, "domain", Qnil);
+    if (!NIL_P(dom)) {
+        domain = ruby_libvirt_domain_get(dom);
+    }
+    max_batch = NUM2LONG(domain_event_queue_option(opts, "max_batch",
+                                                   INT2NUM(256)));
+    max_latency = NUM2DBL(domain_event_queue_option(opts, "max_latency",
+                                                    rb_float_new(0.05)));
+    conn = ruby_libvirt_connect_get(c);
+
+    q = calloc(1, sizeof(*q));
+    if (q == NULL) {
+        rb_memerror();
+    }
+    q->callback_ids = calloc(nids, sizeof(int));
+    if (q->callback_ids == NULL) {
+        free(q);
+        rb_memerror();
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->refs = 1;
+    q->max_batch = max_batch < 1 ? 1 : max_batch;
+    q->max_latency = max_latency;
+    q->coalesce = RTEST(domain_event_queue_option(opts, "coalesce", Qfalse));
+
+    /* the queue has its own reference so that it can always deregister */
+    q->conn = conn;
+    virConnectRef(q->conn);
+
+    result = TypedData_Wrap_Struct(c_domain_event_queue,
+                                   &domain_event_queue_data_type, q);
+    rb_iv_set(result, "@connection", c);
+
+    for (i = 0; i < nids; i++) {
+        id = NUM2INT(rb_ary_entry(event_ids, i));
+        cb = domain_event_queue_callback(id);
+
+        pthread_mutex_lock(&q->lock);
+        q->refs++;
+        pthread_mutex_unlock(&q->lock);
+
+        ret = virConnectDomainEventRegisterAny(q->conn, domain, id, cb, q,
+                                               domain_event_queue_release);
+        if (ret < 0) {
+            domain_event_queue_unref(q);
+            /* the Ruby object's free deregisters whatever did succeed */
+            ruby_libvirt_raise_error_if(1, e_RetrieveError,
+                                        "virConnectDomainEventRegisterAny",
+                                        q->conn);
+        }
+        q->callback_ids[q->ncallbacks++] = ret;
+    }
+
+    return result;
+}
+#endif
+
+/*
+ * call-seq:
+ *   conn.num_of_domains -> Fixnum
+ *
+ * Call virConnectNumOfDomains[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virConnectNumOfDomains]
+ * to retrieve the number of active domains on this connection.
+ */
+static VALUE libvirt_connect_num_of_domains(VALUE c)
+{
+    gen_conn_num_of(c, Domains);
+}
+
+/*
+ * call-seq:
+ *   conn.list_domains -> list
+ *
+ * Call virConnectListDomains[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virConnectListDomains]
+ * to retrieve a list of active domain IDs on this connection.
+ */
+static VALUE libvirt_connect_list_domains(VALUE c)
+{
+    int i, r, num, *ids;
+    VALUE result;
 
     num = virConnectNumOfDomains(ruby_libvirt_connect_get(c));
     ruby_libvirt_raise_error_if(num < 0, e_RetrieveError,
@@ -1028,6 +2003,9 @@ static VALUE libvirt_connect_list_defined_domains(VALUE c)
     gen_conn_list_names(c, DefinedDomains);
 }
 
+ruby_libvirt_declare_nogvl3(virDomainPtr, virDomainCreateLinux, virConnectPtr,
+                            const char *, unsigned int)
+
 /*
  * call-seq:
  *   conn.create_domain_linux(xml, flags=0) -> Libvirt::Domain
@@ -1038,21 +2016,22 @@ static VALUE libvirt_connect_list_defined_domains(VALUE c)
  */
 static VALUE libvirt_connect_create_linux(int argc, VALUE *argv, VALUE c)
 {
-    virDomainPtr dom;
     VALUE flags, xml;
 
     rb_scan_args(argc, argv, "11", &xml, &flags);
 
-    dom = virDomainCreateLinux(ruby_libvirt_connect_get(c),
-                               StringValueCStr(xml),
-                               ruby_libvirt_value_to_uint(flags));
-    ruby_libvirt_raise_error_if(dom == NULL, e_Error, "virDomainCreateLinux",
-                                ruby_libvirt_connect_get(c));
-
-    return ruby_libvirt_domain_new(dom, c);
+    ruby_libvirt_generate_call_object_nogvl(virDomainCreateLinux,
+                                            ruby_libvirt_connect_get(c),
+                                            e_Error, ruby_libvirt_domain_new,
+                                            c, ruby_libvirt_connect_get(c),
+                                            StringValueCStr(xml),
+                                            ruby_libvirt_value_to_uint(flags));
 }
 
 #if HAVE_VIRDOMAINCREATEXML
+ruby_libvirt_declare_nogvl3(virDomainPtr, virDomainCreateXML, virConnectPtr,
+                            const char *, unsigned int)
+
 /*
  * call-seq:
  *   conn.create_domain_xml(xml, flags=0) -> Libvirt::Domain
@@ -1062,78 +2041,392 @@ static VALUE libvirt_connect_create_linux(int argc, VALUE *argv, VALUE c)
  */
 static VALUE libvirt_connect_create_domain_xml(int argc, VALUE *argv, VALUE c)
 {
-    virDomainPtr dom;
     VALUE flags, xml;
 
-    rb_scan_args(argc, argv, "11", &xml, &flags);
+    rb_scan_args(argc, argv, "11", &xml, &flags);
+
+    ruby_libvirt_generate_call_object_nogvl(virDomainCreateXML,
+                                            ruby_libvirt_connect_get(c),
+                                            e_Error, ruby_libvirt_domain_new,
+                                            c, ruby_libvirt_connect_get(c),
+                                            StringValueCStr(xml),
+                                            ruby_libvirt_value_to_uint(flags));
+}
+#endif
+
+ruby_libvirt_declare_nogvl2(virDomainPtr, virDomainLookupByName, virConnectPtr,
+                            const char *)
+ruby_libvirt_declare_nogvl2(virDomainPtr, virDomainLookupByID, virConnectPtr,
+                            int)
+/* named after virDomainLookupByUUID, which this used to call */
+ruby_libvirt_declare_nogvl2_as(virDomainPtr, virDomainLookupByUUID,
+                               virDomainLookupByUUIDString, virConnectPtr,
+                               const char *)
+
+static VALUE lookup_domain_by_name(VALUE c, VALUE name, int missing)
+{
+    ruby_libvirt_generate_call_object_missing_nogvl(virDomainLookupByName,
+                                                    ruby_libvirt_connect_get(c),
+                                                    e_RetrieveError, missing,
+                                                    ruby_libvirt_domain_new, c,
+                                                    ruby_libvirt_connect_get(c),
+                                                    StringValueCStr(name));
+}
+
+/*
+ * call-seq:
+ *   conn.lookup_domain_by_name(name) -> Libvirt::Domain
+ *
+ * Call virDomainLookupByName[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLookupByName]
+ * to retrieve a domain object for name.
+ */
+static VALUE libvirt_connect_lookup_domain_by_name(VALUE c, VALUE name)
+{
+    return lookup_domain_by_name(c, name, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   conn.find_domain_by_name(name) -> Libvirt::Domain or nil
+ *
+ * Like conn.lookup_domain_by_name, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such domain.
+ */
+static VALUE libvirt_connect_find_domain_by_name(VALUE c, VALUE name)
+{
+    return lookup_domain_by_name(c, name, VIR_ERR_NO_DOMAIN);
+}
+
+static VALUE lookup_domain_by_id(VALUE c, VALUE id, int missing)
+{
+    ruby_libvirt_generate_call_object_missing_nogvl(virDomainLookupByID,
+                                                    ruby_libvirt_connect_get(c),
+                                                    e_RetrieveError, missing,
+                                                    ruby_libvirt_domain_new, c,
+                                                    ruby_libvirt_connect_get(c),
+                                                    NUM2INT(id));
+}
+
+/*
+ * call-seq:
+ *   conn.lookup_domain_by_id(id) -> Libvirt::Domain
+ *
+ * Call virDomainLookupByID[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLookupByID]
+ * to retrieve a domain object for id.
+ */
+static VALUE libvirt_connect_lookup_domain_by_id(VALUE c, VALUE id)
+{
+    return lookup_domain_by_id(c, id, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   conn.find_domain_by_id(id) -> Libvirt::Domain or nil
+ *
+ * Like conn.lookup_domain_by_id, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such domain.
+ */
+static VALUE libvirt_connect_find_domain_by_id(VALUE c, VALUE id)
+{
+    return lookup_domain_by_id(c, id, VIR_ERR_NO_DOMAIN);
+}
+
+static VALUE lookup_domain_by_uuid(VALUE c, VALUE uuid, int missing)
+{
+    ruby_libvirt_generate_call_object_missing_nogvl(virDomainLookupByUUID,
+                                                    ruby_libvirt_connect_get(c),
+                                                    e_RetrieveError, missing,
+                                                    ruby_libvirt_domain_new, c,
+                                                    ruby_libvirt_connect_get(c),
+                                                    StringValueCStr(uuid));
+}
+
+/*
+ * call-seq:
+ *   conn.lookup_domain_by_uuid(uuid) -> Libvirt::Domain
+ *
+ * Call virDomainLookupByUUIDString[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLookupByUUIDString]
+ * to retrieve a domain object for uuid.
+ */
+static VALUE libvirt_connect_lookup_domain_by_uuid(VALUE c, VALUE uuid)
+{
+    return lookup_domain_by_uuid(c, uuid, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   conn.find_domain_by_uuid(uuid) -> Libvirt::Domain or nil
+ *
+ * Like conn.lookup_domain_by_uuid, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such domain.
+ */
+static VALUE libvirt_connect_find_domain_by_uuid(VALUE c, VALUE uuid)
+{
+    return lookup_domain_by_uuid(c, uuid, VIR_ERR_NO_DOMAIN);
+}
+
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+/*
+ * Bulk lookups.  The keys are copied out of Ruby and then handed to a few
+ * native threads which share one connection; libvirt multiplexes their
+ * calls over the connection's socket, so the round trips overlap instead of
+ * queueing up behind each other.  As with ruby_libvirt_parallel_nogvl(), at
+ * most 64 threads are used however many are asked for.
+ */
+#define LOOKUP_DOMAINS_MAX_THREADS 64
+
+struct lookup_domains_arg {
+    virConnectPtr conn;
+    virDomainPtr (*lookup)(virConnectPtr, const char *);
+    char **keys;
+    virDomainPtr *doms;
+    virErrorPtr *errs;
+    long n;
+    long next;
+    int nthreads;
+    pthread_mutex_t lock;
+    volatile int cancelled;
+};
+
+static void *lookup_domains_worker(void *p)
+{
+    struct lookup_domains_arg *arg = (struct lookup_domains_arg *)p;
+    long i;
+
+    for (;;) {
+        pthread_mutex_lock(&arg->lock);
+        i = arg->next++;
+        pthread_mutex_unlock(&arg->lock);
+
+        if (i >= arg->n || arg->cancelled) {
+            break;
+        }
+
+        arg->doms[i] = arg->lookup(arg->conn, arg->keys[i]);
+        if (arg->doms[i] == NULL) {
+            arg->errs[i] = virSaveLastError();
+        }
+    }
+
+    return NULL;
+}
+
+static void *lookup_domains_nogvl(void *p)
+{
+    struct lookup_domains_arg *arg = (struct lookup_domains_arg *)p;
+    pthread_t *threads;
+    int i, started = 0;
+
+    threads = calloc(arg->nthreads, sizeof(pthread_t));
+    if (threads != NULL) {
+        /* this thread is one of the workers, so start one fewer */
+        for (i = 1; i < arg->nthreads; i++) {
+            if (pthread_create(&threads[started], NULL, lookup_domains_worker,
+                               arg) != 0) {
+                break;
+            }
+            started++;
+        }
+    }
+
+    lookup_domains_worker(arg);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    /* the errors are all saved per key by now */
+    virConnectClose(arg->conn);
+
+    return NULL;
+}
+
+static void lookup_domains_cancel(void *p)
+{
+    ((struct lookup_domains_arg *)p)->cancelled = 1;
+}
+
+static VALUE lookup_domains_run(VALUE in)
+{
+    struct lookup_domains_arg *arg = (struct lookup_domains_arg *)in;
+
+    /* dropped by lookup_domains_nogvl, as for the nogvl trampolines */
+    virConnectRef(arg->conn);
+    ruby_libvirt_without_gvl(lookup_domains_nogvl, arg, lookup_domains_cancel,
+                             arg);
+
+    return Qnil;
+}
+
+static VALUE lookup_domains_cleanup(VALUE in)
+{
+    struct lookup_domains_arg *arg = (struct lookup_domains_arg *)in;
+    long i;
+
+    for (i = 0; i < arg->n; i++) {
+        free(arg->keys[i]);
+        if (arg->doms[i]) {
+            virDomainFree(arg->doms[i]);
+        }
+        if (arg->errs[i]) {
+            virFreeError(arg->errs[i]);
+        }
+    }
+    free(arg->keys);
+    free(arg->doms);
+    free(arg->errs);
+    pthread_mutex_destroy(&arg->lock);
+
+    return Qnil;
+}
 
-    dom = virDomainCreateXML(ruby_libvirt_connect_get(c), StringValueCStr(xml),
-                             ruby_libvirt_value_to_uint(flags));
-    ruby_libvirt_raise_error_if(dom == NULL, e_Error, "virDomainCreateXML",
-                                ruby_libvirt_connect_get(c));
+struct lookup_domains_result_arg {
+    struct lookup_domains_arg *arg;
+    VALUE c;
+    VALUE keys;
+    const char *func;
+};
 
-    return ruby_libvirt_domain_new(dom, c);
+static VALUE lookup_domains_result(VALUE in)
+{
+    struct lookup_domains_result_arg *res = (struct lookup_domains_result_arg *)in;
+    struct lookup_domains_arg *arg = res->arg;
+    VALUE found, errors, key;
+    long i;
+
+    lookup_domains_run((VALUE)arg);
+
+    found = rb_hash_new();
+    errors = rb_hash_new();
+    for (i = 0; i < arg->n; i++) {
+        key = rb_ary_entry(res->keys, i);
+        if (arg->doms[i]) {
+            rb_hash_aset(found, key, ruby_libvirt_domain_new(arg->doms[i],
+                                                             res->c));
+            /* the Domain owns it now */
+            arg->doms[i] = NULL;
+        }
+        else {
+            rb_hash_aset(errors, key,
+                         ruby_libvirt_error_new(e_RetrieveError, res->func,
+                                                arg->errs[i]));
+        }
+    }
+
+    return rb_assoc_new(found, errors);
 }
-#endif
 
-/*
- * call-seq:
- *   conn.lookup_domain_by_name(name) -> Libvirt::Domain
- *
- * Call virDomainLookupByName[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLookupByName]
- * to retrieve a domain object for name.
- */
-static VALUE libvirt_connect_lookup_domain_by_name(VALUE c, VALUE name)
+static VALUE lookup_domains(int argc, VALUE *argv, VALUE c,
+                            virDomainPtr (*lookup)(virConnectPtr,
+                                                   const char *),
+                            const char *func)
 {
-    virDomainPtr dom;
+    struct lookup_domains_arg arg;
+    struct lookup_domains_result_arg res;
+    VALUE keys, threads, key;
+    long i;
+
+    rb_scan_args(argc, argv, "11", &keys, &threads);
+
+    Check_Type(keys, T_ARRAY);
+    /* work on a copy so that nothing can change underneath us */
+    keys = rb_ary_dup(keys);
+    for (i = 0; i < RARRAY_LEN(keys); i++) {
+        key = rb_ary_entry(keys, i);
+        StringValueCStr(key);
+        rb_ary_store(keys, i, key);
+    }
 
-    dom = virDomainLookupByName(ruby_libvirt_connect_get(c),
-                                StringValueCStr(name));
-    ruby_libvirt_raise_error_if(dom == NULL, e_RetrieveError,
-                                "virDomainLookupByName",
-                                ruby_libvirt_connect_get(c));
+    arg.conn = ruby_libvirt_connect_get(c);
+    arg.lookup = lookup;
+    arg.n = RARRAY_LEN(keys);
+    arg.next = 0;
+    arg.cancelled = 0;
+    arg.nthreads = NIL_P(threads) ? 8 : NUM2INT(threads);
+    if (arg.nthreads < 1) {
+        arg.nthreads = 1;
+    }
+    if (arg.nthreads > LOOKUP_DOMAINS_MAX_THREADS) {
+        arg.nthreads = LOOKUP_DOMAINS_MAX_THREADS;
+    }
+    if (arg.nthreads > arg.n) {
+        arg.nthreads = arg.n ? arg.n : 1;
+    }
 
-    return ruby_libvirt_domain_new(dom, c);
+    arg.keys = calloc(arg.n ? arg.n : 1, sizeof(char *));
+    arg.doms = calloc(arg.n ? arg.n : 1, sizeof(virDomainPtr));
+    arg.errs = calloc(arg.n ? arg.n : 1, sizeof(virErrorPtr));
+    if (arg.keys == NULL || arg.doms == NULL || arg.errs == NULL) {
+        free(arg.keys);
+        free(arg.doms);
+        free(arg.errs);
+        rb_memerror();
+    }
+    pthread_mutex_init(&arg.lock, NULL);
+    for (i = 0; i < arg.n; i++) {
+        arg.keys[i] = strdup(RSTRING_PTR(rb_ary_entry(keys, i)));
+        if (arg.keys[i] == NULL) {
+            lookup_domains_cleanup((VALUE)&arg);
+            rb_memerror();
+        }
+    }
+
+    res.arg = &arg;
+    res.c = c;
+    res.keys = keys;
+    res.func = func;
+
+    return rb_ensure(lookup_domains_result, (VALUE)&res,
+                     lookup_domains_cleanup, (VALUE)&arg);
 }
 
 /*
  * call-seq:
- *   conn.lookup_domain_by_id(id) -> Libvirt::Domain
+ *   conn.lookup_domains_by_name(names, threads=8) -> [Hash, Hash]
  *
- * Call virDomainLookupByID[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLookupByID]
- * to retrieve a domain object for id.
+ * Call virDomainLookupByName[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLookupByName]
+ * for every name in the Array names, from up to threads (at most 64) native
+ * threads at once with the GVL released, so that the round trips to libvirtd
+ * overlap.
+ * Returns two Hashes: the first maps each name that was found to its
+ * Libvirt::Domain, and the second maps every other name to the
+ * Libvirt::RetrieveError that lookup_domain_by_name would have raised.
  */
-static VALUE libvirt_connect_lookup_domain_by_id(VALUE c, VALUE id)
+static VALUE libvirt_connect_lookup_domains_by_name(int argc, VALUE *argv,
+                                                    VALUE c)
 {
-    virDomainPtr dom;
-
-    dom = virDomainLookupByID(ruby_libvirt_connect_get(c), NUM2INT(id));
-    ruby_libvirt_raise_error_if(dom == NULL, e_RetrieveError,
-                                "virDomainLookupByID",
-                                ruby_libvirt_connect_get(c));
-
-    return ruby_libvirt_domain_new(dom, c);
+    return lookup_domains(argc, argv, c, virDomainLookupByName,
+                          "virDomainLookupByName");
 }
 
 /*
  * call-seq:
- *   conn.lookup_domain_by_uuid(uuid) -> Libvirt::Domain
+ *   conn.lookup_domains_by_uuid(uuids, threads=8) -> [Hash, Hash]
  *
  * Call virDomainLookupByUUIDString[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLookupByUUIDString]
- * to retrieve a domain object for uuid.
+ * for every UUID string in the Array uuids, from up to threads (at most 64)
+ * native threads at once with the GVL released, so that the round trips to
+ * libvirtd overlap.  Returns two Hashes: the first maps each UUID that was found to
+ * its Libvirt::Domain, and the second maps every other UUID to the
+ * Libvirt::RetrieveError that lookup_domain_by_uuid would have raised.
  */
-static VALUE libvirt_connect_lookup_domain_by_uuid(VALUE c, VALUE uuid)
+static VALUE libvirt_connect_lookup_domains_by_uuid(int argc, VALUE *argv,
+                                                    VALUE c)
 {
-    virDomainPtr dom;
-
-    dom = virDomainLookupByUUIDString(ruby_libvirt_connect_get(c),
-                                      StringValueCStr(uuid));
-    ruby_libvirt_raise_error_if(dom == NULL, e_RetrieveError,
-                                "virDomainLookupByUUID",
-                                ruby_libvirt_connect_get(c));
-
-    return ruby_libvirt_domain_new(dom, c);
+    return lookup_domains(argc, argv, c, virDomainLookupByUUIDString,
+                          "virDomainLookupByUUID");
 }
+#endif
+
+#if HAVE_VIRDOMAINDEFINEXMLFLAGS
+/* named after virDomainDefineXML, which this used to call */
+ruby_libvirt_declare_nogvl3_as(virDomainPtr, virDomainDefineXML,
+                               virDomainDefineXMLFlags, virConnectPtr,
+                               const char *, unsigned int)
+#else
+ruby_libvirt_declare_nogvl2(virDomainPtr, virDomainDefineXML, virConnectPtr,
+                            const char *)
+#endif
 
 /*
  * call-seq:
@@ -1144,28 +2437,30 @@ static VALUE libvirt_connect_lookup_domain_by_uuid(VALUE c, VALUE uuid)
  */
 static VALUE libvirt_connect_define_domain_xml(int argc, VALUE *argv, VALUE c)
 {
-    virDomainPtr dom;
     VALUE xml;
     VALUE flags;
 
     rb_scan_args(argc, argv, "11", &xml, &flags);
 
 #if HAVE_VIRDOMAINDEFINEXMLFLAGS
-    dom = virDomainDefineXMLFlags(ruby_libvirt_connect_get(c),
-                                  StringValueCStr(xml),
-                                  ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_object_nogvl(virDomainDefineXML,
+                                            ruby_libvirt_connect_get(c),
+                                            e_DefinitionError,
+                                            ruby_libvirt_domain_new, c,
+                                            ruby_libvirt_connect_get(c),
+                                            StringValueCStr(xml),
+                                            ruby_libvirt_value_to_uint(flags));
 #else
     if (ruby_libvirt_value_to_uint(flags) != 0) {
         rb_raise(e_NoSupportError, "Non-zero flags not supported");
     }
-    dom = virDomainDefineXML(ruby_libvirt_connect_get(c), StringValueCStr(xml));
+    ruby_libvirt_generate_call_object_nogvl(virDomainDefineXML,
+                                            ruby_libvirt_connect_get(c),
+                                            e_DefinitionError,
+                                            ruby_libvirt_domain_new, c,
+                                            ruby_libvirt_connect_get(c),
+                                            StringValueCStr(xml));
 #endif
-
-    ruby_libvirt_raise_error_if(dom == NULL, e_DefinitionError,
-                                "virDomainDefineXML",
-                                ruby_libvirt_connect_get(c));
-
-    return ruby_libvirt_domain_new(dom, c);
 }
 
 #if HAVE_VIRCONNECTDOMAINXMLFROMNATIVE
@@ -1265,6 +2560,23 @@ static VALUE libvirt_connect_list_defined_interfaces(VALUE c)
     gen_conn_list_names(c, DefinedInterfaces);
 }
 
+static VALUE lookup_interface_by_name(VALUE c, VALUE name, int missing)
+{
+    virInterfacePtr iface;
+
+    iface = virInterfaceLookupByName(ruby_libvirt_connect_get(c),
+                                     StringValueCStr(name));
+    if (ruby_libvirt_error_missing(iface == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
+    ruby_libvirt_raise_error_if(iface == NULL, e_RetrieveError,
+                                "virInterfaceLookupByName",
+                                ruby_libvirt_connect_get(c));
+
+    return ruby_libvirt_interface_new(iface, c);
+}
+
 /*
  * call-seq:
  *   conn.lookup_interface_by_name(name) -> Libvirt::Interface
@@ -1273,13 +2585,34 @@ static VALUE libvirt_connect_list_defined_interfaces(VALUE c)
  * to retrieve an interface object by name.
  */
 static VALUE libvirt_connect_lookup_interface_by_name(VALUE c, VALUE name)
+{
+    return lookup_interface_by_name(c, name, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   conn.find_interface_by_name(name) -> Libvirt::Interface or nil
+ *
+ * Like conn.lookup_interface_by_name, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such interface.
+ */
+static VALUE libvirt_connect_find_interface_by_name(VALUE c, VALUE name)
+{
+    return lookup_interface_by_name(c, name, VIR_ERR_NO_INTERFACE);
+}
+
+static VALUE lookup_interface_by_mac(VALUE c, VALUE mac, int missing)
 {
     virInterfacePtr iface;
 
-    iface = virInterfaceLookupByName(ruby_libvirt_connect_get(c),
-                                     StringValueCStr(name));
+    iface = virInterfaceLookupByMACString(ruby_libvirt_connect_get(c),
+                                          StringValueCStr(mac));
+    if (ruby_libvirt_error_missing(iface == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
     ruby_libvirt_raise_error_if(iface == NULL, e_RetrieveError,
-                                "virInterfaceLookupByName",
+                                "virInterfaceLookupByMACString",
                                 ruby_libvirt_connect_get(c));
 
     return ruby_libvirt_interface_new(iface, c);
@@ -1294,15 +2627,19 @@ static VALUE libvirt_connect_lookup_interface_by_name(VALUE c, VALUE name)
  */
 static VALUE libvirt_connect_lookup_interface_by_mac(VALUE c, VALUE mac)
 {
-    virInterfacePtr iface;
-
-    iface = virInterfaceLookupByMACString(ruby_libvirt_connect_get(c),
-                                          StringValueCStr(mac));
-    ruby_libvirt_raise_error_if(iface == NULL, e_RetrieveError,
-                                "virInterfaceLookupByMACString",
-                                ruby_libvirt_connect_get(c));
+    return lookup_interface_by_mac(c, mac, VIR_ERR_OK);
+}
 
-    return ruby_libvirt_interface_new(iface, c);
+/*
+ * call-seq:
+ *   conn.find_interface_by_mac(mac) -> Libvirt::Interface or nil
+ *
+ * Like conn.lookup_interface_by_mac, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such interface.
+ */
+static VALUE libvirt_connect_find_interface_by_mac(VALUE c, VALUE mac)
+{
+    return lookup_interface_by_mac(c, mac, VIR_ERR_NO_INTERFACE);
 }
 
 /*
@@ -1379,6 +2716,23 @@ static VALUE libvirt_connect_list_defined_networks(VALUE c)
     gen_conn_list_names(c, DefinedNetworks);
 }
 
+static VALUE lookup_network_by_name(VALUE c, VALUE name, int missing)
+{
+    virNetworkPtr netw;
+
+    netw = virNetworkLookupByName(ruby_libvirt_connect_get(c),
+                                  StringValueCStr(name));
+    if (ruby_libvirt_error_missing(netw == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
+    ruby_libvirt_raise_error_if(netw == NULL, e_RetrieveError,
+                                "virNetworkLookupByName",
+                                ruby_libvirt_connect_get(c));
+
+    return ruby_libvirt_network_new(netw, c);
+}
+
 /*
  * call-seq:
  *   conn.lookup_network_by_name(name) -> Libvirt::Network
@@ -1387,13 +2741,34 @@ static VALUE libvirt_connect_list_defined_networks(VALUE c)
  * to retrieve a network object by name.
  */
 static VALUE libvirt_connect_lookup_network_by_name(VALUE c, VALUE name)
+{
+    return lookup_network_by_name(c, name, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   conn.find_network_by_name(name) -> Libvirt::Network or nil
+ *
+ * Like conn.lookup_network_by_name, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such network.
+ */
+static VALUE libvirt_connect_find_network_by_name(VALUE c, VALUE name)
+{
+    return lookup_network_by_name(c, name, VIR_ERR_NO_NETWORK);
+}
+
+static VALUE lookup_network_by_uuid(VALUE c, VALUE uuid, int missing)
 {
     virNetworkPtr netw;
 
-    netw = virNetworkLookupByName(ruby_libvirt_connect_get(c),
-                                  StringValueCStr(name));
+    netw = virNetworkLookupByUUIDString(ruby_libvirt_connect_get(c),
+                                        StringValueCStr(uuid));
+    if (ruby_libvirt_error_missing(netw == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
     ruby_libvirt_raise_error_if(netw == NULL, e_RetrieveError,
-                                "virNetworkLookupByName",
+                                "virNetworkLookupByUUID",
                                 ruby_libvirt_connect_get(c));
 
     return ruby_libvirt_network_new(netw, c);
@@ -1408,15 +2783,19 @@ static VALUE libvirt_connect_lookup_network_by_name(VALUE c, VALUE name)
  */
 static VALUE libvirt_connect_lookup_network_by_uuid(VALUE c, VALUE uuid)
 {
-    virNetworkPtr netw;
-
-    netw = virNetworkLookupByUUIDString(ruby_libvirt_connect_get(c),
-                                        StringValueCStr(uuid));
-    ruby_libvirt_raise_error_if(netw == NULL, e_RetrieveError,
-                                "virNetworkLookupByUUID",
-                                ruby_libvirt_connect_get(c));
+    return lookup_network_by_uuid(c, uuid, VIR_ERR_OK);
+}
 
-    return ruby_libvirt_network_new(netw, c);
+/*
+ * call-seq:
+ *   conn.find_network_by_uuid(uuid) -> Libvirt::Network or nil
+ *
+ * Like conn.lookup_network_by_uuid, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such network.
+ */
+static VALUE libvirt_connect_find_network_by_uuid(VALUE c, VALUE uuid)
+{
+    return lookup_network_by_uuid(c, uuid, VIR_ERR_NO_NETWORK);
 }
 
 /*
@@ -1525,19 +2904,16 @@ static VALUE libvirt_connect_list_nodedevices(int argc, VALUE *argv, VALUE c)
     return ruby_libvirt_generate_list(r, names);
 }
 
-/*
- * call-seq:
- *   conn.lookup_nodedevice_by_name(name) -> Libvirt::NodeDevice
- *
- * Call virNodeDeviceLookupByName[http://www.libvirt.org/html/libvirt-libvirt-nodedev.html#virNodeDeviceLookupByName]
- * to retrieve a nodedevice object by name.
- */
-static VALUE libvirt_connect_lookup_nodedevice_by_name(VALUE c, VALUE name)
+static VALUE lookup_nodedevice_by_name(VALUE c, VALUE name, int missing)
 {
     virNodeDevicePtr nodedev;
 
     nodedev = virNodeDeviceLookupByName(ruby_libvirt_connect_get(c),
                                         StringValueCStr(name));
+    if (ruby_libvirt_error_missing(nodedev == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
     ruby_libvirt_raise_error_if(nodedev == NULL, e_RetrieveError,
                                 "virNodeDeviceLookupByName",
                                 ruby_libvirt_connect_get(c));
@@ -1546,6 +2922,30 @@ static VALUE libvirt_connect_lookup_nodedevice_by_name(VALUE c, VALUE name)
 
 }
 
+/*
+ * call-seq:
+ *   conn.lookup_nodedevice_by_name(name) -> Libvirt::NodeDevice
+ *
+ * Call virNodeDeviceLookupByName[http://www.libvirt.org/html/libvirt-libvirt-nodedev.html#virNodeDeviceLookupByName]
+ * to retrieve a nodedevice object by name.
+ */
+static VALUE libvirt_connect_lookup_nodedevice_by_name(VALUE c, VALUE name)
+{
+    return lookup_nodedevice_by_name(c, name, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   conn.find_nodedevice_by_name(name) -> Libvirt::NodeDevice or nil
+ *
+ * Like conn.lookup_nodedevice_by_name, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such node device.
+ */
+static VALUE libvirt_connect_find_nodedevice_by_name(VALUE c, VALUE name)
+{
+    return lookup_nodedevice_by_name(c, name, VIR_ERR_NO_NODE_DEVICE);
+}
+
 #if HAVE_VIRNODEDEVICECREATEXML
 /*
  * call-seq:
@@ -1600,6 +3000,23 @@ static VALUE libvirt_connect_list_nwfilters(VALUE c)
     gen_conn_list_names(c, NWFilters);
 }
 
+static VALUE lookup_nwfilter_by_name(VALUE c, VALUE name, int missing)
+{
+    virNWFilterPtr nwfilter;
+
+    nwfilter = virNWFilterLookupByName(ruby_libvirt_connect_get(c),
+                                       StringValueCStr(name));
+    if (ruby_libvirt_error_missing(nwfilter == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
+    ruby_libvirt_raise_error_if(nwfilter == NULL, e_RetrieveError,
+                                "virNWFilterLookupByName",
+                                ruby_libvirt_connect_get(c));
+
+    return ruby_libvirt_nwfilter_new(nwfilter, c);
+}
+
 /*
  * call-seq:
  *   conn.lookup_nwfilter_by_name(name) -> Libvirt::NWFilter
@@ -1608,13 +3025,34 @@ static VALUE libvirt_connect_list_nwfilters(VALUE c)
  * to retrieve a network filter object by name.
  */
 static VALUE libvirt_connect_lookup_nwfilter_by_name(VALUE c, VALUE name)
+{
+    return lookup_nwfilter_by_name(c, name, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   conn.find_nwfilter_by_name(name) -> Libvirt::NWFilter or nil
+ *
+ * Like conn.lookup_nwfilter_by_name, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such network filter.
+ */
+static VALUE libvirt_connect_find_nwfilter_by_name(VALUE c, VALUE name)
+{
+    return lookup_nwfilter_by_name(c, name, VIR_ERR_NO_NWFILTER);
+}
+
+static VALUE lookup_nwfilter_by_uuid(VALUE c, VALUE uuid, int missing)
 {
     virNWFilterPtr nwfilter;
 
-    nwfilter = virNWFilterLookupByName(ruby_libvirt_connect_get(c),
-                                       StringValueCStr(name));
+    nwfilter = virNWFilterLookupByUUIDString(ruby_libvirt_connect_get(c),
+                                             StringValueCStr(uuid));
+    if (ruby_libvirt_error_missing(nwfilter == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
     ruby_libvirt_raise_error_if(nwfilter == NULL, e_RetrieveError,
-                                "virNWFilterLookupByName",
+                                "virNWFilterLookupByUUIDString",
                                 ruby_libvirt_connect_get(c));
 
     return ruby_libvirt_nwfilter_new(nwfilter, c);
@@ -1629,15 +3067,19 @@ static VALUE libvirt_connect_lookup_nwfilter_by_name(VALUE c, VALUE name)
  */
 static VALUE libvirt_connect_lookup_nwfilter_by_uuid(VALUE c, VALUE uuid)
 {
-    virNWFilterPtr nwfilter;
-
-    nwfilter = virNWFilterLookupByUUIDString(ruby_libvirt_connect_get(c),
-                                             StringValueCStr(uuid));
-    ruby_libvirt_raise_error_if(nwfilter == NULL, e_RetrieveError,
-                                "virNWFilterLookupByUUIDString",
-                                ruby_libvirt_connect_get(c));
+    return lookup_nwfilter_by_uuid(c, uuid, VIR_ERR_OK);
+}
 
-    return ruby_libvirt_nwfilter_new(nwfilter, c);
+/*
+ * call-seq:
+ *   conn.find_nwfilter_by_uuid(uuid) -> Libvirt::NWFilter or nil
+ *
+ * Like conn.lookup_nwfilter_by_uuid, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such network filter.
+ */
+static VALUE libvirt_connect_find_nwfilter_by_uuid(VALUE c, VALUE uuid)
+{
+    return lookup_nwfilter_by_uuid(c, uuid, VIR_ERR_NO_NWFILTER);
 }
 
 /*
@@ -1687,6 +3129,23 @@ static VALUE libvirt_connect_list_secrets(VALUE c)
     gen_conn_list_names(c, Secrets);
 }
 
+static VALUE lookup_secret_by_uuid(VALUE c, VALUE uuid, int missing)
+{
+    virSecretPtr secret;
+
+    secret = virSecretLookupByUUIDString(ruby_libvirt_connect_get(c),
+                                         StringValueCStr(uuid));
+    if (ruby_libvirt_error_missing(secret == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
+    ruby_libvirt_raise_error_if(secret == NULL, e_RetrieveError,
+                                "virSecretLookupByUUID",
+                                ruby_libvirt_connect_get(c));
+
+    return ruby_libvirt_secret_new(secret, c);
+}
+
 /*
  * call-seq:
  *   conn.lookup_secret_by_uuid(uuid) -> Libvirt::Secret
@@ -1695,13 +3154,36 @@ static VALUE libvirt_connect_list_secrets(VALUE c)
  * to retrieve a network object from uuid.
  */
 static VALUE libvirt_connect_lookup_secret_by_uuid(VALUE c, VALUE uuid)
+{
+    return lookup_secret_by_uuid(c, uuid, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   conn.find_secret_by_uuid(uuid) -> Libvirt::Secret or nil
+ *
+ * Like conn.lookup_secret_by_uuid, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such secret.
+ */
+static VALUE libvirt_connect_find_secret_by_uuid(VALUE c, VALUE uuid)
+{
+    return lookup_secret_by_uuid(c, uuid, VIR_ERR_NO_SECRET);
+}
+
+static VALUE lookup_secret_by_usage(VALUE c, VALUE usagetype, VALUE usageID,
+                                    int missing)
 {
     virSecretPtr secret;
 
-    secret = virSecretLookupByUUIDString(ruby_libvirt_connect_get(c),
-                                         StringValueCStr(uuid));
+    secret = virSecretLookupByUsage(ruby_libvirt_connect_get(c),
+                                    NUM2UINT(usagetype),
+                                    StringValueCStr(usageID));
+    if (ruby_libvirt_error_missing(secret == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
     ruby_libvirt_raise_error_if(secret == NULL, e_RetrieveError,
-                                "virSecretLookupByUUID",
+                                "virSecretLookupByUsage",
                                 ruby_libvirt_connect_get(c));
 
     return ruby_libvirt_secret_new(secret, c);
@@ -1717,16 +3199,20 @@ static VALUE libvirt_connect_lookup_secret_by_uuid(VALUE c, VALUE uuid)
 static VALUE libvirt_connect_lookup_secret_by_usage(VALUE c, VALUE usagetype,
                                                     VALUE usageID)
 {
-    virSecretPtr secret;
-
-    secret = virSecretLookupByUsage(ruby_libvirt_connect_get(c),
-                                    NUM2UINT(usagetype),
-                                    StringValueCStr(usageID));
-    ruby_libvirt_raise_error_if(secret == NULL, e_RetrieveError,
-                                "virSecretLookupByUsage",
-                                ruby_libvirt_connect_get(c));
+    return lookup_secret_by_usage(c, usagetype, usageID, VIR_ERR_OK);
+}
 
-    return ruby_libvirt_secret_new(secret, c);
+/*
+ * call-seq:
+ *   conn.find_secret_by_usage(usagetype, usageID) -> Libvirt::Secret or nil
+ *
+ * Like conn.lookup_secret_by_usage, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such secret.
+ */
+static VALUE libvirt_connect_find_secret_by_usage(VALUE c, VALUE usagetype,
+                                                    VALUE usageID)
+{
+    return lookup_secret_by_usage(c, usagetype, usageID, VIR_ERR_NO_SECRET);
 }
 
 /*
@@ -1806,6 +3292,23 @@ static VALUE libvirt_connect_num_of_defined_storage_pools(VALUE c)
     gen_conn_num_of(c, DefinedStoragePools);
 }
 
+static VALUE lookup_pool_by_name(VALUE c, VALUE name, int missing)
+{
+    virStoragePoolPtr pool;
+
+    pool = virStoragePoolLookupByName(ruby_libvirt_connect_get(c),
+                                      StringValueCStr(name));
+    if (ruby_libvirt_error_missing(pool == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
+    ruby_libvirt_raise_error_if(pool == NULL, e_RetrieveError,
+                                "virStoragePoolLookupByName",
+                                ruby_libvirt_connect_get(c));
+
+    return pool_new(pool, c);
+}
+
 /*
  * call-seq:
  *   conn.lookup_storage_pool_by_name(name) -> Libvirt::StoragePool
@@ -1814,13 +3317,34 @@ static VALUE libvirt_connect_num_of_defined_storage_pools(VALUE c)
  * to retrieve a storage pool object by name.
  */
 static VALUE libvirt_connect_lookup_pool_by_name(VALUE c, VALUE name)
+{
+    return lookup_pool_by_name(c, name, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   conn.find_storage_pool_by_name(name) -> Libvirt::StoragePool or nil
+ *
+ * Like conn.lookup_storage_pool_by_name, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such storage pool.
+ */
+static VALUE libvirt_connect_find_pool_by_name(VALUE c, VALUE name)
+{
+    return lookup_pool_by_name(c, name, VIR_ERR_NO_STORAGE_POOL);
+}
+
+static VALUE lookup_pool_by_uuid(VALUE c, VALUE uuid, int missing)
 {
     virStoragePoolPtr pool;
 
-    pool = virStoragePoolLookupByName(ruby_libvirt_connect_get(c),
-                                      StringValueCStr(name));
+    pool = virStoragePoolLookupByUUIDString(ruby_libvirt_connect_get(c),
+                                            StringValueCStr(uuid));
+    if (ruby_libvirt_error_missing(pool == NULL, missing,
+                                   ruby_libvirt_connect_get(c))) {
+        return Qnil;
+    }
     ruby_libvirt_raise_error_if(pool == NULL, e_RetrieveError,
-                                "virStoragePoolLookupByName",
+                                "virStoragePoolLookupByUUID",
                                 ruby_libvirt_connect_get(c));
 
     return pool_new(pool, c);
@@ -1835,15 +3359,19 @@ static VALUE libvirt_connect_lookup_pool_by_name(VALUE c, VALUE name)
  */
 static VALUE libvirt_connect_lookup_pool_by_uuid(VALUE c, VALUE uuid)
 {
-    virStoragePoolPtr pool;
-
-    pool = virStoragePoolLookupByUUIDString(ruby_libvirt_connect_get(c),
-                                            StringValueCStr(uuid));
-    ruby_libvirt_raise_error_if(pool == NULL, e_RetrieveError,
-                                "virStoragePoolLookupByUUID",
-                                ruby_libvirt_connect_get(c));
+    return lookup_pool_by_uuid(c, uuid, VIR_ERR_OK);
+}
 
-    return pool_new(pool, c);
+/*
+ * call-seq:
+ *   conn.find_storage_pool_by_uuid(uuid) -> Libvirt::StoragePool or nil
+ *
+ * Like conn.lookup_storage_pool_by_uuid, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such storage pool.
+ */
+static VALUE libvirt_connect_find_pool_by_uuid(VALUE c, VALUE uuid)
+{
+    return lookup_pool_by_uuid(c, uuid, VIR_ERR_NO_STORAGE_POOL);
 }
 
 /*
@@ -2030,11 +3558,12 @@ static VALUE libvirt_connect_interface_change_rollback(int argc, VALUE *argv,
 #endif
 
 #if HAVE_VIRNODEGETCPUSTATS
-static void cpu_stats_set(void *voidparams, int i, VALUE result)
+static void cpu_stats_set(void *voidparams, int i, VALUE result,
+                          int symbol_keys)
 {
     virNodeCPUStatsPtr params = (virNodeCPUStatsPtr)voidparams;
 
-    rb_hash_aset(result, rb_str_new2(params[i].field),
+    rb_hash_aset(result, ruby_libvirt_param_key(params[i].field, symbol_keys),
                  ULL2NUM(params[i].value));
 }
 
@@ -2067,15 +3596,21 @@ static const char *cpu_stats_get(VALUE d, unsigned int flags, void *voidparams,
 
 /*
  * call-seq:
- *   conn.node_cpu_stats(cpuNum=-1, flags=0) -> Hash
+ *   conn.node_cpu_stats(cpuNum=-1, flags=0, keys: :string) -> Hash
  *
  * Call virNodeGetCPUStats[http://www.libvirt.org/html/libvirt-libvirt-host.html#virNodeGetCPUStats]
  * to retrieve cpu statistics from the virtualization host.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_connect_node_cpu_stats(int argc, VALUE *argv, VALUE c)
 {
     VALUE intparam, flags;
     int tmp;
+    int symbol_keys;
+
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
     rb_scan_args(argc, argv, "02", &intparam, &flags);
 
@@ -2087,18 +3622,20 @@ static VALUE libvirt_connect_node_cpu_stats(int argc, VALUE *argv, VALUE c)
     }
 
     return ruby_libvirt_get_parameters(c, ruby_libvirt_value_to_uint(flags),
-                                       (void *)&tmp, sizeof(virNodeCPUStats),
+                                       symbol_keys, (void *)&tmp,
+                                       sizeof(virNodeCPUStats),
                                        cpu_stats_nparams, cpu_stats_get,
                                        cpu_stats_set);
 }
 #endif
 
 #if HAVE_VIRNODEGETMEMORYSTATS
-static void memory_stats_set(void *voidparams, int i, VALUE result)
+static void memory_stats_set(void *voidparams, int i, VALUE result,
+                             int symbol_keys)
 {
     virNodeMemoryStatsPtr params = (virNodeMemoryStatsPtr)voidparams;
 
-    rb_hash_aset(result, rb_str_new2(params[i].field),
+    rb_hash_aset(result, ruby_libvirt_param_key(params[i].field, symbol_keys),
                  ULL2NUM(params[i].value));
 }
 
@@ -2132,15 +3669,21 @@ static const char *memory_stats_get(VALUE d, unsigned int flags,
 
 /*
  * call-seq:
- *   conn.node_memory_stats(cellNum=-1, flags=0) -> Hash
+ *   conn.node_memory_stats(cellNum=-1, flags=0, keys: :string) -> Hash
  *
  * Call virNodeGetMemoryStats[http://www.libvirt.org/html/libvirt-libvirt-host.html#virNodeGetMemoryStats]
  * to retrieve memory statistics from the virtualization host.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_connect_node_memory_stats(int argc, VALUE *argv, VALUE c)
 {
     VALUE intparam, flags;
     int tmp;
+    int symbol_keys;
+
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
     rb_scan_args(argc, argv, "02", &intparam, &flags);
 
@@ -2152,7 +3695,8 @@ static VALUE libvirt_connect_node_memory_stats(int argc, VALUE *argv, VALUE c)
     }
 
     return ruby_libvirt_get_parameters(c, ruby_libvirt_value_to_uint(flags),
-                                       (void *)&tmp, sizeof(virNodeMemoryStats),
+                                       symbol_keys, (void *)&tmp,
+                                       sizeof(virNodeMemoryStats),
                                        memory_stats_nparams, memory_stats_get,
                                        memory_stats_set);
 }
@@ -2264,20 +3808,27 @@ static const char *node_memory_set(VALUE d, unsigned int flags,
 
 /*
  * call-seq:
- *   conn.node_memory_parameters(flags=0) -> Hash
+ *   conn.node_memory_parameters(flags=0, keys: :string) -> Hash
  *
  * Call virNodeGetMemoryParameters[http://www.libvirt.org/html/libvirt-libvirt-host.html#virNodeGetMemoryParameters]
  * to get information about memory on the host node.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_connect_node_memory_parameters(int argc, VALUE *argv,
                                                     VALUE c)
 {
     VALUE flags;
+    int symbol_keys;
+
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
     rb_scan_args(argc, argv, "01", &flags);
 
     return ruby_libvirt_get_typed_parameters(c,
                                              ruby_libvirt_value_to_uint(flags),
+                                             symbol_keys,
                                              NULL, node_memory_nparams,
                                              node_memory_get);
 }
@@ -2333,6 +3884,18 @@ static VALUE cpu_map_field_to_value(VALUE input)
     return Qnil;
 }
 
+struct cpu_map_arg {
+    unsigned char *map;
+    int ncpus;
+};
+
+static VALUE cpumap_new_wrap(VALUE input)
+{
+    struct cpu_map_arg *args = (struct cpu_map_arg *)input;
+
+    return ruby_libvirt_cpumap_new(args->map, args->ncpus);
+}
+
 /*
  * call-seq:
  *   conn.node_cpu_map -> Hash
@@ -2370,6 +3933,44 @@ static VALUE libvirt_connect_node_cpu_map(int argc, VALUE *argv, VALUE c)
 
     free(map);
 
+    /* the map covers every host CPU, so keep the cached count current */
+    ruby_libvirt_set_maxcpus(c, ret);
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   conn.node_cpu_bitmap(flags=0) -> Libvirt::CPUMap
+ *
+ * Call virNodeGetCPUMap[http://www.libvirt.org/html/libvirt-libvirt-host.html#virNodeGetCPUMap]
+ * to get the online host CPUs as a Libvirt::CPUMap rather than the hash
+ * conn.node_cpu_map returns.
+ */
+static VALUE libvirt_connect_node_cpu_bitmap(int argc, VALUE *argv, VALUE c)
+{
+    VALUE flags, result;
+    unsigned char *map;
+    int ret, exception = 0;
+    struct cpu_map_arg args;
+
+    rb_scan_args(argc, argv, "01", &flags);
+
+    ret = virNodeGetCPUMap(ruby_libvirt_connect_get(c), &map, NULL,
+                           ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError, "virNodeGetCPUMap",
+                                ruby_libvirt_connect_get(c));
+
+    args.map = map;
+    args.ncpus = ret;
+    result = rb_protect(cpumap_new_wrap, (VALUE)&args, &exception);
+    free(map);
+    if (exception) {
+        rb_jump_tag(exception);
+    }
+
+    ruby_libvirt_set_maxcpus(c, ret);
+
     return result;
 }
 #endif
@@ -2385,6 +3986,8 @@ static VALUE libvirt_connect_node_cpu_map(int argc, VALUE *argv, VALUE c)
  */
 static VALUE libvirt_connect_set_keepalive(VALUE c, VALUE interval, VALUE count)
 {
+    ruby_libvirt_event_impl_check("conn.set_keepalive");
+
     ruby_libvirt_generate_call_int(virConnectSetKeepAlive,
                                    ruby_libvirt_connect_get(c),
                                    ruby_libvirt_connect_get(c),
@@ -2412,6 +4015,8 @@ static VALUE libvirt_connect_keepalive_equal(VALUE c, VALUE in)
     interval = rb_ary_entry(in, 0);
     count = rb_ary_entry(in, 1);
 
+    ruby_libvirt_event_impl_check("conn.keepalive=");
+
     ruby_libvirt_generate_call_int(virConnectSetKeepAlive,
                                    ruby_libvirt_connect_get(c),
                                    ruby_libvirt_connect_get(c),
@@ -2420,6 +4025,9 @@ static VALUE libvirt_connect_keepalive_equal(VALUE c, VALUE in)
 #endif
 
 #if HAVE_VIRCONNECTLISTALLDOMAINS
+ruby_libvirt_declare_nogvl3(int, virConnectListAllDomains, virConnectPtr,
+                            virDomainPtr **, unsigned int)
+
 /*
  * call-seq:
  *   conn.list_all_domains(flags=0) -> Array
@@ -2429,10 +4037,11 @@ static VALUE libvirt_connect_keepalive_equal(VALUE c, VALUE in)
  */
 static VALUE libvirt_connect_list_all_domains(int argc, VALUE *argv, VALUE c)
 {
-    ruby_libvirt_generate_call_list_all(virDomainPtr, argc, argv,
-                                        virConnectListAllDomains,
-                                        ruby_libvirt_connect_get(c), c,
-                                        ruby_libvirt_domain_new, virDomainFree);
+    ruby_libvirt_generate_call_list_all_nogvl(virDomainPtr, argc, argv,
+                                              virConnectListAllDomains,
+                                              ruby_libvirt_connect_get(c), c,
+                                              ruby_libvirt_domain_new,
+                                              virDomainFree);
 }
 #endif
 
@@ -2827,6 +4436,319 @@ static VALUE libvirt_connect_node_free_pages(int argc, VALUE *argv, VALUE c)
 }
 #endif
 
+#if HAVE_VIRCONNECTGETALLDOMAINSTATS
+struct domain_stats_arg {
+    virDomainStatsRecordPtr *records;
+    int nrecords;
+    VALUE conn;
+};
+
+static VALUE domain_stats_to_array(VALUE in)
+{
+    struct domain_stats_arg *args = (struct domain_stats_arg *)in;
+    VALUE result, entry, hash;
+    int i, j;
+
+    result = rb_ary_new2(args->nrecords);
+
+    for (i = 0; i < args->nrecords; i++) {
+        hash = rb_hash_new();
+        for (j = 0; j < args->records[i]->nparams; j++) {
+            ruby_libvirt_typed_params_to_hash(args->records[i]->params, j,
+                                              hash, 0);
+        }
+
+        /* the record list owns its domain references, so take one of our
+         * own for the Libvirt::Domain object
+         */
+        virDomainRef(args->records[i]->dom);
+
+        entry = rb_ary_new2(2);
+        rb_ary_store(entry, 0, ruby_libvirt_domain_new(args->records[i]->dom,
+                                                       args->conn));
+        rb_ary_store(entry, 1, hash);
+        rb_ary_store(result, i, entry);
+    }
+
+    return result;
+}
+
+static VALUE domain_stats_records_to_array(virDomainStatsRecordPtr *records,
+                                           int nrecords, VALUE conn)
+{
+    struct domain_stats_arg args;
+    VALUE result;
+    int exception = 0;
+
+    args.records = records;
+    args.nrecords = nrecords;
+    args.conn = conn;
+    result = rb_protect(domain_stats_to_array, (VALUE)&args, &exception);
+    virDomainStatsRecordListFree(records);
+    if (exception) {
+        rb_jump_tag(exception);
+    }
+
+    return result;
+}
+
+ruby_libvirt_declare_nogvl4(int, virConnectGetAllDomainStats, virConnectPtr,
+                            unsigned int, virDomainStatsRecordPtr **,
+                            unsigned int)
+
+/*
+ * call-seq:
+ *   conn.all_domain_stats(stats=0, flags=0) -> Array
+ *
+ * Call virConnectGetAllDomainStats[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virConnectGetAllDomainStats]
+ * to retrieve statistics for all of the domains on this connection in a
+ * single call.  The stats argument is a bitwise-OR of the
+ * Libvirt::Connect::DOMAIN_STATS_* constants (0 means all supported
+ * statistics), and the flags argument is a bitwise-OR of the
+ * Libvirt::Connect::GET_ALL_DOMAINS_STATS_* constants.  The return value is an
+ * array of [Libvirt::Domain, Hash] pairs, where the keys and values of the
+ * hash are the typed parameters returned for that domain.
+ */
+static VALUE libvirt_connect_all_domain_stats(int argc, VALUE *argv, VALUE c)
+{
+    VALUE stats, flags, result;
+    virDomainStatsRecordPtr *records = NULL;
+
+    rb_scan_args(argc, argv, "02", &stats, &flags);
+
+    {
+        ruby_libvirt_call_nogvl_owned(args, state,
+                                      virConnectGetAllDomainStats, NULL, NULL,
+                                      ruby_libvirt_connect_get(c),
+                                      ruby_libvirt_value_to_uint(stats),
+                                      &records,
+                                      ruby_libvirt_value_to_uint(flags));
+        if (args.ret < 0) {
+            ruby_libvirt_raise_pending(state);
+        }
+        ruby_libvirt_raise_error_if(args.ret < 0, e_RetrieveError,
+                                    "virConnectGetAllDomainStats",
+                                    ruby_libvirt_connect_get(c));
+
+        result = domain_stats_records_to_array(records, args.ret, c);
+        ruby_libvirt_raise_pending(state);
+
+        return result;
+    }
+}
+#endif
+
+#if HAVE_VIRDOMAINLISTGETSTATS
+/* the handles here are the domains of a NULL-terminated list, so every one
+ * of them is held across the call
+ */
+typedef virDomainPtr *domain_list;
+
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void domain_list_hold(domain_list doms)
+{
+    for (; *doms != NULL; doms++) {
+        virDomainRef(*doms);
+    }
+}
+
+static void domain_list_drop(domain_list doms)
+{
+    for (; *doms != NULL; doms++) {
+        virDomainFree(*doms);
+    }
+}
+
+#define ruby_libvirt_nogvl_hold_domain_list(p) domain_list_hold(p)
+#define ruby_libvirt_nogvl_drop_domain_list(p) domain_list_drop(p)
+#endif
+
+ruby_libvirt_declare_nogvl4(int, virDomainListGetStats, domain_list,
+                            unsigned int, virDomainStatsRecordPtr **,
+                            unsigned int)
+
+struct domain_list_stats_arg {
+    VALUE c;
+    VALUE domains;
+    long ndoms;
+    virDomainPtr *doms;
+    unsigned int stats;
+    unsigned int flags;
+};
+
+static VALUE domain_list_stats_call(VALUE in)
+{
+    struct domain_list_stats_arg *arg = (struct domain_list_stats_arg *)in;
+    virDomainStatsRecordPtr *records = NULL;
+    VALUE result;
+    long i;
+
+    /* virDomainListGetStats wants a NULL-terminated array */
+    for (i = 0; i < arg->ndoms; i++) {
+        arg->doms[i] = ruby_libvirt_domain_get(rb_ary_entry(arg->domains, i));
+    }
+    arg->doms[i] = NULL;
+
+    {
+        ruby_libvirt_call_nogvl_owned(args, state, virDomainListGetStats,
+                                      NULL, NULL, arg->doms, arg->stats,
+                                      &records, arg->flags);
+        if (args.ret < 0) {
+            ruby_libvirt_raise_pending(state);
+        }
+        ruby_libvirt_raise_error_if(args.ret < 0, e_RetrieveError,
+                                    "virDomainListGetStats",
+                                    ruby_libvirt_connect_get(arg->c));
+
+        result = domain_stats_records_to_array(records, args.ret, arg->c);
+        ruby_libvirt_raise_pending(state);
+
+        return result;
+    }
+}
+
+static VALUE domain_list_stats_free(VALUE in)
+{
+    xfree(((struct domain_list_stats_arg *)in)->doms);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   conn.domain_list_stats(domains, stats=0, flags=0) -> Array
+ *
+ * Call virDomainListGetStats[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainListGetStats]
+ * to retrieve statistics for the array of Libvirt::Domain objects in domains
+ * in a single call.  The domains must all belong to this connection.  The
+ * stats and flags arguments, and the return value, are the same as for
+ * conn.all_domain_stats.  An empty domains gives an empty Array, without a
+ * call.
+ */
+static VALUE libvirt_connect_domain_list_stats(int argc, VALUE *argv, VALUE c)
+{
+    VALUE domains, stats, flags;
+    struct domain_list_stats_arg arg;
+
+    rb_scan_args(argc, argv, "12", &domains, &stats, &flags);
+
+    Check_Type(domains, T_ARRAY);
+
+    arg.c = c;
+    arg.domains = domains;
+    arg.stats = ruby_libvirt_value_to_uint(stats);
+    arg.flags = ruby_libvirt_value_to_uint(flags);
+    arg.ndoms = RARRAY_LEN(domains);
+    if (arg.ndoms == 0) {
+        return rb_ary_new();
+    }
+    arg.doms = ALLOC_N(virDomainPtr, arg.ndoms + 1);
+
+    return rb_ensure(domain_list_stats_call, (VALUE)&arg,
+                     domain_list_stats_free, (VALUE)&arg);
+}
+#endif
+
+#if HAVE_VIRCONNECTGETALLDOMAINSTATS && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+/*
+ * call-seq:
+ *   conn.sampler(interval: 1.0, capacity: 3600, stats: 0, flags: 0) -> Libvirt::Sampler
+ *
+ * Start a Libvirt::Sampler: a native thread that every interval seconds
+ * calls virConnectGetAllDomainStats[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virConnectGetAllDomainStats]
+ * (with stats and flags as for conn.all_domain_stats),
+ * virNodeGetCPUStats[http://www.libvirt.org/html/libvirt-libvirt-host.html#virNodeGetCPUStats]
+ * and virNodeGetMemoryStats[http://www.libvirt.org/html/libvirt-libvirt-host.html#virNodeGetMemoryStats],
+ * and keeps the last capacity rows of per-domain and host counters and
+ * rates for sampler.drain.  The sampler keeps running, independently of
+ * Ruby, until sampler.stop is called or it is garbage collected.  Any other
+ * option raises an ArgumentError.
+ */
+static VALUE libvirt_connect_sampler(int argc, VALUE *argv, VALUE c)
+{
+    VALUE opts;
+
+    rb_scan_args(argc, argv, "01", &opts);
+
+    return ruby_libvirt_sampler_new(c, opts);
+}
+#endif
+
+#if HAVE_VIRDOMAINOPENCONSOLE && HAVE_TYPE_VIRSTREAMPTR && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+/*
+ * call-seq:
+ *   conn.console_mux(buffer_size: 65536) -> Libvirt::ConsoleMux
+ *
+ * Create a Libvirt::ConsoleMux to collect the consoles of any number of
+ * domains on this connection.  Consoles that are not given a file
+ * descriptor keep the last buffer_size bytes of their output.  The consoles
+ * are read from the registered event loop implementation, so one (for
+ * instance Libvirt::event_run_default_impl_in_thread) must be set up
+ * before consoles are added.
+ */
+static VALUE libvirt_connect_console_mux(int argc, VALUE *argv, VALUE c)
+{
+    VALUE opts;
+
+    rb_scan_args(argc, argv, "01", &opts);
+
+    return ruby_libvirt_console_mux_new(c, opts);
+}
+#endif
+
+#if RUBY_LIBVIRT_XML_CACHE
+/*
+ * call-seq:
+ *   conn.enable_xml_cache(max_entries: 4096) -> nil
+ *
+ * Start caching the results of dom.xml_desc and net.xml_desc on this
+ * connection, by object and flags.  Cached XML is returned as the same
+ * frozen String each time, until a domain (lifecycle, device added or
+ * removed, metadata, balloon, tray, tunable or block job) or network event
+ * for the object says it may have changed, or a method that changes the
+ * configuration without an event (such as dom.attach_device, dom.vcpus= or
+ * net.update) succeeds on this connection.  pool.xml_desc and vol.xml_desc
+ * are never cached, since the allocation they report changes without any
+ * event.
+ * Since the events are what keep the cache honest, an event loop
+ * implementation must be registered first.  When max_entries results are
+ * cached the lot is thrown away.  Calling it again starts a new, empty
+ * cache.
+ */
+static VALUE libvirt_connect_enable_xml_cache(int argc, VALUE *argv, VALUE c)
+{
+    VALUE opts;
+
+    rb_scan_args(argc, argv, "01", &opts);
+
+    return ruby_libvirt_xml_cache_enable(c, opts);
+}
+
+/*
+ * call-seq:
+ *   conn.disable_xml_cache -> nil
+ *
+ * Stop caching XML on this connection and throw away what is cached.
+ */
+static VALUE libvirt_connect_disable_xml_cache(VALUE c)
+{
+    return ruby_libvirt_xml_cache_disable(c);
+}
+
+/*
+ * call-seq:
+ *   conn.xml_cache_stats -> Hash
+ *
+ * Return a Hash of "hits", "misses", "entries" and "invalidations" (events
+ * received) for the XML cache of this connection, or nil if there isn't
+ * one.
+ */
+static VALUE libvirt_connect_xml_cache_stats(VALUE c)
+{
+    return ruby_libvirt_xml_cache_stats(c);
+}
+#endif
+
 /*
  * Class Libvirt::Connect
  */
@@ -2834,18 +4756,24 @@ void ruby_libvirt_connect_init(void)
 {
     c_connect = rb_define_class_under(m_libvirt, "Connect", rb_cObject);
 
+#if HAVE_VIRCONNECTDOMAINEVENTREGISTERANY || HAVE_VIRCONNECTDOMAINEVENTREGISTER
+    /* no leading @, so the hash is invisible from Ruby */
+    id_domain_event_callbacks = rb_intern("domain_event_callbacks");
+#endif
+
     /*
      * Class Libvirt::Connect::Nodeinfo
      */
     c_node_info = rb_define_class_under(c_connect, "Nodeinfo", rb_cObject);
-    rb_define_attr(c_node_info, "model", 1, 0);
-    rb_define_attr(c_node_info, "memory", 1, 0);
-    rb_define_attr(c_node_info, "cpus", 1, 0);
-    rb_define_attr(c_node_info, "mhz", 1, 0);
-    rb_define_attr(c_node_info, "nodes", 1, 0);
-    rb_define_attr(c_node_info, "sockets", 1, 0);
-    rb_define_attr(c_node_info, "cores", 1, 0);
-    rb_define_attr(c_node_info, "threads", 1, 0);
+    rb_define_alloc_func(c_node_info, node_info_alloc);
+    rb_define_method(c_node_info, "model", node_info_model, 0);
+    rb_define_method(c_node_info, "memory", node_info_memory, 0);
+    rb_define_method(c_node_info, "cpus", node_info_cpus, 0);
+    rb_define_method(c_node_info, "mhz", node_info_mhz, 0);
+    rb_define_method(c_node_info, "nodes", node_info_nodes, 0);
+    rb_define_method(c_node_info, "sockets", node_info_sockets, 0);
+    rb_define_method(c_node_info, "cores", node_info_cores, 0);
+    rb_define_method(c_node_info, "threads", node_info_threads, 0);
 
     /*
      * Class Libvirt::Connect::NodeSecurityModel
@@ -2868,6 +4796,8 @@ void ruby_libvirt_connect_init(void)
     rb_define_method(c_connect, "max_vcpus", libvirt_connect_max_vcpus, -1);
     rb_define_method(c_connect, "node_info", libvirt_connect_node_info, 0);
     rb_define_alias(c_connect, "node_get_info", "node_info");
+    rb_define_method(c_connect, "node_max_cpus",
+                     libvirt_connect_node_max_cpus, -1);
     rb_define_method(c_connect, "node_free_memory",
                      libvirt_connect_node_free_memory, 0);
     rb_define_method(c_connect, "node_cells_free_memory",
@@ -3111,6 +5041,43 @@ void ruby_libvirt_connect_init(void)
                      libvirt_connect_domain_event_deregister_any, 1);
 #endif
 
+#if HAVE_VIRCONNECTDOMAINEVENTREGISTERANY && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_define_method(c_connect, "domain_event_queue",
+                     libvirt_connect_domain_event_queue, -1);
+
+    /*
+     * Class Libvirt::Connect::DomainEventQueue
+     */
+    c_domain_event_queue = rb_define_class_under(c_connect, "DomainEventQueue",
+                                                 rb_cObject);
+    rb_undef_alloc_func(c_domain_event_queue);
+    rb_define_attr(c_domain_event_queue, "connection", 1, 0);
+    rb_define_method(c_domain_event_queue, "pop",
+                     libvirt_domain_event_queue_pop, -1);
+    rb_define_method(c_domain_event_queue, "size",
+                     libvirt_domain_event_queue_size, 0);
+    rb_define_method(c_domain_event_queue, "coalesced",
+                     libvirt_domain_event_queue_coalesced, 0);
+    rb_define_method(c_domain_event_queue, "dropped",
+                     libvirt_domain_event_queue_dropped, 0);
+    rb_define_method(c_domain_event_queue, "close",
+                     libvirt_domain_event_queue_close, 0);
+    rb_define_method(c_domain_event_queue, "closed?",
+                     libvirt_domain_event_queue_closed_p, 0);
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB
+    rb_define_const(c_connect, "DOMAIN_EVENT_ID_BLOCK_JOB",
+                    INT2NUM(VIR_DOMAIN_EVENT_ID_BLOCK_JOB));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2
+    rb_define_const(c_connect, "DOMAIN_EVENT_ID_BLOCK_JOB_2",
+                    INT2NUM(VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_JOB_COMPLETED
+    rb_define_const(c_connect, "DOMAIN_EVENT_ID_JOB_COMPLETED",
+                    INT2NUM(VIR_DOMAIN_EVENT_ID_JOB_COMPLETED));
+#endif
+
     /* Domain creation/lookup */
     rb_define_method(c_connect, "num_of_domains",
                      libvirt_connect_num_of_domains, 0);
@@ -3128,10 +5095,22 @@ void ruby_libvirt_connect_init(void)
 #endif
     rb_define_method(c_connect, "lookup_domain_by_name",
                      libvirt_connect_lookup_domain_by_name, 1);
+    rb_define_method(c_connect, "find_domain_by_name",
+                     libvirt_connect_find_domain_by_name, 1);
     rb_define_method(c_connect, "lookup_domain_by_id",
                      libvirt_connect_lookup_domain_by_id, 1);
+    rb_define_method(c_connect, "find_domain_by_id",
+                     libvirt_connect_find_domain_by_id, 1);
     rb_define_method(c_connect, "lookup_domain_by_uuid",
                      libvirt_connect_lookup_domain_by_uuid, 1);
+    rb_define_method(c_connect, "find_domain_by_uuid",
+                     libvirt_connect_find_domain_by_uuid, 1);
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_define_method(c_connect, "lookup_domains_by_name",
+                     libvirt_connect_lookup_domains_by_name, -1);
+    rb_define_method(c_connect, "lookup_domains_by_uuid",
+                     libvirt_connect_lookup_domains_by_uuid, -1);
+#endif
 #if HAVE_CONST_VIR_DOMAIN_DEFINE_VALIDATE
     rb_define_const(c_connect, "DOMAIN_DEFINE_VALIDATE",
                     INT2NUM(VIR_DOMAIN_DEFINE_VALIDATE));
@@ -3160,8 +5139,12 @@ void ruby_libvirt_connect_init(void)
                      libvirt_connect_list_defined_interfaces, 0);
     rb_define_method(c_connect, "lookup_interface_by_name",
                      libvirt_connect_lookup_interface_by_name, 1);
+    rb_define_method(c_connect, "find_interface_by_name",
+                     libvirt_connect_find_interface_by_name, 1);
     rb_define_method(c_connect, "lookup_interface_by_mac",
                      libvirt_connect_lookup_interface_by_mac, 1);
+    rb_define_method(c_connect, "find_interface_by_mac",
+                     libvirt_connect_find_interface_by_mac, 1);
     rb_define_method(c_connect, "define_interface_xml",
                      libvirt_connect_define_interface_xml, -1);
 #endif
@@ -3177,8 +5160,12 @@ void ruby_libvirt_connect_init(void)
                      libvirt_connect_list_defined_networks, 0);
     rb_define_method(c_connect, "lookup_network_by_name",
                      libvirt_connect_lookup_network_by_name, 1);
+    rb_define_method(c_connect, "find_network_by_name",
+                     libvirt_connect_find_network_by_name, 1);
     rb_define_method(c_connect, "lookup_network_by_uuid",
                      libvirt_connect_lookup_network_by_uuid, 1);
+    rb_define_method(c_connect, "find_network_by_uuid",
+                     libvirt_connect_find_network_by_uuid, 1);
     rb_define_method(c_connect, "create_network_xml",
                      libvirt_connect_create_network_xml, 1);
     rb_define_method(c_connect, "define_network_xml",
@@ -3192,6 +5179,8 @@ void ruby_libvirt_connect_init(void)
                      libvirt_connect_list_nodedevices, -1);
     rb_define_method(c_connect, "lookup_nodedevice_by_name",
                      libvirt_connect_lookup_nodedevice_by_name, 1);
+    rb_define_method(c_connect, "find_nodedevice_by_name",
+                     libvirt_connect_find_nodedevice_by_name, 1);
 #if HAVE_VIRNODEDEVICECREATEXML
     rb_define_method(c_connect, "create_nodedevice_xml",
                      libvirt_connect_create_nodedevice_xml, -1);
@@ -3206,8 +5195,12 @@ void ruby_libvirt_connect_init(void)
                      libvirt_connect_list_nwfilters, 0);
     rb_define_method(c_connect, "lookup_nwfilter_by_name",
                      libvirt_connect_lookup_nwfilter_by_name, 1);
+    rb_define_method(c_connect, "find_nwfilter_by_name",
+                     libvirt_connect_find_nwfilter_by_name, 1);
     rb_define_method(c_connect, "lookup_nwfilter_by_uuid",
                      libvirt_connect_lookup_nwfilter_by_uuid, 1);
+    rb_define_method(c_connect, "find_nwfilter_by_uuid",
+                     libvirt_connect_find_nwfilter_by_uuid, 1);
     rb_define_method(c_connect, "define_nwfilter_xml",
                      libvirt_connect_define_nwfilter_xml, 1);
 #endif
@@ -3220,8 +5213,12 @@ void ruby_libvirt_connect_init(void)
                      libvirt_connect_list_secrets, 0);
     rb_define_method(c_connect, "lookup_secret_by_uuid",
                      libvirt_connect_lookup_secret_by_uuid, 1);
+    rb_define_method(c_connect, "find_secret_by_uuid",
+                     libvirt_connect_find_secret_by_uuid, 1);
     rb_define_method(c_connect, "lookup_secret_by_usage",
                      libvirt_connect_lookup_secret_by_usage, 2);
+    rb_define_method(c_connect, "find_secret_by_usage",
+                     libvirt_connect_find_secret_by_usage, 2);
     rb_define_method(c_connect, "define_secret_xml",
                      libvirt_connect_define_secret_xml, -1);
 #endif
@@ -3238,8 +5235,12 @@ void ruby_libvirt_connect_init(void)
                      libvirt_connect_list_defined_storage_pools, 0);
     rb_define_method(c_connect, "lookup_storage_pool_by_name",
                      libvirt_connect_lookup_pool_by_name, 1);
+    rb_define_method(c_connect, "find_storage_pool_by_name",
+                     libvirt_connect_find_pool_by_name, 1);
     rb_define_method(c_connect, "lookup_storage_pool_by_uuid",
                      libvirt_connect_lookup_pool_by_uuid, 1);
+    rb_define_method(c_connect, "find_storage_pool_by_uuid",
+                     libvirt_connect_find_pool_by_uuid, 1);
     rb_define_method(c_connect, "create_storage_pool_xml",
                      libvirt_connect_create_pool_xml, -1);
     rb_define_method(c_connect, "define_storage_pool_xml",
@@ -3311,6 +5312,8 @@ void ruby_libvirt_connect_init(void)
     rb_define_method(c_connect, "node_cpu_map",
                      libvirt_connect_node_cpu_map, -1);
     rb_define_alias(c_connect, "node_get_cpu_map", "node_cpu_map");
+    rb_define_method(c_connect, "node_cpu_bitmap",
+                     libvirt_connect_node_cpu_bitmap, -1);
 #endif
 
 #if HAVE_VIRCONNECTSETKEEPALIVE
@@ -3498,4 +5501,84 @@ void ruby_libvirt_connect_init(void)
     rb_define_method(c_connect, "node_free_pages",
                      libvirt_connect_node_free_pages, -1);
 #endif
+#if HAVE_VIRCONNECTGETALLDOMAINSTATS
+    rb_define_const(c_connect, "DOMAIN_STATS_STATE",
+                    INT2NUM(VIR_DOMAIN_STATS_STATE));
+    rb_define_const(c_connect, "DOMAIN_STATS_CPU_TOTAL",
+                    INT2NUM(VIR_DOMAIN_STATS_CPU_TOTAL));
+    rb_define_const(c_connect, "DOMAIN_STATS_BALLOON",
+                    INT2NUM(VIR_DOMAIN_STATS_BALLOON));
+    rb_define_const(c_connect, "DOMAIN_STATS_VCPU",
+                    INT2NUM(VIR_DOMAIN_STATS_VCPU));
+    rb_define_const(c_connect, "DOMAIN_STATS_INTERFACE",
+                    INT2NUM(VIR_DOMAIN_STATS_INTERFACE));
+    rb_define_const(c_connect, "DOMAIN_STATS_BLOCK",
+                    INT2NUM(VIR_DOMAIN_STATS_BLOCK));
+#if HAVE_CONST_VIR_DOMAIN_STATS_PERF
+    rb_define_const(c_connect, "DOMAIN_STATS_PERF",
+                    INT2NUM(VIR_DOMAIN_STATS_PERF));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_STATS_IOTHREAD
+    rb_define_const(c_connect, "DOMAIN_STATS_IOTHREAD",
+                    INT2NUM(VIR_DOMAIN_STATS_IOTHREAD));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_STATS_MEMORY
+    rb_define_const(c_connect, "DOMAIN_STATS_MEMORY",
+                    INT2NUM(VIR_DOMAIN_STATS_MEMORY));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_STATS_DIRTYRATE
+    rb_define_const(c_connect, "DOMAIN_STATS_DIRTYRATE",
+                    INT2NUM(VIR_DOMAIN_STATS_DIRTYRATE));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_STATS_VM
+    rb_define_const(c_connect, "DOMAIN_STATS_VM",
+                    INT2NUM(VIR_DOMAIN_STATS_VM));
+#endif
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_ACTIVE",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE));
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_INACTIVE",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_INACTIVE));
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_PERSISTENT",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_PERSISTENT));
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_TRANSIENT",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_TRANSIENT));
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_RUNNING",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_RUNNING));
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_PAUSED",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_PAUSED));
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_SHUTOFF",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_SHUTOFF));
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_OTHER",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_OTHER));
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_ENFORCE_STATS",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_ENFORCE_STATS));
+#if HAVE_CONST_VIR_CONNECT_GET_ALL_DOMAINS_STATS_BACKING
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_BACKING",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_BACKING));
+#endif
+#if HAVE_CONST_VIR_CONNECT_GET_ALL_DOMAINS_STATS_NOWAIT
+    rb_define_const(c_connect, "GET_ALL_DOMAINS_STATS_NOWAIT",
+                    INT2NUM(VIR_CONNECT_GET_ALL_DOMAINS_STATS_NOWAIT));
+#endif
+    rb_define_method(c_connect, "all_domain_stats",
+                     libvirt_connect_all_domain_stats, -1);
+#endif
+#if HAVE_VIRDOMAINLISTGETSTATS
+    rb_define_method(c_connect, "domain_list_stats",
+                     libvirt_connect_domain_list_stats, -1);
+#endif
+#if HAVE_VIRCONNECTGETALLDOMAINSTATS && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_define_method(c_connect, "sampler", libvirt_connect_sampler, -1);
+#endif
+#if HAVE_VIRDOMAINOPENCONSOLE && HAVE_TYPE_VIRSTREAMPTR && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_define_method(c_connect, "console_mux", libvirt_connect_console_mux, -1);
+#endif
+#if RUBY_LIBVIRT_XML_CACHE
+    rb_define_method(c_connect, "enable_xml_cache",
+                     libvirt_connect_enable_xml_cache, -1);
+    rb_define_method(c_connect, "disable_xml_cache",
+                     libvirt_connect_disable_xml_cache, 0);
+    rb_define_method(c_connect, "xml_cache_stats",
+                     libvirt_connect_xml_cache_stats, 0);
+#endif
 }
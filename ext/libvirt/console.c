@@ -0,0 +1,839 @@
+/*
+ * console.c: Libvirt::ConsoleMux methods
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <ruby.h>
+#include <ruby/io.h>
+#include <libvirt/libvirt.h>
+#include <libvirt/virterror.h>
+#include "common.h"
+#include "connect.h"
+#include "domain.h"
+#include "extconf.h"
+#include "console.h"
+
+#if HAVE_VIRDOMAINOPENCONSOLE && HAVE_TYPE_VIRSTREAMPTR && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static VALUE c_console_mux;
+
+/* A console mux owns the (non-blocking) console streams of any number of
+ * domains.  Each stream has a native event callback, run by whatever event
+ * loop implementation is registered, that reads everything available
+ * straight into that console's ring buffer, or writes it to the console's
+ * file descriptor, without calling into Ruby.  Ruby only sees the data when
+ * it asks: mux.read for one console, or mux.dispatch, which sleeps without
+ * the GVL until some console has whole lines and then yields them a batch
+ * per console.
+ *
+ * A console is referenced by the mux and by its event callback (dropped by
+ * the callback's free function), and each console references the mux core,
+ * so whichever of the Ruby object and the event loop lets go last frees
+ * things.
+ */
+struct console_mux;
+
+struct console {
+    struct console_mux *mux;
+    int refs;
+    virStreamPtr st;
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    int fd;
+    int open;
+    char *buf;
+    size_t start;
+    size_t len;
+    unsigned long long bytes;
+    unsigned long long dropped;
+};
+
+struct console_mux {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;
+    unsigned long generation;
+    size_t buffer_size;
+    struct console **consoles;
+    long nconsoles;
+    long capacity;
+};
+
+static void console_mux_unref(struct console_mux *mux)
+{
+    int refs;
+
+    pthread_mutex_lock(&mux->lock);
+    refs = --mux->refs;
+    pthread_mutex_unlock(&mux->lock);
+
+    if (refs > 0) {
+        return;
+    }
+
+    free(mux->consoles);
+    pthread_cond_destroy(&mux->cond);
+    pthread_mutex_destroy(&mux->lock);
+    free(mux);
+}
+
+/* free what a console holds besides its stream and the mux */
+static void console_discard(struct console *con)
+{
+    if (con->fd >= 0) {
+        close(con->fd);
+    }
+    free(con->buf);
+    free(con);
+}
+
+static void console_unref(struct console *con)
+{
+    struct console_mux *mux = con->mux;
+    int refs;
+
+    pthread_mutex_lock(&mux->lock);
+    refs = --con->refs;
+    pthread_mutex_unlock(&mux->lock);
+
+    if (refs > 0) {
+        return;
+    }
+
+    virStreamFree(con->st);
+    console_discard(con);
+    console_mux_unref(mux);
+}
+
+static void console_release(void *opaque)
+{
+    console_unref((struct console *)opaque);
+}
+
+/* append LEN bytes to the ring, dropping the oldest if it is full; called
+ * with the lock held
+ */
+static void console_append(struct console *con, const char *data, size_t len)
+{
+    size_t cap = con->mux->buffer_size;
+    size_t pos, n;
+
+    if (len > cap) {
+        con->dropped += len - cap;
+        data += len - cap;
+        len = cap;
+    }
+    if (con->len + len > cap) {
+        n = con->len + len - cap;
+        con->dropped += n;
+        con->start = (con->start + n) % cap;
+        con->len -= n;
+    }
+
+    pos = (con->start + con->len) % cap;
+    n = cap - pos < len ? cap - pos : len;
+    memcpy(con->buf + pos, data, n);
+    memcpy(con->buf, data + n, len - n);
+    con->len += len;
+}
+
+/* write LEN bytes to the (non-blocking) file descriptor of CON; whatever it
+ * cannot take right now is counted as dropped rather than stalling the event
+ * loop
+ */
+static void console_write_fd(struct console *con, const char *data,
+                             size_t len)
+{
+    ssize_t r;
+
+    while (len > 0) {
+        r = write(con->fd, data, len);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            pthread_mutex_lock(&con->mux->lock);
+            con->dropped += len;
+            pthread_mutex_unlock(&con->mux->lock);
+            return;
+        }
+        data += r;
+        len -= r;
+    }
+}
+
+static void console_event_callback(virStreamPtr st, int events, void *opaque)
+{
+    struct console *con = (struct console *)opaque;
+    struct console_mux *mux = con->mux;
+    char data[16384];
+    int r, lines, hangup = 0;
+
+    if (events & VIR_STREAM_EVENT_READABLE) {
+        for (;;) {
+            r = virStreamRecv(st, data, sizeof(data));
+            if (r == -2) {
+                break;
+            }
+            if (r <= 0) {
+                if (r < 0) {
+                    virResetLastError();
+                }
+                hangup = 1;
+                break;
+            }
+
+            if (con->fd >= 0) {
+                console_write_fd(con, data, r);
+            }
+            lines = memchr(data, '\n', r) != NULL;
+
+            pthread_mutex_lock(&mux->lock);
+            con->bytes += r;
+            if (con->fd < 0) {
+                console_append(con, data, r);
+            }
+            if (lines) {
+                mux->generation++;
+                pthread_cond_broadcast(&mux->cond);
+            }
+            pthread_mutex_unlock(&mux->lock);
+        }
+    }
+    if (events & (VIR_STREAM_EVENT_ERROR | VIR_STREAM_EVENT_HANGUP)) {
+        hangup = 1;
+    }
+
+    if (hangup) {
+        pthread_mutex_lock(&mux->lock);
+        con->open = 0;
+        mux->generation++;
+        pthread_cond_broadcast(&mux->cond);
+        pthread_mutex_unlock(&mux->lock);
+        /* the free function drops the callback's reference */
+        if (virStreamEventRemoveCallback(st) < 0) {
+            virResetLastError();
+        }
+    }
+}
+
+/* take the console out of the mux and stop reading it */
+static void console_detach(struct console *con)
+{
+    int open;
+
+    pthread_mutex_lock(&con->mux->lock);
+    open = con->open;
+    con->open = 0;
+    pthread_mutex_unlock(&con->mux->lock);
+
+    if (open) {
+        /* the callback may have hung up and removed itself meanwhile */
+        if (virStreamEventRemoveCallback(con->st) < 0) {
+            virResetLastError();
+        }
+        if (virStreamAbort(con->st) < 0) {
+            virResetLastError();
+        }
+    }
+    console_unref(con);
+}
+
+static void console_mux_free(void *p)
+{
+    struct console_mux *mux = (struct console_mux *)p;
+    long i;
+
+    for (i = 0; i < mux->nconsoles; i++) {
+        console_detach(mux->consoles[i]);
+    }
+    mux->nconsoles = 0;
+    console_mux_unref(mux);
+}
+
+/* not RUBY_TYPED_FREE_IMMEDIATELY: detaching the consoles that were never
+ * removed aborts their streams, which may wait on libvirtd, so leave that to
+ * a finalizer rather than to the GC itself
+ */
+static const rb_data_type_t console_mux_data_type = {
+    "Libvirt::ConsoleMux",
+    { NULL, console_mux_free, NULL, },
+    NULL, NULL, 0
+};
+
+static struct console_mux *console_mux_get(VALUE m)
+{
+    struct console_mux *mux;
+
+    TypedData_Get_Struct(m, struct console_mux, &console_mux_data_type, mux);
+
+    return mux;
+}
+
+static VALUE console_mux_option(VALUE opts, const char *name, VALUE def)
+{
+    VALUE val;
+
+    if (NIL_P(opts)) {
+        return def;
+    }
+    val = rb_hash_aref(opts, ID2SYM(rb_intern(name)));
+
+    return NIL_P(val) ? def : val;
+}
+
+/* look a console up by Libvirt::Domain or UUID string */
+static long console_mux_index(struct console_mux *mux, VALUE key)
+{
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    const char *want;
+    long i;
+
+    if (rb_obj_is_kind_of(key, rb_const_get(m_libvirt, rb_intern("Domain")))) {
+        if (virDomainGetUUIDString(ruby_libvirt_domain_get(key), uuid) < 0) {
+            ruby_libvirt_raise_error_if(1, e_RetrieveError,
+                                        "virDomainGetUUIDString",
+                                        ruby_libvirt_connect_get(key));
+        }
+        want = uuid;
+    }
+    else {
+        want = StringValueCStr(key);
+    }
+
+    for (i = 0; i < mux->nconsoles; i++) {
+        if (strcmp(mux->consoles[i]->uuid, want) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static struct console *console_mux_find(struct console_mux *mux, VALUE key)
+{
+    long i = console_mux_index(mux, key);
+
+    if (i < 0) {
+        rb_raise(rb_eArgError, "no console for that domain in the mux");
+    }
+
+    return mux->consoles[i];
+}
+
+VALUE ruby_libvirt_console_mux_new(VALUE c, VALUE opts)
+{
+    struct console_mux *mux;
+    long buffer_size;
+    VALUE result;
+
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+    }
+    buffer_size = NUM2LONG(console_mux_option(opts, "buffer_size",
+                                              INT2NUM(65536)));
+    if (buffer_size < 1) {
+        rb_raise(rb_eArgError, "buffer_size must be at least 1");
+    }
+
+    mux = calloc(1, sizeof(*mux));
+    if (mux == NULL) {
+        rb_memerror();
+    }
+    pthread_mutex_init(&mux->lock, NULL);
+    pthread_cond_init(&mux->cond, NULL);
+    mux->refs = 1;
+    mux->buffer_size = buffer_size;
+
+    result = TypedData_Wrap_Struct(c_console_mux, &console_mux_data_type, mux);
+    rb_iv_set(result, "@connection", c);
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   mux.add(domain, device=nil, fd: nil, flags: 0) -> String
+ *
+ * Open the console device (the first console if nil) of domain with
+ * virDomainOpenConsole[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainOpenConsole]
+ * on a non-blocking stream, and start collecting its output.  If fd (an IO
+ * or Integer file descriptor) is given, it is duplicated, the duplicate is
+ * put in non-blocking mode, and output is written to that as it arrives
+ * rather than buffered; output that it cannot take at once is counted as
+ * dropped.  The duplicate is closed once the console is gone, so fd itself
+ * may be closed at any time.  Returns the UUID of the domain, which is how
+ * the console is named from then on (the Libvirt::Domain works too).
+ */
+static VALUE libvirt_console_mux_add(int argc, VALUE *argv, VALUE m)
+{
+    struct console_mux *mux = console_mux_get(m);
+    VALUE d, device, opts, fd, flags;
+    virDomainPtr dom;
+    virConnectPtr conn;
+    struct console *con, **consoles;
+    const char *devname;
+    unsigned int oflags;
+    long capacity;
+    int ret, ofd = -1;
+
+    rb_scan_args(argc, argv, "12", &d, &device, &opts);
+    if (TYPE(device) == T_HASH && NIL_P(opts)) {
+        opts = device;
+        device = Qnil;
+    }
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+    }
+    fd = console_mux_option(opts, "fd", Qnil);
+    flags = console_mux_option(opts, "flags", INT2NUM(0));
+
+    /* convert everything that may raise before allocating anything */
+    dom = ruby_libvirt_domain_get(d);
+    conn = ruby_libvirt_connect_get(d);
+    devname = ruby_libvirt_get_cstring_or_null(device);
+    oflags = NUM2UINT(flags);
+    if (FIXNUM_P(fd)) {
+        ofd = NUM2INT(fd);
+    }
+    else if (!NIL_P(fd)) {
+        if (!rb_respond_to(fd, rb_intern("fileno"))) {
+            rb_raise(rb_eTypeError,
+                     "wrong argument type (expected IO or Integer)");
+        }
+        ofd = NUM2INT(rb_funcall(fd, rb_intern("fileno"), 0));
+    }
+    if (console_mux_index(mux, d) >= 0) {
+        rb_raise(rb_eArgError, "the domain's console is already in the mux");
+    }
+
+    if (mux->nconsoles == mux->capacity) {
+        capacity = mux->capacity ? mux->capacity * 2 : 16;
+        consoles = realloc(mux->consoles, capacity * sizeof(*consoles));
+        if (consoles == NULL) {
+            rb_memerror();
+        }
+        mux->consoles = consoles;
+        mux->capacity = capacity;
+    }
+
+    con = calloc(1, sizeof(*con));
+    if (con == NULL) {
+        rb_memerror();
+    }
+    con->fd = -1;
+    if (ofd >= 0) {
+        /* the callback writes to its own copy, which lives as long as the
+         * console does, whatever happens to the caller's IO
+         */
+        con->fd = dup(ofd);
+        if (con->fd < 0) {
+            free(con);
+            rb_sys_fail("dup");
+        }
+        fcntl(con->fd, F_SETFL, fcntl(con->fd, F_GETFL) | O_NONBLOCK);
+    }
+    else {
+        con->buf = malloc(mux->buffer_size);
+        if (con->buf == NULL) {
+            free(con);
+            rb_memerror();
+        }
+    }
+    if (virDomainGetUUIDString(dom, con->uuid) < 0) {
+        console_discard(con);
+        ruby_libvirt_raise_error_if(1, e_RetrieveError,
+                                    "virDomainGetUUIDString", conn);
+    }
+
+    con->st = virStreamNew(conn, VIR_STREAM_NONBLOCK);
+    if (con->st == NULL) {
+        console_discard(con);
+        ruby_libvirt_raise_error_if(1, e_RetrieveError, "virStreamNew", conn);
+    }
+    if (virDomainOpenConsole(dom, devname, con->st, oflags) < 0) {
+        virStreamFree(con->st);
+        console_discard(con);
+        ruby_libvirt_raise_error_if(1, e_RetrieveError,
+                                    "virDomainOpenConsole", conn);
+    }
+
+    /* one reference for the mux, one for the event callback */
+    con->mux = mux;
+    con->refs = 2;
+    con->open = 1;
+    pthread_mutex_lock(&mux->lock);
+    mux->refs++;
+    pthread_mutex_unlock(&mux->lock);
+
+    ret = virStreamEventAddCallback(con->st,
+                                    VIR_STREAM_EVENT_READABLE |
+                                    VIR_STREAM_EVENT_ERROR |
+                                    VIR_STREAM_EVENT_HANGUP,
+                                    console_event_callback, con,
+                                    console_release);
+    if (ret < 0) {
+        con->refs = 1;
+        con->open = 0;
+        virStreamAbort(con->st);
+        console_unref(con);
+        ruby_libvirt_raise_error_if(1, e_RetrieveError,
+                                    "virStreamEventAddCallback", conn);
+    }
+
+    mux->consoles[mux->nconsoles++] = con;
+
+    return rb_str_new2(con->uuid);
+}
+
+/*
+ * call-seq:
+ *   mux.remove(domain) -> nil
+ *
+ * Stop collecting the console of domain (a Libvirt::Domain or UUID) and
+ * close its stream.  Buffered output is thrown away.
+ */
+static VALUE libvirt_console_mux_remove(VALUE m, VALUE d)
+{
+    struct console_mux *mux = console_mux_get(m);
+    struct console *con;
+    long i;
+
+    i = console_mux_index(mux, d);
+    if (i < 0) {
+        rb_raise(rb_eArgError, "no console for that domain in the mux");
+    }
+    con = mux->consoles[i];
+    mux->consoles[i] = mux->consoles[--mux->nconsoles];
+
+    console_detach(con);
+
+    return Qnil;
+}
+
+/* take everything (if LINES is 0) or everything up to and including the
+ * last newline (if it is 1) out of the ring of CON
+ */
+static VALUE console_take(struct console *con, int lines)
+{
+    size_t cap = con->mux->buffer_size;
+    size_t n, i, first;
+    VALUE result;
+
+    result = rb_str_buf_new(cap);
+
+    pthread_mutex_lock(&con->mux->lock);
+    n = con->len;
+    if (lines) {
+        for (i = n; i > 0; i--) {
+            if (con->buf[(con->start + i - 1) % cap] == '\n') {
+                break;
+            }
+        }
+        n = i;
+    }
+    /* a console that has gone away has no more lines coming */
+    if (lines && n == 0 && !con->open) {
+        n = con->len;
+    }
+    first = cap - con->start < n ? cap - con->start : n;
+    memcpy(RSTRING_PTR(result), con->buf + con->start, first);
+    memcpy(RSTRING_PTR(result) + first, con->buf, n - first);
+    con->start = (con->start + n) % cap;
+    con->len -= n;
+    pthread_mutex_unlock(&con->mux->lock);
+
+    rb_str_set_len(result, n);
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   mux.read(domain) -> String
+ *
+ * Return, and remove from the buffer, everything collected from the
+ * console of domain (a Libvirt::Domain or UUID) so far.  Consoles that write
+ * to a file descriptor always return an empty String.
+ */
+static VALUE libvirt_console_mux_read(VALUE m, VALUE d)
+{
+    struct console *con = console_mux_find(console_mux_get(m), d);
+
+    if (con->buf == NULL) {
+        return rb_str_new(NULL, 0);
+    }
+
+    return console_take(con, 0);
+}
+
+/* cancelled belongs to one dispatch call rather than the mux, so that an
+ * interrupt is only ever seen by the thread it was meant for
+ */
+struct console_mux_wait_arg {
+    struct console_mux *mux;
+    unsigned long generation;
+    double deadline;
+    int cancelled;
+};
+
+static double console_mux_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void *console_mux_wait_nogvl(void *in)
+{
+    struct console_mux_wait_arg *arg = (struct console_mux_wait_arg *)in;
+    struct console_mux *mux = arg->mux;
+    struct timespec ts;
+
+    pthread_mutex_lock(&mux->lock);
+    while (!arg->cancelled && mux->generation == arg->generation) {
+        if (arg->deadline < 0) {
+            pthread_cond_wait(&mux->cond, &mux->lock);
+            continue;
+        }
+        if (console_mux_now() >= arg->deadline) {
+            break;
+        }
+        ts.tv_sec = (time_t)arg->deadline;
+        ts.tv_nsec = (long)((arg->deadline - ts.tv_sec) * 1000000000.0);
+        pthread_cond_timedwait(&mux->cond, &mux->lock, &ts);
+    }
+    pthread_mutex_unlock(&mux->lock);
+
+    return NULL;
+}
+
+static void console_mux_wait_cancel(void *in)
+{
+    struct console_mux_wait_arg *arg = (struct console_mux_wait_arg *)in;
+    struct console_mux *mux = arg->mux;
+
+    pthread_mutex_lock(&mux->lock);
+    arg->cancelled = 1;
+    pthread_cond_broadcast(&mux->cond);
+    pthread_mutex_unlock(&mux->lock);
+}
+
+/* yield the complete lines of every console that has some */
+static long console_mux_yield_lines(VALUE m)
+{
+    struct console_mux *mux = console_mux_get(m);
+    VALUE uuids, data;
+    long i, n = 0;
+
+    /* the block may add and remove consoles, so go by UUID */
+    uuids = rb_ary_new();
+    for (i = 0; i < mux->nconsoles; i++) {
+        if (mux->consoles[i]->buf) {
+            rb_ary_push(uuids, rb_str_new2(mux->consoles[i]->uuid));
+        }
+    }
+
+    for (i = 0; i < RARRAY_LEN(uuids); i++) {
+        if (console_mux_index(mux, rb_ary_entry(uuids, i)) < 0) {
+            continue;
+        }
+        data = console_take(console_mux_find(mux, rb_ary_entry(uuids, i)), 1);
+        if (RSTRING_LEN(data) > 0) {
+            rb_yield_values(2, rb_ary_entry(uuids, i), data);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * call-seq:
+ *   mux.dispatch(timeout=nil) {|uuid, lines| block } -> Fixnum
+ *
+ * Wait, with the GVL released, until at least one buffered console has
+ * one or more complete lines of output (or timeout seconds have passed, if
+ * timeout is given), then call the block once for each such console with
+ * its UUID and all of its complete lines as one String.  A trailing partial
+ * line stays buffered until it is finished, or the console goes away.
+ * Returns the number of times the block was called.
+ */
+static VALUE libvirt_console_mux_dispatch(int argc, VALUE *argv, VALUE m)
+{
+    struct console_mux *mux = console_mux_get(m);
+    struct console_mux_wait_arg arg;
+    VALUE timeout;
+    long n;
+
+    rb_scan_args(argc, argv, "01", &timeout);
+
+    if (!rb_block_given_p()) {
+        rb_raise(rb_eRuntimeError, "A block must be provided");
+    }
+
+    arg.mux = mux;
+    arg.deadline = NIL_P(timeout) ? -1 : console_mux_now() + NUM2DBL(timeout);
+
+    for (;;) {
+        pthread_mutex_lock(&mux->lock);
+        arg.generation = mux->generation;
+        arg.cancelled = 0;
+        pthread_mutex_unlock(&mux->lock);
+
+        n = console_mux_yield_lines(m);
+        if (n > 0) {
+            return LONG2NUM(n);
+        }
+        if (arg.deadline >= 0 && console_mux_now() >= arg.deadline) {
+            return INT2NUM(0);
+        }
+
+        ruby_libvirt_without_gvl(console_mux_wait_nogvl, &arg,
+                                 console_mux_wait_cancel, &arg);
+        rb_thread_check_ints();
+    }
+}
+
+/*
+ * call-seq:
+ *   mux.domains -> Array
+ *
+ * Return the UUIDs of the domains whose consoles are in the mux.
+ */
+static VALUE libvirt_console_mux_domains(VALUE m)
+{
+    struct console_mux *mux = console_mux_get(m);
+    VALUE result;
+    long i;
+
+    result = rb_ary_new2(mux->nconsoles);
+    for (i = 0; i < mux->nconsoles; i++) {
+        rb_ary_push(result, rb_str_new2(mux->consoles[i]->uuid));
+    }
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   mux.open?(domain) -> [True|False]
+ *
+ * Return +true+ if the console of domain (a Libvirt::Domain or UUID) is
+ * still connected, +false+ once the stream has hung up or failed.
+ */
+static VALUE libvirt_console_mux_open_p(VALUE m, VALUE d)
+{
+    struct console_mux *mux = console_mux_get(m);
+    struct console *con = console_mux_find(mux, d);
+    int open;
+
+    pthread_mutex_lock(&mux->lock);
+    open = con->open;
+    pthread_mutex_unlock(&mux->lock);
+
+    return open ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   mux.stats -> Hash
+ *
+ * Return a Hash from the UUID of each console to a Hash of "bytes" (read
+ * from the console in total), "buffered" (waiting to be read), "dropped"
+ * (overwritten in the ring, or not written to the file descriptor) and
+ * "open".
+ */
+static VALUE libvirt_console_mux_stats(VALUE m)
+{
+    struct console_mux *mux = console_mux_get(m);
+    struct console *con;
+    unsigned long long bytes, dropped;
+    size_t buffered;
+    int open;
+    VALUE result, stat;
+    long i;
+
+    result = rb_hash_new();
+    for (i = 0; i < mux->nconsoles; i++) {
+        con = mux->consoles[i];
+
+        pthread_mutex_lock(&mux->lock);
+        bytes = con->bytes;
+        dropped = con->dropped;
+        buffered = con->len;
+        open = con->open;
+        pthread_mutex_unlock(&mux->lock);
+
+        stat = rb_hash_new();
+        rb_hash_aset(stat, rb_str_new2("bytes"), ULL2NUM(bytes));
+        rb_hash_aset(stat, rb_str_new2("buffered"), ULONG2NUM(buffered));
+        rb_hash_aset(stat, rb_str_new2("dropped"), ULL2NUM(dropped));
+        rb_hash_aset(stat, rb_str_new2("open"), open ? Qtrue : Qfalse);
+        rb_hash_aset(result, rb_str_new2(con->uuid), stat);
+    }
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   mux.close -> nil
+ *
+ * Remove every console from the mux.
+ */
+static VALUE libvirt_console_mux_close(VALUE m)
+{
+    struct console_mux *mux = console_mux_get(m);
+
+    while (mux->nconsoles > 0) {
+        console_detach(mux->consoles[--mux->nconsoles]);
+    }
+
+    return Qnil;
+}
+#endif
+
+/*
+ * Class Libvirt::ConsoleMux
+ */
+void ruby_libvirt_console_init(void)
+{
+#if HAVE_VIRDOMAINOPENCONSOLE && HAVE_TYPE_VIRSTREAMPTR && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    c_console_mux = rb_define_class_under(m_libvirt, "ConsoleMux", rb_cObject);
+    rb_undef_alloc_func(c_console_mux);
+
+    rb_define_attr(c_console_mux, "connection", 1, 0);
+
+    rb_define_method(c_console_mux, "add", libvirt_console_mux_add, -1);
+    rb_define_method(c_console_mux, "remove", libvirt_console_mux_remove, 1);
+    rb_define_method(c_console_mux, "read", libvirt_console_mux_read, 1);
+    rb_define_method(c_console_mux, "dispatch",
+                     libvirt_console_mux_dispatch, -1);
+    rb_define_method(c_console_mux, "domains",
+                     libvirt_console_mux_domains, 0);
+    rb_define_method(c_console_mux, "open?", libvirt_console_mux_open_p, 1);
+    rb_define_method(c_console_mux, "stats", libvirt_console_mux_stats, 0);
+    rb_define_method(c_console_mux, "close", libvirt_console_mux_close, 0);
+#endif
+}
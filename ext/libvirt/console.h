@@ -0,0 +1,8 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+void ruby_libvirt_console_init(void);
+
+VALUE ruby_libvirt_console_mux_new(VALUE c, VALUE opts);
+
+#endif
@@ -0,0 +1,451 @@
+/*
+ * cpumap.c: Libvirt::CPUMap methods
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <string.h>
+#include <ruby.h>
+#include <libvirt/libvirt.h>
+#include <libvirt/virterror.h>
+#include "common.h"
+#include "extconf.h"
+#include "cpumap.h"
+
+static VALUE c_cpumap;
+
+/* Libvirt::CPUMap keeps a cpumap in libvirt's own layout: one bit per host
+ * CPU, CPU 0 in the least significant bit of the first byte.  Bits past
+ * ncpus are always kept clear so that popcount and == need no masking.
+ */
+struct cpumap {
+    int ncpus;
+    unsigned char *map;
+};
+
+static void cpumap_free(void *p)
+{
+    struct cpumap *m = p;
+
+    xfree(m->map);
+    xfree(m);
+}
+
+static const rb_data_type_t cpumap_data_type = {
+    "Libvirt::CPUMap",
+    { NULL, cpumap_free, NULL, },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE cpumap_alloc(VALUE klass)
+{
+    struct cpumap *m;
+
+    return TypedData_Make_Struct(klass, struct cpumap, &cpumap_data_type, m);
+}
+
+static struct cpumap *cpumap_get(VALUE s)
+{
+    struct cpumap *m;
+
+    TypedData_Get_Struct(s, struct cpumap, &cpumap_data_type, m);
+    return m;
+}
+
+static void cpumap_resize(struct cpumap *m, int ncpus)
+{
+    unsigned char *map;
+
+    if (ncpus < 0) {
+        rb_raise(rb_eArgError, "negative number of CPUs");
+    }
+
+    map = ALLOC_N(unsigned char, VIR_CPU_MAPLEN(ncpus));
+    MEMZERO(map, unsigned char, VIR_CPU_MAPLEN(ncpus));
+
+    xfree(m->map);
+    m->map = map;
+    m->ncpus = ncpus;
+}
+
+static void cpumap_trim(struct cpumap *m)
+{
+    if (m->ncpus % 8) {
+        m->map[m->ncpus / 8] &= (1 << (m->ncpus % 8)) - 1;
+    }
+}
+
+static int cpumap_cpu(struct cpumap *m, VALUE cpu)
+{
+    int n = NUM2INT(cpu);
+
+    if (n < 0 || n >= m->ncpus) {
+        rb_raise(rb_eArgError, "CPU %d out of range (0-%d)", n, m->ncpus - 1);
+    }
+
+    return n;
+}
+
+VALUE ruby_libvirt_cpumap_new(const unsigned char *map, int ncpus)
+{
+    VALUE result;
+    struct cpumap *m;
+
+    result = cpumap_alloc(c_cpumap);
+    m = cpumap_get(result);
+    cpumap_resize(m, ncpus);
+    memcpy(m->map, map, VIR_CPU_MAPLEN(ncpus));
+    cpumap_trim(m);
+
+    return result;
+}
+
+/*
+ * Set the bits of the zeroed, ncpus wide cpumap map from in, which is either
+ * a Libvirt::CPUMap or an array of CPU numbers.  CPUs at or past ncpus are
+ * rejected rather than written past the end of map.
+ */
+void ruby_libvirt_cpumap_fill(VALUE in, unsigned char *map, int ncpus)
+{
+    struct cpumap *m;
+    int i, cpu;
+
+    if (rb_obj_is_kind_of(in, c_cpumap) == Qtrue) {
+        m = cpumap_get(in);
+        for (i = ncpus; i < m->ncpus; i++) {
+            if (VIR_CPU_USED(m->map, i)) {
+                rb_raise(rb_eArgError, "CPU %d out of range (0-%d)", i,
+                         ncpus - 1);
+            }
+        }
+        memcpy(map, m->map,
+               VIR_CPU_MAPLEN(m->ncpus < ncpus ? m->ncpus : ncpus));
+        return;
+    }
+
+    Check_Type(in, T_ARRAY);
+
+    for (i = 0; i < RARRAY_LEN(in); i++) {
+        cpu = NUM2INT(rb_ary_entry(in, i));
+        if (cpu < 0 || cpu >= ncpus) {
+            rb_raise(rb_eArgError, "CPU %d out of range (0-%d)", cpu,
+                     ncpus - 1);
+        }
+        VIR_USE_CPU(map, cpu);
+    }
+}
+
+/*
+ * call-seq:
+ *   Libvirt::CPUMap.new(ncpus, cpulist=[]) -> Libvirt::CPUMap
+ *
+ * Create a bitmap of ncpus host CPUs with the CPUs in cpulist set.  The
+ * result can be passed anywhere a cpulist is accepted, e.g. dom.pin_vcpu.
+ */
+static VALUE libvirt_cpumap_initialize(int argc, VALUE *argv, VALUE s)
+{
+    VALUE ncpus, cpulist;
+    struct cpumap *m = cpumap_get(s);
+
+    rb_scan_args(argc, argv, "11", &ncpus, &cpulist);
+
+    cpumap_resize(m, NUM2INT(ncpus));
+    if (!NIL_P(cpulist)) {
+        ruby_libvirt_cpumap_fill(cpulist, m->map, m->ncpus);
+    }
+
+    return s;
+}
+
+static VALUE libvirt_cpumap_initialize_copy(VALUE s, VALUE orig)
+{
+    struct cpumap *m = cpumap_get(s), *o = cpumap_get(orig);
+
+    if (m != o) {
+        cpumap_resize(m, o->ncpus);
+        memcpy(m->map, o->map, VIR_CPU_MAPLEN(o->ncpus));
+    }
+
+    return s;
+}
+
+/*
+ * call-seq:
+ *   cpumap.size -> Fixnum
+ *
+ * Return the number of host CPUs this bitmap covers.
+ */
+static VALUE libvirt_cpumap_size(VALUE s)
+{
+    return INT2NUM(cpumap_get(s)->ncpus);
+}
+
+/*
+ * call-seq:
+ *   cpumap[cpu] -> [true|false]
+ *
+ * Return whether CPU number cpu is set.  CPUs this bitmap does not cover are
+ * never set.
+ */
+static VALUE libvirt_cpumap_aref(VALUE s, VALUE cpu)
+{
+    struct cpumap *m = cpumap_get(s);
+    int n = NUM2INT(cpu);
+
+    if (n < 0 || n >= m->ncpus) {
+        return Qfalse;
+    }
+
+    return VIR_CPU_USED(m->map, n) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   cpumap[cpu] = [true|false]
+ *
+ * Set or clear CPU number cpu.
+ */
+static VALUE libvirt_cpumap_aset(VALUE s, VALUE cpu, VALUE val)
+{
+    struct cpumap *m = cpumap_get(s);
+    int n;
+
+    rb_check_frozen(s);
+    n = cpumap_cpu(m, cpu);
+    if (RTEST(val)) {
+        VIR_USE_CPU(m->map, n);
+    }
+    else {
+        VIR_UNUSE_CPU(m->map, n);
+    }
+
+    return val;
+}
+
+/*
+ * call-seq:
+ *   cpumap.popcount -> Fixnum
+ *
+ * Return the number of CPUs that are set.
+ */
+static VALUE libvirt_cpumap_popcount(VALUE s)
+{
+    struct cpumap *m = cpumap_get(s);
+    int i, count = 0;
+    unsigned char b;
+
+    for (i = 0; i < VIR_CPU_MAPLEN(m->ncpus); i++) {
+        for (b = m->map[i]; b; b &= b - 1) {
+            count++;
+        }
+    }
+
+    return INT2NUM(count);
+}
+
+/*
+ * call-seq:
+ *   cpumap.each_set_bit {|cpu| block } -> Libvirt::CPUMap
+ *
+ * Call the block with the number of each CPU that is set, in ascending
+ * order.  Without a block, return an Enumerator.
+ */
+static VALUE libvirt_cpumap_each_set_bit(VALUE s)
+{
+    struct cpumap *m = cpumap_get(s);
+    int i, bit;
+    unsigned char b;
+
+    RETURN_ENUMERATOR(s, 0, 0);
+
+    for (i = 0; i < VIR_CPU_MAPLEN(m->ncpus); i++) {
+        /* the block may change the map, so re-read the byte each time */
+        for (bit = 0; bit < 8 && (b = m->map[i] >> bit) != 0; bit++) {
+            if (b & 1) {
+                rb_yield(INT2NUM(i * 8 + bit));
+            }
+        }
+    }
+
+    return s;
+}
+
+/*
+ * call-seq:
+ *   cpumap.cpus -> Array
+ *
+ * Return the numbers of the CPUs that are set, in the form dom.pin_vcpu
+ * takes as a cpulist.
+ */
+static VALUE libvirt_cpumap_cpus(VALUE s)
+{
+    struct cpumap *m = cpumap_get(s);
+    VALUE result;
+    int i;
+
+    result = rb_ary_new();
+    for (i = 0; i < m->ncpus; i++) {
+        if (VIR_CPU_USED(m->map, i)) {
+            rb_ary_push(result, INT2NUM(i));
+        }
+    }
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   cpumap.to_a -> Array
+ *
+ * Return an array with one true or false entry per host CPU, the form
+ * dom.emulator_pin_info and Libvirt::Domain::VCPUInfo#cpumap return.
+ */
+static VALUE libvirt_cpumap_to_a(VALUE s)
+{
+    struct cpumap *m = cpumap_get(s);
+    VALUE result;
+    int i;
+
+    result = rb_ary_new2(m->ncpus);
+    for (i = 0; i < m->ncpus; i++) {
+        rb_ary_push(result, VIR_CPU_USED(m->map, i) ? Qtrue : Qfalse);
+    }
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   cpumap.bytes -> String
+ *
+ * Return the raw cpumap bytes, in the layout libvirt uses.
+ */
+static VALUE libvirt_cpumap_bytes(VALUE s)
+{
+    struct cpumap *m = cpumap_get(s);
+
+    return rb_str_new((const char *)m->map, VIR_CPU_MAPLEN(m->ncpus));
+}
+
+static VALUE cpumap_combine(VALUE s, VALUE other, int intersect)
+{
+    struct cpumap *a = cpumap_get(s), *b, *r;
+    VALUE result;
+    int i, len;
+
+    if (rb_obj_is_kind_of(other, c_cpumap) != Qtrue) {
+        rb_raise(rb_eTypeError,
+                 "wrong argument type %s (expected Libvirt::CPUMap)",
+                 rb_obj_classname(other));
+    }
+    b = cpumap_get(other);
+
+    result = cpumap_alloc(c_cpumap);
+    r = cpumap_get(result);
+    cpumap_resize(r, a->ncpus > b->ncpus ? a->ncpus : b->ncpus);
+
+    /* bytes past the end of the shorter map count as all clear */
+    len = VIR_CPU_MAPLEN(a->ncpus < b->ncpus ? a->ncpus : b->ncpus);
+    for (i = 0; i < len; i++) {
+        if (intersect) {
+            r->map[i] = a->map[i] & b->map[i];
+        }
+        else {
+            r->map[i] = a->map[i] | b->map[i];
+        }
+    }
+    if (!intersect) {
+        for (; i < VIR_CPU_MAPLEN(a->ncpus); i++) {
+            r->map[i] = a->map[i];
+        }
+        for (; i < VIR_CPU_MAPLEN(b->ncpus); i++) {
+            r->map[i] = b->map[i];
+        }
+    }
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   cpumap & other -> Libvirt::CPUMap
+ *
+ * Return a bitmap of the CPUs set in both cpumap and other.
+ */
+static VALUE libvirt_cpumap_and(VALUE s, VALUE other)
+{
+    return cpumap_combine(s, other, 1);
+}
+
+/*
+ * call-seq:
+ *   cpumap | other -> Libvirt::CPUMap
+ *
+ * Return a bitmap of the CPUs set in either cpumap or other.
+ */
+static VALUE libvirt_cpumap_or(VALUE s, VALUE other)
+{
+    return cpumap_combine(s, other, 0);
+}
+
+/*
+ * call-seq:
+ *   cpumap == other -> [true|false]
+ *
+ * Return whether other is a Libvirt::CPUMap of the same size with the same
+ * CPUs set.
+ */
+static VALUE libvirt_cpumap_equal(VALUE s, VALUE other)
+{
+    struct cpumap *a = cpumap_get(s), *b;
+
+    if (rb_obj_is_kind_of(other, c_cpumap) != Qtrue) {
+        return Qfalse;
+    }
+    b = cpumap_get(other);
+
+    if (a->ncpus != b->ncpus) {
+        return Qfalse;
+    }
+
+    if (memcmp(a->map, b->map, VIR_CPU_MAPLEN(a->ncpus)) != 0) {
+        return Qfalse;
+    }
+
+    return Qtrue;
+}
+
+/*
+ * Class Libvirt::CPUMap
+ */
+void ruby_libvirt_cpumap_init(void)
+{
+    c_cpumap = rb_define_class_under(m_libvirt, "CPUMap", rb_cObject);
+    rb_define_alloc_func(c_cpumap, cpumap_alloc);
+    rb_define_method(c_cpumap, "initialize", libvirt_cpumap_initialize, -1);
+    rb_define_method(c_cpumap, "initialize_copy",
+                     libvirt_cpumap_initialize_copy, 1);
+    rb_define_method(c_cpumap, "size", libvirt_cpumap_size, 0);
+    rb_define_method(c_cpumap, "[]", libvirt_cpumap_aref, 1);
+    rb_define_method(c_cpumap, "[]=", libvirt_cpumap_aset, 2);
+    rb_define_method(c_cpumap, "popcount", libvirt_cpumap_popcount, 0);
+    rb_define_method(c_cpumap, "each_set_bit", libvirt_cpumap_each_set_bit, 0);
+    rb_define_method(c_cpumap, "cpus", libvirt_cpumap_cpus, 0);
+    rb_define_method(c_cpumap, "to_a", libvirt_cpumap_to_a, 0);
+    rb_define_method(c_cpumap, "bytes", libvirt_cpumap_bytes, 0);
+    rb_define_method(c_cpumap, "&", libvirt_cpumap_and, 1);
+    rb_define_method(c_cpumap, "|", libvirt_cpumap_or, 1);
+    rb_define_method(c_cpumap, "==", libvirt_cpumap_equal, 1);
+}
@@ -0,0 +1,9 @@
+#ifndef CPUMAP_H
+#define CPUMAP_H
+
+void ruby_libvirt_cpumap_init(void);
+
+VALUE ruby_libvirt_cpumap_new(const unsigned char *map, int ncpus);
+void ruby_libvirt_cpumap_fill(VALUE in, unsigned char *map, int ncpus);
+
+#endif
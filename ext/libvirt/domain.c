@@ -19,8 +19,14 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
  */
 
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <ruby.h>
 /* we need to include st.h since ruby 1.8 needs it for RHash */
 #include <st.h>
@@ -36,6 +42,8 @@
 #include "connect.h"
 #include "extconf.h"
 #include "stream.h"
+#include "cpumap.h"
+#include "xmlcache.h"
 
 #ifndef HAVE_TYPE_VIRTYPEDPARAMETERPTR
 #define VIR_TYPED_PARAM_INT VIR_DOMAIN_SCHED_FIELD_INT
@@ -78,9 +86,15 @@ static VALUE c_domain_memory_stats;
 #endif
 #if HAVE_TYPE_VIRDOMAINSNAPSHOTPTR
 static VALUE c_domain_snapshot;
+#if HAVE_VIRDOMAINLISTALLSNAPSHOTS
+static VALUE c_domain_snapshot_node;
+#endif
 #endif
 #if HAVE_TYPE_VIRDOMAINJOBINFOPTR
 static VALUE c_domain_job_info;
+#if HAVE_VIRDOMAINGETJOBSTATS
+static VALUE c_domain_job_progress;
+#endif
 #endif
 static VALUE c_domain_vcpuinfo;
 #if HAVE_VIRDOMAINGETCONTROLINFO
@@ -90,14 +104,11 @@ static VALUE c_domain_control_info;
 static VALUE c_domain_block_job_info;
 #endif
 
-static void domain_free(void *d)
-{
-    ruby_libvirt_free_struct(Domain, d);
-}
+ruby_libvirt_handle_type(Domain, "Libvirt::Domain")
 
 VALUE ruby_libvirt_domain_new(virDomainPtr d, VALUE conn)
 {
-    return ruby_libvirt_new_class(c_domain, d, conn, domain_free);
+    return ruby_libvirt_new_class(c_domain, &Domain_handle_data_type, d, conn);
 }
 
 virDomainPtr ruby_libvirt_domain_get(VALUE d)
@@ -125,6 +136,49 @@ static void domain_input_to_fixnum_and_flags(VALUE in, VALUE *hash, VALUE *flags
     }
 }
 
+#if HAVE_TYPE_VIRDOMAINJOBINFOPTR
+/* Unblocking function for the long running calls (migration, save, dump)
+ * that we make without the GVL.  There is no way to cancel a libvirt call
+ * once it is in flight, but all of these run as a domain job, and aborting
+ * the job makes the blocked call return promptly with an error.
+ */
+static void domain_abort_job_ubf(void *d)
+{
+    virDomainAbortJob((virDomainPtr)d);
+}
+#define DOMAIN_JOB_UBF domain_abort_job_ubf
+#else
+#define DOMAIN_JOB_UBF NULL
+#endif
+
+/* Like ruby_libvirt_generate_call_nil, for calls that can change the XML of
+ * the domain d without libvirt raising an event for it (a config-only
+ * change, for one): once the call has succeeded, drop whatever
+ * conn.enable_xml_cache holds for d.
+ */
+#define domain_generate_call_nil_changed(func, d, args...)                \
+    do {                                                                  \
+        int _r_##func;                                                    \
+        unsigned long long _t_##func = ruby_libvirt_call_stats_start();   \
+        _r_##func = func(args);                                           \
+        ruby_libvirt_call_stats_end(#func, _t_##func);                    \
+        ruby_libvirt_raise_error_if(_r_##func < 0, e_Error, #func,        \
+                                    ruby_libvirt_connect_get(d));         \
+        ruby_libvirt_xml_cache_domain_changed(d);                         \
+        return Qnil;                                                      \
+    } while(0)
+
+/* the destination connection is used without the GVL as well, so the
+ * migrate calls hold it along with the domain
+ */
+ruby_libvirt_nogvl_trampoline_held2(virDomainMigrate, virDomainPtr,
+                                    virDomainPtr, virConnectPtr,
+                                    virDomainPtr a0; virConnectPtr a1;
+                                    unsigned long a2; const char *a3;
+                                    const char *a4; unsigned long a5;,
+                                    virDomainMigrate(a->a0, a->a1, a->a2,
+                                                     a->a3, a->a4, a->a5))
+
 /*
  * call-seq:
  *   dom.migrate(dconn, flags=0, dname=nil, uri=nil, bandwidth=0) -> Libvirt::Domain
@@ -136,25 +190,29 @@ static void domain_input_to_fixnum_and_flags(VALUE in, VALUE *hash, VALUE *flags
 static VALUE libvirt_domain_migrate(int argc, VALUE *argv, VALUE d)
 {
     VALUE dconn, flags, dname, uri, bandwidth;
-    virDomainPtr ddom = NULL;
 
     rb_scan_args(argc, argv, "14", &dconn, &flags, &dname, &uri,
                  &bandwidth);
 
-    ddom = virDomainMigrate(ruby_libvirt_domain_get(d),
-                            ruby_libvirt_connect_get(dconn),
-                            ruby_libvirt_value_to_ulong(flags),
-                            ruby_libvirt_get_cstring_or_null(dname),
-                            ruby_libvirt_get_cstring_or_null(uri),
-                            ruby_libvirt_value_to_ulong(bandwidth));
-
-    ruby_libvirt_raise_error_if(ddom == NULL, e_Error, "virDomainMigrate",
-                                ruby_libvirt_connect_get(d));
-
-    return ruby_libvirt_domain_new(ddom, dconn);
+    ruby_libvirt_generate_call_object_nogvl_ubf(virDomainMigrate,
+                                                ruby_libvirt_connect_get(d),
+                                                e_Error,
+                                                ruby_libvirt_domain_new, dconn,
+                                                DOMAIN_JOB_UBF,
+                                                ruby_libvirt_domain_get(d),
+                                                ruby_libvirt_domain_get(d),
+                                                ruby_libvirt_connect_get(dconn),
+                                                ruby_libvirt_value_to_ulong(flags),
+                                                ruby_libvirt_get_cstring_or_null(dname),
+                                                ruby_libvirt_get_cstring_or_null(uri),
+                                                ruby_libvirt_value_to_ulong(bandwidth));
 }
 
 #if HAVE_VIRDOMAINMIGRATETOURI
+ruby_libvirt_declare_nogvl5(int, virDomainMigrateToURI, virDomainPtr,
+                            const char *, unsigned long, const char *,
+                            unsigned long)
+
 /*
  * call-seq:
  *   dom.migrate_to_uri(duri, flags=0, dname=nil, bandwidth=0) -> nil
@@ -169,12 +227,15 @@ static VALUE libvirt_domain_migrate_to_uri(int argc, VALUE *argv, VALUE d)
 
     rb_scan_args(argc, argv, "13", &duri, &flags, &dname, &bandwidth);
 
-    ruby_libvirt_generate_call_nil(virDomainMigrateToURI,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   StringValueCStr(duri), NUM2ULONG(flags),
-                                   ruby_libvirt_get_cstring_or_null(dname),
-                                   ruby_libvirt_value_to_ulong(bandwidth));
+    ruby_libvirt_generate_call_nil_nogvl_ubf(virDomainMigrateToURI,
+                                             ruby_libvirt_connect_get(d),
+                                             DOMAIN_JOB_UBF,
+                                             ruby_libvirt_domain_get(d),
+                                             ruby_libvirt_domain_get(d),
+                                             StringValueCStr(duri),
+                                             NUM2ULONG(flags),
+                                             ruby_libvirt_get_cstring_or_null(dname),
+                                             ruby_libvirt_value_to_ulong(bandwidth));
 }
 #endif
 
@@ -223,6 +284,19 @@ static VALUE libvirt_domain_migrate_max_downtime_equal(VALUE d, VALUE in)
 #endif
 
 #if HAVE_VIRDOMAINMIGRATE2
+ruby_libvirt_nogvl_trampoline_held2(virDomainMigrate2, virDomainPtr,
+                                    virDomainPtr, virConnectPtr,
+                                    virDomainPtr a0; virConnectPtr a1;
+                                    const char *a2; unsigned long a3;
+                                    const char *a4; const char *a5;
+                                    unsigned long a6;,
+                                    virDomainMigrate2(a->a0, a->a1, a->a2,
+                                                      a->a3, a->a4, a->a5,
+                                                      a->a6))
+ruby_libvirt_declare_nogvl7(int, virDomainMigrateToURI2, virDomainPtr,
+                            const char *, const char *, const char *,
+                            unsigned long, const char *, unsigned long)
+
 /*
  * call-seq:
  *   dom.migrate2(dconn, dxml=nil, flags=0, dname=nil, uri=nil, bandwidth=0) -> Libvirt::Domain
@@ -234,23 +308,23 @@ static VALUE libvirt_domain_migrate_max_downtime_equal(VALUE d, VALUE in)
 static VALUE libvirt_domain_migrate2(int argc, VALUE *argv, VALUE d)
 {
     VALUE dconn, dxml, flags, dname, uri, bandwidth;
-    virDomainPtr ddom = NULL;
 
     rb_scan_args(argc, argv, "15", &dconn, &dxml, &flags, &dname, &uri,
                  &bandwidth);
 
-    ddom = virDomainMigrate2(ruby_libvirt_domain_get(d),
-                             ruby_libvirt_connect_get(dconn),
-                             ruby_libvirt_get_cstring_or_null(dxml),
-                             ruby_libvirt_value_to_ulong(flags),
-                             ruby_libvirt_get_cstring_or_null(dname),
-                             ruby_libvirt_get_cstring_or_null(uri),
-                             ruby_libvirt_value_to_ulong(bandwidth));
-
-    ruby_libvirt_raise_error_if(ddom == NULL, e_Error, "virDomainMigrate2",
-                                ruby_libvirt_connect_get(d));
-
-    return ruby_libvirt_domain_new(ddom, dconn);
+    ruby_libvirt_generate_call_object_nogvl_ubf(virDomainMigrate2,
+                                                ruby_libvirt_connect_get(d),
+                                                e_Error,
+                                                ruby_libvirt_domain_new, dconn,
+                                                DOMAIN_JOB_UBF,
+                                                ruby_libvirt_domain_get(d),
+                                                ruby_libvirt_domain_get(d),
+                                                ruby_libvirt_connect_get(dconn),
+                                                ruby_libvirt_get_cstring_or_null(dxml),
+                                                ruby_libvirt_value_to_ulong(flags),
+                                                ruby_libvirt_get_cstring_or_null(dname),
+                                                ruby_libvirt_get_cstring_or_null(uri),
+                                                ruby_libvirt_value_to_ulong(bandwidth));
 }
 
 /*
@@ -268,15 +342,17 @@ static VALUE libvirt_domain_migrate_to_uri2(int argc, VALUE *argv, VALUE d)
     rb_scan_args(argc, argv, "06", &duri, &migrate_uri, &dxml, &flags, &dname,
                  &bandwidth);
 
-    ruby_libvirt_generate_call_nil(virDomainMigrateToURI2,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   ruby_libvirt_get_cstring_or_null(duri),
-                                   ruby_libvirt_get_cstring_or_null(migrate_uri),
-                                   ruby_libvirt_get_cstring_or_null(dxml),
-                                   ruby_libvirt_value_to_ulong(flags),
-                                   ruby_libvirt_get_cstring_or_null(dname),
-                                   ruby_libvirt_value_to_ulong(bandwidth));
+    ruby_libvirt_generate_call_nil_nogvl_ubf(virDomainMigrateToURI2,
+                                             ruby_libvirt_connect_get(d),
+                                             DOMAIN_JOB_UBF,
+                                             ruby_libvirt_domain_get(d),
+                                             ruby_libvirt_domain_get(d),
+                                             ruby_libvirt_get_cstring_or_null(duri),
+                                             ruby_libvirt_get_cstring_or_null(migrate_uri),
+                                             ruby_libvirt_get_cstring_or_null(dxml),
+                                             ruby_libvirt_value_to_ulong(flags),
+                                             ruby_libvirt_get_cstring_or_null(dname),
+                                             ruby_libvirt_value_to_ulong(bandwidth));
 }
 
 /*
@@ -322,6 +398,13 @@ static VALUE libvirt_domain_migrate_max_speed_equal(VALUE d, VALUE in)
 }
 #endif
 
+#if HAVE_VIRDOMAINSHUTDOWNFLAGS
+ruby_libvirt_declare_nogvl2(int, virDomainShutdownFlags, virDomainPtr,
+                            unsigned int)
+#else
+ruby_libvirt_declare_nogvl1(int, virDomainShutdown, virDomainPtr)
+#endif
+
 /*
  * call-seq:
  *   dom.shutdown(flags=0) -> nil
@@ -338,21 +421,23 @@ static VALUE libvirt_domain_shutdown(int argc, VALUE *argv, VALUE d)
     rb_scan_args(argc, argv, "01", &flags);
 
 #if HAVE_VIRDOMAINSHUTDOWNFLAGS
-    ruby_libvirt_generate_call_nil(virDomainShutdownFlags,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virDomainShutdownFlags,
+                                         ruby_libvirt_connect_get(d),
+                                         ruby_libvirt_domain_get(d),
+                                         ruby_libvirt_value_to_uint(flags));
 #else
     if (ruby_libvirt_value_to_uint(flags) != 0) {
         rb_raise(e_NoSupportError, "Non-zero flags not supported");
     }
 
-    ruby_libvirt_generate_call_nil(virDomainShutdown,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d));
+    ruby_libvirt_generate_call_nil_nogvl(virDomainShutdown,
+                                         ruby_libvirt_connect_get(d),
+                                         ruby_libvirt_domain_get(d));
 #endif
 }
 
+ruby_libvirt_declare_nogvl2(int, virDomainReboot, virDomainPtr, unsigned int)
+
 /*
  * call-seq:
  *   dom.reboot(flags=0) -> nil
@@ -366,11 +451,19 @@ static VALUE libvirt_domain_reboot(int argc, VALUE *argv, VALUE d)
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_nil(virDomainReboot, ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virDomainReboot,
+                                         ruby_libvirt_connect_get(d),
+                                         ruby_libvirt_domain_get(d),
+                                         ruby_libvirt_value_to_uint(flags));
 }
 
+#if HAVE_VIRDOMAINDESTROYFLAGS
+ruby_libvirt_declare_nogvl2(int, virDomainDestroyFlags, virDomainPtr,
+                            unsigned int)
+#else
+ruby_libvirt_declare_nogvl1(int, virDomainDestroy, virDomainPtr)
+#endif
+
 /*
  * call-seq:
  *   dom.destroy(flags=0) -> nil
@@ -385,20 +478,22 @@ static VALUE libvirt_domain_destroy(int argc, VALUE *argv, VALUE d)
     rb_scan_args(argc, argv, "01", &flags);
 
 #if HAVE_VIRDOMAINDESTROYFLAGS
-    ruby_libvirt_generate_call_nil(virDomainDestroyFlags,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virDomainDestroyFlags,
+                                         ruby_libvirt_connect_get(d),
+                                         ruby_libvirt_domain_get(d),
+                                         ruby_libvirt_value_to_uint(flags));
 #else
     if (ruby_libvirt_value_to_uint(flags) != 0) {
         rb_raise(e_NoSupportError, "Non-zero flags not supported");
     }
-    ruby_libvirt_generate_call_nil(virDomainDestroy,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d));
+    ruby_libvirt_generate_call_nil_nogvl(virDomainDestroy,
+                                         ruby_libvirt_connect_get(d),
+                                         ruby_libvirt_domain_get(d));
 #endif
 }
 
+ruby_libvirt_declare_nogvl1(int, virDomainSuspend, virDomainPtr)
+
 /*
  * call-seq:
  *   dom.suspend -> nil
@@ -409,11 +504,13 @@ static VALUE libvirt_domain_destroy(int argc, VALUE *argv, VALUE d)
  */
 static VALUE libvirt_domain_suspend(VALUE d)
 {
-    ruby_libvirt_generate_call_nil(virDomainSuspend,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d));
+    ruby_libvirt_generate_call_nil_nogvl(virDomainSuspend,
+                                         ruby_libvirt_connect_get(d),
+                                         ruby_libvirt_domain_get(d));
 }
 
+ruby_libvirt_declare_nogvl1(int, virDomainResume, virDomainPtr)
+
 /*
  * call-seq:
  *   dom.resume -> nil
@@ -424,10 +521,18 @@ static VALUE libvirt_domain_suspend(VALUE d)
  */
 static VALUE libvirt_domain_resume(VALUE d)
 {
-    ruby_libvirt_generate_call_nil(virDomainResume, ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d));
+    ruby_libvirt_generate_call_nil_nogvl(virDomainResume,
+                                         ruby_libvirt_connect_get(d),
+                                         ruby_libvirt_domain_get(d));
 }
 
+#if HAVE_VIRDOMAINSAVEFLAGS
+ruby_libvirt_declare_nogvl4(int, virDomainSaveFlags, virDomainPtr,
+                            const char *, const char *, unsigned int)
+#else
+ruby_libvirt_declare_nogvl2(int, virDomainSave, virDomainPtr, const char *)
+#endif
+
 /*
  * call-seq:
  *   dom.save(filename, dxml=nil, flags=0) -> nil
@@ -443,12 +548,14 @@ static VALUE libvirt_domain_save(int argc, VALUE *argv, VALUE d)
     rb_scan_args(argc, argv, "12", &to, &dxml, &flags);
 
 #if HAVE_VIRDOMAINSAVEFLAGS
-    ruby_libvirt_generate_call_nil(virDomainSaveFlags,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   StringValueCStr(to),
-                                   ruby_libvirt_get_cstring_or_null(dxml),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl_ubf(virDomainSaveFlags,
+                                             ruby_libvirt_connect_get(d),
+                                             DOMAIN_JOB_UBF,
+                                             ruby_libvirt_domain_get(d),
+                                             ruby_libvirt_domain_get(d),
+                                             StringValueCStr(to),
+                                             ruby_libvirt_get_cstring_or_null(dxml),
+                                             ruby_libvirt_value_to_uint(flags));
 #else
     if (TYPE(dxml) != T_NIL) {
         rb_raise(e_NoSupportError, "Non-nil dxml not supported");
@@ -456,13 +563,19 @@ static VALUE libvirt_domain_save(int argc, VALUE *argv, VALUE d)
     if (ruby_libvirt_value_to_uint(flags) != 0) {
         rb_raise(e_NoSupportError, "Non-zero flags not supported");
     }
-    ruby_libvirt_generate_call_nil(virDomainSave, ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   StringValueCStr(to));
+    ruby_libvirt_generate_call_nil_nogvl_ubf(virDomainSave,
+                                             ruby_libvirt_connect_get(d),
+                                             DOMAIN_JOB_UBF,
+                                             ruby_libvirt_domain_get(d),
+                                             ruby_libvirt_domain_get(d),
+                                             StringValueCStr(to));
 #endif
 }
 
 #if HAVE_VIRDOMAINMANAGEDSAVE
+ruby_libvirt_declare_nogvl2(int, virDomainManagedSave, virDomainPtr,
+                            unsigned int)
+
 /*
  * call-seq:
  *   dom.managed_save(flags=0) -> nil
@@ -477,10 +590,12 @@ static VALUE libvirt_domain_managed_save(int argc, VALUE *argv, VALUE d)
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_nil(virDomainManagedSave,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl_ubf(virDomainManagedSave,
+                                             ruby_libvirt_connect_get(d),
+                                             DOMAIN_JOB_UBF,
+                                             ruby_libvirt_domain_get(d),
+                                             ruby_libvirt_domain_get(d),
+                                             ruby_libvirt_value_to_uint(flags));
 }
 
 /*
@@ -522,6 +637,9 @@ static VALUE libvirt_domain_managed_save_remove(int argc, VALUE *argv, VALUE d)
 }
 #endif
 
+ruby_libvirt_declare_nogvl3(int, virDomainCoreDump, virDomainPtr, const char *,
+                            unsigned int)
+
 /*
  * call-seq:
  *   dom.core_dump(filename, flags=0) -> nil
@@ -535,13 +653,17 @@ static VALUE libvirt_domain_core_dump(int argc, VALUE *argv, VALUE d)
 
     rb_scan_args(argc, argv, "11", &to, &flags);
 
-    ruby_libvirt_generate_call_nil(virDomainCoreDump,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   StringValueCStr(to),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl_ubf(virDomainCoreDump,
+                                             ruby_libvirt_connect_get(d),
+                                             DOMAIN_JOB_UBF,
+                                             ruby_libvirt_domain_get(d),
+                                             ruby_libvirt_domain_get(d),
+                                             StringValueCStr(to),
+                                             ruby_libvirt_value_to_uint(flags));
 }
 
+ruby_libvirt_declare_nogvl2(int, virDomainRestore, virConnectPtr, const char *)
+
 /*
  * call-seq:
  *   Libvirt::Domain::restore(conn, filename) -> nil
@@ -552,12 +674,19 @@ static VALUE libvirt_domain_core_dump(int argc, VALUE *argv, VALUE d)
 static VALUE libvirt_domain_s_restore(VALUE RUBY_LIBVIRT_UNUSED(klass), VALUE c,
                                       VALUE from)
 {
-    ruby_libvirt_generate_call_nil(virDomainRestore,
-                                   ruby_libvirt_connect_get(c),
-                                   ruby_libvirt_connect_get(c),
-                                   StringValueCStr(from));
+    ruby_libvirt_generate_call_nil_nogvl(virDomainRestore,
+                                         ruby_libvirt_connect_get(c),
+                                         ruby_libvirt_connect_get(c),
+                                         StringValueCStr(from));
 }
 
+ruby_libvirt_struct_type(domain_info, virDomainInfo, "Libvirt::Domain::Info")
+ruby_libvirt_struct_reader(domain_info, state, state, CHR2FIX)
+ruby_libvirt_struct_reader(domain_info, max_mem, maxMem, ULONG2NUM)
+ruby_libvirt_struct_reader(domain_info, memory, memory, ULONG2NUM)
+ruby_libvirt_struct_reader(domain_info, nr_virt_cpu, nrVirtCpu, INT2NUM)
+ruby_libvirt_struct_reader(domain_info, cpu_time, cpuTime, ULL2NUM)
+
 /*
  * call-seq:
  *   dom.info -> Libvirt::Domain::Info
@@ -569,20 +698,12 @@ static VALUE libvirt_domain_info(VALUE d)
 {
     virDomainInfo info;
     int r;
-    VALUE result;
 
     r = virDomainGetInfo(ruby_libvirt_domain_get(d), &info);
     ruby_libvirt_raise_error_if(r < 0, e_RetrieveError, "virDomainGetInfo",
                                 ruby_libvirt_connect_get(d));
 
-    result = rb_class_new_instance(0, NULL, c_domain_info);
-    rb_iv_set(result, "@state", CHR2FIX(info.state));
-    rb_iv_set(result, "@max_mem", ULONG2NUM(info.maxMem));
-    rb_iv_set(result, "@memory", ULONG2NUM(info.memory));
-    rb_iv_set(result, "@nr_virt_cpu", INT2NUM((int) info.nrVirtCpu));
-    rb_iv_set(result, "@cpu_time", ULL2NUM(info.cpuTime));
-
-    return result;
+    return domain_info_new(c_domain_info, &info);
 }
 
 #if HAVE_VIRDOMAINGETSECURITYLABEL
@@ -612,6 +733,14 @@ static VALUE libvirt_domain_security_label(VALUE d)
 }
 #endif
 
+ruby_libvirt_struct_type(domain_block_stats, virDomainBlockStatsStruct,
+                         "Libvirt::Domain::BlockStats")
+ruby_libvirt_struct_reader(domain_block_stats, rd_req, rd_req, LL2NUM)
+ruby_libvirt_struct_reader(domain_block_stats, rd_bytes, rd_bytes, LL2NUM)
+ruby_libvirt_struct_reader(domain_block_stats, wr_req, wr_req, LL2NUM)
+ruby_libvirt_struct_reader(domain_block_stats, wr_bytes, wr_bytes, LL2NUM)
+ruby_libvirt_struct_reader(domain_block_stats, errs, errs, LL2NUM)
+
 /*
  * call-seq:
  *   dom.block_stats(path) -> Libvirt::Domain::BlockStats
@@ -623,24 +752,21 @@ static VALUE libvirt_domain_block_stats(VALUE d, VALUE path)
 {
     virDomainBlockStatsStruct stats;
     int r;
-    VALUE result;
 
     r = virDomainBlockStats(ruby_libvirt_domain_get(d), StringValueCStr(path),
                             &stats, sizeof(stats));
     ruby_libvirt_raise_error_if(r < 0, e_RetrieveError, "virDomainBlockStats",
                                 ruby_libvirt_connect_get(d));
 
-    result = rb_class_new_instance(0, NULL, c_domain_block_stats);
-    rb_iv_set(result, "@rd_req", LL2NUM(stats.rd_req));
-    rb_iv_set(result, "@rd_bytes", LL2NUM(stats.rd_bytes));
-    rb_iv_set(result, "@wr_req", LL2NUM(stats.wr_req));
-    rb_iv_set(result, "@wr_bytes", LL2NUM(stats.wr_bytes));
-    rb_iv_set(result, "@errs", LL2NUM(stats.errs));
-
-    return result;
+    return domain_block_stats_new(c_domain_block_stats, &stats);
 }
 
 #if HAVE_TYPE_VIRDOMAINMEMORYSTATPTR
+ruby_libvirt_struct_type(domain_memory_stats, virDomainMemoryStatStruct,
+                         "Libvirt::Domain::MemoryStats")
+ruby_libvirt_struct_reader(domain_memory_stats, tag, tag, INT2NUM)
+ruby_libvirt_struct_reader(domain_memory_stats, value, val, ULL2NUM)
+
 /*
  * call-seq:
  *   dom.memory_stats(flags=0) -> [ Libvirt::Domain::MemoryStats ]
@@ -652,7 +778,7 @@ static VALUE libvirt_domain_memory_stats(int argc, VALUE *argv, VALUE d)
 {
     virDomainMemoryStatStruct stats[6];
     int i, r;
-    VALUE result, flags, tmp;
+    VALUE result, flags;
 
     rb_scan_args(argc, argv, "01", &flags);
 
@@ -673,11 +799,9 @@ static VALUE libvirt_domain_memory_stats(int argc, VALUE *argv, VALUE d)
      */
     result = rb_ary_new2(r);
     for (i = 0; i < r; i++) {
-        tmp = rb_class_new_instance(0, NULL, c_domain_memory_stats);
-        rb_iv_set(tmp, "@tag", INT2NUM(stats[i].tag));
-        rb_iv_set(tmp, "@val", ULL2NUM(stats[i].val));
-
-        rb_ary_store(result, i, tmp);
+        rb_ary_store(result, i,
+                     domain_memory_stats_new(c_domain_memory_stats,
+                                             &stats[i]));
     }
 
     return result;
@@ -685,6 +809,12 @@ static VALUE libvirt_domain_memory_stats(int argc, VALUE *argv, VALUE d)
 #endif
 
 #if HAVE_TYPE_VIRDOMAINBLOCKINFOPTR
+ruby_libvirt_struct_type(domain_block_info, virDomainBlockInfo,
+                         "Libvirt::Domain::BlockInfo")
+ruby_libvirt_struct_reader(domain_block_info, capacity, capacity, ULL2NUM)
+ruby_libvirt_struct_reader(domain_block_info, allocation, allocation, ULL2NUM)
+ruby_libvirt_struct_reader(domain_block_info, physical, physical, ULL2NUM)
+
 /*
  * call-seq:
  *   dom.blockinfo(path, flags=0) -> Libvirt::Domain::BlockInfo
@@ -696,7 +826,7 @@ static VALUE libvirt_domain_block_info(int argc, VALUE *argv, VALUE d)
 {
     virDomainBlockInfo info;
     int r;
-    VALUE result, flags, path;
+    VALUE flags, path;
 
     rb_scan_args(argc, argv, "11", &path, &flags);
 
@@ -706,100 +836,556 @@ static VALUE libvirt_domain_block_info(int argc, VALUE *argv, VALUE d)
                                 "virDomainGetBlockInfo",
                                 ruby_libvirt_connect_get(d));
 
-    result = rb_class_new_instance(0, NULL, c_domain_block_info);
-    rb_iv_set(result, "@capacity", ULL2NUM(info.capacity));
-    rb_iv_set(result, "@allocation", ULL2NUM(info.allocation));
-    rb_iv_set(result, "@physical", ULL2NUM(info.physical));
+    return domain_block_info_new(c_domain_block_info, &info);
+}
+#endif
+
+#if HAVE_VIRDOMAINBLOCKPEEK || HAVE_VIRDOMAINMEMORYPEEK
+/* What the libvirt remote protocol has always allowed in one peek */
+#define DOMAIN_PEEK_CHUNK 65536
+#define DOMAIN_PEEK_MAX_THREADS 64
 
-    return result;
+struct domain_peek_slot {
+    int failed;
+    virError err;
+};
+
+/* A block peek (path set) or memory peek of size bytes from offset.  It is
+ * read window by window, each window being up to threads chunks that are
+ * fetched at once with the GVL released: straight into the String str, or
+ * into heap and from there written to the IO io or yielded.
+ */
+struct domain_peek {
+    virDomainPtr dom;
+    /* a frozen copy of the path String, so that path stays valid while the
+     * GVL is released
+     */
+    VALUE pathstr;
+    const char *path;
+    unsigned long long offset;
+    unsigned long long size;
+    unsigned int flags;
+    size_t chunk;
+    int threads;
+    VALUE str;
+    VALUE io;
+    char *heap;
+    struct domain_peek_slot *slots;
+    /* the window being read */
+    unsigned long long done;
+    char *window;
+    size_t window_len;
+};
+
+static void domain_peek_fetch(long i, void *p)
+{
+    struct domain_peek *peek = (struct domain_peek *)p;
+    size_t off, len;
+    int r = -1;
+
+    off = (size_t)i * peek->chunk;
+    len = peek->window_len - off;
+    if (len > peek->chunk) {
+        len = peek->chunk;
+    }
+
+    if (peek->path) {
+#if HAVE_VIRDOMAINBLOCKPEEK
+        r = virDomainBlockPeek(peek->dom, peek->path,
+                               peek->offset + peek->done + off, len,
+                               peek->window + off, peek->flags);
+#endif
+    }
+    else {
+#if HAVE_VIRDOMAINMEMORYPEEK
+        r = virDomainMemoryPeek(peek->dom, peek->offset + peek->done + off,
+                                len, peek->window + off, peek->flags);
+#endif
+    }
+    if (r < 0) {
+        peek->slots[i].failed = 1;
+        virCopyLastError(&peek->slots[i].err);
+        virResetLastError();
+    }
+}
+
+static VALUE domain_peek_run(VALUE in)
+{
+    struct domain_peek *peek = (struct domain_peek *)in;
+    unsigned long long left;
+    size_t off, len;
+    long i, nchunks, ran;
+
+    while (peek->done < peek->size) {
+        left = peek->size - peek->done;
+        peek->window_len = left < peek->chunk * peek->threads ?
+            (size_t)left : peek->chunk * peek->threads;
+        peek->window = NIL_P(peek->str) ? peek->heap :
+            RSTRING_PTR(peek->str) + peek->done;
+        nchunks = (peek->window_len + peek->chunk - 1) / peek->chunk;
+
+        for (i = 0; i < nchunks; i++) {
+            if (peek->slots[i].failed) {
+                virResetError(&peek->slots[i].err);
+                peek->slots[i].failed = 0;
+            }
+        }
+
+        ran = ruby_libvirt_parallel_nogvl(nchunks, peek->threads,
+                                          domain_peek_fetch, peek);
+        if (ran < nchunks) {
+            rb_thread_check_ints();
+            /* not interrupted after all; read the window again */
+            continue;
+        }
+
+        for (i = 0; i < nchunks; i++) {
+            if (peek->slots[i].failed) {
+                rb_exc_raise(ruby_libvirt_error_new(e_RetrieveError,
+                                                    peek->path ?
+                                                    "virDomainBlockPeek" :
+                                                    "virDomainMemoryPeek",
+                                                    &peek->slots[i].err));
+            }
+        }
+
+        if (!NIL_P(peek->io)) {
+            rb_io_write(peek->io, rb_str_new(peek->window, peek->window_len));
+        }
+        else if (NIL_P(peek->str)) {
+            for (off = 0; off < peek->window_len; off += len) {
+                len = peek->window_len - off;
+                if (len > peek->chunk) {
+                    len = peek->chunk;
+                }
+                rb_yield_values(2, rb_str_new(peek->window + off, len),
+                                ULL2NUM(peek->offset + peek->done + off));
+            }
+        }
+
+        peek->done += peek->window_len;
+    }
+
+    return Qnil;
+}
+
+static VALUE domain_peek_free(VALUE in)
+{
+    struct domain_peek *peek = (struct domain_peek *)in;
+    int i;
+
+    for (i = 0; i < peek->threads; i++) {
+        if (peek->slots[i].failed) {
+            virResetError(&peek->slots[i].err);
+        }
+    }
+    xfree(peek->slots);
+    xfree(peek->heap);
+    if (!NIL_P(peek->str)) {
+        rb_str_unlocktmp(peek->str);
+    }
+
+    return Qnil;
+}
+
+/* Fill in the chunk_size: and threads: options of peek from opts (which
+ * may be nil).
+ */
+static void domain_peek_options(struct domain_peek *peek, VALUE opts)
+{
+    VALUE val;
+
+    peek->chunk = DOMAIN_PEEK_CHUNK;
+    peek->threads = 4;
+    if (NIL_P(opts)) {
+        return;
+    }
+
+    Check_Type(opts, T_HASH);
+    val = rb_hash_aref(opts, ID2SYM(rb_intern("chunk_size")));
+    if (!NIL_P(val)) {
+        if (NUM2LONG(val) < 1 || NUM2LONG(val) > DOMAIN_PEEK_CHUNK) {
+            rb_raise(rb_eArgError, "chunk_size must be between 1 and %d",
+                     DOMAIN_PEEK_CHUNK);
+        }
+        peek->chunk = NUM2LONG(val);
+    }
+    val = rb_hash_aref(opts, ID2SYM(rb_intern("threads")));
+    if (!NIL_P(val)) {
+        peek->threads = NUM2INT(val);
+    }
+    if (peek->threads < 1) {
+        peek->threads = 1;
+    }
+    if (peek->threads > DOMAIN_PEEK_MAX_THREADS) {
+        peek->threads = DOMAIN_PEEK_MAX_THREADS;
+    }
+}
+
+/* Read the peek described by peek into target, which is a String (resized
+ * to exactly the bytes read), an object that responds to write, or nil to
+ * yield each chunk.
+ */
+static VALUE domain_peek(struct domain_peek *peek, VALUE target)
+{
+    peek->str = Qnil;
+    peek->io = Qnil;
+    peek->heap = NULL;
+    peek->done = 0;
+
+    if (RB_TYPE_P(target, T_STRING)) {
+        if (peek->size > LONG_MAX) {
+            rb_raise(rb_eArgError, "size too big for a String");
+        }
+        rb_str_modify(target);
+        rb_str_resize(target, (long)peek->size);
+        peek->str = target;
+    }
+    else if (NIL_P(target) ||
+             rb_respond_to(target, rb_intern("write"))) {
+        peek->io = target;
+        peek->heap = ALLOC_N(char, peek->chunk * peek->threads);
+    }
+    else {
+        rb_raise(rb_eTypeError, "wrong argument type (expected String or IO)");
+    }
+
+    peek->slots = ALLOC_N(struct domain_peek_slot, peek->threads);
+    memset(peek->slots, 0, sizeof(*peek->slots) * peek->threads);
+    if (!NIL_P(peek->str)) {
+        rb_str_locktmp(peek->str);
+    }
+
+    rb_ensure(domain_peek_run, (VALUE)peek, domain_peek_free, (VALUE)peek);
+    RB_GC_GUARD(peek->pathstr);
+
+    return NIL_P(target) ? Qnil : target;
 }
 #endif
 
 #if HAVE_VIRDOMAINBLOCKPEEK
+/* Parse (path, offset, size, [target,] flags=0, options={}) */
+static void domain_block_peek_args(int argc, VALUE *argv, VALUE d,
+                                   int with_target, struct domain_peek *peek,
+                                   VALUE *target)
+{
+    VALUE path, offset, size, flags, opts;
+
+    *target = Qnil;
+    if (with_target) {
+        rb_scan_args(argc, argv, "42", &path, &offset, &size, target, &flags,
+                     &opts);
+    }
+    else {
+        rb_scan_args(argc, argv, "32", &path, &offset, &size, &flags, &opts);
+    }
+    if (TYPE(flags) == T_HASH && NIL_P(opts)) {
+        opts = flags;
+        flags = Qnil;
+    }
+
+    peek->dom = ruby_libvirt_domain_get(d);
+    StringValueCStr(path);
+    peek->pathstr = rb_str_new_frozen(path);
+    peek->path = StringValueCStr(peek->pathstr);
+    peek->offset = NUM2ULL(offset);
+    peek->size = NUM2ULL(size);
+    peek->flags = ruby_libvirt_value_to_uint(flags);
+    domain_peek_options(peek, opts);
+}
+
 /*
  * call-seq:
  *   dom.block_peek(path, offset, size, flags=0) -> String
  *
  * Call virDomainBlockPeek[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainBlockPeek]
  * to read size number of bytes, starting at offset offset from domain backing
- * file path.  Due to limitations of the libvirt remote protocol, the user
- * should never request more than 64k bytes.
+ * file path.  Requests bigger than the 64k bytes the libvirt remote protocol
+ * allows are split up as for dom.block_peek_into.
  */
 static VALUE libvirt_domain_block_peek(int argc, VALUE *argv, VALUE d)
 {
     VALUE path, offset, size, flags;
-    char *buffer;
-    int r;
+    VALUE args[4];
+    struct domain_peek peek;
+    VALUE target;
 
     rb_scan_args(argc, argv, "31", &path, &offset, &size, &flags);
 
-    buffer = alloca(sizeof(char) * NUM2UINT(size));
+    args[0] = path;
+    args[1] = offset;
+    args[2] = size;
+    args[3] = flags;
+    domain_block_peek_args(4, args, d, 0, &peek, &target);
 
-    r = virDomainBlockPeek(ruby_libvirt_domain_get(d), StringValueCStr(path),
-                           NUM2ULL(offset), NUM2UINT(size), buffer,
-                           ruby_libvirt_value_to_uint(flags));
-    ruby_libvirt_raise_error_if(r < 0, e_RetrieveError, "virDomainBlockPeek",
-                                ruby_libvirt_connect_get(d));
+    return domain_peek(&peek, rb_str_new(NULL, 0));
+}
+
+/*
+ * call-seq:
+ *   dom.block_peek_into(path, offset, size, buffer, flags=0, chunk_size: 65536, threads: 4) -> buffer
+ *
+ * Like dom.block_peek, but read into buffer, which is either a String
+ * (which is resized to size and filled in place, so that it can be reused
+ * from call to call) or an IO (or anything else that responds to write).
+ * The range is read with
+ * virDomainBlockPeek[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainBlockPeek]
+ * chunk_size bytes (at most 65536) at a time, with up to threads of these
+ * calls in flight at once and the GVL released, so that only chunk_size times
+ * threads bytes are ever buffered when writing to an IO.
+ */
+static VALUE libvirt_domain_block_peek_into(int argc, VALUE *argv, VALUE d)
+{
+    struct domain_peek peek;
+    VALUE target;
+
+    domain_block_peek_args(argc, argv, d, 1, &peek, &target);
+
+    return domain_peek(&peek, target);
+}
 
-    return rb_str_new(buffer, NUM2UINT(size));
+/*
+ * call-seq:
+ *   dom.block_peek_each(path, offset, size, flags=0, chunk_size: 65536, threads: 4) {|data, offset| block} -> nil
+ *
+ * Read the range as for dom.block_peek_into, yielding each chunk (a String
+ * of up to chunk_size bytes) and its offset in order.  Without a block, an
+ * Enumerator is returned.
+ */
+static VALUE libvirt_domain_block_peek_each(int argc, VALUE *argv, VALUE d)
+{
+    struct domain_peek peek;
+    VALUE target;
+
+    /* check the arguments now rather than on the first iteration */
+    domain_block_peek_args(argc, argv, d, 0, &peek, &target);
+
+    RETURN_ENUMERATOR(d, argc, argv);
+
+    return domain_peek(&peek, Qnil);
 }
 #endif
 
 #if HAVE_VIRDOMAINMEMORYPEEK
+/* Parse (start, size, [target,] flags=MEMORY_VIRTUAL, options={}) */
+static void domain_memory_peek_args(int argc, VALUE *argv, VALUE d,
+                                    int with_target, struct domain_peek *peek,
+                                    VALUE *target)
+{
+    VALUE start, size, flags, opts;
+
+    *target = Qnil;
+    if (with_target) {
+        rb_scan_args(argc, argv, "32", &start, &size, target, &flags, &opts);
+    }
+    else {
+        rb_scan_args(argc, argv, "22", &start, &size, &flags, &opts);
+    }
+    if (TYPE(flags) == T_HASH && NIL_P(opts)) {
+        opts = flags;
+        flags = Qnil;
+    }
+
+    if (NIL_P(flags)) {
+        flags = INT2NUM(VIR_MEMORY_VIRTUAL);
+    }
+
+    peek->dom = ruby_libvirt_domain_get(d);
+    peek->pathstr = Qnil;
+    peek->path = NULL;
+    peek->offset = NUM2ULL(start);
+    peek->size = NUM2ULL(size);
+    peek->flags = NUM2UINT(flags);
+    domain_peek_options(peek, opts);
+}
+
 /*
  * call-seq:
  *   dom.memory_peek(start, size, flags=Libvirt::Domain::MEMORY_VIRTUAL) -> String
  *
  * Call virDomainMemoryPeek[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainMemoryPeek]
  * to read size number of bytes from offset start from the domain memory.
- * Due to limitations of the libvirt remote protocol, the user
- * should never request more than 64k bytes.
+ * Requests bigger than the 64k bytes the libvirt remote protocol allows are
+ * split up as for dom.memory_peek_into.
  */
 static VALUE libvirt_domain_memory_peek(int argc, VALUE *argv, VALUE d)
 {
     VALUE start, size, flags;
-    char *buffer;
-    int r;
+    VALUE args[3];
+    struct domain_peek peek;
+    VALUE target;
 
     rb_scan_args(argc, argv, "21", &start, &size, &flags);
 
-    if (NIL_P(flags)) {
-        flags = INT2NUM(VIR_MEMORY_VIRTUAL);
-    }
+    args[0] = start;
+    args[1] = size;
+    args[2] = flags;
+    domain_memory_peek_args(3, args, d, 0, &peek, &target);
 
-    buffer = alloca(sizeof(char) * NUM2UINT(size));
+    return domain_peek(&peek, rb_str_new(NULL, 0));
+}
 
-    r = virDomainMemoryPeek(ruby_libvirt_domain_get(d), NUM2ULL(start),
-                            NUM2UINT(size), buffer, NUM2UINT(flags));
-    ruby_libvirt_raise_error_if(r < 0, e_RetrieveError, "virDomainMemoryPeek",
-                                ruby_libvirt_connect_get(d));
+/*
+ * call-seq:
+ *   dom.memory_peek_into(start, size, buffer, flags=Libvirt::Domain::MEMORY_VIRTUAL, chunk_size: 65536, threads: 4) -> buffer
+ *
+ * Like dom.memory_peek, but read into buffer, a String or an IO, chunk by
+ * chunk with
+ * virDomainMemoryPeek[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainMemoryPeek]
+ * as for dom.block_peek_into.
+ */
+static VALUE libvirt_domain_memory_peek_into(int argc, VALUE *argv, VALUE d)
+{
+    struct domain_peek peek;
+    VALUE target;
 
-    return rb_str_new(buffer, NUM2UINT(size));
+    domain_memory_peek_args(argc, argv, d, 1, &peek, &target);
+
+    return domain_peek(&peek, target);
 }
-#endif
 
-/* call-seq:
- *   dom.vcpus -> [ Libvirt::Domain::VCPUInfo ]
+/*
+ * call-seq:
+ *   dom.memory_peek_each(start, size, flags=Libvirt::Domain::MEMORY_VIRTUAL, chunk_size: 65536, threads: 4) {|data, offset| block} -> nil
  *
- * Call virDomainGetVcpus[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetVcpus]
- * to retrieve detailed information about the state of a domain's virtual CPUs.
+ * Read the range as for dom.memory_peek_into, yielding each chunk and its
+ * address in order.  Without a block, an Enumerator is returned.
  */
-static VALUE libvirt_domain_vcpus(VALUE d)
+static VALUE libvirt_domain_memory_peek_each(int argc, VALUE *argv, VALUE d)
 {
-    virDomainInfo dominfo;
-    virVcpuInfoPtr cpuinfo = NULL;
-    unsigned char *cpumap;
-    int cpumaplen, r, j, maxcpus;
-    VALUE result, vcpuinfo, p2vcpumap;
-    unsigned short i;
+    struct domain_peek peek;
+    VALUE target;
 
-    r = virDomainGetInfo(ruby_libvirt_domain_get(d), &dominfo);
-    ruby_libvirt_raise_error_if(r < 0, e_RetrieveError, "virDomainGetInfo",
-                                ruby_libvirt_connect_get(d));
+    /* check the arguments now rather than on the first iteration */
+    domain_memory_peek_args(argc, argv, d, 0, &peek, &target);
+
+    RETURN_ENUMERATOR(d, argc, argv);
+
+    return domain_peek(&peek, Qnil);
+}
+#endif
+
+/* Libvirt::Domain::VCPUInfo keeps the virVcpuInfo plus this vcpu's slice of
+ * the cpumap, and only builds the cpumap array when it is asked for.
+ */
+struct domain_vcpuinfo {
+    virVcpuInfo info;
+    int have_info;
+    int maxcpus;
+    unsigned char *cpumap;
+};
+
+static void domain_vcpuinfo_free(void *p)
+{
+    struct domain_vcpuinfo *vcpu = p;
+
+    xfree(vcpu->cpumap);
+    xfree(vcpu);
+}
+
+static const rb_data_type_t domain_vcpuinfo_data_type = {
+    "Libvirt::Domain::VCPUInfo",
+    { NULL, domain_vcpuinfo_free, NULL, },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE domain_vcpuinfo_alloc(VALUE klass)
+{
+    struct domain_vcpuinfo *vcpu;
+
+    return TypedData_Make_Struct(klass, struct domain_vcpuinfo,
+                                 &domain_vcpuinfo_data_type, vcpu);
+}
+
+static struct domain_vcpuinfo *domain_vcpuinfo_get(VALUE s)
+{
+    struct domain_vcpuinfo *vcpu;
+
+    TypedData_Get_Struct(s, struct domain_vcpuinfo, &domain_vcpuinfo_data_type,
+                         vcpu);
+    return vcpu;
+}
+
+static VALUE domain_vcpuinfo_number(VALUE s)
+{
+    struct domain_vcpuinfo *vcpu = domain_vcpuinfo_get(s);
+
+    return vcpu->have_info ? INT2NUM(vcpu->info.number) : Qnil;
+}
+
+static VALUE domain_vcpuinfo_state(VALUE s)
+{
+    struct domain_vcpuinfo *vcpu = domain_vcpuinfo_get(s);
+
+    return vcpu->have_info ? INT2NUM(vcpu->info.state) : Qnil;
+}
+
+static VALUE domain_vcpuinfo_cpu_time(VALUE s)
+{
+    struct domain_vcpuinfo *vcpu = domain_vcpuinfo_get(s);
+
+    return vcpu->have_info ? ULL2NUM(vcpu->info.cpuTime) : Qnil;
+}
+
+static VALUE domain_vcpuinfo_cpu(VALUE s)
+{
+    struct domain_vcpuinfo *vcpu = domain_vcpuinfo_get(s);
+
+    return vcpu->have_info ? INT2NUM(vcpu->info.cpu) : Qnil;
+}
+
+static VALUE domain_vcpuinfo_cpumap(VALUE s)
+{
+    struct domain_vcpuinfo *vcpu = domain_vcpuinfo_get(s);
+    VALUE result;
+    int j;
+
+    if (vcpu->cpumap == NULL) {
+        return Qnil;
+    }
+
+    result = rb_ary_new2(vcpu->maxcpus);
+    for (j = 0; j < vcpu->maxcpus; j++) {
+        rb_ary_push(result, VIR_CPU_USED(vcpu->cpumap, j) ? Qtrue : Qfalse);
+    }
+
+    return result;
+}
+
+static VALUE domain_vcpuinfo_cpu_bitmap(VALUE s)
+{
+    struct domain_vcpuinfo *vcpu = domain_vcpuinfo_get(s);
+
+    if (vcpu->cpumap == NULL) {
+        return Qnil;
+    }
+
+    return ruby_libvirt_cpumap_new(vcpu->cpumap, vcpu->maxcpus);
+}
+
+/* call-seq:
+ *   dom.vcpus -> [ Libvirt::Domain::VCPUInfo ]
+ *
+ * Call virDomainGetVcpus[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetVcpus]
+ * to retrieve detailed information about the state of a domain's virtual CPUs.
+ */
+static VALUE libvirt_domain_vcpus(VALUE d)
+{
+    virDomainInfo dominfo;
+    virVcpuInfoPtr cpuinfo = NULL;
+    unsigned char *cpumap;
+    int cpumaplen, r, maxcpus;
+    VALUE result, vcpuinfo;
+    struct domain_vcpuinfo *vcpu;
+    unsigned short i;
+
+    r = virDomainGetInfo(ruby_libvirt_domain_get(d), &dominfo);
+    ruby_libvirt_raise_error_if(r < 0, e_RetrieveError, "virDomainGetInfo",
+                                ruby_libvirt_connect_get(d));
 
     cpuinfo = alloca(sizeof(virVcpuInfo) * dominfo.nrVirtCpu);
 
-    maxcpus = ruby_libvirt_get_maxcpus(ruby_libvirt_connect_get(d));
+    maxcpus = ruby_libvirt_get_maxcpus(d);
 
     cpumaplen = VIR_CPU_MAPLEN(maxcpus);
 
@@ -824,36 +1410,27 @@ static VALUE libvirt_domain_vcpus(VALUE d)
                                     "virDomainGetVcpuPinInfo",
                                     ruby_libvirt_connect_get(d));
 
+        /* only the pinning information is valid in this case */
+        cpuinfo = NULL;
+
 #else
         ruby_libvirt_raise_error_if(r < 0, e_RetrieveError, "virDomainGetVcpus",
                                     ruby_libvirt_connect_get(d));
 #endif
     }
 
-    result = rb_ary_new();
+    result = rb_ary_new2(r);
 
     for (i = 0; i < r; i++) {
-        vcpuinfo = rb_class_new_instance(0, NULL, c_domain_vcpuinfo);
+        vcpuinfo = domain_vcpuinfo_alloc(c_domain_vcpuinfo);
+        vcpu = domain_vcpuinfo_get(vcpuinfo);
         if (cpuinfo != NULL) {
-            rb_iv_set(vcpuinfo, "@number", INT2NUM(cpuinfo[i].number));
-            rb_iv_set(vcpuinfo, "@state", INT2NUM(cpuinfo[i].state));
-            rb_iv_set(vcpuinfo, "@cpu_time", ULL2NUM(cpuinfo[i].cpuTime));
-            rb_iv_set(vcpuinfo, "@cpu", INT2NUM(cpuinfo[i].cpu));
-        }
-        else {
-            rb_iv_set(vcpuinfo, "@number", Qnil);
-            rb_iv_set(vcpuinfo, "@state", Qnil);
-            rb_iv_set(vcpuinfo, "@cpu_time", Qnil);
-            rb_iv_set(vcpuinfo, "@cpu", Qnil);
+            vcpu->info = cpuinfo[i];
+            vcpu->have_info = 1;
         }
-
-        p2vcpumap = rb_ary_new();
-
-        for (j = 0; j < maxcpus; j++) {
-            rb_ary_push(p2vcpumap, (VIR_CPU_USABLE(cpumap, cpumaplen,
-                                                   i, j)) ? Qtrue : Qfalse);
-        }
-        rb_iv_set(vcpuinfo, "@cpumap", p2vcpumap);
+        vcpu->maxcpus = maxcpus;
+        vcpu->cpumap = ALLOC_N(unsigned char, cpumaplen);
+        memcpy(vcpu->cpumap, VIR_GET_CPUMAP(cpumap, cpumaplen, i), cpumaplen);
 
         rb_ary_push(result, vcpuinfo);
     }
@@ -893,6 +1470,17 @@ static VALUE libvirt_domain_persistent_p(VALUE d)
 }
 #endif
 
+ruby_libvirt_struct_type(domain_ifinfo, virDomainInterfaceStatsStruct,
+                         "Libvirt::Domain::InterfaceInfo")
+ruby_libvirt_struct_reader(domain_ifinfo, rx_bytes, rx_bytes, LL2NUM)
+ruby_libvirt_struct_reader(domain_ifinfo, rx_packets, rx_packets, LL2NUM)
+ruby_libvirt_struct_reader(domain_ifinfo, rx_errs, rx_errs, LL2NUM)
+ruby_libvirt_struct_reader(domain_ifinfo, rx_drop, rx_drop, LL2NUM)
+ruby_libvirt_struct_reader(domain_ifinfo, tx_bytes, tx_bytes, LL2NUM)
+ruby_libvirt_struct_reader(domain_ifinfo, tx_packets, tx_packets, LL2NUM)
+ruby_libvirt_struct_reader(domain_ifinfo, tx_errs, tx_errs, LL2NUM)
+ruby_libvirt_struct_reader(domain_ifinfo, tx_drop, tx_drop, LL2NUM)
+
 /*
  * call-seq:
  *   dom.ifinfo(if) -> Libvirt::Domain::IfInfo
@@ -914,15 +1502,7 @@ static VALUE libvirt_domain_if_stats(VALUE d, VALUE sif)
                                     "virDomainInterfaceStats",
                                     ruby_libvirt_connect_get(d));
 
-        result = rb_class_new_instance(0, NULL, c_domain_ifinfo);
-        rb_iv_set(result, "@rx_bytes", LL2NUM(ifinfo.rx_bytes));
-        rb_iv_set(result, "@rx_packets", LL2NUM(ifinfo.rx_packets));
-        rb_iv_set(result, "@rx_errs", LL2NUM(ifinfo.rx_errs));
-        rb_iv_set(result, "@rx_drop", LL2NUM(ifinfo.rx_drop));
-        rb_iv_set(result, "@tx_bytes", LL2NUM(ifinfo.tx_bytes));
-        rb_iv_set(result, "@tx_packets", LL2NUM(ifinfo.tx_packets));
-        rb_iv_set(result, "@tx_errs", LL2NUM(ifinfo.tx_errs));
-        rb_iv_set(result, "@tx_drop", LL2NUM(ifinfo.tx_drop));
+        result = domain_ifinfo_new(c_domain_ifinfo, &ifinfo);
     }
     return result;
 }
@@ -1033,6 +1613,7 @@ static VALUE libvirt_domain_max_memory_equal(VALUE d, VALUE max_memory)
     ruby_libvirt_raise_error_if(r < 0, e_DefinitionError,
                                 "virDomainSetMaxMemory",
                                 ruby_libvirt_connect_get(d));
+    ruby_libvirt_xml_cache_domain_changed(d);
 
     return ULONG2NUM(max_memory);
 }
@@ -1065,6 +1646,7 @@ static VALUE libvirt_domain_memory_equal(VALUE d, VALUE in)
 
     ruby_libvirt_raise_error_if(r < 0, e_DefinitionError, "virDomainSetMemory",
                                 ruby_libvirt_connect_get(d));
+    ruby_libvirt_xml_cache_domain_changed(d);
 
     return ULONG2NUM(memory);
 }
@@ -1130,20 +1712,18 @@ static VALUE libvirt_domain_vcpus_equal(VALUE d, VALUE in)
                  "wrong argument type (expected Number or Array)");
     }
 
-    ruby_libvirt_generate_call_nil(virDomainSetVcpusFlags,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d), NUM2UINT(nvcpus),
-                                   NUM2UINT(flags));
+    domain_generate_call_nil_changed(virDomainSetVcpusFlags, d,
+                                     ruby_libvirt_domain_get(d), NUM2UINT(nvcpus),
+                                     NUM2UINT(flags));
 #else
 
     if (NUM2UINT(flags) != 0) {
         rb_raise(e_NoSupportError, "Non-zero flags not supported");
     }
 
-    ruby_libvirt_generate_call_nil(virDomainSetVcpus,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   NUM2UINT(nvcpus));
+    domain_generate_call_nil_changed(virDomainSetVcpus, d,
+                                     ruby_libvirt_domain_get(d),
+                                     NUM2UINT(nvcpus));
 #endif
 }
 
@@ -1165,10 +1745,9 @@ static VALUE libvirt_domain_vcpus_flags_equal(VALUE d, VALUE in)
 
     domain_input_to_fixnum_and_flags(in, &nvcpus, &flags);
 
-    ruby_libvirt_generate_call_nil(virDomainSetVcpusFlags,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d), NUM2UINT(nvcpus),
-                                   NUM2UINT(flags));
+    domain_generate_call_nil_changed(virDomainSetVcpusFlags, d,
+                                     ruby_libvirt_domain_get(d), NUM2UINT(nvcpus),
+                                     NUM2UINT(flags));
 }
 #endif
 
@@ -1179,65 +1758,84 @@ static VALUE libvirt_domain_vcpus_flags_equal(VALUE d, VALUE in)
  * Call virDomainPinVcpu[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainPinVcpu]
  * to pin a particular virtual CPU to a range of physical processors.  The
  * cpulist should be an array of Fixnums representing the physical processors
- * this virtual CPU should be allowed to be scheduled on.
+ * this virtual CPU should be allowed to be scheduled on, or a
+ * Libvirt::CPUMap.
  */
 static VALUE libvirt_domain_pin_vcpu(int argc, VALUE *argv, VALUE d)
 {
-    VALUE vcpu, cpulist, flags, e;
-    int i, cpumaplen, maxcpus;
+    VALUE vcpu, cpulist, flags;
+    int cpumaplen, maxcpus;
     unsigned char *cpumap;
 
     rb_scan_args(argc, argv, "21", &vcpu, &cpulist, &flags);
 
-    Check_Type(cpulist, T_ARRAY);
-
-    maxcpus = ruby_libvirt_get_maxcpus(ruby_libvirt_connect_get(d));
+    maxcpus = ruby_libvirt_get_maxcpus(d);
 
     cpumaplen = VIR_CPU_MAPLEN(maxcpus);
 
     cpumap = alloca(sizeof(unsigned char) * cpumaplen);
     MEMZERO(cpumap, unsigned char, cpumaplen);
 
-    for (i = 0; i < RARRAY_LEN(cpulist); i++) {
-        e = rb_ary_entry(cpulist, i);
-        VIR_USE_CPU(cpumap, NUM2UINT(e));
-    }
+    ruby_libvirt_cpumap_fill(cpulist, cpumap, maxcpus);
 
 #if HAVE_VIRDOMAINPINVCPUFLAGS
-    ruby_libvirt_generate_call_nil(virDomainPinVcpuFlags,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   NUM2UINT(vcpu), cpumap, cpumaplen,
-                                   ruby_libvirt_value_to_uint(flags));
+    domain_generate_call_nil_changed(virDomainPinVcpuFlags, d,
+                                     ruby_libvirt_domain_get(d),
+                                     NUM2UINT(vcpu), cpumap, cpumaplen,
+                                     ruby_libvirt_value_to_uint(flags));
 #else
     if (ruby_libvirt_value_to_uint(flags) != 0) {
         rb_raise(e_NoSupportError, "Non-zero flags not supported");
     }
 
-    ruby_libvirt_generate_call_nil(virDomainPinVcpu,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d), NUM2UINT(vcpu),
-                                   cpumap, cpumaplen);
+    domain_generate_call_nil_changed(virDomainPinVcpu, d,
+                                     ruby_libvirt_domain_get(d), NUM2UINT(vcpu),
+                                     cpumap, cpumaplen);
 #endif
 }
 
+ruby_libvirt_declare_nogvl2(char *, virDomainGetXMLDesc, virDomainPtr,
+                            unsigned int)
+
+static VALUE domain_xml_desc(VALUE d, unsigned int flags)
+{
+    ruby_libvirt_generate_call_string_nogvl(virDomainGetXMLDesc,
+                                            ruby_libvirt_connect_get(d), 1,
+                                            ruby_libvirt_domain_get(d), flags);
+}
+
 /*
  * call-seq:
  *   dom.xml_desc(flags=0) -> String
  *
  * Call virDomainGetXMLDesc[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetXMLDesc]
- * to retrieve the XML describing this domain.
+ * to retrieve the XML describing this domain.  If conn.enable_xml_cache
+ * has been called, the result is a frozen String shared with other
+ * callers until an event says the domain has changed.
  */
 static VALUE libvirt_domain_xml_desc(int argc, VALUE *argv, VALUE d)
 {
     VALUE flags;
+#if RUBY_LIBVIRT_XML_CACHE
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    VALUE c;
+#endif
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_string(virDomainGetXMLDesc,
-                                      ruby_libvirt_connect_get(d), 1,
-                                      ruby_libvirt_domain_get(d),
-                                      ruby_libvirt_value_to_uint(flags));
+#if RUBY_LIBVIRT_XML_CACHE
+    c = ruby_libvirt_conn_attr(d);
+    if (ruby_libvirt_xml_cache_enabled(c)) {
+        if (virDomainGetUUIDString(ruby_libvirt_domain_get(d), uuid) == 0) {
+            return ruby_libvirt_xml_cache_call(c, RUBY_LIBVIRT_XML_DOMAIN, uuid,
+                                               ruby_libvirt_value_to_uint(flags),
+                                               domain_xml_desc, d);
+        }
+        virResetLastError();
+    }
+#endif
+
+    return domain_xml_desc(d, ruby_libvirt_value_to_uint(flags));
 }
 
 /*
@@ -1270,6 +1868,13 @@ static VALUE libvirt_domain_undefine(int argc, VALUE *argv, VALUE d)
 #endif
 }
 
+#if HAVE_VIRDOMAINCREATEWITHFLAGS
+ruby_libvirt_declare_nogvl2(int, virDomainCreateWithFlags, virDomainPtr,
+                            unsigned int)
+#else
+ruby_libvirt_declare_nogvl1(int, virDomainCreate, virDomainPtr)
+#endif
+
 /*
  * call-seq:
  *   dom.create(flags=0) -> nil
@@ -1284,16 +1889,17 @@ static VALUE libvirt_domain_create(int argc, VALUE *argv, VALUE d)
     rb_scan_args(argc, argv, "01", &flags);
 
 #if HAVE_VIRDOMAINCREATEWITHFLAGS
-    ruby_libvirt_generate_call_nil(virDomainCreateWithFlags,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virDomainCreateWithFlags,
+                                         ruby_libvirt_connect_get(d),
+                                         ruby_libvirt_domain_get(d),
+                                         ruby_libvirt_value_to_uint(flags));
 #else
     if (ruby_libvirt_value_to_uint(flags) != 0) {
         rb_raise(e_NoSupportError, "Non-zero flags not supported");
     }
-    ruby_libvirt_generate_call_nil(virDomainCreate, ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d));
+    ruby_libvirt_generate_call_nil_nogvl(virDomainCreate,
+                                         ruby_libvirt_connect_get(d),
+                                         ruby_libvirt_domain_get(d));
 #endif
 }
 
@@ -1349,19 +1955,17 @@ static VALUE libvirt_domain_attach_device(int argc, VALUE *argv, VALUE d)
     rb_scan_args(argc, argv, "11", &xml, &flags);
 
 #if HAVE_VIRDOMAINATTACHDEVICEFLAGS
-    ruby_libvirt_generate_call_nil(virDomainAttachDeviceFlags,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   StringValueCStr(xml),
-                                   ruby_libvirt_value_to_uint(flags));
+    domain_generate_call_nil_changed(virDomainAttachDeviceFlags, d,
+                                     ruby_libvirt_domain_get(d),
+                                     StringValueCStr(xml),
+                                     ruby_libvirt_value_to_uint(flags));
 #else
     if (ruby_libvirt_value_to_uint(flags) != 0) {
         rb_raise(e_NoSupportError, "Non-zero flags not supported");
     }
-    ruby_libvirt_generate_call_nil(virDomainAttachDevice,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   StringValueCStr(xml));
+    domain_generate_call_nil_changed(virDomainAttachDevice, d,
+                                     ruby_libvirt_domain_get(d),
+                                     StringValueCStr(xml));
 #endif
 }
 
@@ -1379,19 +1983,17 @@ static VALUE libvirt_domain_detach_device(int argc, VALUE *argv, VALUE d)
     rb_scan_args(argc, argv, "11", &xml, &flags);
 
 #if HAVE_VIRDOMAINDETACHDEVICEFLAGS
-    ruby_libvirt_generate_call_nil(virDomainDetachDeviceFlags,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   StringValueCStr(xml),
-                                   ruby_libvirt_value_to_uint(flags));
+    domain_generate_call_nil_changed(virDomainDetachDeviceFlags, d,
+                                     ruby_libvirt_domain_get(d),
+                                     StringValueCStr(xml),
+                                     ruby_libvirt_value_to_uint(flags));
 #else
     if (ruby_libvirt_value_to_uint(flags) != 0) {
         rb_raise(e_NoSupportError, "Non-zero flags not supported");
     }
-    ruby_libvirt_generate_call_nil(virDomainDetachDevice,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   StringValueCStr(xml));
+    domain_generate_call_nil_changed(virDomainDetachDevice, d,
+                                     ruby_libvirt_domain_get(d),
+                                     StringValueCStr(xml));
 #endif
 }
 
@@ -1409,11 +2011,10 @@ static VALUE libvirt_domain_update_device(int argc, VALUE *argv, VALUE d)
 
     rb_scan_args(argc, argv, "11", &xml, &flags);
 
-    ruby_libvirt_generate_call_nil(virDomainUpdateDeviceFlags,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   StringValueCStr(xml),
-                                   ruby_libvirt_value_to_uint(flags));
+    domain_generate_call_nil_changed(virDomainUpdateDeviceFlags, d,
+                                     ruby_libvirt_domain_get(d),
+                                     StringValueCStr(xml),
+                                     ruby_libvirt_value_to_uint(flags));
 }
 #endif
 
@@ -1430,18 +2031,15 @@ static VALUE libvirt_domain_free(VALUE d)
 }
 
 #if HAVE_TYPE_VIRDOMAINSNAPSHOTPTR
-static void domain_snapshot_free(void *d)
-{
-    ruby_libvirt_free_struct(DomainSnapshot, d);
-}
+ruby_libvirt_handle_type(DomainSnapshot, "Libvirt::Domain::Snapshot")
 
 static VALUE domain_snapshot_new(virDomainSnapshotPtr d, VALUE domain)
 {
     VALUE result;
 
-    result = ruby_libvirt_new_class(c_domain_snapshot, d,
-                                    rb_iv_get(domain, "@connection"),
-                                    domain_snapshot_free);
+    result = ruby_libvirt_new_class(c_domain_snapshot,
+                                    &DomainSnapshot_handle_data_type, d,
+                                    ruby_libvirt_conn_attr(domain));
     rb_iv_set(result, "@domain", domain);
 
     return result;
@@ -1692,8 +2290,29 @@ static VALUE libvirt_domain_snapshot_name(VALUE s)
 }
 #endif
 
-
 #if HAVE_TYPE_VIRDOMAINJOBINFOPTR
+ruby_libvirt_struct_type(domain_job_info, virDomainJobInfo,
+                         "Libvirt::Domain::JobInfo")
+ruby_libvirt_struct_reader(domain_job_info, type, type, INT2NUM)
+ruby_libvirt_struct_reader(domain_job_info, time_elapsed, timeElapsed, ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_info, time_remaining, timeRemaining,
+                           ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_info, data_total, dataTotal, ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_info, data_processed, dataProcessed,
+                           ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_info, data_remaining, dataRemaining,
+                           ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_info, mem_total, memTotal, ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_info, mem_processed, memProcessed,
+                           ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_info, mem_remaining, memRemaining,
+                           ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_info, file_total, fileTotal, ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_info, file_processed, fileProcessed,
+                           ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_info, file_remaining, fileRemaining,
+                           ULL2NUM)
+
 /*
  * call-seq:
  *   dom.job_info -> Libvirt::Domain::JobInfo
@@ -1705,27 +2324,12 @@ static VALUE libvirt_domain_job_info(VALUE d)
 {
     int r;
     virDomainJobInfo info;
-    VALUE result;
 
     r = virDomainGetJobInfo(ruby_libvirt_domain_get(d), &info);
     ruby_libvirt_raise_error_if(r < 0, e_RetrieveError, "virDomainGetJobInfo",
                                 ruby_libvirt_connect_get(d));
 
-    result = rb_class_new_instance(0, NULL, c_domain_job_info);
-    rb_iv_set(result, "@type", INT2NUM(info.type));
-    rb_iv_set(result, "@time_elapsed", ULL2NUM(info.timeElapsed));
-    rb_iv_set(result, "@time_remaining", ULL2NUM(info.timeRemaining));
-    rb_iv_set(result, "@data_total", ULL2NUM(info.dataTotal));
-    rb_iv_set(result, "@data_processed", ULL2NUM(info.dataProcessed));
-    rb_iv_set(result, "@data_remaining", ULL2NUM(info.dataRemaining));
-    rb_iv_set(result, "@mem_total", ULL2NUM(info.memTotal));
-    rb_iv_set(result, "@mem_processed", ULL2NUM(info.memProcessed));
-    rb_iv_set(result, "@mem_remaining", ULL2NUM(info.memRemaining));
-    rb_iv_set(result, "@file_total", ULL2NUM(info.fileTotal));
-    rb_iv_set(result, "@file_processed", ULL2NUM(info.fileProcessed));
-    rb_iv_set(result, "@file_remaining", ULL2NUM(info.fileRemaining));
-
-    return result;
+    return domain_job_info_new(c_domain_job_info, &info);
 }
 
 /*
@@ -1922,25 +2526,33 @@ static const char *scheduler_set(VALUE d, unsigned int flags,
     }
 #endif
 
+    ruby_libvirt_xml_cache_domain_changed(d);
     return NULL;
 }
 
 /*
  * call-seq:
- *   dom.scheduler_parameters(flags=0) -> Hash
+ *   dom.scheduler_parameters(flags=0, keys: :string) -> Hash
  *
  * Call virDomainGetSchedulerParameters[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetSchedulerParameters]
  * to retrieve all of the scheduler parameters for this domain.  The keys and
  * values in the hash that is returned are hypervisor specific.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_domain_scheduler_parameters(int argc, VALUE *argv, VALUE d)
 {
     VALUE flags;
+    int symbol_keys;
+
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
     rb_scan_args(argc, argv, "01", &flags);
 
     return ruby_libvirt_get_typed_parameters(d,
                                              ruby_libvirt_value_to_uint(flags),
+                                             symbol_keys,
                                              NULL, scheduler_nparams,
                                              scheduler_get);
 }
@@ -2030,25 +2642,33 @@ static const char *memory_set(VALUE d, unsigned int flags,
         return "virDomainSetMemoryParameters";
     }
 
+    ruby_libvirt_xml_cache_domain_changed(d);
     return NULL;
 }
 
 /*
  * call-seq:
- *   dom.memory_parameters(flags=0) -> Hash
+ *   dom.memory_parameters(flags=0, keys: :string) -> Hash
  *
  * Call virDomainGetMemoryParameters[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetMemoryParameters]
  * to retrieve all of the memory parameters for this domain.  The keys and
  * values in the hash that is returned are hypervisor specific.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_domain_memory_parameters(int argc, VALUE *argv, VALUE d)
 {
     VALUE flags;
+    int symbol_keys;
+
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
     rb_scan_args(argc, argv, "01", &flags);
 
     return ruby_libvirt_get_typed_parameters(d,
                                              ruby_libvirt_value_to_uint(flags),
+                                             symbol_keys,
                                              NULL, memory_nparams, memory_get);
 }
 
@@ -2127,25 +2747,33 @@ static const char *blkio_set(VALUE d, unsigned int flags,
         return "virDomainSetBlkioParameters";
     }
 
+    ruby_libvirt_xml_cache_domain_changed(d);
     return NULL;
 }
 
 /*
  * call-seq:
- *   dom.blkio_parameters(flags=0) -> Hash
+ *   dom.blkio_parameters(flags=0, keys: :string) -> Hash
  *
  * Call virDomainGetBlkioParameters[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetBlkioParameters]
  * to retrieve all of the blkio parameters for this domain.  The keys and
  * values in the hash that is returned are hypervisor specific.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_domain_blkio_parameters(int argc, VALUE *argv, VALUE d)
 {
     VALUE flags;
+    int symbol_keys;
+
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
     rb_scan_args(argc, argv, "01", &flags);
 
     return ruby_libvirt_get_typed_parameters(d,
                                              ruby_libvirt_value_to_uint(flags),
+                                             symbol_keys,
                                              NULL, blkio_nparams, blkio_get);
 }
 
@@ -2457,13 +3085,12 @@ static VALUE libvirt_domain_metadata_equal(VALUE d, VALUE in)
         flags = rb_ary_entry(in, 4);
     }
 
-    ruby_libvirt_generate_call_nil(virDomainSetMetadata,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d), NUM2INT(type),
-                                   ruby_libvirt_get_cstring_or_null(metadata),
-                                   ruby_libvirt_get_cstring_or_null(key),
-                                   ruby_libvirt_get_cstring_or_null(uri),
-                                   ruby_libvirt_value_to_uint(flags));
+    domain_generate_call_nil_changed(virDomainSetMetadata, d,
+                                     ruby_libvirt_domain_get(d), NUM2INT(type),
+                                     ruby_libvirt_get_cstring_or_null(metadata),
+                                     ruby_libvirt_get_cstring_or_null(key),
+                                     ruby_libvirt_get_cstring_or_null(uri),
+                                     ruby_libvirt_value_to_uint(flags));
 }
 #endif
 
@@ -2505,6 +3132,339 @@ static VALUE libvirt_domain_list_all_snapshots(int argc, VALUE *argv, VALUE d)
                                         domain_snapshot_new,
                                         virDomainSnapshotFree);
 }
+
+struct snapshot_tree_slot {
+    virDomainSnapshotPtr snap;
+    char *xml;
+    char *parent;
+    char *state;
+    long long creation_time;
+    const char *failed;
+    virError err;
+};
+
+struct snapshot_tree_arg {
+    VALUE d;
+    virDomainPtr dom;
+    struct snapshot_tree_slot *slots;
+    int nslots;
+    unsigned int xml_flags;
+    int keep_xml;
+    int threads;
+    char *current;
+    int nomem;
+};
+
+/* decode the five predefined entities, which is all libvirt emits */
+static char *snapshot_xml_unescape(const char *start, const char *end)
+{
+    static const char *entities[][2] = {
+        { "&lt;", "<" }, { "&gt;", ">" }, { "&amp;", "&" },
+        { "&quot;", "\"" }, { "&apos;", "'" },
+    };
+    char *result, *out;
+    size_t i, len;
+
+    result = malloc(end - start + 1);
+    if (result == NULL) {
+        return NULL;
+    }
+    out = result;
+    while (start < end) {
+        if (*start == '&') {
+            for (i = 0; i < sizeof(entities) / sizeof(entities[0]); i++) {
+                len = strlen(entities[i][0]);
+                if ((size_t)(end - start) >= len &&
+                    strncmp(start, entities[i][0], len) == 0) {
+                    *out++ = entities[i][1][0];
+                    start += len;
+                    break;
+                }
+            }
+            if (i < sizeof(entities) / sizeof(entities[0])) {
+                continue;
+            }
+        }
+        *out++ = *start++;
+    }
+    *out = '\0';
+
+    return result;
+}
+
+/* the text of the first <TAG> between FROM and END, or NULL */
+static char *snapshot_xml_text(const char *from, const char *end,
+                               const char *tag)
+{
+    char open[32], close[32];
+    const char *start, *stop;
+
+    snprintf(open, sizeof(open), "<%s>", tag);
+    snprintf(close, sizeof(close), "</%s>", tag);
+
+    start = strstr(from, open);
+    if (start == NULL || start >= end) {
+        return NULL;
+    }
+    start += strlen(open);
+    stop = strstr(start, close);
+    if (stop == NULL || stop > end) {
+        return NULL;
+    }
+
+    return snapshot_xml_unescape(start, stop);
+}
+
+/* pick the creation time and state out of the snapshot's own elements,
+ * stopping before the embedded <domain>
+ */
+static void snapshot_tree_parse(struct snapshot_tree_slot *slot)
+{
+    const char *end, *p;
+    char *time;
+
+    end = slot->xml + strlen(slot->xml);
+    p = strstr(slot->xml, "<domain ");
+    if (p && p < end) {
+        end = p;
+    }
+    p = strstr(slot->xml, "<domain>");
+    if (p && p < end) {
+        end = p;
+    }
+
+    slot->state = snapshot_xml_text(slot->xml, end, "state");
+    time = snapshot_xml_text(slot->xml, end, "creationTime");
+    if (time) {
+        slot->creation_time = strtoll(time, NULL, 10);
+        free(time);
+    }
+}
+
+static void snapshot_tree_fetch(long i, void *p)
+{
+    struct snapshot_tree_arg *arg = (struct snapshot_tree_arg *)p;
+    struct snapshot_tree_slot *slot;
+    virDomainSnapshotPtr current, parent;
+    virErrorPtr err;
+
+    /* the one extra index finds out which snapshot is current */
+    if (i == arg->nslots) {
+        current = virDomainSnapshotCurrent(arg->dom, 0);
+        if (current == NULL) {
+            virResetLastError();
+            return;
+        }
+        arg->current = strdup(virDomainSnapshotGetName(current));
+        if (arg->current == NULL) {
+            arg->nomem = 1;
+        }
+        virDomainSnapshotFree(current);
+        return;
+    }
+
+    slot = &arg->slots[i];
+    slot->xml = virDomainSnapshotGetXMLDesc(slot->snap, arg->xml_flags);
+    if (slot->xml == NULL) {
+        slot->failed = "virDomainSnapshotGetXMLDesc";
+        virCopyLastError(&slot->err);
+        virResetLastError();
+        return;
+    }
+    snapshot_tree_parse(slot);
+
+    parent = virDomainSnapshotGetParent(slot->snap, 0);
+    if (parent == NULL) {
+        /* for a root, this is how libvirt says that there is no parent */
+        err = virGetLastError();
+        if (err != NULL && err->code != VIR_ERR_NO_DOMAIN_SNAPSHOT) {
+            slot->failed = "virDomainSnapshotGetParent";
+            virCopyLastError(&slot->err);
+        }
+        virResetLastError();
+    }
+    else {
+        slot->parent = strdup(virDomainSnapshotGetName(parent));
+        if (slot->parent == NULL) {
+            arg->nomem = 1;
+        }
+        virDomainSnapshotFree(parent);
+    }
+    if (!arg->keep_xml) {
+        free(slot->xml);
+        slot->xml = NULL;
+    }
+}
+
+static VALUE snapshot_tree_build(VALUE in)
+{
+    struct snapshot_tree_arg *arg = (struct snapshot_tree_arg *)in;
+    struct snapshot_tree_slot *slot;
+    VALUE nodes, by_name, roots, node, parent, name;
+    const char *cname;
+    int i;
+
+    /* inside the rb_ensure, so that the slots are freed whatever is raised */
+    if (ruby_libvirt_parallel_nogvl(arg->nslots + 1, arg->threads,
+                                    snapshot_tree_fetch, arg) <
+        arg->nslots + 1) {
+        rb_thread_check_ints();
+    }
+    if (arg->nomem) {
+        rb_memerror();
+    }
+    for (i = 0; i < arg->nslots; i++) {
+        if (arg->slots[i].failed) {
+            rb_exc_raise(ruby_libvirt_error_new(e_RetrieveError,
+                                                arg->slots[i].failed,
+                                                &arg->slots[i].err));
+        }
+    }
+
+    nodes = rb_ary_new2(arg->nslots);
+    by_name = rb_hash_new();
+    for (i = 0; i < arg->nslots; i++) {
+        slot = &arg->slots[i];
+        cname = virDomainSnapshotGetName(slot->snap);
+        name = rb_str_new2(cname);
+
+        node = rb_class_new_instance(0, NULL, c_domain_snapshot_node);
+        rb_iv_set(node, "@name", name);
+        rb_iv_set(node, "@parent",
+                  slot->parent ? rb_str_new2(slot->parent) : Qnil);
+        rb_iv_set(node, "@children", rb_ary_new());
+        rb_iv_set(node, "@creation_time", LL2NUM(slot->creation_time));
+        rb_iv_set(node, "@state", slot->state ? rb_str_new2(slot->state) : Qnil);
+        rb_iv_set(node, "@current",
+                  arg->current && strcmp(arg->current, cname) == 0 ?
+                  Qtrue : Qfalse);
+        rb_iv_set(node, "@xml", slot->xml ? rb_str_new2(slot->xml) : Qnil);
+        rb_iv_set(node, "@snapshot", domain_snapshot_new(slot->snap, arg->d));
+        /* the Snapshot object owns it now */
+        slot->snap = NULL;
+
+        rb_ary_push(nodes, node);
+        rb_hash_aset(by_name, name, node);
+    }
+
+    roots = rb_ary_new();
+    for (i = 0; i < arg->nslots; i++) {
+        node = rb_ary_entry(nodes, i);
+        parent = rb_hash_aref(by_name, rb_iv_get(node, "@parent"));
+        if (NIL_P(parent)) {
+            /* a root, or a child of a snapshot the flags filtered out */
+            rb_ary_push(roots, node);
+        }
+        else {
+            rb_ary_push(rb_iv_get(parent, "@children"), node);
+        }
+    }
+
+    return roots;
+}
+
+static VALUE snapshot_tree_free(VALUE in)
+{
+    struct snapshot_tree_arg *arg = (struct snapshot_tree_arg *)in;
+    int i;
+
+    for (i = 0; i < arg->nslots; i++) {
+        if (arg->slots[i].snap) {
+            virDomainSnapshotFree(arg->slots[i].snap);
+        }
+        free(arg->slots[i].xml);
+        free(arg->slots[i].parent);
+        free(arg->slots[i].state);
+        if (arg->slots[i].failed) {
+            virResetError(&arg->slots[i].err);
+        }
+    }
+    free(arg->slots);
+    free(arg->current);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   dom.snapshot_tree(flags=0, threads: 4, xml: false, xml_flags: 0) -> Array
+ *
+ * Fetch every snapshot of the domain (as selected by flags, as for
+ * dom.list_all_snapshots) with one call to
+ * virDomainListAllSnapshots[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainListAllSnapshots],
+ * then their XML with
+ * virDomainSnapshotGetXMLDesc[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainSnapshotGetXMLDesc]
+ * (and the current snapshot with
+ * virDomainSnapshotCurrent[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainSnapshotCurrent])
+ * from up to threads native threads at once with the GVL released.  The
+ * result is an array of the root Libvirt::Domain::Snapshot::Node objects,
+ * each with its name, parent name (from
+ * virDomainSnapshotGetParent[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainSnapshotGetParent]),
+ * children, creation_time, state, whether it is current, the
+ * Libvirt::Domain::Snapshot itself and, if xml is true, its XML (fetched with
+ * xml_flags).  Children are in topological order where libvirt supports it.
+ * Any other option raises ArgumentError.
+ */
+static VALUE libvirt_domain_snapshot_tree(int argc, VALUE *argv, VALUE d)
+{
+    static const char *const names[] = { "threads", "xml", "xml_flags", NULL };
+    VALUE flags, opts, val;
+    struct snapshot_tree_arg arg;
+    virDomainSnapshotPtr *snaps;
+    unsigned int list_flags;
+    int i, n;
+
+    rb_scan_args(argc, argv, "02", &flags, &opts);
+    if (TYPE(flags) == T_HASH && NIL_P(opts)) {
+        opts = flags;
+        flags = Qnil;
+    }
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        ruby_libvirt_check_options(opts, names);
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.d = d;
+    arg.dom = ruby_libvirt_domain_get(d);
+    arg.threads = 4;
+    if (!NIL_P(opts)) {
+        val = rb_hash_aref(opts, ID2SYM(rb_intern("threads")));
+        if (!NIL_P(val)) {
+            arg.threads = NUM2INT(val);
+        }
+        arg.keep_xml = RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("xml"))));
+        arg.xml_flags = ruby_libvirt_value_to_uint(rb_hash_aref(opts,
+                                                                ID2SYM(rb_intern("xml_flags"))));
+    }
+
+    list_flags = ruby_libvirt_value_to_uint(flags);
+#if HAVE_CONST_VIR_DOMAIN_SNAPSHOT_LIST_TOPOLOGICAL
+    list_flags |= VIR_DOMAIN_SNAPSHOT_LIST_TOPOLOGICAL;
+#endif
+
+    n = virDomainListAllSnapshots(arg.dom, &snaps, list_flags);
+    ruby_libvirt_raise_error_if(n < 0, e_RetrieveError,
+                                "virDomainListAllSnapshots",
+                                ruby_libvirt_connect_get(d));
+
+    arg.slots = calloc(n > 0 ? n : 1, sizeof(*arg.slots));
+    if (arg.slots == NULL) {
+        for (i = 0; i < n; i++) {
+            virDomainSnapshotFree(snaps[i]);
+        }
+        free(snaps);
+        rb_memerror();
+    }
+    for (i = 0; i < n; i++) {
+        arg.slots[i].snap = snaps[i];
+    }
+    arg.nslots = n;
+    free(snaps);
+
+    return rb_ensure(snapshot_tree_build, (VALUE)&arg, snapshot_tree_free,
+                     (VALUE)&arg);
+}
 #endif
 
 #if HAVE_VIRDOMAINSNAPSHOTNUMCHILDREN
@@ -3022,7 +3982,7 @@ static VALUE libvirt_domain_emulator_pin_info(int argc, VALUE *argv, VALUE d)
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    maxcpus = ruby_libvirt_get_maxcpus(ruby_libvirt_connect_get(d));
+    maxcpus = ruby_libvirt_get_maxcpus(d);
 
     cpumaplen = VIR_CPU_MAPLEN(maxcpus);
 
@@ -3044,45 +4004,72 @@ static VALUE libvirt_domain_emulator_pin_info(int argc, VALUE *argv, VALUE d)
 
     return emulator2cpumap;
 }
-#endif
 
-#if HAVE_VIRDOMAINPINEMULATOR
 /*
  * call-seq:
- *   dom.pin_emulator(cpulist, flags=0) -> nil
+ *   dom.emulator_pin_bitmap(flags=0) -> Libvirt::CPUMap
  *
- * Call virDomainPinVcpu[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainPinVcpu]
- * to pin the emulator to a range of physical processors.  The cpulist should
- * be an array of Fixnums representing the physical processors this domain's
- * emulator should be allowed to be scheduled on.
+ * Call virDomainGetEmulatorPinInfo[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetEmulatorPinInfo]
+ * to retrieve the physical CPUs the emulator threads may run on, as a
+ * Libvirt::CPUMap rather than the array dom.emulator_pin_info returns.
+ */
+static VALUE libvirt_domain_emulator_pin_bitmap(int argc, VALUE *argv, VALUE d)
+{
+    int maxcpus, ret;
+    size_t cpumaplen;
+    unsigned char *cpumap;
+    VALUE flags;
+
+    rb_scan_args(argc, argv, "01", &flags);
+
+    maxcpus = ruby_libvirt_get_maxcpus(d);
+
+    cpumaplen = VIR_CPU_MAPLEN(maxcpus);
+
+    cpumap = alloca(sizeof(unsigned char) * cpumaplen);
+
+    ret = virDomainGetEmulatorPinInfo(ruby_libvirt_domain_get(d), cpumap,
+                                      cpumaplen,
+                                      ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError,
+                                "virDomainGetEmulatorPinInfo",
+                                ruby_libvirt_connect_get(d));
+
+    return ruby_libvirt_cpumap_new(cpumap, maxcpus);
+}
+#endif
+
+#if HAVE_VIRDOMAINPINEMULATOR
+/*
+ * call-seq:
+ *   dom.pin_emulator(cpulist, flags=0) -> nil
+ *
+ * Call virDomainPinVcpu[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainPinVcpu]
+ * to pin the emulator to a range of physical processors.  The cpulist should
+ * be an array of Fixnums representing the physical processors this domain's
+ * emulator should be allowed to be scheduled on, or a Libvirt::CPUMap.
  */
 static VALUE libvirt_domain_pin_emulator(int argc, VALUE *argv, VALUE d)
 {
-    VALUE cpulist, flags, e;
-    int i, maxcpus, cpumaplen;
+    VALUE cpulist, flags;
+    int maxcpus, cpumaplen;
     unsigned char *cpumap;
 
     rb_scan_args(argc, argv, "11", &cpulist, &flags);
 
-    Check_Type(cpulist, T_ARRAY);
-
-    maxcpus = ruby_libvirt_get_maxcpus(ruby_libvirt_connect_get(d));
+    maxcpus = ruby_libvirt_get_maxcpus(d);
 
     cpumaplen = VIR_CPU_MAPLEN(maxcpus);
 
     cpumap = alloca(sizeof(unsigned char) * cpumaplen);
     MEMZERO(cpumap, unsigned char, cpumaplen);
 
-    for (i = 0; i < RARRAY_LEN(cpulist); i++) {
-        e = rb_ary_entry(cpulist, i);
-        VIR_USE_CPU(cpumap, NUM2UINT(e));
-    }
+    ruby_libvirt_cpumap_fill(cpulist, cpumap, maxcpus);
 
-    ruby_libvirt_generate_call_nil(virDomainPinEmulator,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d), cpumap,
-                                   cpumaplen,
-                                   ruby_libvirt_value_to_uint(flags));
+    domain_generate_call_nil_changed(virDomainPinEmulator, d,
+                                     ruby_libvirt_domain_get(d), cpumap,
+                                     cpumaplen,
+                                     ruby_libvirt_value_to_uint(flags));
 }
 #endif
 
@@ -3121,8 +4108,10 @@ static VALUE libvirt_domain_security_label_list(VALUE d)
 
 #if HAVE_VIRDOMAINGETJOBSTATS
 struct params_to_hash_arg {
+    int type;
     virTypedParameterPtr params;
     int nparams;
+    int symbol_keys;
     VALUE result;
 };
 
@@ -3131,8 +4120,13 @@ static VALUE params_to_hash(VALUE in)
     struct params_to_hash_arg *args = (struct params_to_hash_arg *)in;
     int i;
 
+    rb_hash_aset(args->result, ruby_libvirt_param_key("type",
+                                                      args->symbol_keys),
+                 INT2NUM(args->type));
+
     for (i = 0; i < args->nparams; i++) {
-        ruby_libvirt_typed_params_to_hash(args->params, i, args->result);
+        ruby_libvirt_typed_params_to_hash(args->params, i, args->result,
+                                          args->symbol_keys);
     }
 
     return Qnil;
@@ -3140,22 +4134,24 @@ static VALUE params_to_hash(VALUE in)
 
 /*
  * call-seq:
- *   dom.job_stats -> Hash
+ *   dom.job_stats(flags=0, keys: :string) -> Hash
  *
  * Call virDomainGetJobStats[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetJobStats]
  * to retrieve information about progress of a background job on a domain.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_domain_job_stats(int argc, VALUE *argv, VALUE d)
 {
-    VALUE flags, result;
-    int type, exception = 0, nparams = 0, r;
+    VALUE flags;
+    int type, exception = 0, nparams = 0, r, symbol_keys;
     virTypedParameterPtr params = NULL;
     struct params_to_hash_arg args;
-    struct ruby_libvirt_hash_aset_arg asetargs;
 
-    rb_scan_args(argc, argv, "01", &flags);
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
-    result = rb_hash_new();
+    rb_scan_args(argc, argv, "01", &flags);
 
     r = virDomainGetJobStats(ruby_libvirt_domain_get(d), &type, &params,
                              &nparams, ruby_libvirt_value_to_uint(flags));
@@ -3166,19 +4162,12 @@ static VALUE libvirt_domain_job_stats(int argc, VALUE *argv, VALUE d)
      * calls below to make sure we don't leak memory
      */
 
-    asetargs.hash = result;
-    asetargs.name = "type";
-    asetargs.val = INT2NUM(type);
-    rb_protect(ruby_libvirt_hash_aset_wrap, (VALUE)&asetargs, &exception);
-    if (exception) {
-        virTypedParamsFree(params, nparams);
-        rb_jump_tag(exception);
-    }
-
+    args.type = type;
     args.params = params;
     args.nparams = nparams;
-    args.result = result;
-    result = rb_protect(params_to_hash, (VALUE)&args, &exception);
+    args.symbol_keys = symbol_keys;
+    args.result = rb_hash_new();
+    rb_protect(params_to_hash, (VALUE)&args, &exception);
     if (exception) {
         virTypedParamsFree(params, nparams);
         rb_jump_tag(exception);
@@ -3186,7 +4175,339 @@ static VALUE libvirt_domain_job_stats(int argc, VALUE *argv, VALUE d)
 
     virTypedParamsFree(params, nparams);
 
-    return result;
+    return args.result;
+}
+
+/* A compact snapshot of a job's progress together with the rates derived
+ * from consecutive samples, for dom.monitor_job
+ */
+struct domain_job_progress {
+    int type;
+    unsigned long long time_elapsed;
+    unsigned long long data_total;
+    unsigned long long data_processed;
+    unsigned long long data_remaining;
+    unsigned long long memory_iteration;
+    double throughput;
+    double dirty_rate;
+    double remaining_time;
+    double progress;
+};
+
+static VALUE job_progress_seconds(double secs)
+{
+    return secs < 0 ? Qnil : rb_float_new(secs);
+}
+
+ruby_libvirt_struct_type(domain_job_progress, struct domain_job_progress,
+                         "Libvirt::Domain::JobProgress")
+ruby_libvirt_struct_reader(domain_job_progress, type, type, INT2NUM)
+ruby_libvirt_struct_reader(domain_job_progress, time_elapsed, time_elapsed,
+                           ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_progress, data_total, data_total,
+                           ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_progress, data_processed,
+                           data_processed, ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_progress, data_remaining,
+                           data_remaining, ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_progress, memory_iteration,
+                           memory_iteration, ULL2NUM)
+ruby_libvirt_struct_reader(domain_job_progress, throughput, throughput,
+                           rb_float_new)
+ruby_libvirt_struct_reader(domain_job_progress, dirty_rate, dirty_rate,
+                           rb_float_new)
+ruby_libvirt_struct_reader(domain_job_progress, remaining_time,
+                           remaining_time, job_progress_seconds)
+ruby_libvirt_struct_reader(domain_job_progress, progress, progress,
+                           rb_float_new)
+
+/* with this flag, virDomainGetJobStats reports on the job that most
+ * recently finished, if libvirt is new enough to support that
+ */
+#if HAVE_CONST_VIR_DOMAIN_JOB_STATS_COMPLETED
+#define JOB_MONITOR_COMPLETED VIR_DOMAIN_JOB_STATS_COMPLETED
+#else
+#define JOB_MONITOR_COMPLETED 0
+#endif
+
+struct job_monitor {
+    virDomainPtr dom;
+    unsigned int flags;
+    double interval;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int cancelled;
+    /* set, under lock, once the call whose job is watched has returned */
+    int finished;
+
+    int first;
+    int wait;
+    int r;
+    int changed;
+    double sampled_at;
+    struct domain_job_progress cur;
+    struct domain_job_progress prev;
+};
+
+static double job_monitor_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* look up the unsigned field NAME in PARAMS, returning 1 if it is there */
+static int job_param_ull(virTypedParameterPtr params, int nparams,
+                         const char *name, unsigned long long *val)
+{
+    int i;
+
+    for (i = 0; i < nparams; i++) {
+        if (strcmp(params[i].field, name) != 0) {
+            continue;
+        }
+        switch (params[i].type) {
+        case VIR_TYPED_PARAM_ULLONG:
+            *val = params[i].value.ul;
+            return 1;
+        case VIR_TYPED_PARAM_LLONG:
+            *val = params[i].value.l < 0 ? 0 : params[i].value.l;
+            return 1;
+        case VIR_TYPED_PARAM_UINT:
+            *val = params[i].value.ui;
+            return 1;
+        case VIR_TYPED_PARAM_INT:
+            *val = params[i].value.i < 0 ? 0 : params[i].value.i;
+            return 1;
+        default:
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/* derive the rates in M->cur from the sample in PARAMS and the previous
+ * sample in M->prev, taken ELAPSED seconds earlier
+ */
+static void job_monitor_derive(struct job_monitor *m,
+                               virTypedParameterPtr params, int nparams,
+                               double elapsed)
+{
+    struct domain_job_progress *cur = &m->cur, *prev = &m->prev;
+    unsigned long long dirty = 0, pagesize = 4096, remaining_ms;
+    double effective;
+
+    job_param_ull(params, nparams, "time_elapsed", &cur->time_elapsed);
+    job_param_ull(params, nparams, "data_total", &cur->data_total);
+    job_param_ull(params, nparams, "data_processed", &cur->data_processed);
+    job_param_ull(params, nparams, "data_remaining", &cur->data_remaining);
+    job_param_ull(params, nparams, "memory_iteration",
+                  &cur->memory_iteration);
+
+    if (!m->first && elapsed > 0 &&
+        cur->data_processed >= prev->data_processed) {
+        cur->throughput = (cur->data_processed - prev->data_processed) / elapsed;
+    }
+    else if (cur->time_elapsed > 0) {
+        cur->throughput = cur->data_processed * 1000.0 / cur->time_elapsed;
+    }
+
+    if (job_param_ull(params, nparams, "memory_dirty_rate", &dirty)) {
+        job_param_ull(params, nparams, "memory_page_size", &pagesize);
+        cur->dirty_rate = (double)dirty * pagesize;
+    }
+
+    if (job_param_ull(params, nparams, "time_remaining", &remaining_ms)) {
+        cur->remaining_time = remaining_ms / 1000.0;
+    }
+    else if (cur->data_remaining == 0) {
+        cur->remaining_time = cur->data_total ? 0 : -1;
+    }
+    else {
+        /* pages dirtied while we copy have to be sent again, so they eat
+         * into the useful part of the bandwidth
+         */
+        effective = cur->throughput - cur->dirty_rate;
+        cur->remaining_time = effective > 0 ? cur->data_remaining / effective : -1;
+    }
+
+    if (cur->data_total > 0) {
+        cur->progress = (double)cur->data_processed / cur->data_total;
+    }
+}
+
+/* wait out the rest of the interval (unless this is the first sample) and
+ * take a sample; M->changed is set if it differs from the previous one
+ */
+static void *job_monitor_sample_nogvl(void *p)
+{
+    struct job_monitor *m = (struct job_monitor *)p;
+    struct timespec ts;
+    virTypedParameterPtr params = NULL;
+    int type, nparams = 0, cancelled;
+    double until, now;
+
+    pthread_mutex_lock(&m->lock);
+    if (m->wait) {
+        until = m->sampled_at + m->interval;
+        while (!m->cancelled && !m->finished && job_monitor_now() < until) {
+            ts.tv_sec = (time_t)until;
+            ts.tv_nsec = (long)((until - ts.tv_sec) * 1000000000.0);
+            pthread_cond_timedwait(&m->cond, &m->lock, &ts);
+        }
+    }
+    cancelled = m->cancelled;
+    pthread_mutex_unlock(&m->lock);
+
+    if (cancelled) {
+        return NULL;
+    }
+
+    m->r = virDomainGetJobStats(m->dom, &type, &params, &nparams, m->flags);
+    now = job_monitor_now();
+    if (m->r < 0) {
+        return NULL;
+    }
+
+    m->prev = m->cur;
+    memset(&m->cur, 0, sizeof(m->cur));
+    m->cur.type = type;
+    job_monitor_derive(m, params, nparams, now - m->sampled_at);
+    virTypedParamsFree(params, nparams);
+
+    m->changed = m->first || m->cur.type != m->prev.type ||
+        m->cur.data_processed != m->prev.data_processed ||
+        m->cur.data_remaining != m->prev.data_remaining ||
+        m->cur.memory_iteration != m->prev.memory_iteration;
+    m->first = 0;
+    m->wait = 1;
+    m->sampled_at = now;
+
+    return NULL;
+}
+
+static void job_monitor_cancel(void *p)
+{
+    struct job_monitor *m = (struct job_monitor *)p;
+
+    pthread_mutex_lock(&m->lock);
+    m->cancelled = 1;
+    pthread_cond_broadcast(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+}
+
+struct job_monitor_arg {
+    VALUE d;
+    struct job_monitor *m;
+};
+
+static VALUE job_monitor_run(VALUE in)
+{
+    struct job_monitor_arg *arg = (struct job_monitor_arg *)in;
+    struct job_monitor *m = arg->m;
+    VALUE last = Qnil;
+    int active = 0;
+
+    for (;;) {
+        m->cancelled = 0;
+        m->changed = 0;
+        ruby_libvirt_without_gvl(job_monitor_sample_nogvl, m,
+                                 job_monitor_cancel, m);
+        if (m->cancelled) {
+            /* interrupted; look for pending exceptions and carry on */
+            rb_thread_check_ints();
+            continue;
+        }
+        ruby_libvirt_raise_error_if(m->r < 0, e_RetrieveError,
+                                    "virDomainGetJobStats",
+                                    ruby_libvirt_connect_get(arg->d));
+
+        if (m->changed) {
+            last = domain_job_progress_new(c_domain_job_progress, &m->cur);
+            rb_yield(last);
+        }
+
+        if (m->flags & JOB_MONITOR_COMPLETED) {
+            break;
+        }
+        if (m->cur.type != VIR_DOMAIN_JOB_NONE) {
+            active = 1;
+            continue;
+        }
+        if (!active || JOB_MONITOR_COMPLETED == 0) {
+            break;
+        }
+        /* the job we were watching has just finished; fetch its final
+         * statistics straight away
+         */
+        m->flags |= JOB_MONITOR_COMPLETED;
+        m->wait = 0;
+    }
+
+    return last;
+}
+
+static VALUE job_monitor_cleanup(VALUE in)
+{
+    struct job_monitor *m = (struct job_monitor *)in;
+
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->lock);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   dom.monitor_job(interval_ms=1000, flags=0) {|progress| block } -> Libvirt::Domain::JobProgress
+ *
+ * Watch the background job (usually a migration) running on this domain,
+ * calling virDomainGetJobStats[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetJobStats]
+ * every interval_ms milliseconds.  The waiting and sampling are done with
+ * the GVL released, and the block is only called, with a
+ * Libvirt::Domain::JobProgress, when the job has made progress since the
+ * last call, so many jobs can each be watched from their own Ruby thread
+ * cheaply.  The first sample is always passed to the block.  This returns
+ * the last Libvirt::Domain::JobProgress passed to the block once no job is
+ * running; if a job was seen, the block is finally called with its
+ * completed statistics (type Libvirt::Domain::JobInfo::COMPLETED or FAILED)
+ * where libvirt supports this.  Use break in the block to stop watching
+ * early.
+ */
+static VALUE libvirt_domain_monitor_job(int argc, VALUE *argv, VALUE d)
+{
+    VALUE interval, flags;
+    struct job_monitor m;
+    struct job_monitor_arg arg;
+
+    if (!rb_block_given_p()) {
+        rb_raise(rb_eRuntimeError, "A block must be provided");
+    }
+
+    rb_scan_args(argc, argv, "02", &interval, &flags);
+
+    memset(&m, 0, sizeof(m));
+    m.dom = ruby_libvirt_domain_get(d);
+    m.flags = ruby_libvirt_value_to_uint(flags);
+    m.interval = NIL_P(interval) ? 1.0 : NUM2INT(interval) / 1000.0;
+    if (m.interval <= 0) {
+        rb_raise(rb_eArgError, "interval must be positive");
+    }
+    m.first = 1;
+    m.sampled_at = job_monitor_now();
+
+    pthread_mutex_init(&m.lock, NULL);
+    pthread_cond_init(&m.cond, NULL);
+
+    arg.d = d;
+    arg.m = &m;
+
+    return rb_ensure(job_monitor_run, (VALUE)&arg, job_monitor_cleanup,
+                     (VALUE)&m);
 }
 #endif
 
@@ -3231,25 +4552,33 @@ static const char *iotune_set(VALUE d, unsigned int flags,
         return "virDomainSetBlockIoTune";
     }
 
+    ruby_libvirt_xml_cache_domain_changed(d);
     return NULL;
 }
 
 /*
  * call-seq:
- *   dom.block_iotune(disk=nil, flags=0) -> Hash
+ *   dom.block_iotune(disk=nil, flags=0, keys: :string) -> Hash
  *
  * Call virDomainGetBlockIoTune[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetBlockIoTune]
  * to retrieve all of the block IO tune parameters for this domain.  The keys
  * and values in the hash that is returned are hypervisor specific.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_domain_block_iotune(int argc, VALUE *argv, VALUE d)
 {
     VALUE disk, flags;
+    int symbol_keys;
+
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
     rb_scan_args(argc, argv, "02", &disk, &flags);
 
     return ruby_libvirt_get_typed_parameters(d,
                                              ruby_libvirt_value_to_uint(flags),
+                                             symbol_keys,
                                              (void *)disk, iotune_nparams,
                                              iotune_get);
 }
@@ -3398,6 +4727,16 @@ static VALUE libvirt_domain_block_job_speed_equal(VALUE d, VALUE in)
 }
 #endif
 
+#if HAVE_TYPE_VIRDOMAINBLOCKJOBINFOPTR
+ruby_libvirt_struct_type(domain_block_job_info, virDomainBlockJobInfo,
+                         "Libvirt::Domain::BlockJobInfo")
+ruby_libvirt_struct_reader(domain_block_job_info, type, type, UINT2NUM)
+ruby_libvirt_struct_reader(domain_block_job_info, bandwidth, bandwidth,
+                           ULONG2NUM)
+ruby_libvirt_struct_reader(domain_block_job_info, cur, cur, ULL2NUM)
+ruby_libvirt_struct_reader(domain_block_job_info, end, end, ULL2NUM)
+#endif
+
 #if HAVE_VIRDOMAINGETBLOCKJOBINFO
 /*
  * call-seq:
@@ -3408,7 +4747,7 @@ static VALUE libvirt_domain_block_job_speed_equal(VALUE d, VALUE in)
  */
 static VALUE libvirt_domain_block_job_info(int argc, VALUE *argv, VALUE d)
 {
-    VALUE disk, flags = RUBY_Qnil, result;
+    VALUE disk, flags = RUBY_Qnil;
     virDomainBlockJobInfo info;
     int r;
 
@@ -3423,13 +4762,7 @@ static VALUE libvirt_domain_block_job_info(int argc, VALUE *argv, VALUE d)
                                 "virDomainGetBlockJobInfo",
                                 ruby_libvirt_connect_get(d));
 
-    result = rb_class_new_instance(0, NULL, c_domain_block_job_info);
-    rb_iv_set(result, "@type", UINT2NUM(info.type));
-    rb_iv_set(result, "@bandwidth", ULONG2NUM(info.bandwidth));
-    rb_iv_set(result, "@cur", ULL2NUM(info.cur));
-    rb_iv_set(result, "@end", ULL2NUM(info.end));
-
-    return result;
+    return domain_block_job_info_new(c_domain_block_job_info, &info);
 }
 #endif
 
@@ -3496,20 +4829,27 @@ static const char *interface_set(VALUE d, unsigned int flags,
         return "virDomainSetIntefaceParameters";
     }
 
+    ruby_libvirt_xml_cache_domain_changed(d);
     return NULL;
 }
 
 /*
  * call-seq:
- *   dom.interface_parameters(interface, flags=0) -> Hash
+ *   dom.interface_parameters(interface, flags=0, keys: :string) -> Hash
  *
  * Call virDomainGetInterfaceParameters[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetInterfaceParameters]
  * to retrieve the interface parameters for the given interface on this domain.
  * The keys and values in the hash that is returned are hypervisor specific.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_domain_interface_parameters(int argc, VALUE *argv, VALUE d)
 {
     VALUE device = RUBY_Qnil, flags = RUBY_Qnil;
+    int symbol_keys;
+
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
     rb_scan_args(argc, argv, "11", &device, &flags);
 
@@ -3517,6 +4857,7 @@ static VALUE libvirt_domain_interface_parameters(int argc, VALUE *argv, VALUE d)
 
     return ruby_libvirt_get_typed_parameters(d,
                                              ruby_libvirt_value_to_uint(flags),
+                                             symbol_keys,
                                              (void *)device,
                                              interface_nparams, interface_get);
 }
@@ -3598,15 +4939,21 @@ static const char *block_stats_get(VALUE d, unsigned int flags,
 
 /*
  * call-seq:
- *   dom.block_stats_flags(disk, flags=0) -> Hash
+ *   dom.block_stats_flags(disk, flags=0, keys: :string) -> Hash
  *
  * Call virDomainGetBlockStatsFlags[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetBlockStatsFlags]
  * to retrieve the block statistics for the given disk on this domain.
  * The keys and values in the hash that is returned are hypervisor specific.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_domain_block_stats_flags(int argc, VALUE *argv, VALUE d)
 {
     VALUE disk = RUBY_Qnil, flags = RUBY_Qnil;
+    int symbol_keys;
+
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
     rb_scan_args(argc, argv, "11", &disk, &flags);
 
@@ -3614,6 +4961,7 @@ static VALUE libvirt_domain_block_stats_flags(int argc, VALUE *argv, VALUE d)
 
     return ruby_libvirt_get_typed_parameters(d,
                                              ruby_libvirt_value_to_uint(flags),
+                                             symbol_keys,
                                              (void *)disk,
                                              block_stats_nparams,
                                              block_stats_get);
@@ -3654,25 +5002,33 @@ static const char *numa_set(VALUE d, unsigned int flags,
         return "virDomainSetNumaParameters";
     }
 
+    ruby_libvirt_xml_cache_domain_changed(d);
     return NULL;
 }
 
 /*
  * call-seq:
- *   dom.numa_parameters(flags=0) -> Hash
+ *   dom.numa_parameters(flags=0, keys: :string) -> Hash
  *
  * Call virDomainGetNumaParameters[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetNumaParameters]
  * to retrieve the numa parameters for this domain.  The keys and values in
  * the hash that is returned are hypervisor specific.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_domain_numa_parameters(int argc, VALUE *argv, VALUE d)
 {
     VALUE flags = RUBY_Qnil;
+    int symbol_keys;
+
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
 
     rb_scan_args(argc, argv, "01", &flags);
 
     return ruby_libvirt_get_typed_parameters(d,
                                              ruby_libvirt_value_to_uint(flags),
+                                             symbol_keys,
                                              NULL, numa_nparams, numa_get);
 }
 
@@ -3703,265 +5059,821 @@ static VALUE libvirt_domain_numa_parameters_equal(VALUE d, VALUE in)
 }
 #endif
 
-#if HAVE_VIRDOMAINLXCOPENNAMESPACE
-/*
- * call-seq:
- *   dom.lxc_open_namespace(flags=0) -> Array
- *
- * Call virDomainLxcOpenNamespace[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLxcOpenNamespace]
- * to open an LXC namespace.  Note that this will only work on connections to
- * the LXC driver.  The call will return an array of open file descriptors;
- * these should be closed when use of them is finished.
+#if HAVE_VIRDOMAINLXCOPENNAMESPACE
+/*
+ * call-seq:
+ *   dom.lxc_open_namespace(flags=0) -> Array
+ *
+ * Call virDomainLxcOpenNamespace[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLxcOpenNamespace]
+ * to open an LXC namespace.  Note that this will only work on connections to
+ * the LXC driver.  The call will return an array of open file descriptors;
+ * these should be closed when use of them is finished.
+ */
+static VALUE libvirt_domain_lxc_open_namespace(int argc, VALUE *argv, VALUE d)
+{
+    VALUE flags = RUBY_Qnil, result;
+    int *fdlist = NULL;
+    int ret, i, exception = 0;
+    struct ruby_libvirt_ary_store_arg args;
+
+    rb_scan_args(argc, argv, "01", &flags);
+
+    ret = virDomainLxcOpenNamespace(ruby_libvirt_domain_get(d),
+                                    &fdlist, ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError,
+                                "virDomainLxcOpenNamespace",
+                                ruby_libvirt_connect_get(d));
+
+    result = rb_protect(ruby_libvirt_ary_new2_wrap, (VALUE)&ret, &exception);
+    if (exception) {
+        goto error;
+    }
+
+    for (i = 0; i < ret; i++) {
+        args.arr = result;
+        args.index = i;
+        /* from reading the ruby sources, INT2NUM can't possibly throw an
+         * exception, so this can't leak.
+         */
+        args.elem = INT2NUM(fdlist[i]);
+
+        rb_protect(ruby_libvirt_ary_store_wrap, (VALUE)&args, &exception);
+        if (exception) {
+            goto error;
+        }
+    }
+
+    free(fdlist);
+
+    return result;
+
+error:
+    for (i = 0; i < ret; i++) {
+        close(fdlist[i]);
+    }
+    free(fdlist);
+    rb_jump_tag(exception);
+}
+#endif
+
+#if HAVE_VIRDOMAINQEMUAGENTCOMMAND
+/*
+ * call-seq:
+ *   dom.qemu_agent_command(command, timeout=0, flags=0) -> String
+ *
+ * Call virDomainQemuAgentCommand[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainQemuAgentCommand]
+ * to run an arbitrary command on the Qemu Agent.
+ */
+static VALUE libvirt_domain_qemu_agent_command(int argc, VALUE *argv, VALUE d)
+{
+    VALUE command, timeout = RUBY_Qnil, flags = RUBY_Qnil, result;
+    char *ret;
+    int exception = 0;
+
+    rb_scan_args(argc, argv, "12", &command, &timeout, &flags);
+
+    ret = virDomainQemuAgentCommand(ruby_libvirt_domain_get(d),
+                                    StringValueCStr(command),
+                                    ruby_libvirt_value_to_int(timeout),
+                                    ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_raise_error_if(ret == NULL, e_RetrieveError,
+                                "virDomainQemuAgentCommand",
+                                ruby_libvirt_connect_get(d));
+
+    result = rb_protect(ruby_libvirt_str_new2_wrap, (VALUE)&ret, &exception);
+    free(ret);
+    if (exception) {
+        rb_jump_tag(exception);
+    }
+
+    return result;
+}
+#endif
+
+#if HAVE_VIRDOMAINLXCENTERNAMESPACE
+/*
+ * call-seq:
+ *   dom.lxc_enter_namespace(fds, flags=0) -> Array
+ *
+ * Call virDomainLxcEnterNamespace[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLxcEnterNamespace]
+ * to attach the process to the namespaces associated with the file descriptors
+ * in the fds array.  Note that this call does not actually enter the namespace;
+ * the next call to fork will do that.  Also note that this function will return
+ * an array of old file descriptors that can be used to switch back to the
+ * current namespace later.
+ */
+static VALUE libvirt_domain_lxc_enter_namespace(int argc, VALUE *argv, VALUE d)
+{
+    VALUE fds = RUBY_Qnil, flags = RUBY_Qnil, result;
+    int *fdlist;
+    int ret, exception = 0;
+    int *oldfdlist;
+    unsigned int noldfdlist, i;
+    struct ruby_libvirt_ary_store_arg args;
+
+    rb_scan_args(argc, argv, "11", &fds, &flags);
+
+    Check_Type(fds, T_ARRAY);
+
+    fdlist = alloca(sizeof(int) * RARRAY_LEN(fds));
+    for (i = 0; i < RARRAY_LEN(fds); i++) {
+        fdlist[i] = NUM2INT(rb_ary_entry(fds, i));
+    }
+
+    ret = virDomainLxcEnterNamespace(ruby_libvirt_domain_get(d),
+                                     RARRAY_LEN(fds), fdlist, &noldfdlist,
+                                     &oldfdlist,
+                                     ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError,
+                                "virDomainLxcEnterNamespace",
+                                ruby_libvirt_connect_get(d));
+
+    result = rb_protect(ruby_libvirt_ary_new2_wrap, (VALUE)&noldfdlist,
+                        &exception);
+    if (exception) {
+        free(oldfdlist);
+        rb_jump_tag(exception);
+    }
+
+    for (i = 0; i < noldfdlist; i++) {
+        args.arr = result;
+        args.index = i;
+        /* from reading the ruby sources, INT2NUM can't possibly throw an
+         * exception, so this can't leak.
+         */
+        args.elem = INT2NUM(oldfdlist[i]);
+
+        rb_protect(ruby_libvirt_ary_store_wrap, (VALUE)&args, &exception);
+        if (exception) {
+            free(oldfdlist);
+            rb_jump_tag(exception);
+        }
+    }
+
+    free(oldfdlist);
+
+    return result;
+}
+#endif
+
+#if HAVE_VIRDOMAINMIGRATE3
+static struct ruby_libvirt_typed_param migrate3_allowed[] = {
+    {VIR_MIGRATE_PARAM_URI, VIR_TYPED_PARAM_STRING},
+    {VIR_MIGRATE_PARAM_DEST_NAME, VIR_TYPED_PARAM_STRING},
+    {VIR_MIGRATE_PARAM_DEST_XML, VIR_TYPED_PARAM_STRING},
+    {VIR_MIGRATE_PARAM_BANDWIDTH, VIR_TYPED_PARAM_ULLONG},
+    {VIR_MIGRATE_PARAM_GRAPHICS_URI, VIR_TYPED_PARAM_STRING},
+#if HAVE_CONST_VIR_MIGRATE_PARAM_LISTEN_ADDRESS
+    {VIR_MIGRATE_PARAM_LISTEN_ADDRESS, VIR_TYPED_PARAM_STRING},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_MIGRATE_DISKS
+    {VIR_MIGRATE_PARAM_MIGRATE_DISKS, VIR_TYPED_PARAM_STRING},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_DISKS_PORT
+    {VIR_MIGRATE_PARAM_DISKS_PORT, VIR_TYPED_PARAM_INT},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_DISKS_URI
+    {VIR_MIGRATE_PARAM_DISKS_URI, VIR_TYPED_PARAM_STRING},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION
+    {VIR_MIGRATE_PARAM_COMPRESSION, VIR_TYPED_PARAM_STRING},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_MT_LEVEL
+    {VIR_MIGRATE_PARAM_COMPRESSION_MT_LEVEL, VIR_TYPED_PARAM_INT},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_MT_THREADS
+    {VIR_MIGRATE_PARAM_COMPRESSION_MT_THREADS, VIR_TYPED_PARAM_INT},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_MT_DTHREADS
+    {VIR_MIGRATE_PARAM_COMPRESSION_MT_DTHREADS, VIR_TYPED_PARAM_INT},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_XBZRLE_CACHE
+    {VIR_MIGRATE_PARAM_COMPRESSION_XBZRLE_CACHE, VIR_TYPED_PARAM_ULLONG},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_ZLIB_LEVEL
+    {VIR_MIGRATE_PARAM_COMPRESSION_ZLIB_LEVEL, VIR_TYPED_PARAM_INT},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_ZSTD_LEVEL
+    {VIR_MIGRATE_PARAM_COMPRESSION_ZSTD_LEVEL, VIR_TYPED_PARAM_INT},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_PERSIST_XML
+    {VIR_MIGRATE_PARAM_PERSIST_XML, VIR_TYPED_PARAM_STRING},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_AUTO_CONVERGE_INITIAL
+    {VIR_MIGRATE_PARAM_AUTO_CONVERGE_INITIAL, VIR_TYPED_PARAM_INT},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_AUTO_CONVERGE_INCREMENT
+    {VIR_MIGRATE_PARAM_AUTO_CONVERGE_INCREMENT, VIR_TYPED_PARAM_INT},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_BANDWIDTH_POSTCOPY
+    {VIR_MIGRATE_PARAM_BANDWIDTH_POSTCOPY, VIR_TYPED_PARAM_ULLONG},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_PARALLEL_CONNECTIONS
+    {VIR_MIGRATE_PARAM_PARALLEL_CONNECTIONS, VIR_TYPED_PARAM_INT},
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_TLS_DESTINATION
+    {VIR_MIGRATE_PARAM_TLS_DESTINATION, VIR_TYPED_PARAM_STRING},
+#endif
+};
+
+/* The parameters that may be given more than once; for these, an Array
+ * value adds one parameter per element.
+ */
+static const char *migrate3_repeatable[] = {
+#if HAVE_CONST_VIR_MIGRATE_PARAM_MIGRATE_DISKS
+    VIR_MIGRATE_PARAM_MIGRATE_DISKS,
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION
+    VIR_MIGRATE_PARAM_COMPRESSION,
+#endif
+    NULL
+};
+
+/* Return 1 if VAL, the value for KEY, is to be expanded into one parameter
+ * per element, raising TypeError for an Array given for any other key
+ */
+static int migrate3_expand(VALUE key, VALUE val)
+{
+    const char *keyname;
+    int i;
+
+    if (TYPE(val) != T_ARRAY) {
+        return 0;
+    }
+
+    keyname = SYMBOL_P(key) ? rb_id2name(SYM2ID(key)) : StringValueCStr(key);
+    for (i = 0; migrate3_repeatable[i] != NULL; i++) {
+        if (strcmp(migrate3_repeatable[i], keyname) == 0) {
+            return 1;
+        }
+    }
+
+    rb_raise(rb_eTypeError, "wrong argument type for %s (Array not allowed)",
+             keyname);
+}
+
+static int migrate3_count(VALUE key, VALUE val, VALUE in)
+{
+    unsigned long *count = (unsigned long *)in;
+
+    if (migrate3_expand(key, val)) {
+        *count += RARRAY_LEN(val);
+    }
+    else {
+        (*count)++;
+    }
+
+    return ST_CONTINUE;
+}
+
+static int migrate3_assign(VALUE key, VALUE val, VALUE in)
+{
+    long i;
+
+    if (!migrate3_expand(key, val)) {
+        return ruby_libvirt_typed_parameter_assign(key, val, in);
+    }
+
+    /* the length is checked afresh each time round, and the assignment
+     * stops at the room that was counted, should to_int change the Array
+     */
+    for (i = 0; i < RARRAY_LEN(val); i++) {
+        ruby_libvirt_typed_parameter_assign(key, rb_ary_entry(val, i), in);
+    }
+
+    return ST_CONTINUE;
+}
+
+/* The number of typed parameters that HASH (which may be nil) expands to */
+static unsigned long migrate3_nparams(VALUE hash)
+{
+    unsigned long count = 0;
+
+    if (!NIL_P(hash)) {
+        Check_Type(hash, T_HASH);
+        rb_hash_foreach(hash, migrate3_count, (VALUE)&count);
+    }
+
+    return count;
+}
+
+/* Fill ARGS from HASH; ARGS->params must have room for ARGS->nalloc
+ * entries, normally migrate3_nparams(HASH).
+ */
+static void migrate3_params(VALUE hash,
+                            struct ruby_libvirt_parameter_assign_args *args)
+{
+    args->allowed = migrate3_allowed;
+    args->num_allowed = ARRAY_SIZE(migrate3_allowed);
+    args->i = 0;
+
+    if (!NIL_P(hash)) {
+        rb_hash_foreach(hash, migrate3_assign, (VALUE)args);
+    }
+}
+
+struct migrate3_arg {
+    VALUE d;
+    /* the destination Libvirt::Connect, or URI String (or nil) */
+    VALUE dest;
+    VALUE hash;
+    unsigned int flags;
+    struct ruby_libvirt_parameter_assign_args *args;
+};
+
+ruby_libvirt_nogvl_trampoline_held2(virDomainMigrate3, virDomainPtr,
+                                    virDomainPtr, virConnectPtr,
+                                    virDomainPtr a0; virConnectPtr a1;
+                                    virTypedParameterPtr a2; unsigned int a3;
+                                    unsigned int a4;,
+                                    virDomainMigrate3(a->a0, a->a1, a->a2,
+                                                      a->a3, a->a4))
+ruby_libvirt_declare_nogvl5(int, virDomainMigrateToURI3, virDomainPtr,
+                            const char *, virTypedParameterPtr, unsigned int,
+                            unsigned int)
+
+static VALUE migrate3_call(VALUE in)
+{
+    struct migrate3_arg *m = (struct migrate3_arg *)in;
+
+    migrate3_params(m->hash, m->args);
+
+    ruby_libvirt_generate_call_object_nogvl_ubf(virDomainMigrate3,
+                                                ruby_libvirt_connect_get(m->d),
+                                                e_Error,
+                                                ruby_libvirt_domain_new,
+                                                m->dest,
+                                                DOMAIN_JOB_UBF,
+                                                ruby_libvirt_domain_get(m->d),
+                                                ruby_libvirt_domain_get(m->d),
+                                                ruby_libvirt_connect_get(m->dest),
+                                                m->args->params, m->args->i,
+                                                m->flags);
+}
+
+/*
+ * call-seq:
+ *   dom.migrate3(dconn, Hash=nil, flags=0) -> Libvirt::Domain
+ *
+ * Call virDomainMigrate3[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainMigrate3]
+ * to migrate a domain from the host on this connection to the connection
+ * referenced in dconn.  The keys of Hash are the
+ * Libvirt::Domain::MIGRATE_PARAM_* names (as Strings or Symbols); the value
+ * for a parameter that may be repeated, such as
+ * Libvirt::Domain::MIGRATE_PARAM_MIGRATE_DISKS, may be an Array.  For
+ * example, a migration over four connections with zstd compression is
+ *
+ *   dom.migrate3(dconn,
+ *                { Libvirt::Domain::MIGRATE_PARAM_PARALLEL_CONNECTIONS => 4,
+ *                  Libvirt::Domain::MIGRATE_PARAM_COMPRESSION => "zstd" },
+ *                Libvirt::Domain::MIGRATE_LIVE |
+ *                Libvirt::Domain::MIGRATE_PARALLEL |
+ *                Libvirt::Domain::MIGRATE_COMPRESSED)
+ *
+ * The migration runs with the GVL released, so other Ruby threads keep
+ * running; if the calling thread is interrupted, the migration job is
+ * aborted.
+ */
+static VALUE libvirt_domain_migrate3(int argc, VALUE *argv, VALUE d)
+{
+    VALUE dconn = RUBY_Qnil, hash = RUBY_Qnil, flags = RUBY_Qnil;
+    struct ruby_libvirt_parameter_assign_args args;
+    struct migrate3_arg m;
+    unsigned long nparams;
+
+    rb_scan_args(argc, argv, "12", &dconn, &hash, &flags);
+
+    nparams = migrate3_nparams(hash);
+    memset(&args, 0, sizeof(struct ruby_libvirt_parameter_assign_args));
+    if (nparams > 0) {
+        args.params = alloca(sizeof(virTypedParameter) * nparams);
+    }
+    args.nalloc = nparams;
+
+    m.d = d;
+    m.dest = dconn;
+    m.hash = hash;
+    m.flags = ruby_libvirt_value_to_uint(flags);
+    m.args = &args;
+
+    return ruby_libvirt_typed_params_ensure(migrate3_call, (VALUE)&m, &args);
+}
+
+static VALUE migrate_to_uri3_call(VALUE in)
+{
+    struct migrate3_arg *m = (struct migrate3_arg *)in;
+
+    migrate3_params(m->hash, m->args);
+
+    ruby_libvirt_generate_call_nil_nogvl_ubf(virDomainMigrateToURI3,
+                                             ruby_libvirt_connect_get(m->d),
+                                             DOMAIN_JOB_UBF,
+                                             ruby_libvirt_domain_get(m->d),
+                                             ruby_libvirt_domain_get(m->d),
+                                             ruby_libvirt_get_cstring_or_null(m->dest),
+                                             m->args->params, m->args->i,
+                                             m->flags);
+}
+
+/*
+ * call-seq:
+ *   dom.migrate_to_uri3(duri=nil, Hash=nil, flags=0) -> nil
+ *
+ * Call virDomainMigrateToURI3[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainMigrateToURI3]
+ * to migrate a domain from the host on this connection to the host whose
+ * libvirt URI is duri.  Hash is as for dom.migrate3, and as there, the
+ * migration runs with the GVL released.
+ */
+static VALUE libvirt_domain_migrate_to_uri3(int argc, VALUE *argv, VALUE d)
+{
+    VALUE duri = RUBY_Qnil, hash = RUBY_Qnil, flags = RUBY_Qnil;
+    struct ruby_libvirt_parameter_assign_args args;
+    struct migrate3_arg m;
+    unsigned long nparams;
+
+    rb_scan_args(argc, argv, "03", &duri, &hash, &flags);
+
+    nparams = migrate3_nparams(hash);
+    memset(&args, 0, sizeof(struct ruby_libvirt_parameter_assign_args));
+    if (nparams > 0) {
+        args.params = alloca(sizeof(virTypedParameter) * nparams);
+    }
+    args.nalloc = nparams;
+
+    m.d = d;
+    m.dest = duri;
+    m.hash = hash;
+    m.flags = ruby_libvirt_value_to_uint(flags);
+    m.args = &args;
+
+    return ruby_libvirt_typed_params_ensure(migrate_to_uri3_call, (VALUE)&m,
+                                            &args);
+}
+#endif
+
+#if HAVE_VIRDOMAINSAVEPARAMS
+static struct ruby_libvirt_typed_param save_params_allowed[] = {
+    {VIR_DOMAIN_SAVE_PARAM_FILE, VIR_TYPED_PARAM_STRING},
+    {VIR_DOMAIN_SAVE_PARAM_DXML, VIR_TYPED_PARAM_STRING},
+#if HAVE_CONST_VIR_DOMAIN_SAVE_PARAM_IMAGE_FORMAT
+    {VIR_DOMAIN_SAVE_PARAM_IMAGE_FORMAT, VIR_TYPED_PARAM_STRING},
+#endif
+#if HAVE_CONST_VIR_DOMAIN_SAVE_PARAM_PARALLEL_CHANNELS
+    {VIR_DOMAIN_SAVE_PARAM_PARALLEL_CHANNELS, VIR_TYPED_PARAM_INT},
+#endif
+};
+
+/* Fill ARGS from HASH; ARGS->params must have room for RHASH_SIZE(HASH)
+ * entries.
  */
-static VALUE libvirt_domain_lxc_open_namespace(int argc, VALUE *argv, VALUE d)
+static void save_params_params(VALUE hash,
+                               struct ruby_libvirt_parameter_assign_args *args)
 {
-    VALUE flags = RUBY_Qnil, result;
-    int *fdlist = NULL;
-    int ret, i, exception = 0;
-    struct ruby_libvirt_ary_store_arg args;
+    args->allowed = save_params_allowed;
+    args->num_allowed = ARRAY_SIZE(save_params_allowed);
+    args->i = 0;
 
-    rb_scan_args(argc, argv, "01", &flags);
+    rb_hash_foreach(hash, ruby_libvirt_typed_parameter_assign, (VALUE)args);
+}
 
-    ret = virDomainLxcOpenNamespace(ruby_libvirt_domain_get(d),
-                                    &fdlist, ruby_libvirt_value_to_uint(flags));
-    ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError,
-                                "virDomainLxcOpenNamespace",
-                                ruby_libvirt_connect_get(d));
+struct save_params_arg {
+    /* the domain, or for restore_params the connection */
+    VALUE d;
+    VALUE hash;
+    VALUE interval;
+    unsigned int flags;
+    int progress;
+    struct ruby_libvirt_parameter_assign_args *args;
+};
 
-    result = rb_protect(ruby_libvirt_ary_new2_wrap, (VALUE)&ret, &exception);
-    if (exception) {
-        goto error;
+ruby_libvirt_declare_nogvl4(int, virDomainSaveParams, virDomainPtr,
+                            virTypedParameterPtr, int, unsigned int)
+ruby_libvirt_declare_nogvl4(int, virDomainRestoreParams, virConnectPtr,
+                            virTypedParameterPtr, int, unsigned int)
+
+#if HAVE_VIRDOMAINGETJOBSTATS
+/* A virDomainSaveParams call made on its own native thread, so that the
+ * calling Ruby thread can watch its job with a job_monitor meanwhile.
+ */
+struct save_params_job {
+    virDomainPtr dom;
+    virTypedParameterPtr params;
+    int nparams;
+    unsigned int flags;
+
+    pthread_t thread;
+    int r;
+    virError err;
+    struct job_monitor m;
+};
+
+static void *save_params_thread(void *p)
+{
+    struct save_params_job *job = (struct save_params_job *)p;
+
+    job->r = virDomainSaveParams(job->dom, job->params, job->nparams,
+                                 job->flags);
+    if (job->r < 0) {
+        virCopyLastError(&job->err);
+        virResetLastError();
     }
 
-    for (i = 0; i < ret; i++) {
-        args.arr = result;
-        args.index = i;
-        /* from reading the ruby sources, INT2NUM can't possibly throw an
-         * exception, so this can't leak.
-         */
-        args.elem = INT2NUM(fdlist[i]);
+    pthread_mutex_lock(&job->m.lock);
+    job->m.finished = 1;
+    pthread_cond_broadcast(&job->m.cond);
+    pthread_mutex_unlock(&job->m.lock);
 
-        rb_protect(ruby_libvirt_ary_store_wrap, (VALUE)&args, &exception);
-        if (exception) {
-            goto error;
+    return NULL;
+}
+
+static VALUE save_params_monitor(VALUE in)
+{
+    struct save_params_job *job = (struct save_params_job *)in;
+    struct job_monitor *m = &job->m;
+    int finished;
+
+    for (;;) {
+        m->cancelled = 0;
+        m->changed = 0;
+        ruby_libvirt_without_gvl(job_monitor_sample_nogvl, m,
+                                 job_monitor_cancel, m);
+        if (m->cancelled) {
+            rb_thread_check_ints();
+            continue;
         }
-    }
 
-    free(fdlist);
+        pthread_mutex_lock(&m->lock);
+        finished = m->finished;
+        pthread_mutex_unlock(&m->lock);
 
-    return result;
+        /* the stats can't be had once the save has stopped the domain, so
+         * a failed sample is only skipped
+         */
+        if (m->r < 0) {
+            virResetLastError();
+            m->wait = 1;
+            m->sampled_at = job_monitor_now();
+        }
+        else if (m->changed && !finished) {
+            rb_yield(domain_job_progress_new(c_domain_job_progress, &m->cur));
+        }
 
-error:
-    for (i = 0; i < ret; i++) {
-        close(fdlist[i]);
+        if (finished) {
+            break;
+        }
     }
-    free(fdlist);
-    rb_jump_tag(exception);
+
+    return Qnil;
 }
-#endif
 
-#if HAVE_VIRDOMAINQEMUAGENTCOMMAND
-/*
- * call-seq:
- *   dom.qemu_agent_command(command, timeout=0, flags=0) -> String
- *
- * Call virDomainQemuAgentCommand[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainQemuAgentCommand]
- * to run an arbitrary command on the Qemu Agent.
+/* if the block raised or broke out, abort the save rather than leave it
+ * running unwatched.  An abort sent before the save thread has started its
+ * job does nothing, so keep sending one every SAVE_PARAMS_ABORT_RETRY
+ * seconds until the save has stopped
  */
-static VALUE libvirt_domain_qemu_agent_command(int argc, VALUE *argv, VALUE d)
-{
-    VALUE command, timeout = RUBY_Qnil, flags = RUBY_Qnil, result;
-    char *ret;
-    int exception = 0;
+#define SAVE_PARAMS_ABORT_RETRY 0.1
 
-    rb_scan_args(argc, argv, "12", &command, &timeout, &flags);
+static void *save_params_join(void *p)
+{
+    struct save_params_job *job = (struct save_params_job *)p;
+    struct timespec ts;
+    double until;
 
-    ret = virDomainQemuAgentCommand(ruby_libvirt_domain_get(d),
-                                    StringValueCStr(command),
-                                    ruby_libvirt_value_to_int(timeout),
-                                    ruby_libvirt_value_to_uint(flags));
-    ruby_libvirt_raise_error_if(ret == NULL, e_RetrieveError,
-                                "virDomainQemuAgentCommand",
-                                ruby_libvirt_connect_get(d));
+    pthread_mutex_lock(&job->m.lock);
+    while (!job->m.finished) {
+        pthread_mutex_unlock(&job->m.lock);
+        if (virDomainAbortJob(job->dom) < 0) {
+            virResetLastError();
+        }
+        pthread_mutex_lock(&job->m.lock);
 
-    result = rb_protect(ruby_libvirt_str_new2_wrap, (VALUE)&ret, &exception);
-    free(ret);
-    if (exception) {
-        rb_jump_tag(exception);
+        until = job_monitor_now() + SAVE_PARAMS_ABORT_RETRY;
+        while (!job->m.finished && job_monitor_now() < until) {
+            ts.tv_sec = (time_t)until;
+            ts.tv_nsec = (long)((until - ts.tv_sec) * 1000000000.0);
+            pthread_cond_timedwait(&job->m.cond, &job->m.lock, &ts);
+        }
     }
+    pthread_mutex_unlock(&job->m.lock);
 
-    return result;
+    pthread_join(job->thread, NULL);
+
+    return NULL;
 }
-#endif
 
-#if HAVE_VIRDOMAINLXCENTERNAMESPACE
-/*
- * call-seq:
- *   dom.lxc_enter_namespace(fds, flags=0) -> Array
- *
- * Call virDomainLxcEnterNamespace[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainLxcEnterNamespace]
- * to attach the process to the namespaces associated with the file descriptors
- * in the fds array.  Note that this call does not actually enter the namespace;
- * the next call to fork will do that.  Also note that this function will return
- * an array of old file descriptors that can be used to switch back to the
- * current namespace later.
- */
-static VALUE libvirt_domain_lxc_enter_namespace(int argc, VALUE *argv, VALUE d)
+static VALUE save_params_cleanup(VALUE in)
 {
-    VALUE fds = RUBY_Qnil, flags = RUBY_Qnil, result;
-    int *fdlist;
-    int ret, exception = 0;
-    int *oldfdlist;
-    unsigned int noldfdlist, i;
-    struct ruby_libvirt_ary_store_arg args;
+    struct save_params_job *job = (struct save_params_job *)in;
 
-    rb_scan_args(argc, argv, "11", &fds, &flags);
+    ruby_libvirt_without_gvl(save_params_join, job, NULL, NULL);
 
-    Check_Type(fds, T_ARRAY);
+    pthread_cond_destroy(&job->m.cond);
+    pthread_mutex_destroy(&job->m.lock);
 
-    fdlist = alloca(sizeof(int) * RARRAY_LEN(fds));
-    for (i = 0; i < RARRAY_LEN(fds); i++) {
-        fdlist[i] = NUM2INT(rb_ary_entry(fds, i));
-    }
+    return Qnil;
+}
 
-    ret = virDomainLxcEnterNamespace(ruby_libvirt_domain_get(d),
-                                     RARRAY_LEN(fds), fdlist, &noldfdlist,
-                                     &oldfdlist,
-                                     ruby_libvirt_value_to_uint(flags));
-    ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError,
-                                "virDomainLxcEnterNamespace",
-                                ruby_libvirt_connect_get(d));
+static void save_params_with_progress(VALUE d, VALUE interval,
+                                      virTypedParameterPtr params,
+                                      int nparams, unsigned int flags)
+{
+    struct save_params_job job;
+    VALUE error;
 
-    result = rb_protect(ruby_libvirt_ary_new2_wrap, (VALUE)&noldfdlist,
-                        &exception);
-    if (exception) {
-        free(oldfdlist);
-        rb_jump_tag(exception);
+    memset(&job, 0, sizeof(job));
+    job.dom = ruby_libvirt_domain_get(d);
+    job.params = params;
+    job.nparams = nparams;
+    job.flags = flags;
+    job.m.dom = job.dom;
+    job.m.interval = NIL_P(interval) ? 1.0 : NUM2INT(interval) / 1000.0;
+    if (job.m.interval <= 0) {
+        rb_raise(rb_eArgError, "interval must be positive");
     }
+    job.m.first = 1;
+    job.m.sampled_at = job_monitor_now();
 
-    for (i = 0; i < noldfdlist; i++) {
-        args.arr = result;
-        args.index = i;
-        /* from reading the ruby sources, INT2NUM can't possibly throw an
-         * exception, so this can't leak.
-         */
-        args.elem = INT2NUM(oldfdlist[i]);
+    pthread_mutex_init(&job.m.lock, NULL);
+    pthread_cond_init(&job.m.cond, NULL);
 
-        rb_protect(ruby_libvirt_ary_store_wrap, (VALUE)&args, &exception);
-        if (exception) {
-            free(oldfdlist);
-            rb_jump_tag(exception);
-        }
+    if (pthread_create(&job.thread, NULL, save_params_thread, &job) != 0) {
+        pthread_cond_destroy(&job.m.cond);
+        pthread_mutex_destroy(&job.m.lock);
+        rb_sys_fail("pthread_create");
     }
 
-    free(oldfdlist);
+    rb_ensure(save_params_monitor, (VALUE)&job, save_params_cleanup,
+              (VALUE)&job);
 
-    return result;
+    if (job.r < 0) {
+        error = ruby_libvirt_error_new(e_Error, "virDomainSaveParams",
+                                       &job.err);
+        virResetError(&job.err);
+        rb_exc_raise(error);
+    }
 }
 #endif
 
-#if HAVE_VIRDOMAINMIGRATE3
-static struct ruby_libvirt_typed_param migrate3_allowed[] = {
-    {VIR_MIGRATE_PARAM_URI, VIR_TYPED_PARAM_STRING},
-    {VIR_MIGRATE_PARAM_DEST_NAME, VIR_TYPED_PARAM_STRING},
-    {VIR_MIGRATE_PARAM_DEST_XML, VIR_TYPED_PARAM_STRING},
-    {VIR_MIGRATE_PARAM_BANDWIDTH, VIR_TYPED_PARAM_ULLONG},
-    {VIR_MIGRATE_PARAM_GRAPHICS_URI, VIR_TYPED_PARAM_STRING},
-#if HAVE_CONST_VIR_MIGRATE_PARAM_LISTEN_ADDRESS
-    {VIR_MIGRATE_PARAM_LISTEN_ADDRESS, VIR_TYPED_PARAM_STRING},
+static VALUE save_params_call(VALUE in)
+{
+    struct save_params_arg *sp = (struct save_params_arg *)in;
+
+    save_params_params(sp->hash, sp->args);
+
+    if (sp->progress) {
+#if HAVE_VIRDOMAINGETJOBSTATS
+        save_params_with_progress(sp->d, sp->interval, sp->args->params,
+                                  sp->args->i, sp->flags);
+        return Qnil;
+#else
+        rb_raise(e_NoSupportError, "Progress reporting not supported");
 #endif
-};
+    }
+
+    ruby_libvirt_generate_call_nil_nogvl_ubf(virDomainSaveParams,
+                                             ruby_libvirt_connect_get(sp->d),
+                                             DOMAIN_JOB_UBF,
+                                             ruby_libvirt_domain_get(sp->d),
+                                             ruby_libvirt_domain_get(sp->d),
+                                             sp->args->params, sp->args->i,
+                                             sp->flags);
+}
 
 /*
  * call-seq:
- *   dom.migrate3(dconn, Hash=nil, flags=0) -> Libvirt::Domain
+ *   dom.save_params(Hash, flags=0, interval_ms: 1000) {|progress| block } -> nil
  *
- * Call virDomainMigrate3[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainMigrate3]
- * to migrate a domain from the host on this connection to the connection
- * referenced in dconn.
+ * Call virDomainSaveParams[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainSaveParams]
+ * to save the domain state as described by Hash, whose keys are the
+ * Libvirt::Domain::SAVE_PARAM_* names (as Strings or Symbols).  For example,
+ * a save written over four channels is
+ *
+ *   dom.save_params({ Libvirt::Domain::SAVE_PARAM_FILE => "/var/save/dom",
+ *                     Libvirt::Domain::SAVE_PARAM_PARALLEL_CHANNELS => 4 },
+ *                   Libvirt::Domain::SAVE_PARALLEL)
+ *
+ * As with dom.save, the save runs with the GVL released, and interrupting
+ * the calling thread aborts it.  If a block is given, it is called with a
+ * Libvirt::Domain::JobProgress every interval_ms milliseconds that the save
+ * has made progress, as for dom.monitor_job; raising or breaking out of the
+ * block aborts the save.  Any option other than interval_ms raises
+ * ArgumentError.
  */
-static VALUE libvirt_domain_migrate3(int argc, VALUE *argv, VALUE d)
+static VALUE libvirt_domain_save_params(int argc, VALUE *argv, VALUE d)
 {
-    VALUE dconn = RUBY_Qnil, hash = RUBY_Qnil, flags = RUBY_Qnil;
-    virDomainPtr ddom = NULL;
+    static const char *const names[] = { "interval_ms", NULL };
+    VALUE hash, flags, opts, interval = Qnil;
     struct ruby_libvirt_parameter_assign_args args;
-    unsigned long hashsize;
-
-    rb_scan_args(argc, argv, "12", &dconn, &hash, &flags);
+    struct save_params_arg sp;
 
+    rb_scan_args(argc, argv, "12", &hash, &flags, &opts);
+    if (TYPE(flags) == T_HASH && NIL_P(opts)) {
+        opts = flags;
+        flags = Qnil;
+    }
     Check_Type(hash, T_HASH);
-
-    hashsize = RHASH_SIZE(hash);
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        ruby_libvirt_check_options(opts, names);
+        interval = rb_hash_aref(opts, ID2SYM(rb_intern("interval_ms")));
+    }
 
     memset(&args, 0, sizeof(struct ruby_libvirt_parameter_assign_args));
+    if (RHASH_SIZE(hash) > 0) {
+        args.params = alloca(sizeof(virTypedParameter) * RHASH_SIZE(hash));
+    }
+    args.nalloc = RHASH_SIZE(hash);
 
-    if (hashsize > 0) {
-        args.allowed = migrate3_allowed;
-        args.num_allowed = ARRAY_SIZE(migrate3_allowed);
-
-        args.params = alloca(sizeof(virTypedParameter) * hashsize);
-        args.i = 0;
+    sp.d = d;
+    sp.hash = hash;
+    sp.interval = interval;
+    sp.flags = ruby_libvirt_value_to_uint(flags);
+    sp.progress = rb_block_given_p();
+    sp.args = &args;
 
-        rb_hash_foreach(hash, ruby_libvirt_typed_parameter_assign,
-                        (VALUE)&args);
-    }
+    return ruby_libvirt_typed_params_ensure(save_params_call, (VALUE)&sp,
+                                            &args);
+}
 
-    ddom = virDomainMigrate3(ruby_libvirt_domain_get(d),
-                             ruby_libvirt_connect_get(dconn), args.params,
-                             args.i, ruby_libvirt_value_to_uint(flags));
+static VALUE restore_params_call(VALUE in)
+{
+    struct save_params_arg *sp = (struct save_params_arg *)in;
 
-    ruby_libvirt_raise_error_if(ddom == NULL, e_Error, "virDomainMigrate3",
-                                ruby_libvirt_connect_get(d));
+    save_params_params(sp->hash, sp->args);
 
-    return ruby_libvirt_domain_new(ddom, dconn);
+    ruby_libvirt_generate_call_nil_nogvl(virDomainRestoreParams,
+                                         ruby_libvirt_connect_get(sp->d),
+                                         ruby_libvirt_connect_get(sp->d),
+                                         sp->args->params, sp->args->i,
+                                         sp->flags);
 }
 
 /*
  * call-seq:
- *   dom.migrate_to_uri3(duri=nil, Hash=nil, flags=0) -> nil
+ *   Libvirt::Domain::restore_params(conn, Hash, flags=0) -> nil
  *
- * Call virDomainMigrateToURI3[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainMigrateToURI3]
- * to migrate a domain from the host on this connection to the host whose
- * libvirt URI is duri.
+ * Call virDomainRestoreParams[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainRestoreParams]
+ * to restore a domain saved with dom.save_params.  Hash is as for
+ * dom.save_params; the same Libvirt::Domain::SAVE_PARAM_PARALLEL_CHANNELS
+ * and Libvirt::Domain::SAVE_PARALLEL should be given to read the image back
+ * in parallel.  The restore runs with the GVL released.
  */
-static VALUE libvirt_domain_migrate_to_uri3(int argc, VALUE *argv, VALUE d)
+static VALUE libvirt_domain_s_restore_params(int argc, VALUE *argv,
+                                             VALUE RUBY_LIBVIRT_UNUSED(klass))
 {
-    VALUE duri = RUBY_Qnil, hash = RUBY_Qnil, flags = RUBY_Qnil;
+    VALUE c, hash, flags;
     struct ruby_libvirt_parameter_assign_args args;
-    unsigned long hashsize;
+    struct save_params_arg sp;
 
-    rb_scan_args(argc, argv, "03", &duri, &hash, &flags);
+    rb_scan_args(argc, argv, "21", &c, &hash, &flags);
 
     Check_Type(hash, T_HASH);
-
-    hashsize = RHASH_SIZE(hash);
-
     memset(&args, 0, sizeof(struct ruby_libvirt_parameter_assign_args));
+    if (RHASH_SIZE(hash) > 0) {
+        args.params = alloca(sizeof(virTypedParameter) * RHASH_SIZE(hash));
+    }
+    args.nalloc = RHASH_SIZE(hash);
 
-    if (hashsize > 0) {
-        args.allowed = migrate3_allowed;
-        args.num_allowed = ARRAY_SIZE(migrate3_allowed);
+    sp.d = c;
+    sp.hash = hash;
+    sp.interval = Qnil;
+    sp.flags = ruby_libvirt_value_to_uint(flags);
+    sp.progress = 0;
+    sp.args = &args;
 
-        args.params = alloca(sizeof(virTypedParameter) * hashsize);
-        args.i = 0;
+    return ruby_libvirt_typed_params_ensure(restore_params_call, (VALUE)&sp,
+                                            &args);
+}
+#endif
 
-        rb_hash_foreach(hash, ruby_libvirt_typed_parameter_assign,
-                        (VALUE)&args);
-    }
+#if HAVE_VIRDOMAINMIGRATESTARTPOSTCOPY
+/*
+ * call-seq:
+ *   dom.migrate_start_post_copy(flags=0) -> nil
+ *
+ * Call virDomainMigrateStartPostCopy[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainMigrateStartPostCopy]
+ * to switch a migration started with Libvirt::Domain::MIGRATE_POSTCOPY over
+ * to post-copy mode.  This is normally called from another thread while
+ * dom.migrate3 or dom.migrate_to_uri3 is running.
+ */
+static VALUE libvirt_domain_migrate_start_post_copy(int argc, VALUE *argv,
+                                                    VALUE d)
+{
+    VALUE flags = RUBY_Qnil;
+
+    rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_nil(virDomainMigrateToURI3,
+    ruby_libvirt_generate_call_nil(virDomainMigrateStartPostCopy,
                                    ruby_libvirt_connect_get(d),
                                    ruby_libvirt_domain_get(d),
-                                   ruby_libvirt_get_cstring_or_null(duri),
-                                   args.params, args.i,
-                                   ruby_libvirt_value_to_ulong(flags));
+                                   ruby_libvirt_value_to_uint(flags));
 }
 #endif
 
 #if HAVE_VIRDOMAINGETCPUSTATS
 /*
  * call-seq:
- *   dom.cpu_stats(start_cpu=-1, numcpus=1, flags=0) -> Hash
+ *   dom.cpu_stats(start_cpu=-1, numcpus=1, flags=0, keys: :string) -> Hash
  *
  * Call virDomainGetCPUStats[http://www.libvirt.org/html/libvirt-libvirt-domain.html#virDomainGetCPUStats]
  * to get statistics about CPU usage attributable to a single domain.  If
@@ -3969,14 +5881,19 @@ static VALUE libvirt_domain_migrate_to_uri3(int argc, VALUE *argv, VALUE d)
  * entire domain is returned.  If start_cpu is any positive number, then it
  * represents which CPU to start with and numcpus represents how many
  * consecutive processors to query.
+ *
+ * Parameter names are returned as frozen Strings, or as Symbols with
+ * keys: :symbol.
  */
 static VALUE libvirt_domain_cpu_stats(int argc, VALUE *argv, VALUE d)
 {
     VALUE start_cpu = RUBY_Qnil, numcpus = RUBY_Qnil, flags = RUBY_Qnil, result, tmp;
-    int ret, nparams, j;
+    int ret, nparams, j, symbol_keys;
     unsigned int i;
     virTypedParameterPtr params;
 
+    symbol_keys = ruby_libvirt_keys_option(&argc, argv);
+
     rb_scan_args(argc, argv, "03", &start_cpu, &numcpus, &flags);
 
     if (NIL_P(start_cpu)) {
@@ -4011,7 +5928,7 @@ static VALUE libvirt_domain_cpu_stats(int argc, VALUE *argv, VALUE d)
         result = rb_hash_new();
         tmp = rb_hash_new();
         for (j = 0; j < nparams; j++) {
-            ruby_libvirt_typed_params_to_hash(params, j, tmp);
+            ruby_libvirt_typed_params_to_hash(params, j, tmp, symbol_keys);
         }
 
         rb_hash_aset(result, rb_str_new2("all"), tmp);
@@ -4040,7 +5957,8 @@ static VALUE libvirt_domain_cpu_stats(int argc, VALUE *argv, VALUE d)
             }
             tmp = rb_hash_new();
             for (j = 0; j < nparams; j++) {
-                ruby_libvirt_typed_params_to_hash(params, j, tmp);
+                ruby_libvirt_typed_params_to_hash(params, i * nparams + j, tmp,
+                                                  symbol_keys);
             }
 
             rb_hash_aset(result, INT2NUM(NUM2UINT(start_cpu) + i), tmp);
@@ -4296,11 +6214,10 @@ static VALUE libvirt_domain_rename(int argc, VALUE *argv, VALUE d)
 
     rb_scan_args(argc, argv, "11", &name, &flags);
 
-    ruby_libvirt_generate_call_nil(virDomainRename,
-                                   ruby_libvirt_connect_get(d),
-                                   ruby_libvirt_domain_get(d),
-                                   StringValueCStr(name),
-                                   ruby_libvirt_value_to_uint(flags));
+    domain_generate_call_nil_changed(virDomainRename, d,
+                                     ruby_libvirt_domain_get(d),
+                                     StringValueCStr(name),
+                                     ruby_libvirt_value_to_uint(flags));
 }
 #endif
 
@@ -4417,6 +6334,29 @@ void ruby_libvirt_domain_init(void)
     rb_define_const(c_domain, "MIGRATE_RDMA_PIN_ALL",
                     INT2NUM(VIR_MIGRATE_RDMA_PIN_ALL));
 #endif
+#if HAVE_CONST_VIR_MIGRATE_POSTCOPY
+    rb_define_const(c_domain, "MIGRATE_POSTCOPY",
+                    INT2NUM(VIR_MIGRATE_POSTCOPY));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_TLS
+    rb_define_const(c_domain, "MIGRATE_TLS", INT2NUM(VIR_MIGRATE_TLS));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARALLEL
+    rb_define_const(c_domain, "MIGRATE_PARALLEL",
+                    INT2NUM(VIR_MIGRATE_PARALLEL));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_NON_SHARED_SYNCHRONOUS_WRITES
+    rb_define_const(c_domain, "MIGRATE_NON_SHARED_SYNCHRONOUS_WRITES",
+                    INT2NUM(VIR_MIGRATE_NON_SHARED_SYNCHRONOUS_WRITES));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_POSTCOPY_RESUME
+    rb_define_const(c_domain, "MIGRATE_POSTCOPY_RESUME",
+                    INT2NUM(VIR_MIGRATE_POSTCOPY_RESUME));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_ZEROCOPY
+    rb_define_const(c_domain, "MIGRATE_ZEROCOPY",
+                    INT2NUM(VIR_MIGRATE_ZEROCOPY));
+#endif
 
     /* Ideally we would just have the "XML_SECURE" constant.  Unfortunately
      * we screwed up long ago, and we have to leave "DOMAIN_XML_SECURE" for
@@ -4531,6 +6471,27 @@ void ruby_libvirt_domain_init(void)
 #if HAVE_CONST_VIR_DOMAIN_SAVE_PAUSED
     rb_define_const(c_domain, "SAVE_PAUSED", INT2NUM(VIR_DOMAIN_SAVE_PAUSED));
 #endif
+#if HAVE_CONST_VIR_DOMAIN_SAVE_PARALLEL
+    rb_define_const(c_domain, "SAVE_PARALLEL",
+                    INT2NUM(VIR_DOMAIN_SAVE_PARALLEL));
+#endif
+#if HAVE_VIRDOMAINSAVEPARAMS
+    rb_define_method(c_domain, "save_params", libvirt_domain_save_params, -1);
+    rb_define_singleton_method(c_domain, "restore_params",
+                               libvirt_domain_s_restore_params, -1);
+    rb_define_const(c_domain, "SAVE_PARAM_FILE",
+                    rb_str_new2(VIR_DOMAIN_SAVE_PARAM_FILE));
+    rb_define_const(c_domain, "SAVE_PARAM_DXML",
+                    rb_str_new2(VIR_DOMAIN_SAVE_PARAM_DXML));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_SAVE_PARAM_IMAGE_FORMAT
+    rb_define_const(c_domain, "SAVE_PARAM_IMAGE_FORMAT",
+                    rb_str_new2(VIR_DOMAIN_SAVE_PARAM_IMAGE_FORMAT));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_SAVE_PARAM_PARALLEL_CHANNELS
+    rb_define_const(c_domain, "SAVE_PARAM_PARALLEL_CHANNELS",
+                    rb_str_new2(VIR_DOMAIN_SAVE_PARAM_PARALLEL_CHANNELS));
+#endif
 
 #if HAVE_CONST_VIR_DOMAIN_UNDEFINE_MANAGED_SAVE
     rb_define_const(c_domain, "UNDEFINE_MANAGED_SAVE",
@@ -4544,7 +6505,7 @@ void ruby_libvirt_domain_init(void)
     rb_define_const(c_domain, "UNDEFINE_NVRAM",
                     INT2NUM(VIR_DOMAIN_UNDEFINE_NVRAM));
 #endif
-    rb_define_attr(c_domain, "connection", 1, 0);
+    rb_define_method(c_domain, "connection", ruby_libvirt_handle_connection, 0);
 
 #if HAVE_CONST_VIR_DOMAIN_SHUTDOWN_DEFAULT
     rb_define_const(c_domain, "SHUTDOWN_DEFAULT",
@@ -4682,12 +6643,20 @@ void ruby_libvirt_domain_init(void)
 #endif
 #if HAVE_VIRDOMAINBLOCKPEEK
     rb_define_method(c_domain, "block_peek", libvirt_domain_block_peek, -1);
+    rb_define_method(c_domain, "block_peek_into",
+                     libvirt_domain_block_peek_into, -1);
+    rb_define_method(c_domain, "block_peek_each",
+                     libvirt_domain_block_peek_each, -1);
 #endif
 #if HAVE_TYPE_VIRDOMAINBLOCKINFOPTR
     rb_define_method(c_domain, "blockinfo", libvirt_domain_block_info, -1);
 #endif
 #if HAVE_VIRDOMAINMEMORYPEEK
     rb_define_method(c_domain, "memory_peek", libvirt_domain_memory_peek, -1);
+    rb_define_method(c_domain, "memory_peek_into",
+                     libvirt_domain_memory_peek_into, -1);
+    rb_define_method(c_domain, "memory_peek_each",
+                     libvirt_domain_memory_peek_each, -1);
 #endif
     rb_define_method(c_domain, "vcpus", libvirt_domain_vcpus, 0);
     rb_define_alias(c_domain, "get_vcpus", "vcpus");
@@ -4718,25 +6687,29 @@ void ruby_libvirt_domain_init(void)
      * Class Libvirt::Domain::Info
      */
     c_domain_info = rb_define_class_under(c_domain, "Info", rb_cObject);
-    rb_define_attr(c_domain_info, "state", 1, 0);
-    rb_define_attr(c_domain_info, "max_mem", 1, 0);
-    rb_define_attr(c_domain_info, "memory", 1, 0);
-    rb_define_attr(c_domain_info, "nr_virt_cpu", 1, 0);
-    rb_define_attr(c_domain_info, "cpu_time", 1, 0);
+    rb_define_alloc_func(c_domain_info, domain_info_alloc);
+    rb_define_method(c_domain_info, "state", domain_info_state, 0);
+    rb_define_method(c_domain_info, "max_mem", domain_info_max_mem, 0);
+    rb_define_method(c_domain_info, "memory", domain_info_memory, 0);
+    rb_define_method(c_domain_info, "nr_virt_cpu", domain_info_nr_virt_cpu, 0);
+    rb_define_method(c_domain_info, "cpu_time", domain_info_cpu_time, 0);
 
     /*
      * Class Libvirt::Domain::InterfaceInfo
      */
     c_domain_ifinfo = rb_define_class_under(c_domain, "InterfaceInfo",
                                             rb_cObject);
-    rb_define_attr(c_domain_ifinfo, "rx_bytes", 1, 0);
-    rb_define_attr(c_domain_ifinfo, "rx_packets", 1, 0);
-    rb_define_attr(c_domain_ifinfo, "rx_errs", 1, 0);
-    rb_define_attr(c_domain_ifinfo, "rx_drop", 1, 0);
-    rb_define_attr(c_domain_ifinfo, "tx_bytes", 1, 0);
-    rb_define_attr(c_domain_ifinfo, "tx_packets", 1, 0);
-    rb_define_attr(c_domain_ifinfo, "tx_errs", 1, 0);
-    rb_define_attr(c_domain_ifinfo, "tx_drop", 1, 0);
+    rb_define_alloc_func(c_domain_ifinfo, domain_ifinfo_alloc);
+    rb_define_method(c_domain_ifinfo, "rx_bytes", domain_ifinfo_rx_bytes, 0);
+    rb_define_method(c_domain_ifinfo, "rx_packets",
+                     domain_ifinfo_rx_packets, 0);
+    rb_define_method(c_domain_ifinfo, "rx_errs", domain_ifinfo_rx_errs, 0);
+    rb_define_method(c_domain_ifinfo, "rx_drop", domain_ifinfo_rx_drop, 0);
+    rb_define_method(c_domain_ifinfo, "tx_bytes", domain_ifinfo_tx_bytes, 0);
+    rb_define_method(c_domain_ifinfo, "tx_packets",
+                     domain_ifinfo_tx_packets, 0);
+    rb_define_method(c_domain_ifinfo, "tx_errs", domain_ifinfo_tx_errs, 0);
+    rb_define_method(c_domain_ifinfo, "tx_drop", domain_ifinfo_tx_drop, 0);
 
     /*
      * Class Libvirt::Domain::SecurityLabel
@@ -4751,11 +6724,16 @@ void ruby_libvirt_domain_init(void)
      */
     c_domain_block_stats = rb_define_class_under(c_domain, "BlockStats",
                                                  rb_cObject);
-    rb_define_attr(c_domain_block_stats, "rd_req", 1, 0);
-    rb_define_attr(c_domain_block_stats, "rd_bytes", 1, 0);
-    rb_define_attr(c_domain_block_stats, "wr_req", 1, 0);
-    rb_define_attr(c_domain_block_stats, "wr_bytes", 1, 0);
-    rb_define_attr(c_domain_block_stats, "errs", 1, 0);
+    rb_define_alloc_func(c_domain_block_stats, domain_block_stats_alloc);
+    rb_define_method(c_domain_block_stats, "rd_req",
+                     domain_block_stats_rd_req, 0);
+    rb_define_method(c_domain_block_stats, "rd_bytes",
+                     domain_block_stats_rd_bytes, 0);
+    rb_define_method(c_domain_block_stats, "wr_req",
+                     domain_block_stats_wr_req, 0);
+    rb_define_method(c_domain_block_stats, "wr_bytes",
+                     domain_block_stats_wr_bytes, 0);
+    rb_define_method(c_domain_block_stats, "errs", domain_block_stats_errs, 0);
 
 #if HAVE_TYPE_VIRDOMAINBLOCKJOBINFOPTR
     /*
@@ -4763,10 +6741,15 @@ void ruby_libvirt_domain_init(void)
      */
     c_domain_block_job_info = rb_define_class_under(c_domain, "BlockJobInfo",
                                                     rb_cObject);
-    rb_define_attr(c_domain_block_job_info, "type", 1, 0);
-    rb_define_attr(c_domain_block_job_info, "bandwidth", 1, 0);
-    rb_define_attr(c_domain_block_job_info, "cur", 1, 0);
-    rb_define_attr(c_domain_block_job_info, "end", 1, 0);
+    rb_define_alloc_func(c_domain_block_job_info, domain_block_job_info_alloc);
+    rb_define_method(c_domain_block_job_info, "type",
+                     domain_block_job_info_type, 0);
+    rb_define_method(c_domain_block_job_info, "bandwidth",
+                     domain_block_job_info_bandwidth, 0);
+    rb_define_method(c_domain_block_job_info, "cur",
+                     domain_block_job_info_cur, 0);
+    rb_define_method(c_domain_block_job_info, "end",
+                     domain_block_job_info_end, 0);
 #endif
 
 #if HAVE_TYPE_VIRDOMAINMEMORYSTATPTR
@@ -4775,8 +6758,10 @@ void ruby_libvirt_domain_init(void)
      */
     c_domain_memory_stats = rb_define_class_under(c_domain, "MemoryStats",
                                                   rb_cObject);
-    rb_define_attr(c_domain_memory_stats, "tag", 1, 0);
-    rb_define_attr(c_domain_memory_stats, "value", 1, 0);
+    rb_define_alloc_func(c_domain_memory_stats, domain_memory_stats_alloc);
+    rb_define_method(c_domain_memory_stats, "tag", domain_memory_stats_tag, 0);
+    rb_define_method(c_domain_memory_stats, "value",
+                     domain_memory_stats_value, 0);
 
     rb_define_const(c_domain_memory_stats, "SWAP_IN",
                     INT2NUM(VIR_DOMAIN_MEMORY_STAT_SWAP_IN));
@@ -4806,9 +6791,13 @@ void ruby_libvirt_domain_init(void)
      */
     c_domain_block_info = rb_define_class_under(c_domain, "BlockInfo",
                                                 rb_cObject);
-    rb_define_attr(c_domain_block_info, "capacity", 1, 0);
-    rb_define_attr(c_domain_block_info, "allocation", 1, 0);
-    rb_define_attr(c_domain_block_info, "physical", 1, 0);
+    rb_define_alloc_func(c_domain_block_info, domain_block_info_alloc);
+    rb_define_method(c_domain_block_info, "capacity",
+                     domain_block_info_capacity, 0);
+    rb_define_method(c_domain_block_info, "allocation",
+                     domain_block_info_allocation, 0);
+    rb_define_method(c_domain_block_info, "physical",
+                     domain_block_info_physical, 0);
 #endif
 
 #if HAVE_TYPE_VIRDOMAINSNAPSHOTPTR
@@ -4846,11 +6835,15 @@ void ruby_libvirt_domain_init(void)
     rb_define_const(c_domain_vcpuinfo, "OFFLINE", VIR_VCPU_OFFLINE);
     rb_define_const(c_domain_vcpuinfo, "RUNNING", VIR_VCPU_RUNNING);
     rb_define_const(c_domain_vcpuinfo, "BLOCKED", VIR_VCPU_BLOCKED);
-    rb_define_attr(c_domain_vcpuinfo, "number", 1, 0);
-    rb_define_attr(c_domain_vcpuinfo, "state", 1, 0);
-    rb_define_attr(c_domain_vcpuinfo, "cpu_time", 1, 0);
-    rb_define_attr(c_domain_vcpuinfo, "cpu", 1, 0);
-    rb_define_attr(c_domain_vcpuinfo, "cpumap", 1, 0);
+    rb_define_alloc_func(c_domain_vcpuinfo, domain_vcpuinfo_alloc);
+    rb_define_method(c_domain_vcpuinfo, "number", domain_vcpuinfo_number, 0);
+    rb_define_method(c_domain_vcpuinfo, "state", domain_vcpuinfo_state, 0);
+    rb_define_method(c_domain_vcpuinfo, "cpu_time", domain_vcpuinfo_cpu_time,
+                     0);
+    rb_define_method(c_domain_vcpuinfo, "cpu", domain_vcpuinfo_cpu, 0);
+    rb_define_method(c_domain_vcpuinfo, "cpumap", domain_vcpuinfo_cpumap, 0);
+    rb_define_method(c_domain_vcpuinfo, "cpu_bitmap",
+                     domain_vcpuinfo_cpu_bitmap, 0);
 
 #if HAVE_TYPE_VIRDOMAINJOBINFOPTR
     /*
@@ -4868,18 +6861,30 @@ void ruby_libvirt_domain_init(void)
                     INT2NUM(VIR_DOMAIN_JOB_FAILED));
     rb_define_const(c_domain_job_info, "CANCELLED",
                     INT2NUM(VIR_DOMAIN_JOB_CANCELLED));
-    rb_define_attr(c_domain_job_info, "type", 1, 0);
-    rb_define_attr(c_domain_job_info, "time_elapsed", 1, 0);
-    rb_define_attr(c_domain_job_info, "time_remaining", 1, 0);
-    rb_define_attr(c_domain_job_info, "data_total", 1, 0);
-    rb_define_attr(c_domain_job_info, "data_processed", 1, 0);
-    rb_define_attr(c_domain_job_info, "data_remaining", 1, 0);
-    rb_define_attr(c_domain_job_info, "mem_total", 1, 0);
-    rb_define_attr(c_domain_job_info, "mem_processed", 1, 0);
-    rb_define_attr(c_domain_job_info, "mem_remaining", 1, 0);
-    rb_define_attr(c_domain_job_info, "file_total", 1, 0);
-    rb_define_attr(c_domain_job_info, "file_processed", 1, 0);
-    rb_define_attr(c_domain_job_info, "file_remaining", 1, 0);
+    rb_define_alloc_func(c_domain_job_info, domain_job_info_alloc);
+    rb_define_method(c_domain_job_info, "type", domain_job_info_type, 0);
+    rb_define_method(c_domain_job_info, "time_elapsed",
+                     domain_job_info_time_elapsed, 0);
+    rb_define_method(c_domain_job_info, "time_remaining",
+                     domain_job_info_time_remaining, 0);
+    rb_define_method(c_domain_job_info, "data_total",
+                     domain_job_info_data_total, 0);
+    rb_define_method(c_domain_job_info, "data_processed",
+                     domain_job_info_data_processed, 0);
+    rb_define_method(c_domain_job_info, "data_remaining",
+                     domain_job_info_data_remaining, 0);
+    rb_define_method(c_domain_job_info, "mem_total",
+                     domain_job_info_mem_total, 0);
+    rb_define_method(c_domain_job_info, "mem_processed",
+                     domain_job_info_mem_processed, 0);
+    rb_define_method(c_domain_job_info, "mem_remaining",
+                     domain_job_info_mem_remaining, 0);
+    rb_define_method(c_domain_job_info, "file_total",
+                     domain_job_info_file_total, 0);
+    rb_define_method(c_domain_job_info, "file_processed",
+                     domain_job_info_file_processed, 0);
+    rb_define_method(c_domain_job_info, "file_remaining",
+                     domain_job_info_file_remaining, 0);
 
     rb_define_method(c_domain, "job_info", libvirt_domain_job_info, 0);
     rb_define_method(c_domain, "abort_job", libvirt_domain_abort_job, 0);
@@ -5504,6 +7509,26 @@ void ruby_libvirt_domain_init(void)
 #endif
     rb_define_method(c_domain, "list_all_snapshots",
                      libvirt_domain_list_all_snapshots, -1);
+#if HAVE_CONST_VIR_DOMAIN_SNAPSHOT_LIST_TOPOLOGICAL
+    rb_define_const(c_domain_snapshot, "LIST_TOPOLOGICAL",
+                    INT2NUM(VIR_DOMAIN_SNAPSHOT_LIST_TOPOLOGICAL));
+#endif
+    rb_define_method(c_domain, "snapshot_tree",
+                     libvirt_domain_snapshot_tree, -1);
+
+    /*
+     * Class Libvirt::Domain::Snapshot::Node
+     */
+    c_domain_snapshot_node = rb_define_class_under(c_domain_snapshot, "Node",
+                                                   rb_cObject);
+    rb_define_attr(c_domain_snapshot_node, "name", 1, 0);
+    rb_define_attr(c_domain_snapshot_node, "parent", 1, 0);
+    rb_define_attr(c_domain_snapshot_node, "children", 1, 0);
+    rb_define_attr(c_domain_snapshot_node, "creation_time", 1, 0);
+    rb_define_attr(c_domain_snapshot_node, "state", 1, 0);
+    rb_define_attr(c_domain_snapshot_node, "current", 1, 0);
+    rb_define_attr(c_domain_snapshot_node, "xml", 1, 0);
+    rb_define_attr(c_domain_snapshot_node, "snapshot", 1, 0);
 #endif
 #if HAVE_CONST_VIR_DOMAIN_SNAPSHOT_CREATE_REDEFINE
     rb_define_const(c_domain_snapshot, "CREATE_REDEFINE",
@@ -5646,6 +7671,8 @@ void ruby_libvirt_domain_init(void)
 #if HAVE_VIRDOMAINGETEMULATORPININFO
     rb_define_method(c_domain, "emulator_pin_info",
                      libvirt_domain_emulator_pin_info, -1);
+    rb_define_method(c_domain, "emulator_pin_bitmap",
+                     libvirt_domain_emulator_pin_bitmap, -1);
 #endif
 #if HAVE_VIRDOMAINPINEMULATOR
     rb_define_method(c_domain, "pin_emulator", libvirt_domain_pin_emulator, -1);
@@ -5696,6 +7723,38 @@ void ruby_libvirt_domain_init(void)
 #endif
 #if HAVE_VIRDOMAINGETJOBSTATS
     rb_define_method(c_domain, "job_stats", libvirt_domain_job_stats, -1);
+    rb_define_method(c_domain, "monitor_job", libvirt_domain_monitor_job, -1);
+
+    /*
+     * Class Libvirt::Domain::JobProgress
+     */
+    c_domain_job_progress = rb_define_class_under(c_domain, "JobProgress",
+                                                  rb_cObject);
+    rb_define_alloc_func(c_domain_job_progress, domain_job_progress_alloc);
+    rb_define_method(c_domain_job_progress, "type",
+                     domain_job_progress_type, 0);
+    rb_define_method(c_domain_job_progress, "time_elapsed",
+                     domain_job_progress_time_elapsed, 0);
+    rb_define_method(c_domain_job_progress, "data_total",
+                     domain_job_progress_data_total, 0);
+    rb_define_method(c_domain_job_progress, "data_processed",
+                     domain_job_progress_data_processed, 0);
+    rb_define_method(c_domain_job_progress, "data_remaining",
+                     domain_job_progress_data_remaining, 0);
+    rb_define_method(c_domain_job_progress, "memory_iteration",
+                     domain_job_progress_memory_iteration, 0);
+    rb_define_method(c_domain_job_progress, "throughput",
+                     domain_job_progress_throughput, 0);
+    rb_define_method(c_domain_job_progress, "dirty_rate",
+                     domain_job_progress_dirty_rate, 0);
+    rb_define_method(c_domain_job_progress, "remaining_time",
+                     domain_job_progress_remaining_time, 0);
+    rb_define_method(c_domain_job_progress, "progress",
+                     domain_job_progress_progress, 0);
+#endif
+#if HAVE_CONST_VIR_DOMAIN_JOB_STATS_COMPLETED
+    rb_define_const(c_domain, "JOB_STATS_COMPLETED",
+                    INT2NUM(VIR_DOMAIN_JOB_STATS_COMPLETED));
 #endif
 #if HAVE_VIRDOMAINGETBLOCKIOTUNE
     rb_define_method(c_domain, "block_iotune",
@@ -5788,6 +7847,88 @@ void ruby_libvirt_domain_init(void)
     rb_define_method(c_domain, "migrate3", libvirt_domain_migrate3, -1);
     rb_define_method(c_domain, "migrate_to_uri3",
                      libvirt_domain_migrate_to_uri3, -1);
+    rb_define_const(c_domain, "MIGRATE_PARAM_URI",
+                    rb_str_new2(VIR_MIGRATE_PARAM_URI));
+    rb_define_const(c_domain, "MIGRATE_PARAM_DEST_NAME",
+                    rb_str_new2(VIR_MIGRATE_PARAM_DEST_NAME));
+    rb_define_const(c_domain, "MIGRATE_PARAM_DEST_XML",
+                    rb_str_new2(VIR_MIGRATE_PARAM_DEST_XML));
+    rb_define_const(c_domain, "MIGRATE_PARAM_BANDWIDTH",
+                    rb_str_new2(VIR_MIGRATE_PARAM_BANDWIDTH));
+    rb_define_const(c_domain, "MIGRATE_PARAM_GRAPHICS_URI",
+                    rb_str_new2(VIR_MIGRATE_PARAM_GRAPHICS_URI));
+#if HAVE_CONST_VIR_MIGRATE_PARAM_LISTEN_ADDRESS
+    rb_define_const(c_domain, "MIGRATE_PARAM_LISTEN_ADDRESS",
+                    rb_str_new2(VIR_MIGRATE_PARAM_LISTEN_ADDRESS));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_MIGRATE_DISKS
+    rb_define_const(c_domain, "MIGRATE_PARAM_MIGRATE_DISKS",
+                    rb_str_new2(VIR_MIGRATE_PARAM_MIGRATE_DISKS));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_DISKS_PORT
+    rb_define_const(c_domain, "MIGRATE_PARAM_DISKS_PORT",
+                    rb_str_new2(VIR_MIGRATE_PARAM_DISKS_PORT));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_DISKS_URI
+    rb_define_const(c_domain, "MIGRATE_PARAM_DISKS_URI",
+                    rb_str_new2(VIR_MIGRATE_PARAM_DISKS_URI));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION
+    rb_define_const(c_domain, "MIGRATE_PARAM_COMPRESSION",
+                    rb_str_new2(VIR_MIGRATE_PARAM_COMPRESSION));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_MT_LEVEL
+    rb_define_const(c_domain, "MIGRATE_PARAM_COMPRESSION_MT_LEVEL",
+                    rb_str_new2(VIR_MIGRATE_PARAM_COMPRESSION_MT_LEVEL));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_MT_THREADS
+    rb_define_const(c_domain, "MIGRATE_PARAM_COMPRESSION_MT_THREADS",
+                    rb_str_new2(VIR_MIGRATE_PARAM_COMPRESSION_MT_THREADS));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_MT_DTHREADS
+    rb_define_const(c_domain, "MIGRATE_PARAM_COMPRESSION_MT_DTHREADS",
+                    rb_str_new2(VIR_MIGRATE_PARAM_COMPRESSION_MT_DTHREADS));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_XBZRLE_CACHE
+    rb_define_const(c_domain, "MIGRATE_PARAM_COMPRESSION_XBZRLE_CACHE",
+                    rb_str_new2(VIR_MIGRATE_PARAM_COMPRESSION_XBZRLE_CACHE));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_ZLIB_LEVEL
+    rb_define_const(c_domain, "MIGRATE_PARAM_COMPRESSION_ZLIB_LEVEL",
+                    rb_str_new2(VIR_MIGRATE_PARAM_COMPRESSION_ZLIB_LEVEL));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_COMPRESSION_ZSTD_LEVEL
+    rb_define_const(c_domain, "MIGRATE_PARAM_COMPRESSION_ZSTD_LEVEL",
+                    rb_str_new2(VIR_MIGRATE_PARAM_COMPRESSION_ZSTD_LEVEL));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_PERSIST_XML
+    rb_define_const(c_domain, "MIGRATE_PARAM_PERSIST_XML",
+                    rb_str_new2(VIR_MIGRATE_PARAM_PERSIST_XML));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_AUTO_CONVERGE_INITIAL
+    rb_define_const(c_domain, "MIGRATE_PARAM_AUTO_CONVERGE_INITIAL",
+                    rb_str_new2(VIR_MIGRATE_PARAM_AUTO_CONVERGE_INITIAL));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_AUTO_CONVERGE_INCREMENT
+    rb_define_const(c_domain, "MIGRATE_PARAM_AUTO_CONVERGE_INCREMENT",
+                    rb_str_new2(VIR_MIGRATE_PARAM_AUTO_CONVERGE_INCREMENT));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_BANDWIDTH_POSTCOPY
+    rb_define_const(c_domain, "MIGRATE_PARAM_BANDWIDTH_POSTCOPY",
+                    rb_str_new2(VIR_MIGRATE_PARAM_BANDWIDTH_POSTCOPY));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_PARALLEL_CONNECTIONS
+    rb_define_const(c_domain, "MIGRATE_PARAM_PARALLEL_CONNECTIONS",
+                    rb_str_new2(VIR_MIGRATE_PARAM_PARALLEL_CONNECTIONS));
+#endif
+#if HAVE_CONST_VIR_MIGRATE_PARAM_TLS_DESTINATION
+    rb_define_const(c_domain, "MIGRATE_PARAM_TLS_DESTINATION",
+                    rb_str_new2(VIR_MIGRATE_PARAM_TLS_DESTINATION));
+#endif
+#endif
+#if HAVE_VIRDOMAINMIGRATESTARTPOSTCOPY
+    rb_define_method(c_domain, "migrate_start_post_copy",
+                     libvirt_domain_migrate_start_post_copy, -1);
 #endif
 #if HAVE_CONST_VIR_DOMAIN_BLOCK_COMMIT_SHALLOW
     rb_define_const(c_domain, "BLOCK_COMMIT_SHALLOW",
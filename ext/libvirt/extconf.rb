@@ -127,6 +127,9 @@ libvirt_funcs = [ 'virStorageVolWipe',
                   'virDomainMemoryPeek',
                   'virConnectOpenAuth',
                   'virEventRegisterImpl',
+                  'virEventRegisterDefaultImpl',
+                  'virEventRunDefaultImpl',
+                  'virEventAddTimeout',
                   'virDomainIsUpdated',
                   'virDomainSetMemoryParameters',
                   'virConnectGetSysinfo',
@@ -169,6 +172,9 @@ libvirt_funcs = [ 'virStorageVolWipe',
                   'virConnectListAllStoragePools',
                   'virConnectListAllNWFilters',
                   'virConnectIsAlive',
+                  'virConnectRegisterCloseCallback',
+                  'virConnectNetworkEventRegisterAny',
+                  'virConnectStoragePoolEventRegisterAny',
                   'virNodeDeviceDetachFlags',
                   'virDomainSendProcessSignal',
                   'virDomainListAllSnapshots',
@@ -225,6 +231,15 @@ libvirt_funcs = [ 'virStorageVolWipe',
                   'virDomainDefineXMLFlags',
                   'virDomainRename',
                   'virDomainSetUserPassword',
+                  'virConnectGetAllDomainStats',
+                  'virDomainListGetStats',
+                  'virStreamRecvFlags',
+                  'virStreamRecvHole',
+                  'virStreamSendHole',
+                  'virStreamSparseRecvAll',
+                  'virStreamSparseSendAll',
+                  'virDomainMigrateStartPostCopy',
+                  'virDomainSaveParams',
                 ]
 
 libvirt_qemu_funcs = [ 'virDomainQemuMonitorCommand',
@@ -269,6 +284,16 @@ libvirt_consts = [ 'VIR_MIGRATE_LIVE',
                    'VIR_DOMAIN_AFFECT_CURRENT',
                    'VIR_DOMAIN_MEM_CURRENT',
                    'VIR_DOMAIN_EVENT_ID_CONTROL_ERROR',
+                   'VIR_DOMAIN_EVENT_ID_BLOCK_JOB',
+                   'VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2',
+                   'VIR_DOMAIN_EVENT_ID_JOB_COMPLETED',
+                   'VIR_DOMAIN_EVENT_ID_DEVICE_ADDED',
+                   'VIR_DOMAIN_EVENT_ID_DEVICE_REMOVED',
+                   'VIR_DOMAIN_EVENT_ID_METADATA_CHANGE',
+                   'VIR_DOMAIN_EVENT_ID_BALLOON_CHANGE',
+                   'VIR_DOMAIN_EVENT_ID_TRAY_CHANGE',
+                   'VIR_DOMAIN_EVENT_ID_TUNABLE',
+                   'VIR_DOMAIN_SNAPSHOT_LIST_TOPOLOGICAL',
                    'VIR_DOMAIN_PAUSED_SHUTTING_DOWN',
                    'VIR_DOMAIN_START_AUTODESTROY',
                    'VIR_DOMAIN_START_BYPASS_CACHE',
@@ -441,6 +466,42 @@ libvirt_consts = [ 'VIR_MIGRATE_LIVE',
                    'VIR_DOMAIN_DEFINE_VALIDATE',
                    'VIR_DOMAIN_PASSWORD_ENCRYPTED',
                    'VIR_DOMAIN_TIME_SYNC',
+                   'VIR_DOMAIN_STATS_PERF',
+                   'VIR_DOMAIN_STATS_IOTHREAD',
+                   'VIR_DOMAIN_STATS_MEMORY',
+                   'VIR_DOMAIN_STATS_DIRTYRATE',
+                   'VIR_DOMAIN_STATS_VM',
+                   'VIR_CONNECT_GET_ALL_DOMAINS_STATS_BACKING',
+                   'VIR_CONNECT_GET_ALL_DOMAINS_STATS_NOWAIT',
+                   'VIR_STREAM_RECV_STOP_AT_HOLE',
+                   'VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM',
+                   'VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM',
+                   'VIR_MIGRATE_PARAM_MIGRATE_DISKS',
+                   'VIR_MIGRATE_PARAM_DISKS_PORT',
+                   'VIR_MIGRATE_PARAM_DISKS_URI',
+                   'VIR_MIGRATE_PARAM_COMPRESSION',
+                   'VIR_MIGRATE_PARAM_COMPRESSION_MT_LEVEL',
+                   'VIR_MIGRATE_PARAM_COMPRESSION_MT_THREADS',
+                   'VIR_MIGRATE_PARAM_COMPRESSION_MT_DTHREADS',
+                   'VIR_MIGRATE_PARAM_COMPRESSION_XBZRLE_CACHE',
+                   'VIR_MIGRATE_PARAM_COMPRESSION_ZLIB_LEVEL',
+                   'VIR_MIGRATE_PARAM_COMPRESSION_ZSTD_LEVEL',
+                   'VIR_MIGRATE_PARAM_PERSIST_XML',
+                   'VIR_MIGRATE_PARAM_AUTO_CONVERGE_INITIAL',
+                   'VIR_MIGRATE_PARAM_AUTO_CONVERGE_INCREMENT',
+                   'VIR_MIGRATE_PARAM_BANDWIDTH_POSTCOPY',
+                   'VIR_MIGRATE_PARAM_PARALLEL_CONNECTIONS',
+                   'VIR_MIGRATE_PARAM_TLS_DESTINATION',
+                   'VIR_MIGRATE_POSTCOPY',
+                   'VIR_MIGRATE_TLS',
+                   'VIR_MIGRATE_PARALLEL',
+                   'VIR_MIGRATE_NON_SHARED_SYNCHRONOUS_WRITES',
+                   'VIR_MIGRATE_POSTCOPY_RESUME',
+                   'VIR_MIGRATE_ZEROCOPY',
+                   'VIR_DOMAIN_JOB_STATS_COMPLETED',
+                   'VIR_DOMAIN_SAVE_PARALLEL',
+                   'VIR_DOMAIN_SAVE_PARAM_IMAGE_FORMAT',
+                   'VIR_DOMAIN_SAVE_PARAM_PARALLEL_CHANNELS',
                  ]
 
 virterror_consts = [
@@ -487,6 +548,20 @@ libvirt_qemu_consts = [
                        'VIR_DOMAIN_QEMU_MONITOR_COMMAND_HMP',
                       ]
 
+# ruby features the bindings can take advantage of when available
+ruby_funcs = [ [ 'rb_thread_call_without_gvl', 'ruby/thread.h' ],
+               [ 'rb_thread_call_without_gvl2', 'ruby/thread.h' ],
+               [ 'rb_io_descriptor', 'ruby/io.h' ],
+               [ 'rb_interned_str_cstr', 'ruby.h' ],
+               [ 'rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h' ],
+               [ 'rb_gc_mark_movable', 'ruby.h' ],
+               [ 'rb_ext_ractor_safe', 'ruby.h' ],
+               [ 'rb_ractor_local_storage_value_newkey', 'ruby/ractor.h' ],
+             ]
+
+ruby_funcs.each { |f, header| have_func(f, header) }
+# used to time calls for Libvirt.call_stats; gettimeofday is the fallback
+have_func('clock_gettime', 'time.h')
 libvirt_types.each { |t| have_type(t, "libvirt/libvirt.h") }
 libvirt_funcs.each { |f| have_func(f, "libvirt/libvirt.h") }
 libvirt_consts.each { |c| have_const(c, ["libvirt/libvirt.h"]) }
@@ -29,10 +29,7 @@
 #if HAVE_TYPE_VIRINTERFACEPTR
 static VALUE c_interface;
 
-static void interface_free(void *i)
-{
-    ruby_libvirt_free_struct(Interface, i);
-}
+ruby_libvirt_handle_type(Interface, "Libvirt::Interface")
 
 static virInterfacePtr interface_get(VALUE i)
 {
@@ -41,7 +38,8 @@ static virInterfacePtr interface_get(VALUE i)
 
 VALUE ruby_libvirt_interface_new(virInterfacePtr i, VALUE conn)
 {
-    return ruby_libvirt_new_class(c_interface, i, conn, interface_free);
+    return ruby_libvirt_new_class(c_interface, &Interface_handle_data_type,
+                                  i, conn);
 }
 
 /*
@@ -183,7 +181,7 @@ void ruby_libvirt_interface_init(void)
     rb_define_const(c_interface, "XML_INACTIVE",
                     INT2NUM(VIR_INTERFACE_XML_INACTIVE));
 #endif
-    rb_define_attr(c_interface, "connection", 1, 0);
+    rb_define_method(c_interface, "connection", ruby_libvirt_handle_connection, 0);
 
     /* Interface object methods */
     rb_define_method(c_interface, "name", libvirt_interface_name, 0);
@@ -25,14 +25,12 @@
 #include "common.h"
 #include "connect.h"
 #include "extconf.h"
+#include "xmlcache.h"
 
 #if HAVE_TYPE_VIRNETWORKPTR
 static VALUE c_network;
 
-static void network_free(void *d)
-{
-    ruby_libvirt_free_struct(Network, d);
-}
+ruby_libvirt_handle_type(Network, "Libvirt::Network")
 
 static virNetworkPtr network_get(VALUE n)
 {
@@ -41,7 +39,8 @@ static virNetworkPtr network_get(VALUE n)
 
 VALUE ruby_libvirt_network_new(virNetworkPtr n, VALUE conn)
 {
-    return ruby_libvirt_new_class(c_network, n, conn, network_free);
+    return ruby_libvirt_new_class(c_network, &Network_handle_data_type,
+                                  n, conn);
 }
 
 /*
@@ -83,11 +82,21 @@ static VALUE libvirt_network_create(VALUE n)
 static VALUE libvirt_network_update(VALUE n, VALUE command, VALUE section,
                                     VALUE index, VALUE xml, VALUE flags)
 {
-    ruby_libvirt_generate_call_nil(virNetworkUpdate,
-                                   ruby_libvirt_connect_get(n),
-                                   network_get(n), NUM2UINT(command),
-                                   NUM2UINT(section), NUM2INT(index),
-                                   StringValuePtr(xml), NUM2UINT(flags));
+    unsigned long long start;
+    int ret;
+
+    start = ruby_libvirt_call_stats_start();
+    ret = virNetworkUpdate(network_get(n), NUM2UINT(command),
+                           NUM2UINT(section), NUM2INT(index),
+                           StringValuePtr(xml), NUM2UINT(flags));
+    ruby_libvirt_call_stats_end("virNetworkUpdate", start);
+    ruby_libvirt_raise_error_if(ret < 0, e_Error, "virNetworkUpdate",
+                                ruby_libvirt_connect_get(n));
+
+    /* there is no network event for an update */
+    ruby_libvirt_xml_cache_network_changed(n, network_get(n));
+
+    return Qnil;
 }
 #endif
 
@@ -132,23 +141,45 @@ static VALUE libvirt_network_uuid(VALUE n)
                                ruby_libvirt_connect_get(n), network_get(n));
 }
 
+static VALUE network_xml_desc(VALUE n, unsigned int flags)
+{
+    ruby_libvirt_generate_call_string(virNetworkGetXMLDesc,
+                                      ruby_libvirt_connect_get(n), 1,
+                                      network_get(n), flags);
+}
+
 /*
  * call-seq:
  *   net.xml_desc(flags=0) -> String
  *
  * Call virNetworkGetXMLDesc[http://www.libvirt.org/html/libvirt-libvirt-network.html#virNetworkGetXMLDesc]
- * to retrieve the XML for this network.
+ * to retrieve the XML for this network.  With conn.enable_xml_cache, the
+ * result is a shared frozen String until the network changes.
  */
 static VALUE libvirt_network_xml_desc(int argc, VALUE *argv, VALUE n)
 {
     VALUE flags = RUBY_Qnil;
+#if RUBY_LIBVIRT_XML_CACHE
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    VALUE c;
+#endif
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_string(virNetworkGetXMLDesc,
-                                      ruby_libvirt_connect_get(n), 1,
-                                      network_get(n),
-                                      ruby_libvirt_value_to_uint(flags));
+#if RUBY_LIBVIRT_XML_CACHE
+    c = ruby_libvirt_conn_attr(n);
+    if (ruby_libvirt_xml_cache_enabled(c)) {
+        if (virNetworkGetUUIDString(network_get(n), uuid) == 0) {
+            return ruby_libvirt_xml_cache_call(c, RUBY_LIBVIRT_XML_NETWORK,
+                                               uuid,
+                                               ruby_libvirt_value_to_uint(flags),
+                                               network_xml_desc, n);
+        }
+        virResetLastError();
+    }
+#endif
+
+    return network_xml_desc(n, ruby_libvirt_value_to_uint(flags));
 }
 
 /*
@@ -341,7 +372,7 @@ void ruby_libvirt_network_init(void)
 {
 #if HAVE_TYPE_VIRNETWORKPTR
     c_network = rb_define_class_under(m_libvirt, "Network", rb_cObject);
-    rb_define_attr(c_network, "connection", 1, 0);
+    rb_define_method(c_network, "connection", ruby_libvirt_handle_connection, 0);
 
     rb_define_method(c_network, "undefine", libvirt_network_undefine, 0);
     rb_define_method(c_network, "create", libvirt_network_create, 0);
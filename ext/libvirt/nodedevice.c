@@ -29,10 +29,7 @@
 #if HAVE_TYPE_VIRNODEDEVICEPTR
 static VALUE c_nodedevice;
 
-static void nodedevice_free(void *s)
-{
-    ruby_libvirt_free_struct(NodeDevice, s);
-}
+ruby_libvirt_handle_type(NodeDevice, "Libvirt::NodeDevice")
 
 static virNodeDevicePtr nodedevice_get(VALUE n)
 {
@@ -41,7 +38,8 @@ static virNodeDevicePtr nodedevice_get(VALUE n)
 
 VALUE ruby_libvirt_nodedevice_new(virNodeDevicePtr n, VALUE conn)
 {
-    return ruby_libvirt_new_class(c_nodedevice, n, conn, nodedevice_free);
+    return ruby_libvirt_new_class(c_nodedevice,
+                                  &NodeDevice_handle_data_type, n, conn);
 }
 
 /*
@@ -275,7 +273,7 @@ void ruby_libvirt_nodedevice_init(void)
 #if HAVE_TYPE_VIRNODEDEVICEPTR
     c_nodedevice = rb_define_class_under(m_libvirt, "NodeDevice", rb_cObject);
 
-    rb_define_attr(c_nodedevice, "connection", 1, 0);
+    rb_define_method(c_nodedevice, "connection", ruby_libvirt_handle_connection, 0);
 
     rb_define_method(c_nodedevice, "name", libvirt_nodedevice_name, 0);
     rb_define_method(c_nodedevice, "parent", libvirt_nodedevice_parent, 0);
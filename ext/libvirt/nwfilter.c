@@ -29,10 +29,7 @@
 #if HAVE_TYPE_VIRNWFILTERPTR
 static VALUE c_nwfilter;
 
-static void nwfilter_free(void *n)
-{
-    ruby_libvirt_free_struct(NWFilter, n);
-}
+ruby_libvirt_handle_type(NWFilter, "Libvirt::NWFilter")
 
 static virNWFilterPtr nwfilter_get(VALUE n)
 {
@@ -41,7 +38,8 @@ static virNWFilterPtr nwfilter_get(VALUE n)
 
 VALUE ruby_libvirt_nwfilter_new(virNWFilterPtr n, VALUE conn)
 {
-    return ruby_libvirt_new_class(c_nwfilter, n, conn, nwfilter_free);
+    return ruby_libvirt_new_class(c_nwfilter, &NWFilter_handle_data_type,
+                                  n, conn);
 }
 
 /*
@@ -126,7 +124,7 @@ void ruby_libvirt_nwfilter_init(void)
 {
 #if HAVE_TYPE_VIRNWFILTERPTR
     c_nwfilter = rb_define_class_under(m_libvirt, "NWFilter", rb_cObject);
-    rb_define_attr(c_nwfilter, "connection", 1, 0);
+    rb_define_method(c_nwfilter, "connection", ruby_libvirt_handle_connection, 0);
 
     /* NWFilter object methods */
     rb_define_method(c_nwfilter, "undefine", libvirt_nwfilter_undefine, 0);
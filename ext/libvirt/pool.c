@@ -0,0 +1,800 @@
+/*
+ * pool.c: Libvirt::ConnectionPool methods
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <ruby.h>
+#include <libvirt/libvirt.h>
+#include <libvirt/virterror.h>
+#include "common.h"
+#include "connect.h"
+#include "extconf.h"
+#include "pool.h"
+#if RUBY_LIBVIRT_RACTOR
+#include <ruby/ractor.h>
+#endif
+
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL && HAVE_VIRCONNECTISALIVE
+static VALUE c_connection_pool;
+
+/* the pools cannot be shared between Ractors, so each has its own registry;
+ * without Ractors it is kept (with no leading @, so invisible from Ruby) on
+ * the class
+ */
+#if RUBY_LIBVIRT_RACTOR
+static rb_ractor_local_key_t shared_pools_key;
+#else
+static ID id_shared_pools;
+#endif
+
+/* A pool holds up to size open Libvirt::Connect objects for one URI (and
+ * set of credentials).  A connection is checked out to one Ruby thread at
+ * a time; checking out again from the same thread returns the same
+ * connection, so nested pool.with blocks don't deadlock.  Members are
+ * evicted when libvirt's close callback reports the connection gone, when
+ * keepalive has marked it dead, or when someone closes it, and are
+ * reopened on demand.  All of the Ruby-facing state is only touched with
+ * the GVL held; the lock protects what the close callback (which runs on
+ * the event loop thread) touches, and lets waiters sleep without the GVL.
+ */
+struct pool_member {
+    struct pool *pool;
+    VALUE conn;
+    virConnectPtr ptr;
+    VALUE owner;
+    long depth;
+    int dead;
+    int registered;
+};
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long generation;
+
+    long size;
+    struct pool_member *members;
+    int closed;
+
+    VALUE uri;
+    VALUE credentials;
+    VALUE userdata;
+    VALUE auth;
+    int read_only;
+    int keepalive_interval;
+    unsigned int keepalive_count;
+    double timeout;
+
+    unsigned long long opened;
+    unsigned long long evicted;
+};
+
+static double pool_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void pool_wakeup(struct pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->generation++;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+#if HAVE_VIRCONNECTREGISTERCLOSECALLBACK
+static void pool_close_callback(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                int RUBY_LIBVIRT_UNUSED(reason), void *opaque)
+{
+    struct pool_member *m = (struct pool_member *)opaque;
+
+    pthread_mutex_lock(&m->pool->lock);
+    m->dead = 1;
+    m->pool->generation++;
+    pthread_cond_broadcast(&m->pool->cond);
+    pthread_mutex_unlock(&m->pool->lock);
+}
+#endif
+
+/* drop the libvirt side of a member: the close callback and the pool's
+ * own reference to the connection
+ */
+static void pool_member_release(struct pool_member *m)
+{
+#if HAVE_VIRCONNECTREGISTERCLOSECALLBACK
+    if (m->registered) {
+        virConnectUnregisterCloseCallback(m->ptr, pool_close_callback);
+        m->registered = 0;
+    }
+#endif
+    if (m->ptr) {
+        virConnectClose(m->ptr);
+        m->ptr = NULL;
+    }
+}
+
+static void pool_mark(void *v)
+{
+    struct pool *p = (struct pool *)v;
+    long i;
+
+    rb_gc_mark(p->uri);
+    rb_gc_mark(p->credentials);
+    rb_gc_mark(p->userdata);
+    rb_gc_mark(p->auth);
+    for (i = 0; i < p->size; i++) {
+        rb_gc_mark(p->members[i].conn);
+        rb_gc_mark(p->members[i].owner);
+    }
+}
+
+static void pool_free(void *v)
+{
+    struct pool *p = (struct pool *)v;
+    long i;
+
+    for (i = 0; i < p->size; i++) {
+        pool_member_release(&p->members[i]);
+    }
+    xfree(p->members);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    xfree(p);
+}
+
+static const rb_data_type_t pool_data_type = {
+    "Libvirt::ConnectionPool",
+    { pool_mark, pool_free, NULL, },
+    NULL, NULL, 0
+};
+
+static VALUE pool_alloc(VALUE klass)
+{
+    struct pool *p;
+    VALUE result;
+
+    result = TypedData_Make_Struct(klass, struct pool, &pool_data_type, p);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->uri = Qnil;
+    p->credentials = Qnil;
+    p->userdata = Qnil;
+    p->auth = Qnil;
+
+    return result;
+}
+
+static struct pool *pool_get(VALUE s)
+{
+    struct pool *p;
+
+    TypedData_Get_Struct(s, struct pool, &pool_data_type, p);
+    if (p->members == NULL) {
+        rb_raise(rb_eArgError, "ConnectionPool has not been initialized");
+    }
+
+    return p;
+}
+
+static VALUE pool_close_conn(VALUE conn)
+{
+    return rb_funcall(conn, rb_intern("close"), 0);
+}
+
+/* close and forget a member's connection; it is reopened when next needed */
+static void pool_evict(struct pool *p, struct pool_member *m)
+{
+    int exception = 0;
+
+    pool_member_release(m);
+    if (!NIL_P(m->conn)) {
+        rb_protect(pool_close_conn, m->conn, &exception);
+        if (exception) {
+            /* closing is best effort; the connection is gone either way */
+            rb_set_errinfo(Qnil);
+        }
+        m->conn = Qnil;
+        p->evicted++;
+    }
+    pthread_mutex_lock(&p->lock);
+    m->dead = 0;
+    pthread_mutex_unlock(&p->lock);
+}
+
+static int pool_member_healthy(struct pool_member *m)
+{
+    int dead;
+
+    if (NIL_P(m->conn) || m->ptr == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&m->pool->lock);
+    dead = m->dead;
+    pthread_mutex_unlock(&m->pool->lock);
+    if (dead) {
+        return 0;
+    }
+    if (RTEST(rb_funcall(m->conn, rb_intern("closed?"), 0))) {
+        return 0;
+    }
+    if (virConnectIsAlive(m->ptr) != 1) {
+        virResetLastError();
+        return 0;
+    }
+
+    return 1;
+}
+
+static VALUE pool_open_conn(VALUE in)
+{
+    struct pool *p = (struct pool *)in;
+    VALUE args[4];
+
+    if (!NIL_P(p->auth)) {
+        args[0] = p->uri;
+        args[1] = p->credentials;
+        args[2] = p->userdata;
+        args[3] = INT2NUM(p->read_only ? VIR_CONNECT_RO : 0);
+        return rb_funcall_with_block(m_libvirt, rb_intern("open_auth"), 4,
+                                     args, p->auth);
+    }
+
+    return rb_funcall(m_libvirt,
+                      rb_intern(p->read_only ? "open_read_only" : "open"), 1,
+                      p->uri);
+}
+
+/* open a connection for the (empty) member M; exceptions propagate */
+static void pool_open(struct pool *p, struct pool_member *m)
+{
+    VALUE conn;
+
+    conn = pool_open_conn((VALUE)p);
+
+    m->conn = conn;
+    m->ptr = ruby_libvirt_connect_get(conn);
+    virConnectRef(m->ptr);
+    m->dead = 0;
+    p->opened++;
+
+#if HAVE_VIRCONNECTSETKEEPALIVE
+    /* keepalive needs an event loop, and isn't there for local drivers;
+     * without it we still have the close callback and virConnectIsAlive
+     */
+    if (p->keepalive_interval > 0 &&
+        virConnectSetKeepAlive(m->ptr, p->keepalive_interval,
+                               p->keepalive_count) < 0) {
+        virResetLastError();
+    }
+#endif
+#if HAVE_VIRCONNECTREGISTERCLOSECALLBACK
+    if (virConnectRegisterCloseCallback(m->ptr, pool_close_callback, m,
+                                        NULL) == 0) {
+        m->registered = 1;
+    }
+    else {
+        virResetLastError();
+    }
+#endif
+}
+
+struct pool_take_arg {
+    struct pool *p;
+    struct pool_member *m;
+};
+
+static VALUE pool_take_open(VALUE in)
+{
+    struct pool_take_arg *arg = (struct pool_take_arg *)in;
+
+    pool_open(arg->p, arg->m);
+
+    return Qnil;
+}
+
+/* hand member M to the current thread, opening it if need be */
+static VALUE pool_take(struct pool *p, struct pool_member *m)
+{
+    struct pool_take_arg arg;
+    int exception = 0;
+
+    /* claim it first: opening may let other threads run */
+    m->owner = rb_thread_current();
+    m->depth = 1;
+
+    if (!NIL_P(m->conn) && !pool_member_healthy(m)) {
+        pool_evict(p, m);
+    }
+    if (NIL_P(m->conn)) {
+        arg.p = p;
+        arg.m = m;
+        rb_protect(pool_take_open, (VALUE)&arg, &exception);
+        if (exception) {
+            m->owner = Qnil;
+            m->depth = 0;
+            pool_wakeup(p);
+            rb_jump_tag(exception);
+        }
+    }
+
+    return m->conn;
+}
+
+/* cancelled is per waiter (and guarded by the pool lock), so that
+ * interrupting one waiting thread never wakes or skips another.
+ */
+struct pool_wait_arg {
+    struct pool *p;
+    unsigned long generation;
+    double deadline;
+    int cancelled;
+};
+
+static void *pool_wait_nogvl(void *in)
+{
+    struct pool_wait_arg *arg = (struct pool_wait_arg *)in;
+    struct pool *p = arg->p;
+    struct timespec ts;
+
+    pthread_mutex_lock(&p->lock);
+    while (!arg->cancelled && p->generation == arg->generation) {
+        if (arg->deadline < 0) {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+        if (pool_now() >= arg->deadline) {
+            break;
+        }
+        ts.tv_sec = (time_t)arg->deadline;
+        ts.tv_nsec = (long)((arg->deadline - ts.tv_sec) * 1000000000.0);
+        pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void pool_wait_cancel(void *in)
+{
+    struct pool_wait_arg *arg = (struct pool_wait_arg *)in;
+    struct pool *p = arg->p;
+
+    pthread_mutex_lock(&p->lock);
+    arg->cancelled = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static struct pool_member *pool_owned(struct pool *p, VALUE th)
+{
+    long i;
+
+    for (i = 0; i < p->size; i++) {
+        if (p->members[i].owner == th) {
+            return &p->members[i];
+        }
+    }
+
+    return NULL;
+}
+
+static VALUE pool_checkout(struct pool *p)
+{
+    struct pool_member *m;
+    struct pool_wait_arg arg;
+    VALUE th = rb_thread_current();
+    long i;
+
+    m = pool_owned(p, th);
+    if (m) {
+        m->depth++;
+        return m->conn;
+    }
+
+    arg.p = p;
+    arg.deadline = p->timeout < 0 ? -1 : pool_now() + p->timeout;
+
+    for (;;) {
+        if (p->closed) {
+            rb_raise(rb_eArgError, "ConnectionPool has been closed");
+        }
+
+        pthread_mutex_lock(&p->lock);
+        arg.generation = p->generation;
+        arg.cancelled = 0;
+        pthread_mutex_unlock(&p->lock);
+
+        /* take back members held by threads that have died */
+        for (i = 0; i < p->size; i++) {
+            m = &p->members[i];
+            if (!NIL_P(m->owner) &&
+                !RTEST(rb_funcall(m->owner, rb_intern("alive?"), 0))) {
+                m->owner = Qnil;
+                m->depth = 0;
+            }
+        }
+
+        /* prefer a connection that is already open */
+        for (i = 0; i < p->size; i++) {
+            m = &p->members[i];
+            if (NIL_P(m->owner) && !NIL_P(m->conn)) {
+                return pool_take(p, m);
+            }
+        }
+        for (i = 0; i < p->size; i++) {
+            m = &p->members[i];
+            if (NIL_P(m->owner)) {
+                return pool_take(p, m);
+            }
+        }
+
+        if (arg.deadline >= 0 && pool_now() >= arg.deadline) {
+            rb_raise(rb_const_get(m_libvirt, rb_intern("ConnectionError")),
+                     "timed out waiting for a pooled connection");
+        }
+        ruby_libvirt_without_gvl(pool_wait_nogvl, &arg, pool_wait_cancel,
+                                 &arg);
+        rb_thread_check_ints();
+    }
+}
+
+static void pool_checkin(struct pool *p)
+{
+    struct pool_member *m;
+
+    m = pool_owned(p, rb_thread_current());
+    if (m == NULL) {
+        rb_raise(rb_eArgError, "no connection is checked out by this thread");
+    }
+    if (--m->depth > 0) {
+        return;
+    }
+
+    m->owner = Qnil;
+    if (p->closed || !pool_member_healthy(m)) {
+        pool_evict(p, m);
+    }
+    pool_wakeup(p);
+}
+
+static VALUE pool_option(VALUE opts, const char *name, VALUE def)
+{
+    VALUE val;
+
+    if (NIL_P(opts)) {
+        return def;
+    }
+    val = rb_hash_aref(opts, ID2SYM(rb_intern(name)));
+
+    return NIL_P(val) ? def : val;
+}
+
+/*
+ * call-seq:
+ *   Libvirt::ConnectionPool.new(uri=nil, size: 4, read_only: false, credentials: nil, userdata: nil, keepalive_interval: 5, keepalive_count: 3, timeout: nil) {|cred| auth block} -> Libvirt::ConnectionPool
+ *
+ * Create a pool of size connections to uri, and open all of them straight
+ * away so that the cost of connecting is paid up front.  Connections are
+ * opened with Libvirt::open, with Libvirt::open_read_only if read_only is
+ * true, or, if a block is given, with Libvirt::open_auth(uri, credentials,
+ * userdata) and the block.  Each connection gets conn.keepalive= with the
+ * given interval and count (though keepalive only works while an event
+ * loop is running), and a
+ * virConnectRegisterCloseCallback[http://www.libvirt.org/html/libvirt-libvirt-host.html#virConnectRegisterCloseCallback]
+ * so that the pool notices when one goes away.  A dead connection is
+ * replaced the next time it would be handed out.  checkout waits at most
+ * timeout seconds (forever if nil) for a free connection.
+ */
+static VALUE libvirt_connection_pool_initialize(int argc, VALUE *argv,
+                                                VALUE s)
+{
+    VALUE uri, opts;
+    struct pool *p;
+    long size, i;
+
+    rb_scan_args(argc, argv, "02", &uri, &opts);
+
+    /* allow ConnectionPool.new(size: 2) for the default URI */
+    if (TYPE(uri) == T_HASH && NIL_P(opts)) {
+        opts = uri;
+        uri = Qnil;
+    }
+    if (!NIL_P(uri)) {
+        StringValue(uri);
+    }
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+    }
+
+    TypedData_Get_Struct(s, struct pool, &pool_data_type, p);
+    if (p->members != NULL) {
+        rb_raise(rb_eArgError, "ConnectionPool is already initialized");
+    }
+
+    size = NUM2LONG(pool_option(opts, "size", INT2NUM(4)));
+    if (size < 1) {
+        rb_raise(rb_eArgError, "size must be at least 1");
+    }
+    p->uri = uri;
+    p->read_only = RTEST(pool_option(opts, "read_only", Qfalse));
+    p->credentials = pool_option(opts, "credentials", Qnil);
+    p->userdata = pool_option(opts, "userdata", Qnil);
+    p->auth = rb_block_given_p() ? rb_block_proc() : Qnil;
+    p->keepalive_interval = NUM2INT(pool_option(opts, "keepalive_interval",
+                                                INT2NUM(5)));
+    p->keepalive_count = NUM2UINT(pool_option(opts, "keepalive_count",
+                                              INT2NUM(3)));
+    p->timeout = NUM2DBL(pool_option(opts, "timeout", rb_float_new(-1)));
+
+    p->members = ALLOC_N(struct pool_member, size);
+    for (i = 0; i < size; i++) {
+        memset(&p->members[i], 0, sizeof(p->members[i]));
+        p->members[i].pool = p;
+        p->members[i].conn = Qnil;
+        p->members[i].owner = Qnil;
+    }
+    p->size = size;
+
+    for (i = 0; i < size; i++) {
+        pool_open(p, &p->members[i]);
+    }
+
+    return s;
+}
+
+static VALUE shared_pools_get(void)
+{
+    VALUE registry;
+
+#if RUBY_LIBVIRT_RACTOR
+    if (!rb_ractor_local_storage_value_lookup(shared_pools_key, &registry)) {
+        registry = rb_hash_new();
+        rb_ractor_local_storage_value_set(shared_pools_key, registry);
+    }
+#else
+    registry = rb_ivar_get(c_connection_pool, id_shared_pools);
+    if (NIL_P(registry)) {
+        registry = rb_hash_new();
+        rb_ivar_set(c_connection_pool, id_shared_pools, registry);
+    }
+#endif
+
+    return registry;
+}
+
+/*
+ * call-seq:
+ *   Libvirt::ConnectionPool.shared(uri=nil, options={}) {|cred| auth block} -> Libvirt::ConnectionPool
+ *
+ * Return the process-wide pool for uri, read_only and credentials,
+ * creating it (with the remaining options and the block as for
+ * Libvirt::ConnectionPool.new) the first time it is asked for, or after it
+ * has been closed.  Each Ractor has its own set of these.
+ */
+static VALUE libvirt_connection_pool_s_shared(int argc, VALUE *argv, VALUE k)
+{
+    VALUE uri, opts, key, registry, pool;
+
+    rb_scan_args(argc, argv, "02", &uri, &opts);
+    if (TYPE(uri) == T_HASH && NIL_P(opts)) {
+        opts = uri;
+        uri = Qnil;
+    }
+
+    key = rb_ary_new3(3, uri, RTEST(pool_option(opts, "read_only", Qfalse)) ? Qtrue : Qfalse,
+                      pool_option(opts, "credentials", Qnil));
+
+    registry = shared_pools_get();
+    pool = rb_hash_aref(registry, key);
+    if (!NIL_P(pool) && !pool_get(pool)->closed) {
+        return pool;
+    }
+
+    pool = rb_funcall_passing_block(k, rb_intern("new"), argc, argv);
+    rb_hash_aset(registry, key, pool);
+
+    return pool;
+}
+
+/*
+ * call-seq:
+ *   pool.checkout -> Libvirt::Connect
+ *
+ * Hand a connection to the current thread, waiting if all of them are in
+ * use.  The same thread gets the same connection until it has called
+ * pool.checkin as many times as pool.checkout.  A connection found to be
+ * dead is transparently replaced with a new one.
+ */
+static VALUE libvirt_connection_pool_checkout(VALUE s)
+{
+    return pool_checkout(pool_get(s));
+}
+
+/*
+ * call-seq:
+ *   pool.checkin -> nil
+ *
+ * Give back the connection the current thread checked out.
+ */
+static VALUE libvirt_connection_pool_checkin(VALUE s)
+{
+    pool_checkin(pool_get(s));
+
+    return Qnil;
+}
+
+static VALUE pool_with_checkin(VALUE s)
+{
+    pool_checkin(pool_get(s));
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   pool.with {|conn| block } -> result of block
+ *
+ * Check out a connection, call the block with it, and check it back in
+ * however the block finishes.
+ */
+static VALUE libvirt_connection_pool_with(VALUE s)
+{
+    VALUE conn;
+
+    if (!rb_block_given_p()) {
+        rb_raise(rb_eRuntimeError, "A block must be provided");
+    }
+
+    conn = pool_checkout(pool_get(s));
+
+    return rb_ensure(rb_yield, conn, pool_with_checkin, s);
+}
+
+/*
+ * call-seq:
+ *   pool.size -> Fixnum
+ *
+ * Return the number of connections the pool holds when they are all open.
+ */
+static VALUE libvirt_connection_pool_size(VALUE s)
+{
+    return LONG2NUM(pool_get(s)->size);
+}
+
+/*
+ * call-seq:
+ *   pool.available -> Fixnum
+ *
+ * Return the number of connections that are not checked out.
+ */
+static VALUE libvirt_connection_pool_available(VALUE s)
+{
+    struct pool *p = pool_get(s);
+    long i, n = 0;
+
+    for (i = 0; i < p->size; i++) {
+        if (NIL_P(p->members[i].owner)) {
+            n++;
+        }
+    }
+
+    return LONG2NUM(n);
+}
+
+/*
+ * call-seq:
+ *   pool.opened -> Fixnum
+ *
+ * Return how many connections the pool has opened, including the initial
+ * ones.
+ */
+static VALUE libvirt_connection_pool_opened(VALUE s)
+{
+    return ULL2NUM(pool_get(s)->opened);
+}
+
+/*
+ * call-seq:
+ *   pool.evicted -> Fixnum
+ *
+ * Return how many connections the pool has thrown away as dead.
+ */
+static VALUE libvirt_connection_pool_evicted(VALUE s)
+{
+    return ULL2NUM(pool_get(s)->evicted);
+}
+
+/*
+ * call-seq:
+ *   pool.close -> nil
+ *
+ * Close every connection that is not checked out, and each of the others
+ * as it is checked in.  Threads waiting in pool.checkout raise an error.
+ */
+static VALUE libvirt_connection_pool_close(VALUE s)
+{
+    struct pool *p = pool_get(s);
+    long i;
+
+    p->closed = 1;
+    for (i = 0; i < p->size; i++) {
+        if (NIL_P(p->members[i].owner)) {
+            pool_evict(p, &p->members[i]);
+        }
+    }
+    pool_wakeup(p);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   pool.closed? -> [True|False]
+ *
+ * Return +true+ if pool.close has been called, +false+ otherwise.
+ */
+static VALUE libvirt_connection_pool_closed_p(VALUE s)
+{
+    return pool_get(s)->closed ? Qtrue : Qfalse;
+}
+#endif
+
+/*
+ * Class Libvirt::ConnectionPool
+ */
+void ruby_libvirt_pool_init(void)
+{
+#if HAVE_RB_THREAD_CALL_WITHOUT_GVL && HAVE_VIRCONNECTISALIVE
+    c_connection_pool = rb_define_class_under(m_libvirt, "ConnectionPool",
+                                              rb_cObject);
+#if RUBY_LIBVIRT_RACTOR
+    shared_pools_key = rb_ractor_local_storage_value_newkey();
+#else
+    id_shared_pools = rb_intern("shared_pools");
+#endif
+
+    rb_define_alloc_func(c_connection_pool, pool_alloc);
+    rb_define_singleton_method(c_connection_pool, "shared",
+                               libvirt_connection_pool_s_shared, -1);
+    rb_define_method(c_connection_pool, "initialize",
+                     libvirt_connection_pool_initialize, -1);
+    rb_define_method(c_connection_pool, "checkout",
+                     libvirt_connection_pool_checkout, 0);
+    rb_define_method(c_connection_pool, "checkin",
+                     libvirt_connection_pool_checkin, 0);
+    rb_define_method(c_connection_pool, "with",
+                     libvirt_connection_pool_with, 0);
+    rb_define_method(c_connection_pool, "size",
+                     libvirt_connection_pool_size, 0);
+    rb_define_method(c_connection_pool, "available",
+                     libvirt_connection_pool_available, 0);
+    rb_define_method(c_connection_pool, "opened",
+                     libvirt_connection_pool_opened, 0);
+    rb_define_method(c_connection_pool, "evicted",
+                     libvirt_connection_pool_evicted, 0);
+    rb_define_method(c_connection_pool, "close",
+                     libvirt_connection_pool_close, 0);
+    rb_define_method(c_connection_pool, "closed?",
+                     libvirt_connection_pool_closed_p, 0);
+#endif
+}
@@ -0,0 +1,6 @@
+#ifndef POOL_H
+#define POOL_H
+
+void ruby_libvirt_pool_init(void);
+
+#endif
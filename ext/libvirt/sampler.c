@@ -0,0 +1,995 @@
+/*
+ * sampler.c: Libvirt::Sampler methods
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <ruby.h>
+#include <libvirt/libvirt.h>
+#include <libvirt/virterror.h>
+#include "common.h"
+#include "connect.h"
+#include "extconf.h"
+#include "sampler.h"
+
+#if HAVE_VIRCONNECTGETALLDOMAINSTATS && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static VALUE c_sampler;
+
+/* The sampler runs its own native thread, which every interval collects
+ * bulk domain statistics and the host CPU and memory statistics, turns the
+ * counters into rates against the previous sample, and appends one row per
+ * domain (and one for the host) to fixed-size rings.  The thread never
+ * touches Ruby, so sampling goes on at the same cost whatever the
+ * interpreter is doing; sampler.drain takes the rows under the lock.
+ */
+
+/* the columns of a domain row, in order */
+enum {
+    DOM_TIME,
+    DOM_CPU_TIME,
+    DOM_CPU_USAGE,
+    DOM_CPU_USER_USAGE,
+    DOM_CPU_SYSTEM_USAGE,
+    DOM_BALLOON_CURRENT,
+    DOM_RD_BYTES,
+    DOM_WR_BYTES,
+    DOM_RD_REQS,
+    DOM_WR_REQS,
+    DOM_RD_BYTES_RATE,
+    DOM_WR_BYTES_RATE,
+    DOM_RD_REQS_RATE,
+    DOM_WR_REQS_RATE,
+    DOM_RX_BYTES,
+    DOM_TX_BYTES,
+    DOM_RX_PKTS,
+    DOM_TX_PKTS,
+    DOM_RX_BYTES_RATE,
+    DOM_TX_BYTES_RATE,
+    DOM_RX_PKTS_RATE,
+    DOM_TX_PKTS_RATE,
+    DOM_NFIELDS
+};
+
+static const char *dom_field_names[DOM_NFIELDS] = {
+    "time", "cpu_time", "cpu_usage", "cpu_user_usage", "cpu_system_usage",
+    "balloon_current", "rd_bytes", "wr_bytes", "rd_reqs", "wr_reqs",
+    "rd_bytes_rate", "wr_bytes_rate", "rd_reqs_rate", "wr_reqs_rate",
+    "rx_bytes", "tx_bytes", "rx_pkts", "tx_pkts", "rx_bytes_rate",
+    "tx_bytes_rate", "rx_pkts_rate", "tx_pkts_rate",
+};
+
+/* the columns of a host row, in order */
+enum {
+    HOST_TIME,
+    HOST_CPU_KERNEL,
+    HOST_CPU_USER,
+    HOST_CPU_IDLE,
+    HOST_CPU_IOWAIT,
+    HOST_CPU_KERNEL_USAGE,
+    HOST_CPU_USER_USAGE,
+    HOST_CPU_IOWAIT_USAGE,
+    HOST_CPU_USAGE,
+    HOST_MEM_TOTAL,
+    HOST_MEM_FREE,
+    HOST_MEM_BUFFERS,
+    HOST_MEM_CACHED,
+    HOST_NFIELDS
+};
+
+static const char *host_field_names[HOST_NFIELDS] = {
+    "time", "cpu_kernel", "cpu_user", "cpu_idle", "cpu_iowait",
+    "cpu_kernel_usage", "cpu_user_usage", "cpu_iowait_usage", "cpu_usage",
+    "mem_total", "mem_free", "mem_buffers", "mem_cached",
+};
+
+struct sampler_dom_row {
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    double values[DOM_NFIELDS];
+};
+
+struct sampler_host_row {
+    double values[HOST_NFIELDS];
+};
+
+/* the previous counters seen for a domain, kept sorted by uuid */
+struct sampler_prev {
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    double values[DOM_NFIELDS];
+};
+
+struct sampler {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int refs;
+    int stopping;
+    int joined;
+
+    virConnectPtr conn;
+    double interval;
+    unsigned int stats;
+    unsigned int flags;
+
+    /* rings of capacity rows; start is the oldest, n the number waiting */
+    long capacity;
+    struct sampler_dom_row *dom_rows;
+    long dom_start;
+    long dom_n;
+    struct sampler_host_row *host_rows;
+    long host_start;
+    long host_n;
+    unsigned long long dropped;
+
+    unsigned long long samples;
+    unsigned long long errors;
+    char *last_error;
+
+    /* only touched by the sampling thread */
+    struct sampler_prev *prev;
+    long nprev;
+    double host_prev[HOST_NFIELDS];
+    int have_host_prev;
+};
+
+static double sampler_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void sampler_unref(struct sampler *s)
+{
+    int refs;
+
+    pthread_mutex_lock(&s->lock);
+    refs = --s->refs;
+    pthread_mutex_unlock(&s->lock);
+
+    if (refs > 0) {
+        return;
+    }
+
+    virConnectClose(s->conn);
+    free(s->dom_rows);
+    free(s->host_rows);
+    free(s->prev);
+    free(s->last_error);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+/* must be called with the lock held */
+static void sampler_error(struct sampler *s, const char *func)
+{
+    virErrorPtr err = virGetLastError();
+    const char *msg = err && err->message ? err->message : "unknown error";
+    size_t len = strlen(func) + strlen(msg) + 3;
+
+    s->errors++;
+    free(s->last_error);
+    s->last_error = malloc(len);
+    if (s->last_error) {
+        snprintf(s->last_error, len, "%s: %s", func, msg);
+    }
+}
+
+/* add the value of PARAM to *VAL, as a double */
+static void sampler_add(virTypedParameterPtr param, double *val)
+{
+    switch (param->type) {
+    case VIR_TYPED_PARAM_INT:
+        *val += param->value.i;
+        break;
+    case VIR_TYPED_PARAM_UINT:
+        *val += param->value.ui;
+        break;
+    case VIR_TYPED_PARAM_LLONG:
+        *val += param->value.l;
+        break;
+    case VIR_TYPED_PARAM_ULLONG:
+        *val += param->value.ul;
+        break;
+    case VIR_TYPED_PARAM_DOUBLE:
+        *val += param->value.d;
+        break;
+    default:
+        break;
+    }
+}
+
+/* does NAME look like PREFIX.<n>.SUFFIX? */
+static int sampler_indexed(const char *name, const char *prefix,
+                           const char *suffix)
+{
+    size_t plen = strlen(prefix);
+    const char *p;
+
+    if (strncmp(name, prefix, plen) != 0 || name[plen] != '.') {
+        return 0;
+    }
+    p = name + plen + 1;
+    if (*p < '0' || *p > '9') {
+        return 0;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+
+    return *p == '.' && strcmp(p + 1, suffix) == 0;
+}
+
+static void sampler_dom_counters(virDomainStatsRecordPtr rec, double *v)
+{
+    static const struct {
+        const char *prefix;
+        const char *suffix;
+        int field;
+    } indexed[] = {
+        { "block", "rd.bytes", DOM_RD_BYTES },
+        { "block", "wr.bytes", DOM_WR_BYTES },
+        { "block", "rd.reqs", DOM_RD_REQS },
+        { "block", "wr.reqs", DOM_WR_REQS },
+        { "net", "rx.bytes", DOM_RX_BYTES },
+        { "net", "tx.bytes", DOM_TX_BYTES },
+        { "net", "rx.pkts", DOM_RX_PKTS },
+        { "net", "tx.pkts", DOM_TX_PKTS },
+    };
+    int i;
+    size_t j;
+    const char *name;
+    double user = 0, system = 0;
+
+    for (i = 0; i < rec->nparams; i++) {
+        name = rec->params[i].field;
+        if (strcmp(name, "cpu.time") == 0) {
+            sampler_add(&rec->params[i], &v[DOM_CPU_TIME]);
+        }
+        else if (strcmp(name, "cpu.user") == 0) {
+            sampler_add(&rec->params[i], &user);
+        }
+        else if (strcmp(name, "cpu.system") == 0) {
+            sampler_add(&rec->params[i], &system);
+        }
+        else if (strcmp(name, "balloon.current") == 0) {
+            sampler_add(&rec->params[i], &v[DOM_BALLOON_CURRENT]);
+        }
+        else {
+            for (j = 0; j < ARRAY_SIZE(indexed); j++) {
+                if (sampler_indexed(name, indexed[j].prefix,
+                                    indexed[j].suffix)) {
+                    sampler_add(&rec->params[i], &v[indexed[j].field]);
+                    break;
+                }
+            }
+        }
+    }
+
+    /* stash the raw user and system times in their usage columns until
+     * sampler_dom_rates turns them into rates
+     */
+    v[DOM_CPU_USER_USAGE] = user;
+    v[DOM_CPU_SYSTEM_USAGE] = system;
+}
+
+static double sampler_rate(double cur, double prev, double dt)
+{
+    if (dt <= 0 || cur < prev) {
+        return NAN;
+    }
+
+    return (cur - prev) / dt;
+}
+
+/* fill in the rate columns of V from the counters in V and PREV (NULL if
+ * this domain has not been seen before); cpu times are in nanoseconds, so
+ * the usages come out in CPUs' worth of time
+ */
+static void sampler_dom_rates(double *v, const double *prev)
+{
+    static const int rates[][2] = {
+        { DOM_RD_BYTES_RATE, DOM_RD_BYTES },
+        { DOM_WR_BYTES_RATE, DOM_WR_BYTES },
+        { DOM_RD_REQS_RATE, DOM_RD_REQS },
+        { DOM_WR_REQS_RATE, DOM_WR_REQS },
+        { DOM_RX_BYTES_RATE, DOM_RX_BYTES },
+        { DOM_TX_BYTES_RATE, DOM_TX_BYTES },
+        { DOM_RX_PKTS_RATE, DOM_RX_PKTS },
+        { DOM_TX_PKTS_RATE, DOM_TX_PKTS },
+    };
+    double dt, user = v[DOM_CPU_USER_USAGE], system = v[DOM_CPU_SYSTEM_USAGE];
+    size_t i;
+
+    if (prev == NULL) {
+        v[DOM_CPU_USAGE] = v[DOM_CPU_USER_USAGE] = NAN;
+        v[DOM_CPU_SYSTEM_USAGE] = NAN;
+        for (i = 0; i < ARRAY_SIZE(rates); i++) {
+            v[rates[i][0]] = NAN;
+        }
+        return;
+    }
+
+    dt = v[DOM_TIME] - prev[DOM_TIME];
+    v[DOM_CPU_USAGE] = sampler_rate(v[DOM_CPU_TIME], prev[DOM_CPU_TIME],
+                                    dt) / 1e9;
+    v[DOM_CPU_USER_USAGE] = sampler_rate(user, prev[DOM_CPU_USER_USAGE],
+                                         dt) / 1e9;
+    v[DOM_CPU_SYSTEM_USAGE] = sampler_rate(system, prev[DOM_CPU_SYSTEM_USAGE],
+                                           dt) / 1e9;
+    for (i = 0; i < ARRAY_SIZE(rates); i++) {
+        v[rates[i][0]] = sampler_rate(v[rates[i][1]], prev[rates[i][1]], dt);
+    }
+}
+
+static int sampler_prev_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct sampler_prev *)a)->uuid,
+                  ((const struct sampler_prev *)b)->uuid);
+}
+
+/* collect the domain rows into ROWS (the caller's buffer of N entries),
+ * replacing s->prev with this sample's counters
+ */
+static void sampler_domains(struct sampler *s, double now,
+                            virDomainStatsRecordPtr *records, int n,
+                            struct sampler_dom_row *rows)
+{
+    struct sampler_prev *prev, key, *found;
+    int i;
+
+    prev = calloc(n > 0 ? n : 1, sizeof(*prev));
+
+    for (i = 0; i < n; i++) {
+        memset(&rows[i], 0, sizeof(rows[i]));
+        if (virDomainGetUUIDString(records[i]->dom, rows[i].uuid) < 0) {
+            rows[i].uuid[0] = '\0';
+        }
+        rows[i].values[DOM_TIME] = now;
+        sampler_dom_counters(records[i], rows[i].values);
+
+        found = NULL;
+        if (s->prev != NULL) {
+            strcpy(key.uuid, rows[i].uuid);
+            found = bsearch(&key, s->prev, s->nprev, sizeof(*s->prev),
+                            sampler_prev_cmp);
+        }
+        if (prev != NULL) {
+            strcpy(prev[i].uuid, rows[i].uuid);
+            memcpy(prev[i].values, rows[i].values, sizeof(prev[i].values));
+        }
+        sampler_dom_rates(rows[i].values, found ? found->values : NULL);
+    }
+
+    free(s->prev);
+    s->prev = prev;
+    s->nprev = prev ? n : 0;
+    if (prev != NULL) {
+        qsort(s->prev, s->nprev, sizeof(*s->prev), sampler_prev_cmp);
+    }
+}
+
+#if HAVE_VIRNODEGETCPUSTATS && HAVE_VIRNODEGETMEMORYSTATS
+/* returns NULL, or the name of the call that failed */
+static const char *sampler_host(struct sampler *s, double now,
+                                struct sampler_host_row *row)
+{
+    virNodeCPUStatsPtr cpu = NULL;
+    virNodeMemoryStatsPtr mem = NULL;
+    int ncpu = 0, nmem = 0, i;
+    double *v = row->values, *p = s->host_prev, total;
+    const char *failed = NULL;
+
+    for (i = 0; i < HOST_NFIELDS; i++) {
+        v[i] = NAN;
+    }
+    v[HOST_TIME] = now;
+
+    if (virNodeGetCPUStats(s->conn, VIR_NODE_CPU_STATS_ALL_CPUS, NULL, &ncpu,
+                           0) < 0) {
+        failed = "virNodeGetCPUStats";
+        goto cleanup;
+    }
+    if (virNodeGetMemoryStats(s->conn, VIR_NODE_MEMORY_STATS_ALL_CELLS, NULL,
+                              &nmem, 0) < 0) {
+        failed = "virNodeGetMemoryStats";
+        goto cleanup;
+    }
+    cpu = calloc(ncpu > 0 ? ncpu : 1, sizeof(*cpu));
+    mem = calloc(nmem > 0 ? nmem : 1, sizeof(*mem));
+    if (cpu == NULL || mem == NULL) {
+        failed = "calloc";
+        goto cleanup;
+    }
+    if (virNodeGetCPUStats(s->conn, VIR_NODE_CPU_STATS_ALL_CPUS, cpu, &ncpu,
+                           0) < 0) {
+        failed = "virNodeGetCPUStats";
+        goto cleanup;
+    }
+    if (virNodeGetMemoryStats(s->conn, VIR_NODE_MEMORY_STATS_ALL_CELLS, mem,
+                              &nmem, 0) < 0) {
+        failed = "virNodeGetMemoryStats";
+        goto cleanup;
+    }
+
+    for (i = 0; i < ncpu; i++) {
+        if (strcmp(cpu[i].field, VIR_NODE_CPU_STATS_KERNEL) == 0) {
+            v[HOST_CPU_KERNEL] = cpu[i].value;
+        }
+        else if (strcmp(cpu[i].field, VIR_NODE_CPU_STATS_USER) == 0) {
+            v[HOST_CPU_USER] = cpu[i].value;
+        }
+        else if (strcmp(cpu[i].field, VIR_NODE_CPU_STATS_IDLE) == 0) {
+            v[HOST_CPU_IDLE] = cpu[i].value;
+        }
+        else if (strcmp(cpu[i].field, VIR_NODE_CPU_STATS_IOWAIT) == 0) {
+            v[HOST_CPU_IOWAIT] = cpu[i].value;
+        }
+    }
+    for (i = 0; i < nmem; i++) {
+        if (strcmp(mem[i].field, VIR_NODE_MEMORY_STATS_TOTAL) == 0) {
+            v[HOST_MEM_TOTAL] = mem[i].value;
+        }
+        else if (strcmp(mem[i].field, VIR_NODE_MEMORY_STATS_FREE) == 0) {
+            v[HOST_MEM_FREE] = mem[i].value;
+        }
+        else if (strcmp(mem[i].field, VIR_NODE_MEMORY_STATS_BUFFERS) == 0) {
+            v[HOST_MEM_BUFFERS] = mem[i].value;
+        }
+        else if (strcmp(mem[i].field, VIR_NODE_MEMORY_STATS_CACHED) == 0) {
+            v[HOST_MEM_CACHED] = mem[i].value;
+        }
+    }
+
+    /* the usages are fractions of all of the time that passed on all of the
+     * host's CPUs; a counter the host does not report stays NaN
+     */
+    if (s->have_host_prev) {
+        total = (v[HOST_CPU_KERNEL] - p[HOST_CPU_KERNEL]) +
+            (v[HOST_CPU_USER] - p[HOST_CPU_USER]) +
+            (v[HOST_CPU_IDLE] - p[HOST_CPU_IDLE]) +
+            (isnan(v[HOST_CPU_IOWAIT]) ? 0 :
+             v[HOST_CPU_IOWAIT] - p[HOST_CPU_IOWAIT]);
+        if (total > 0) {
+            v[HOST_CPU_KERNEL_USAGE] = (v[HOST_CPU_KERNEL] -
+                                        p[HOST_CPU_KERNEL]) / total;
+            v[HOST_CPU_USER_USAGE] = (v[HOST_CPU_USER] -
+                                      p[HOST_CPU_USER]) / total;
+            v[HOST_CPU_IOWAIT_USAGE] = (v[HOST_CPU_IOWAIT] -
+                                        p[HOST_CPU_IOWAIT]) / total;
+            v[HOST_CPU_USAGE] = 1.0 - (v[HOST_CPU_IDLE] -
+                                       p[HOST_CPU_IDLE]) / total;
+        }
+    }
+    memcpy(s->host_prev, v, sizeof(s->host_prev));
+    s->have_host_prev = 1;
+
+cleanup:
+    free(cpu);
+    free(mem);
+
+    return failed;
+}
+#endif
+
+/* append N rows to a ring, overwriting (and counting) the oldest if full */
+#define sampler_push(s, ring, start, count, src, n)                     \
+    do {                                                                \
+        long _i, _slot;                                                 \
+        for (_i = 0; _i < (n); _i++) {                                  \
+            if ((s)->count == (s)->capacity) {                          \
+                (s)->start = ((s)->start + 1) % (s)->capacity;          \
+                (s)->count--;                                           \
+                (s)->dropped++;                                         \
+            }                                                           \
+            _slot = ((s)->start + (s)->count) % (s)->capacity;          \
+            (s)->ring[_slot] = (src)[_i];                               \
+            (s)->count++;                                               \
+        }                                                               \
+    } while (0)
+
+static void sampler_sample(struct sampler *s)
+{
+    virDomainStatsRecordPtr *records = NULL;
+    struct sampler_dom_row *rows = NULL;
+    int n;
+    double now;
+#if HAVE_VIRNODEGETCPUSTATS && HAVE_VIRNODEGETMEMORYSTATS
+    struct sampler_host_row host;
+    const char *host_failed;
+#endif
+
+    now = sampler_now();
+    n = virConnectGetAllDomainStats(s->conn, s->stats, &records, s->flags);
+    if (n < 0) {
+        pthread_mutex_lock(&s->lock);
+        sampler_error(s, "virConnectGetAllDomainStats");
+        pthread_mutex_unlock(&s->lock);
+    }
+    else {
+        rows = malloc((n > 0 ? n : 1) * sizeof(*rows));
+        if (rows != NULL) {
+            sampler_domains(s, now, records, n, rows);
+        }
+        virDomainStatsRecordListFree(records);
+    }
+
+#if HAVE_VIRNODEGETCPUSTATS && HAVE_VIRNODEGETMEMORYSTATS
+    host_failed = sampler_host(s, now, &host);
+#endif
+
+    pthread_mutex_lock(&s->lock);
+    if (rows != NULL) {
+        sampler_push(s, dom_rows, dom_start, dom_n, rows, n);
+    }
+#if HAVE_VIRNODEGETCPUSTATS && HAVE_VIRNODEGETMEMORYSTATS
+    if (host_failed == NULL) {
+        sampler_push(s, host_rows, host_start, host_n, &host, 1);
+    }
+    else {
+        sampler_error(s, host_failed);
+    }
+#endif
+    s->samples++;
+    pthread_mutex_unlock(&s->lock);
+
+    free(rows);
+}
+
+static void *sampler_thread(void *p)
+{
+    struct sampler *s = (struct sampler *)p;
+    struct timespec ts;
+    double next;
+
+    next = sampler_now();
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (!s->stopping && sampler_now() < next) {
+            ts.tv_sec = (time_t)next;
+            ts.tv_nsec = (long)((next - ts.tv_sec) * 1000000000.0);
+            pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+        }
+        if (s->stopping) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        sampler_sample(s);
+
+        /* keep to the interval's grid, but don't try to catch up on
+         * samples missed because the host was slow to answer
+         */
+        next += s->interval;
+        if (next < sampler_now()) {
+            next = sampler_now() + s->interval;
+        }
+    }
+
+    sampler_unref(s);
+
+    return NULL;
+}
+
+static void sampler_signal_stop(struct sampler *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stopping = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void sampler_free(void *p)
+{
+    struct sampler *s = (struct sampler *)p;
+
+    if (!s) {
+        return;
+    }
+    if (!s->joined) {
+        /* the thread may be in the middle of an RPC; let it finish and
+         * drop its own reference rather than waiting for it here
+         */
+        sampler_signal_stop(s);
+        pthread_detach(s->thread);
+    }
+    sampler_unref(s);
+}
+
+static const rb_data_type_t sampler_data_type = {
+    "Libvirt::Sampler",
+    { NULL, sampler_free, NULL, },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct sampler *sampler_get(VALUE s)
+{
+    struct sampler *sampler;
+
+    TypedData_Get_Struct(s, struct sampler, &sampler_data_type, sampler);
+
+    return sampler;
+}
+
+static VALUE sampler_option(VALUE opts, const char *name, VALUE def)
+{
+    VALUE val;
+
+    if (NIL_P(opts)) {
+        return def;
+    }
+    val = rb_hash_aref(opts, ID2SYM(rb_intern(name)));
+
+    return NIL_P(val) ? def : val;
+}
+
+VALUE ruby_libvirt_sampler_new(VALUE c, VALUE opts)
+{
+    static const char *const names[] = { "interval", "capacity", "stats",
+                                         "flags", NULL };
+    struct sampler *s;
+    VALUE result;
+    double interval;
+    long capacity;
+    unsigned int stats, flags;
+
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        ruby_libvirt_check_options(opts, names);
+    }
+    interval = NUM2DBL(sampler_option(opts, "interval", rb_float_new(1.0)));
+    capacity = NUM2LONG(sampler_option(opts, "capacity", INT2NUM(3600)));
+    stats = NUM2UINT(sampler_option(opts, "stats", INT2NUM(0)));
+    flags = NUM2UINT(sampler_option(opts, "flags", INT2NUM(0)));
+    if (interval <= 0) {
+        rb_raise(rb_eArgError, "interval must be positive");
+    }
+    if (capacity < 1) {
+        rb_raise(rb_eArgError, "capacity must be at least 1");
+    }
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        rb_memerror();
+    }
+    s->dom_rows = calloc(capacity, sizeof(*s->dom_rows));
+    s->host_rows = calloc(capacity, sizeof(*s->host_rows));
+    if (s->dom_rows == NULL || s->host_rows == NULL) {
+        free(s->dom_rows);
+        free(s->host_rows);
+        free(s);
+        rb_memerror();
+    }
+    s->capacity = capacity;
+    s->interval = interval;
+    s->stats = stats;
+    s->flags = flags;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    /* one reference for the Ruby object and one for the thread, which also
+     * holds the connection open for as long as it runs
+     */
+    s->refs = 2;
+    s->conn = ruby_libvirt_connect_get(c);
+    virConnectRef(s->conn);
+
+    result = TypedData_Wrap_Struct(c_sampler, &sampler_data_type, s);
+    rb_iv_set(result, "@connection", c);
+
+    if (pthread_create(&s->thread, NULL, sampler_thread, s) != 0) {
+        s->refs = 1;
+        s->joined = 1;
+        rb_sys_fail("pthread_create");
+    }
+
+    return result;
+}
+
+struct sampler_drain_arg {
+    struct sampler *s;
+    long max;
+    struct sampler_dom_row *dom;
+    long ndom;
+    struct sampler_host_row *host;
+    long nhost;
+};
+
+/* take up to arg->max rows of each kind off the rings, without the GVL;
+ * the lock is only held for the copy
+ */
+#define sampler_take(s, ring, start, count, dst, ndst, max)             \
+    do {                                                                \
+        long _i;                                                        \
+        (ndst) = (s)->count < (max) ? (s)->count : (max);               \
+        (dst) = malloc(((ndst) > 0 ? (ndst) : 1) * sizeof(*(dst)));     \
+        if ((dst) == NULL) {                                            \
+            (ndst) = 0;                                                 \
+        }                                                               \
+        for (_i = 0; _i < (ndst); _i++) {                               \
+            (dst)[_i] = (s)->ring[((s)->start + _i) % (s)->capacity];   \
+        }                                                               \
+        (s)->start = ((s)->start + (ndst)) % (s)->capacity;             \
+        (s)->count -= (ndst);                                           \
+    } while (0)
+
+static void *sampler_drain_nogvl(void *p)
+{
+    struct sampler_drain_arg *arg = (struct sampler_drain_arg *)p;
+    struct sampler *s = arg->s;
+
+    pthread_mutex_lock(&s->lock);
+    sampler_take(s, dom_rows, dom_start, dom_n, arg->dom, arg->ndom,
+                 arg->max);
+    sampler_take(s, host_rows, host_start, host_n, arg->host, arg->nhost,
+                 arg->max);
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static VALUE sampler_drain_build(VALUE in)
+{
+    struct sampler_drain_arg *arg = (struct sampler_drain_arg *)in;
+    VALUE uuids, dom, host;
+    long i;
+
+    uuids = rb_ary_new2(arg->ndom);
+    dom = rb_str_buf_new(arg->ndom * sizeof(arg->dom[0].values));
+    for (i = 0; i < arg->ndom; i++) {
+        rb_ary_store(uuids, i, rb_str_new2(arg->dom[i].uuid));
+        rb_str_buf_cat(dom, (const char *)arg->dom[i].values,
+                       sizeof(arg->dom[i].values));
+    }
+    host = rb_str_new((const char *)arg->host,
+                      arg->nhost * sizeof(arg->host[0]));
+
+    return rb_ary_new3(3, uuids, dom, host);
+}
+
+/*
+ * call-seq:
+ *   sampler.drain(max=nil) -> [uuids, domain_rows, host_rows]
+ *
+ * Take up to max (or all) of the domain rows and up to max of the host rows
+ * collected so far.  uuids is an Array with the UUID of the domain in each
+ * domain row.  domain_rows and host_rows are binary Strings of native
+ * doubles, Libvirt::Sampler::DOMAIN_FIELDS.length (or HOST_FIELDS.length)
+ * per row, to be read with unpack("D*").  Rates that can't be worked out
+ * yet, such as those in a domain's first row, are NaN.
+ */
+static VALUE libvirt_sampler_drain(int argc, VALUE *argv, VALUE s)
+{
+    VALUE max, result;
+    struct sampler_drain_arg arg;
+    int exception = 0;
+
+    rb_scan_args(argc, argv, "01", &max);
+
+    memset(&arg, 0, sizeof(arg));
+    arg.s = sampler_get(s);
+    arg.max = NIL_P(max) ? arg.s->capacity : NUM2LONG(max);
+    if (arg.max < 0) {
+        rb_raise(rb_eArgError, "max must not be negative");
+    }
+
+    ruby_libvirt_without_gvl(sampler_drain_nogvl, &arg, NULL, NULL);
+
+    result = rb_protect(sampler_drain_build, (VALUE)&arg, &exception);
+    free(arg.dom);
+    free(arg.host);
+    if (exception) {
+        rb_jump_tag(exception);
+    }
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   sampler.size -> Fixnum
+ *
+ * Return the number of domain rows waiting to be drained.
+ */
+static VALUE libvirt_sampler_size(VALUE s)
+{
+    struct sampler *sampler = sampler_get(s);
+    long n;
+
+    pthread_mutex_lock(&sampler->lock);
+    n = sampler->dom_n;
+    pthread_mutex_unlock(&sampler->lock);
+
+    return LONG2NUM(n);
+}
+
+/*
+ * call-seq:
+ *   sampler.samples -> Fixnum
+ *
+ * Return how many times the sampler has collected statistics.
+ */
+static VALUE libvirt_sampler_samples(VALUE s)
+{
+    struct sampler *sampler = sampler_get(s);
+    unsigned long long n;
+
+    pthread_mutex_lock(&sampler->lock);
+    n = sampler->samples;
+    pthread_mutex_unlock(&sampler->lock);
+
+    return ULL2NUM(n);
+}
+
+/*
+ * call-seq:
+ *   sampler.dropped -> Fixnum
+ *
+ * Return how many rows were overwritten because they were not drained
+ * before the rings filled up.
+ */
+static VALUE libvirt_sampler_dropped(VALUE s)
+{
+    struct sampler *sampler = sampler_get(s);
+    unsigned long long n;
+
+    pthread_mutex_lock(&sampler->lock);
+    n = sampler->dropped;
+    pthread_mutex_unlock(&sampler->lock);
+
+    return ULL2NUM(n);
+}
+
+/*
+ * call-seq:
+ *   sampler.errors -> Fixnum
+ *
+ * Return how many libvirt calls made by the sampler have failed.
+ */
+static VALUE libvirt_sampler_errors(VALUE s)
+{
+    struct sampler *sampler = sampler_get(s);
+    unsigned long long n;
+
+    pthread_mutex_lock(&sampler->lock);
+    n = sampler->errors;
+    pthread_mutex_unlock(&sampler->lock);
+
+    return ULL2NUM(n);
+}
+
+/*
+ * call-seq:
+ *   sampler.last_error -> String
+ *
+ * Return the message of the most recent failed libvirt call made by the
+ * sampler, or nil if none has failed.
+ */
+static VALUE libvirt_sampler_last_error(VALUE s)
+{
+    struct sampler *sampler = sampler_get(s);
+    VALUE result = Qnil;
+
+    pthread_mutex_lock(&sampler->lock);
+    if (sampler->last_error) {
+        result = rb_str_new2(sampler->last_error);
+    }
+    pthread_mutex_unlock(&sampler->lock);
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   sampler.interval -> Float
+ *
+ * Return the number of seconds between samples.
+ */
+static VALUE libvirt_sampler_interval(VALUE s)
+{
+    return rb_float_new(sampler_get(s)->interval);
+}
+
+static void *sampler_join_nogvl(void *p)
+{
+    pthread_join(((struct sampler *)p)->thread, NULL);
+
+    return NULL;
+}
+
+/*
+ * call-seq:
+ *   sampler.stop -> nil
+ *
+ * Stop sampling, waiting (with the GVL released) for a sample in progress
+ * to finish.  Rows already collected can still be drained.
+ */
+static VALUE libvirt_sampler_stop(VALUE s)
+{
+    struct sampler *sampler = sampler_get(s);
+
+    if (sampler->joined) {
+        return Qnil;
+    }
+
+    /* claimed while we still hold the GVL, so that a stop from another
+     * thread can't join the same thread a second time
+     */
+    sampler->joined = 1;
+    sampler_signal_stop(sampler);
+    ruby_libvirt_without_gvl(sampler_join_nogvl, sampler, NULL, NULL);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   sampler.running? -> [True|False]
+ *
+ * Return +true+ if the sampler has not been stopped, +false+ otherwise.
+ */
+static VALUE libvirt_sampler_running_p(VALUE s)
+{
+    return sampler_get(s)->joined ? Qfalse : Qtrue;
+}
+
+static VALUE sampler_field_names(const char **names, int n)
+{
+    VALUE result = rb_ary_new2(n);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        rb_ary_store(result, i, rb_obj_freeze(rb_str_new2(names[i])));
+    }
+
+    return rb_obj_freeze(result);
+}
+#endif
+
+/*
+ * Class Libvirt::Sampler
+ */
+void ruby_libvirt_sampler_init(void)
+{
+#if HAVE_VIRCONNECTGETALLDOMAINSTATS && HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    c_sampler = rb_define_class_under(m_libvirt, "Sampler", rb_cObject);
+    rb_undef_alloc_func(c_sampler);
+
+    rb_define_const(c_sampler, "DOMAIN_FIELDS",
+                    sampler_field_names(dom_field_names, DOM_NFIELDS));
+    rb_define_const(c_sampler, "HOST_FIELDS",
+                    sampler_field_names(host_field_names, HOST_NFIELDS));
+
+    rb_define_attr(c_sampler, "connection", 1, 0);
+    rb_define_method(c_sampler, "drain", libvirt_sampler_drain, -1);
+    rb_define_method(c_sampler, "size", libvirt_sampler_size, 0);
+    rb_define_method(c_sampler, "samples", libvirt_sampler_samples, 0);
+    rb_define_method(c_sampler, "dropped", libvirt_sampler_dropped, 0);
+    rb_define_method(c_sampler, "errors", libvirt_sampler_errors, 0);
+    rb_define_method(c_sampler, "last_error", libvirt_sampler_last_error, 0);
+    rb_define_method(c_sampler, "interval", libvirt_sampler_interval, 0);
+    rb_define_method(c_sampler, "stop", libvirt_sampler_stop, 0);
+    rb_define_method(c_sampler, "running?", libvirt_sampler_running_p, 0);
+#endif
+}
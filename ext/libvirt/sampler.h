@@ -0,0 +1,8 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+void ruby_libvirt_sampler_init(void);
+
+VALUE ruby_libvirt_sampler_new(VALUE c, VALUE opts);
+
+#endif
@@ -29,10 +29,7 @@
 #if HAVE_TYPE_VIRSECRETPTR
 static VALUE c_secret;
 
-static void secret_free(void *s)
-{
-    ruby_libvirt_free_struct(Secret, s);
-}
+ruby_libvirt_handle_type(Secret, "Libvirt::Secret")
 
 static virSecretPtr secret_get(VALUE s)
 {
@@ -41,7 +38,7 @@ static virSecretPtr secret_get(VALUE s)
 
 VALUE ruby_libvirt_secret_new(virSecretPtr s, VALUE conn)
 {
-    return ruby_libvirt_new_class(c_secret, s, conn, secret_free);
+    return ruby_libvirt_new_class(c_secret, &Secret_handle_data_type, s, conn);
 }
 
 /*
@@ -235,7 +232,7 @@ void ruby_libvirt_secret_init(void)
 #if HAVE_TYPE_VIRSECRETPTR
     c_secret = rb_define_class_under(m_libvirt, "Secret", rb_cObject);
 
-    rb_define_attr(c_secret, "connection", 1, 0);
+    rb_define_method(c_secret, "connection", ruby_libvirt_handle_connection, 0);
 
     rb_define_const(c_secret, "USAGE_TYPE_VOLUME",
                     INT2NUM(VIR_SECRET_USAGE_TYPE_VOLUME));
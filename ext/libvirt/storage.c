@@ -19,7 +19,12 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
  */
 
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <ruby.h>
+#include <ruby/io.h>
 #include <libvirt/libvirt.h>
 #include <libvirt/virterror.h>
 #include "common.h"
@@ -31,6 +36,8 @@
 /* this has to be here (as opposed to below with the rest of the volume
  * stuff) because libvirt_storage_vol_get_pool() relies on it
  */
+ruby_libvirt_handle_type(StorageVol, "Libvirt::StorageVol")
+
 static virStorageVolPtr vol_get(VALUE v)
 {
     ruby_libvirt_get_struct(StorageVol, v);
@@ -45,10 +52,7 @@ static VALUE c_storage_pool_info;
  * Class Libvirt::StoragePool
  */
 
-static void pool_free(void *d)
-{
-    ruby_libvirt_free_struct(StoragePool, d);
-}
+ruby_libvirt_handle_type(StoragePool, "Libvirt::StoragePool")
 
 static virStoragePoolPtr pool_get(VALUE p)
 {
@@ -57,7 +61,8 @@ static virStoragePoolPtr pool_get(VALUE p)
 
 VALUE pool_new(virStoragePoolPtr p, VALUE conn)
 {
-    return ruby_libvirt_new_class(c_storage_pool, p, conn, pool_free);
+    return ruby_libvirt_new_class(c_storage_pool,
+                                  &StoragePool_handle_data_type, p, conn);
 }
 
 /*
@@ -79,6 +84,9 @@ static VALUE libvirt_storage_vol_pool(VALUE v)
     return pool_new(pool, ruby_libvirt_conn_attr(v));
 }
 
+ruby_libvirt_declare_nogvl2(int, virStoragePoolBuild, virStoragePoolPtr,
+                            unsigned int)
+
 /*
  * call-seq:
  *   pool.build(flags=0) -> nil
@@ -92,10 +100,10 @@ static VALUE libvirt_storage_pool_build(int argc, VALUE *argv, VALUE p)
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_nil(virStoragePoolBuild,
-                                   ruby_libvirt_connect_get(p),
-                                   pool_get(p),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virStoragePoolBuild,
+                                         ruby_libvirt_connect_get(p),
+                                         pool_get(p),
+                                         ruby_libvirt_value_to_uint(flags));
 }
 
 /*
@@ -112,6 +120,9 @@ static VALUE libvirt_storage_pool_undefine(VALUE p)
                                    pool_get(p));
 }
 
+ruby_libvirt_declare_nogvl2(int, virStoragePoolCreate, virStoragePoolPtr,
+                            unsigned int)
+
 /*
  * call-seq:
  *   pool.create(flags=0) -> nil
@@ -125,12 +136,14 @@ static VALUE libvirt_storage_pool_create(int argc, VALUE *argv, VALUE p)
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_nil(virStoragePoolCreate,
-                                   ruby_libvirt_connect_get(p),
-                                   pool_get(p),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virStoragePoolCreate,
+                                         ruby_libvirt_connect_get(p),
+                                         pool_get(p),
+                                         ruby_libvirt_value_to_uint(flags));
 }
 
+ruby_libvirt_declare_nogvl1(int, virStoragePoolDestroy, virStoragePoolPtr)
+
 /*
  * call-seq:
  *   pool.destroy -> nil
@@ -140,11 +153,14 @@ static VALUE libvirt_storage_pool_create(int argc, VALUE *argv, VALUE p)
  */
 static VALUE libvirt_storage_pool_destroy(VALUE p)
 {
-    ruby_libvirt_generate_call_nil(virStoragePoolDestroy,
-                                   ruby_libvirt_connect_get(p),
-                                   pool_get(p));
+    ruby_libvirt_generate_call_nil_nogvl(virStoragePoolDestroy,
+                                         ruby_libvirt_connect_get(p),
+                                         pool_get(p));
 }
 
+ruby_libvirt_declare_nogvl2(int, virStoragePoolDelete, virStoragePoolPtr,
+                            unsigned int)
+
 /*
  * call-seq:
  *   pool.delete(flags=0) -> nil
@@ -159,12 +175,15 @@ static VALUE libvirt_storage_pool_delete(int argc, VALUE *argv, VALUE p)
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_nil(virStoragePoolDelete,
-                                   ruby_libvirt_connect_get(p),
-                                   pool_get(p),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virStoragePoolDelete,
+                                         ruby_libvirt_connect_get(p),
+                                         pool_get(p),
+                                         ruby_libvirt_value_to_uint(flags));
 }
 
+ruby_libvirt_declare_nogvl2(int, virStoragePoolRefresh, virStoragePoolPtr,
+                            unsigned int)
+
 /*
  * call-seq:
  *   pool.refresh(flags=0) -> nil
@@ -178,10 +197,10 @@ static VALUE libvirt_storage_pool_refresh(int argc, VALUE *argv, VALUE p)
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_nil(virStoragePoolRefresh,
-                                   ruby_libvirt_connect_get(p),
-                                   pool_get(p),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virStoragePoolRefresh,
+                                         ruby_libvirt_connect_get(p),
+                                         pool_get(p),
+                                         ruby_libvirt_value_to_uint(flags));
 }
 
 /*
@@ -211,6 +230,13 @@ static VALUE libvirt_storage_pool_uuid(VALUE p)
                                ruby_libvirt_connect_get(p), pool_get(p));
 }
 
+ruby_libvirt_struct_type(pool_info, virStoragePoolInfo,
+                         "Libvirt::StoragePoolInfo")
+ruby_libvirt_struct_reader(pool_info, state, state, INT2NUM)
+ruby_libvirt_struct_reader(pool_info, capacity, capacity, ULL2NUM)
+ruby_libvirt_struct_reader(pool_info, allocation, allocation, ULL2NUM)
+ruby_libvirt_struct_reader(pool_info, available, available, ULL2NUM)
+
 /*
  * call-seq:
  *   pool.info -> Libvirt::StoragePoolInfo
@@ -222,20 +248,13 @@ static VALUE libvirt_storage_pool_info(VALUE p)
 {
     virStoragePoolInfo info;
     int r;
-    VALUE result;
 
     r = virStoragePoolGetInfo(pool_get(p), &info);
     ruby_libvirt_raise_error_if(r < 0, e_RetrieveError,
                                 "virStoragePoolGetInfo",
                                 ruby_libvirt_connect_get(p));
 
-    result = rb_class_new_instance(0, NULL, c_storage_pool_info);
-    rb_iv_set(result, "@state", INT2NUM(info.state));
-    rb_iv_set(result, "@capacity", ULL2NUM(info.capacity));
-    rb_iv_set(result, "@allocation", ULL2NUM(info.allocation));
-    rb_iv_set(result, "@available", ULL2NUM(info.available));
-
-    return result;
+    return pool_info_new(c_storage_pool_info, &info);
 }
 
 /*
@@ -363,15 +382,28 @@ static VALUE libvirt_storage_pool_free(VALUE p)
  */
 static VALUE c_storage_vol;
 static VALUE c_storage_vol_info;
+static VALUE c_storage_vol_record;
 
-static void vol_free(void *d)
+static VALUE vol_new(virStorageVolPtr v, VALUE conn)
 {
-    ruby_libvirt_free_struct(StorageVol, d);
+    return ruby_libvirt_new_class(c_storage_vol, &StorageVol_handle_data_type,
+                                  v, conn);
 }
 
-static VALUE vol_new(virStorageVolPtr v, VALUE conn)
+static VALUE lookup_vol_by_name(VALUE p, VALUE name, int missing)
 {
-    return ruby_libvirt_new_class(c_storage_vol, v, conn, vol_free);
+    virStorageVolPtr vol;
+
+    vol = virStorageVolLookupByName(pool_get(p), StringValueCStr(name));
+    if (ruby_libvirt_error_missing(vol == NULL, missing,
+                                   ruby_libvirt_connect_get(p))) {
+        return Qnil;
+    }
+    ruby_libvirt_raise_error_if(vol == NULL, e_RetrieveError,
+                                "virStorageVolLookupByName",
+                                ruby_libvirt_connect_get(p));
+
+    return vol_new(vol, ruby_libvirt_conn_attr(p));
 }
 
 /*
@@ -382,12 +414,35 @@ static VALUE vol_new(virStorageVolPtr v, VALUE conn)
  * to retrieve a storage volume object by name.
  */
 static VALUE libvirt_storage_pool_lookup_vol_by_name(VALUE p, VALUE name)
+{
+    return lookup_vol_by_name(p, name, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   pool.find_volume_by_name(name) -> Libvirt::StorageVol or nil
+ *
+ * Like pool.lookup_volume_by_name, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such storage volume.
+ */
+static VALUE libvirt_storage_pool_find_vol_by_name(VALUE p, VALUE name)
+{
+    return lookup_vol_by_name(p, name, VIR_ERR_NO_STORAGE_VOL);
+}
+
+static VALUE lookup_vol_by_key(VALUE p, VALUE key, int missing)
 {
     virStorageVolPtr vol;
 
-    vol = virStorageVolLookupByName(pool_get(p), StringValueCStr(name));
+    /* FIXME: Why does this take a connection, not a pool? */
+    vol = virStorageVolLookupByKey(ruby_libvirt_connect_get(p),
+                                   StringValueCStr(key));
+    if (ruby_libvirt_error_missing(vol == NULL, missing,
+                                   ruby_libvirt_connect_get(p))) {
+        return Qnil;
+    }
     ruby_libvirt_raise_error_if(vol == NULL, e_RetrieveError,
-                                "virStorageVolLookupByName",
+                                "virStorageVolLookupByKey",
                                 ruby_libvirt_connect_get(p));
 
     return vol_new(vol, ruby_libvirt_conn_attr(p));
@@ -401,14 +456,35 @@ static VALUE libvirt_storage_pool_lookup_vol_by_name(VALUE p, VALUE name)
  * to retrieve a storage volume object by key.
  */
 static VALUE libvirt_storage_pool_lookup_vol_by_key(VALUE p, VALUE key)
+{
+    return lookup_vol_by_key(p, key, VIR_ERR_OK);
+}
+
+/*
+ * call-seq:
+ *   pool.find_volume_by_key(key) -> Libvirt::StorageVol or nil
+ *
+ * Like pool.lookup_volume_by_key, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such storage volume.
+ */
+static VALUE libvirt_storage_pool_find_vol_by_key(VALUE p, VALUE key)
+{
+    return lookup_vol_by_key(p, key, VIR_ERR_NO_STORAGE_VOL);
+}
+
+static VALUE lookup_vol_by_path(VALUE p, VALUE path, int missing)
 {
     virStorageVolPtr vol;
 
     /* FIXME: Why does this take a connection, not a pool? */
-    vol = virStorageVolLookupByKey(ruby_libvirt_connect_get(p),
-                                   StringValueCStr(key));
+    vol = virStorageVolLookupByPath(ruby_libvirt_connect_get(p),
+                                    StringValueCStr(path));
+    if (ruby_libvirt_error_missing(vol == NULL, missing,
+                                   ruby_libvirt_connect_get(p))) {
+        return Qnil;
+    }
     ruby_libvirt_raise_error_if(vol == NULL, e_RetrieveError,
-                                "virStorageVolLookupByKey",
+                                "virStorageVolLookupByPath",
                                 ruby_libvirt_connect_get(p));
 
     return vol_new(vol, ruby_libvirt_conn_attr(p));
@@ -423,19 +499,26 @@ static VALUE libvirt_storage_pool_lookup_vol_by_key(VALUE p, VALUE key)
  */
 static VALUE libvirt_storage_pool_lookup_vol_by_path(VALUE p, VALUE path)
 {
-    virStorageVolPtr vol;
-
-    /* FIXME: Why does this take a connection, not a pool? */
-    vol = virStorageVolLookupByPath(ruby_libvirt_connect_get(p),
-                                    StringValueCStr(path));
-    ruby_libvirt_raise_error_if(vol == NULL, e_RetrieveError,
-                                "virStorageVolLookupByPath",
-                                ruby_libvirt_connect_get(p));
+    return lookup_vol_by_path(p, path, VIR_ERR_OK);
+}
 
-    return vol_new(vol, ruby_libvirt_conn_attr(p));
+/*
+ * call-seq:
+ *   pool.find_volume_by_path(path) -> Libvirt::StorageVol or nil
+ *
+ * Like pool.lookup_volume_by_path, but return nil instead of raising a
+ * Libvirt::RetrieveError when there is no such storage volume.
+ */
+static VALUE libvirt_storage_pool_find_vol_by_path(VALUE p, VALUE path)
+{
+    return lookup_vol_by_path(p, path, VIR_ERR_NO_STORAGE_VOL);
 }
 
 #if HAVE_VIRSTORAGEPOOLLISTALLVOLUMES
+ruby_libvirt_declare_nogvl3(int, virStoragePoolListAllVolumes,
+                            virStoragePoolPtr, virStorageVolPtr **,
+                            unsigned int)
+
 /*
  * call-seq:
  *   pool.list_all_volumes(flags=0) -> Array
@@ -446,10 +529,237 @@ static VALUE libvirt_storage_pool_lookup_vol_by_path(VALUE p, VALUE path)
 static VALUE libvirt_storage_pool_list_all_volumes(int argc, VALUE *argv,
                                                    VALUE p)
 {
-    ruby_libvirt_generate_call_list_all(virStorageVolPtr, argc, argv,
-                                        virStoragePoolListAllVolumes,
-                                        pool_get(p), p, vol_new,
-                                        virStorageVolFree);
+    ruby_libvirt_generate_call_list_all_nogvl(virStorageVolPtr, argc, argv,
+                                              virStoragePoolListAllVolumes,
+                                              pool_get(p), p, vol_new,
+                                              virStorageVolFree);
+}
+
+struct volumes_info_slot {
+    virStorageVolPtr vol;
+    char *key;
+    char *path;
+    virStorageVolInfo info;
+    const char *failed;
+    virError err;
+};
+
+struct volumes_info_arg {
+    VALUE p;
+    struct volumes_info_slot *slots;
+    int nslots;
+    int threads;
+    int nomem;
+};
+
+static void volumes_info_fetch(long i, void *p)
+{
+    struct volumes_info_arg *arg = (struct volumes_info_arg *)p;
+    struct volumes_info_slot *slot = &arg->slots[i];
+    const char *key;
+
+    key = virStorageVolGetKey(slot->vol);
+    if (key == NULL) {
+        slot->failed = "virStorageVolGetKey";
+        goto error;
+    }
+    slot->key = strdup(key);
+    if (slot->key == NULL) {
+        /* nothing to report through the slot, so fail the whole call */
+        arg->nomem = 1;
+        return;
+    }
+
+    slot->path = virStorageVolGetPath(slot->vol);
+    if (slot->path == NULL) {
+        slot->failed = "virStorageVolGetPath";
+        goto error;
+    }
+
+    if (virStorageVolGetInfo(slot->vol, &slot->info) < 0) {
+        slot->failed = "virStorageVolGetInfo";
+        goto error;
+    }
+
+    return;
+
+error:
+    virCopyLastError(&slot->err);
+    virResetLastError();
+}
+
+static VALUE volumes_info_build(VALUE in)
+{
+    struct volumes_info_arg *arg = (struct volumes_info_arg *)in;
+    struct volumes_info_slot *slot;
+    VALUE result, record, conn;
+    int i;
+
+    /* inside the rb_ensure, so that the slots are freed whatever is raised */
+    if (ruby_libvirt_parallel_nogvl(arg->nslots, arg->threads,
+                                    volumes_info_fetch, arg) < arg->nslots) {
+        rb_thread_check_ints();
+    }
+    if (arg->nomem) {
+        rb_memerror();
+    }
+
+    conn = ruby_libvirt_conn_attr(arg->p);
+    result = rb_ary_new2(arg->nslots);
+    for (i = 0; i < arg->nslots; i++) {
+        slot = &arg->slots[i];
+
+        record = rb_class_new_instance(0, NULL, c_storage_vol_record);
+        rb_iv_set(record, "@name",
+                  rb_str_new2(virStorageVolGetName(slot->vol)));
+        rb_iv_set(record, "@key", slot->key ? rb_str_new2(slot->key) : Qnil);
+        rb_iv_set(record, "@path",
+                  slot->path ? rb_str_new2(slot->path) : Qnil);
+        if (slot->failed) {
+            rb_iv_set(record, "@type", Qnil);
+            rb_iv_set(record, "@capacity", Qnil);
+            rb_iv_set(record, "@allocation", Qnil);
+            rb_iv_set(record, "@error",
+                      ruby_libvirt_error_new(e_RetrieveError, slot->failed,
+                                             &slot->err));
+        }
+        else {
+            rb_iv_set(record, "@type", INT2NUM(slot->info.type));
+            rb_iv_set(record, "@capacity", ULL2NUM(slot->info.capacity));
+            rb_iv_set(record, "@allocation", ULL2NUM(slot->info.allocation));
+            rb_iv_set(record, "@error", Qnil);
+        }
+        rb_iv_set(record, "@volume", vol_new(slot->vol, conn));
+        /* the StorageVol object owns it now */
+        slot->vol = NULL;
+
+        rb_ary_push(result, record);
+    }
+
+    return result;
+}
+
+static VALUE volumes_info_free(VALUE in)
+{
+    struct volumes_info_arg *arg = (struct volumes_info_arg *)in;
+    int i;
+
+    for (i = 0; i < arg->nslots; i++) {
+        if (arg->slots[i].vol) {
+            virStorageVolFree(arg->slots[i].vol);
+        }
+        free(arg->slots[i].key);
+        free(arg->slots[i].path);
+        if (arg->slots[i].failed) {
+            virResetError(&arg->slots[i].err);
+        }
+    }
+    free(arg->slots);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   pool.volumes_with_info(flags=0, threads: 8, refresh: false, refresh_flags: 0) -> Array
+ *
+ * Fetch every volume of the pool (as selected by flags, as for
+ * pool.list_all_volumes) with one call to
+ * virStoragePoolListAllVolumes[http://www.libvirt.org/html/libvirt-libvirt-storage.html#virStoragePoolListAllVolumes],
+ * then the key, path and info of each with
+ * virStorageVolGetKey[http://www.libvirt.org/html/libvirt-libvirt-storage.html#virStorageVolGetKey],
+ * virStorageVolGetPath[http://www.libvirt.org/html/libvirt-libvirt-storage.html#virStorageVolGetPath] and
+ * virStorageVolGetInfo[http://www.libvirt.org/html/libvirt-libvirt-storage.html#virStorageVolGetInfo]
+ * from up to threads native threads at once with the GVL released.  If
+ * refresh is true, the pool is refreshed (with refresh_flags) first.  The
+ * result is an array of Libvirt::StorageVol::Record objects, each with the
+ * name, key, path, type, capacity and allocation of the volume, the
+ * Libvirt::StorageVol itself and an error.  A volume whose details could
+ * not be retrieved (typically because it was deleted in the meantime) does
+ * not fail the whole call; instead its error is set to the
+ * Libvirt::RetrieveError and the details that are missing are nil.  Any
+ * other option raises ArgumentError.
+ */
+static VALUE libvirt_storage_pool_volumes_with_info(int argc, VALUE *argv,
+                                                    VALUE p)
+{
+    static const char *const names[] = { "threads", "refresh",
+                                         "refresh_flags", NULL };
+    VALUE flags, opts, val;
+    struct volumes_info_arg arg;
+    virStorageVolPtr *vols;
+    int i, n, threads;
+
+    rb_scan_args(argc, argv, "02", &flags, &opts);
+    if (TYPE(flags) == T_HASH && NIL_P(opts)) {
+        opts = flags;
+        flags = Qnil;
+    }
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        ruby_libvirt_check_options(opts, names);
+    }
+
+    threads = 8;
+    if (!NIL_P(opts)) {
+        val = rb_hash_aref(opts, ID2SYM(rb_intern("threads")));
+        if (!NIL_P(val)) {
+            threads = NUM2INT(val);
+        }
+        if (RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("refresh"))))) {
+            val = rb_hash_aref(opts, ID2SYM(rb_intern("refresh_flags")));
+            {
+                ruby_libvirt_call_nogvl(rargs, virStoragePoolRefresh, NULL,
+                                        NULL, pool_get(p),
+                                        ruby_libvirt_value_to_uint(val));
+                ruby_libvirt_raise_error_if(rargs.ret < 0, e_Error,
+                                            "virStoragePoolRefresh",
+                                            ruby_libvirt_connect_get(p));
+            }
+        }
+    }
+
+    {
+        ruby_libvirt_call_nogvl_owned(largs, lstate,
+                                      virStoragePoolListAllVolumes, NULL,
+                                      NULL, pool_get(p), &vols,
+                                      ruby_libvirt_value_to_uint(flags));
+        n = largs.ret;
+        /* a failed call owns nothing, so raise an interrupt now; a fiber
+         * exception after success can't be kept that long, so then give
+         * back the volumes and raise it
+         */
+        if (n < 0 || lstate) {
+            for (i = 0; i < n; i++) {
+                virStorageVolFree(vols[i]);
+            }
+            free(vols);
+            ruby_libvirt_raise_pending(lstate);
+        }
+    }
+    ruby_libvirt_raise_error_if(n < 0, e_RetrieveError,
+                                "virStoragePoolListAllVolumes",
+                                ruby_libvirt_connect_get(p));
+
+    memset(&arg, 0, sizeof(arg));
+    arg.p = p;
+    arg.threads = threads;
+    arg.slots = calloc(n > 0 ? n : 1, sizeof(*arg.slots));
+    if (arg.slots == NULL) {
+        for (i = 0; i < n; i++) {
+            virStorageVolFree(vols[i]);
+        }
+        free(vols);
+        rb_memerror();
+    }
+    for (i = 0; i < n; i++) {
+        arg.slots[i].vol = vols[i];
+    }
+    arg.nslots = n;
+    free(vols);
+
+    return rb_ensure(volumes_info_build, (VALUE)&arg, volumes_info_free,
+                     (VALUE)&arg);
 }
 #endif
 
@@ -481,6 +791,9 @@ static VALUE libvirt_storage_vol_key(VALUE v)
                                       vol_get(v));
 }
 
+ruby_libvirt_declare_nogvl3(virStorageVolPtr, virStorageVolCreateXML,
+                            virStoragePoolPtr, const char *, unsigned int)
+
 /*
  * call-seq:
  *   pool.create_volume_xml(xml, flags=0) -> Libvirt::StorageVol
@@ -491,20 +804,23 @@ static VALUE libvirt_storage_vol_key(VALUE v)
 static VALUE libvirt_storage_pool_create_volume_xml(int argc, VALUE *argv,
                                                     VALUE p)
 {
-    virStorageVolPtr vol;
     VALUE xml, flags = RUBY_Qnil;
 
     rb_scan_args(argc, argv, "11", &xml, &flags);
 
-    vol = virStorageVolCreateXML(pool_get(p), StringValueCStr(xml),
-                                 ruby_libvirt_value_to_uint(flags));
-    ruby_libvirt_raise_error_if(vol == NULL, e_Error, "virStorageVolCreateXML",
-                                ruby_libvirt_connect_get(p));
-
-    return vol_new(vol, ruby_libvirt_conn_attr(p));
+    ruby_libvirt_generate_call_object_nogvl(virStorageVolCreateXML,
+                                            ruby_libvirt_connect_get(p),
+                                            e_Error, vol_new,
+                                            ruby_libvirt_conn_attr(p),
+                                            pool_get(p), StringValueCStr(xml),
+                                            ruby_libvirt_value_to_uint(flags));
 }
 
 #if HAVE_VIRSTORAGEVOLCREATEXMLFROM
+ruby_libvirt_declare_nogvl4(virStorageVolPtr, virStorageVolCreateXMLFrom,
+                            virStoragePoolPtr, const char *, virStorageVolPtr,
+                            unsigned int)
+
 /*
  * call-seq:
  *   pool.create_volume_xml_from(xml, clonevol, flags=0) -> Libvirt::StorageVol
@@ -516,19 +832,17 @@ static VALUE libvirt_storage_pool_create_volume_xml(int argc, VALUE *argv,
 static VALUE libvirt_storage_pool_create_volume_xml_from(int argc, VALUE *argv,
                                                          VALUE p)
 {
-    virStorageVolPtr vol;
     VALUE xml, flags = RUBY_Qnil, cloneval = RUBY_Qnil;
 
     rb_scan_args(argc, argv, "21", &xml, &cloneval, &flags);
 
-    vol = virStorageVolCreateXMLFrom(pool_get(p), StringValueCStr(xml),
-                                     vol_get(cloneval),
-                                     ruby_libvirt_value_to_uint(flags));
-    ruby_libvirt_raise_error_if(vol == NULL, e_Error,
-                                "virStorageVolCreateXMLFrom",
-                                ruby_libvirt_connect_get(p));
-
-    return vol_new(vol, ruby_libvirt_conn_attr(p));
+    ruby_libvirt_generate_call_object_nogvl(virStorageVolCreateXMLFrom,
+                                            ruby_libvirt_connect_get(p),
+                                            e_Error, vol_new,
+                                            ruby_libvirt_conn_attr(p),
+                                            pool_get(p), StringValueCStr(xml),
+                                            vol_get(cloneval),
+                                            ruby_libvirt_value_to_uint(flags));
 }
 #endif
 
@@ -564,6 +878,9 @@ static VALUE libvirt_storage_pool_persistent_p(VALUE p)
 }
 #endif
 
+ruby_libvirt_declare_nogvl2(int, virStorageVolDelete, virStorageVolPtr,
+                            unsigned int)
+
 /*
  * call-seq:
  *   vol.delete(flags=0) -> nil
@@ -577,13 +894,16 @@ static VALUE libvirt_storage_vol_delete(int argc, VALUE *argv, VALUE v)
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_nil(virStorageVolDelete,
-                                   ruby_libvirt_connect_get(v),
-                                   vol_get(v),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virStorageVolDelete,
+                                         ruby_libvirt_connect_get(v),
+                                         vol_get(v),
+                                         ruby_libvirt_value_to_uint(flags));
 }
 
 #if HAVE_VIRSTORAGEVOLWIPE
+ruby_libvirt_declare_nogvl2(int, virStorageVolWipe, virStorageVolPtr,
+                            unsigned int)
+
 /*
  * call-seq:
  *   vol.wipe(flags=0) -> nil
@@ -597,13 +917,19 @@ static VALUE libvirt_storage_vol_wipe(int argc, VALUE *argv, VALUE v)
 
     rb_scan_args(argc, argv, "01", &flags);
 
-    ruby_libvirt_generate_call_nil(virStorageVolWipe,
-                                   ruby_libvirt_connect_get(v),
-                                   vol_get(v),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virStorageVolWipe,
+                                         ruby_libvirt_connect_get(v),
+                                         vol_get(v),
+                                         ruby_libvirt_value_to_uint(flags));
 }
 #endif
 
+ruby_libvirt_struct_type(vol_info, virStorageVolInfo,
+                         "Libvirt::StorageVolInfo")
+ruby_libvirt_struct_reader(vol_info, type, type, INT2NUM)
+ruby_libvirt_struct_reader(vol_info, capacity, capacity, ULL2NUM)
+ruby_libvirt_struct_reader(vol_info, allocation, allocation, ULL2NUM)
+
 /*
  * call-seq:
  *   vol.info -> Libvirt::StorageVolInfo
@@ -615,18 +941,12 @@ static VALUE libvirt_storage_vol_info(VALUE v)
 {
     virStorageVolInfo info;
     int r;
-    VALUE result;
 
     r = virStorageVolGetInfo(vol_get(v), &info);
     ruby_libvirt_raise_error_if(r < 0, e_RetrieveError, "virStorageVolGetInfo",
                                 ruby_libvirt_connect_get(v));
 
-    result = rb_class_new_instance(0, NULL, c_storage_vol_info);
-    rb_iv_set(result, "@type", INT2NUM(info.type));
-    rb_iv_set(result, "@capacity", ULL2NUM(info.capacity));
-    rb_iv_set(result, "@allocation", ULL2NUM(info.allocation));
-
-    return result;
+    return vol_info_new(c_storage_vol_info, &info);
 }
 
 /*
@@ -677,6 +997,14 @@ static VALUE libvirt_storage_vol_free(VALUE v)
 #endif
 
 #if HAVE_VIRSTORAGEVOLDOWNLOAD
+ruby_libvirt_declare_nogvl5(int, virStorageVolDownload, virStorageVolPtr,
+                            virStreamPtr, unsigned long long,
+                            unsigned long long, unsigned int)
+ruby_libvirt_declare_nogvl5(int, virStorageVolUpload, virStorageVolPtr,
+                            virStreamPtr, unsigned long long,
+                            unsigned long long, unsigned int)
+ruby_libvirt_declare_nogvl1(int, virStreamFinish, virStreamPtr)
+
 /*
  * call-seq:
  *   vol.download(stream, offset, length, flags=0) -> nil
@@ -690,11 +1018,12 @@ static VALUE libvirt_storage_vol_download(int argc, VALUE *argv, VALUE v)
 
     rb_scan_args(argc, argv, "31", &st, &offset, &length, &flags);
 
-    ruby_libvirt_generate_call_nil(virStorageVolDownload,
-                                   ruby_libvirt_connect_get(v),
-                                   vol_get(v), ruby_libvirt_stream_get(st),
-                                   NUM2ULL(offset), NUM2ULL(length),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virStorageVolDownload,
+                                         ruby_libvirt_connect_get(v),
+                                         vol_get(v),
+                                         ruby_libvirt_stream_get(st),
+                                         NUM2ULL(offset), NUM2ULL(length),
+                                         ruby_libvirt_value_to_uint(flags));
 }
 
 /*
@@ -710,15 +1039,184 @@ static VALUE libvirt_storage_vol_upload(int argc, VALUE *argv, VALUE v)
 
     rb_scan_args(argc, argv, "31", &st, &offset, &length, &flags);
 
-    ruby_libvirt_generate_call_nil(virStorageVolUpload,
-                                   ruby_libvirt_connect_get(v),
-                                   vol_get(v), ruby_libvirt_stream_get(st),
-                                   NUM2ULL(offset), NUM2ULL(length),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virStorageVolUpload,
+                                         ruby_libvirt_connect_get(v),
+                                         vol_get(v),
+                                         ruby_libvirt_stream_get(st),
+                                         NUM2ULL(offset), NUM2ULL(length),
+                                         ruby_libvirt_value_to_uint(flags));
+}
+
+struct vol_transfer_arg {
+    VALUE v;
+    int upload;
+    int fd;
+    int close_fd;
+    unsigned long long offset;
+    unsigned long long length;
+    unsigned int flags;
+    int sparse;
+    virStreamPtr st;
+    int finished;
+};
+
+static VALUE vol_transfer_run(VALUE in)
+{
+    struct vol_transfer_arg *arg = (struct vol_transfer_arg *)in;
+    virConnectPtr conn = ruby_libvirt_connect_get(arg->v);
+    unsigned long long bytes;
+    int r;
+
+    arg->st = virStreamNew(conn, 0);
+    ruby_libvirt_raise_error_if(arg->st == NULL, e_RetrieveError,
+                                "virStreamNew", conn);
+
+    if (arg->upload) {
+        ruby_libvirt_call_nogvl(args, virStorageVolUpload, NULL, NULL,
+                                vol_get(arg->v), arg->st, arg->offset,
+                                arg->length, arg->flags);
+        r = args.ret;
+    }
+    else {
+        ruby_libvirt_call_nogvl(args, virStorageVolDownload, NULL, NULL,
+                                vol_get(arg->v), arg->st, arg->offset,
+                                arg->length, arg->flags);
+        r = args.ret;
+    }
+    ruby_libvirt_raise_error_if(r < 0, e_RetrieveError,
+                                arg->upload ? "virStorageVolUpload" :
+                                "virStorageVolDownload", conn);
+
+    if (arg->upload) {
+        bytes = ruby_libvirt_stream_sendall_fd(arg->st, arg->fd, arg->sparse,
+                                               conn);
+    }
+    else {
+        bytes = ruby_libvirt_stream_recvall_fd(arg->st, arg->fd, arg->sparse,
+                                               conn);
+    }
+
+    {
+        ruby_libvirt_call_nogvl(args, virStreamFinish, NULL, NULL, arg->st);
+        arg->finished = 1;
+        ruby_libvirt_raise_error_if(args.ret < 0, e_RetrieveError,
+                                    "virStreamFinish", conn);
+    }
+
+    return ULL2NUM(bytes);
+}
+
+static VALUE vol_transfer_cleanup(VALUE in)
+{
+    struct vol_transfer_arg *arg = (struct vol_transfer_arg *)in;
+
+    if (arg->st != NULL) {
+        if (!arg->finished) {
+            virStreamAbort(arg->st);
+        }
+        virStreamFree(arg->st);
+    }
+    if (arg->close_fd) {
+        close(arg->fd);
+    }
+
+    return Qnil;
+}
+
+/* the common part of vol.download_to and vol.upload_from */
+static VALUE vol_transfer(int argc, VALUE *argv, VALUE v, int upload)
+{
+    VALUE target, offset, length, flags, io, path;
+    struct vol_transfer_arg arg;
+
+    rb_scan_args(argc, argv, "13", &target, &offset, &length, &flags);
+
+    arg.v = v;
+    arg.upload = upload;
+    arg.offset = NIL_P(offset) ? 0 : NUM2ULL(offset);
+    arg.length = NIL_P(length) ? 0 : NUM2ULL(length);
+    arg.flags = ruby_libvirt_value_to_uint(flags);
+    arg.sparse = 0;
+#if HAVE_CONST_VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM
+    if (!upload && (arg.flags & VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM)) {
+        arg.sparse = 1;
+    }
+#endif
+#if HAVE_CONST_VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM
+    if (upload && (arg.flags & VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM)) {
+        arg.sparse = 1;
+    }
+#endif
+    arg.st = NULL;
+    arg.finished = 0;
+
+    /* make sure the volume is still valid before we start opening files */
+    vol_get(v);
+
+    io = rb_io_check_io(target);
+    if (NIL_P(io)) {
+        path = rb_get_path(target);
+        arg.fd = rb_cloexec_open(StringValueCStr(path),
+                                 upload ? O_RDONLY :
+                                 O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (arg.fd < 0) {
+            rb_sys_fail(StringValueCStr(path));
+        }
+        rb_update_max_fd(arg.fd);
+        arg.close_fd = 1;
+    }
+    else {
+        arg.fd = ruby_libvirt_io_fd(io, !upload);
+        arg.close_fd = 0;
+    }
+
+    return rb_ensure(vol_transfer_run, (VALUE)&arg, vol_transfer_cleanup,
+                     (VALUE)&arg);
+}
+
+/*
+ * call-seq:
+ *   vol.download_to(path_or_io, offset=0, length=0, flags=0) -> Fixnum
+ *
+ * Call virStorageVolDownload[http://www.libvirt.org/html/libvirt-libvirt-storage.html#virStorageVolDownload]
+ * to download the content of this volume into path_or_io, which is either the
+ * name of a file (created or truncated as needed) or an IO object open for
+ * writing.  A length of 0 means everything from offset to the end of the
+ * volume.  The data is pumped from libvirt into the file descriptor entirely
+ * in C with the GVL released, so no Ruby objects are created per chunk.  With
+ * Libvirt::StorageVol::DOWNLOAD_SPARSE_STREAM in flags, holes in the volume
+ * are transferred as holes and recreated in the file.  Returns the number of
+ * bytes downloaded, including any holes.
+ */
+static VALUE libvirt_storage_vol_download_to(int argc, VALUE *argv, VALUE v)
+{
+    return vol_transfer(argc, argv, v, 0);
+}
+
+/*
+ * call-seq:
+ *   vol.upload_from(path_or_io, offset=0, length=0, flags=0) -> Fixnum
+ *
+ * Call virStorageVolUpload[http://www.libvirt.org/html/libvirt-libvirt-storage.html#virStorageVolUpload]
+ * to upload new content to this volume from path_or_io, which is either the
+ * name of a file or an IO object open for reading.  A length of 0 means
+ * everything from offset to the end of the volume.  The data is pumped from
+ * the file descriptor into libvirt entirely in C with the GVL released, so no
+ * Ruby objects are created per chunk.  With
+ * Libvirt::StorageVol::UPLOAD_SPARSE_STREAM in flags, holes in the file are
+ * found with SEEK_DATA/SEEK_HOLE and sent as holes rather than as zeros.
+ * Returns the number of bytes uploaded, including any holes.
+ */
+static VALUE libvirt_storage_vol_upload_from(int argc, VALUE *argv, VALUE v)
+{
+    return vol_transfer(argc, argv, v, 1);
 }
 #endif
 
 #if HAVE_VIRSTORAGEVOLWIPEPATTERN
+ruby_libvirt_declare_nogvl3(int, virStorageVolWipePattern,
+                            virStorageVolPtr, unsigned int, unsigned int)
+
 /*
  * call-seq:
  *   vol.wipe_pattern(alg, flags=0) -> nil
@@ -732,14 +1230,17 @@ static VALUE libvirt_storage_vol_wipe_pattern(int argc, VALUE *argv, VALUE v)
 
     rb_scan_args(argc, argv, "11", &alg, &flags);
 
-    ruby_libvirt_generate_call_nil(virStorageVolWipePattern,
-                                   ruby_libvirt_connect_get(v),
-                                   vol_get(v), NUM2UINT(alg),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virStorageVolWipePattern,
+                                         ruby_libvirt_connect_get(v),
+                                         vol_get(v), NUM2UINT(alg),
+                                         ruby_libvirt_value_to_uint(flags));
 }
 #endif
 
 #if HAVE_VIRSTORAGEVOLRESIZE
+ruby_libvirt_declare_nogvl3(int, virStorageVolResize, virStorageVolPtr,
+                            unsigned long long, unsigned int)
+
 /*
  * call-seq:
  *   vol.resize(capacity, flags=0) -> nil
@@ -753,10 +1254,10 @@ static VALUE libvirt_storage_vol_resize(int argc, VALUE *argv, VALUE v)
 
     rb_scan_args(argc, argv, "11", &capacity, &flags);
 
-    ruby_libvirt_generate_call_nil(virStorageVolResize,
-                                   ruby_libvirt_connect_get(v),
-                                   vol_get(v), NUM2ULL(capacity),
-                                   ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_generate_call_nil_nogvl(virStorageVolResize,
+                                         ruby_libvirt_connect_get(v),
+                                         vol_get(v), NUM2ULL(capacity),
+                                         ruby_libvirt_value_to_uint(flags));
 }
 #endif
 
@@ -768,15 +1269,17 @@ void ruby_libvirt_storage_init(void)
 #if HAVE_TYPE_VIRSTORAGEPOOLPTR
     c_storage_pool_info = rb_define_class_under(m_libvirt, "StoragePoolInfo",
                                                 rb_cObject);
-    rb_define_attr(c_storage_pool_info, "state", 1, 0);
-    rb_define_attr(c_storage_pool_info, "capacity", 1, 0);
-    rb_define_attr(c_storage_pool_info, "allocation", 1, 0);
-    rb_define_attr(c_storage_pool_info, "available", 1, 0);
+    rb_define_alloc_func(c_storage_pool_info, pool_info_alloc);
+    rb_define_method(c_storage_pool_info, "state", pool_info_state, 0);
+    rb_define_method(c_storage_pool_info, "capacity", pool_info_capacity, 0);
+    rb_define_method(c_storage_pool_info, "allocation",
+                     pool_info_allocation, 0);
+    rb_define_method(c_storage_pool_info, "available", pool_info_available, 0);
 
     c_storage_pool = rb_define_class_under(m_libvirt, "StoragePool",
                                            rb_cObject);
 
-    rb_define_attr(c_storage_pool, "connection", 1, 0);
+    rb_define_method(c_storage_pool, "connection", ruby_libvirt_handle_connection, 0);
 
     /* virStoragePoolState */
     rb_define_const(c_storage_pool, "INACTIVE",
@@ -867,10 +1370,16 @@ void ruby_libvirt_storage_init(void)
     /* Lookup volumes based on various attributes */
     rb_define_method(c_storage_pool, "lookup_volume_by_name",
                      libvirt_storage_pool_lookup_vol_by_name, 1);
+    rb_define_method(c_storage_pool, "find_volume_by_name",
+                     libvirt_storage_pool_find_vol_by_name, 1);
     rb_define_method(c_storage_pool, "lookup_volume_by_key",
                      libvirt_storage_pool_lookup_vol_by_key, 1);
+    rb_define_method(c_storage_pool, "find_volume_by_key",
+                     libvirt_storage_pool_find_vol_by_key, 1);
     rb_define_method(c_storage_pool, "lookup_volume_by_path",
                      libvirt_storage_pool_lookup_vol_by_path, 1);
+    rb_define_method(c_storage_pool, "find_volume_by_path",
+                     libvirt_storage_pool_find_vol_by_path, 1);
     rb_define_method(c_storage_pool, "free", libvirt_storage_pool_free, 0);
     rb_define_method(c_storage_pool, "create_volume_xml",
                      libvirt_storage_pool_create_volume_xml, -1);
@@ -893,6 +1402,8 @@ void ruby_libvirt_storage_init(void)
 #if HAVE_VIRSTORAGEPOOLLISTALLVOLUMES
     rb_define_method(c_storage_pool, "list_all_volumes",
                      libvirt_storage_pool_list_all_volumes, -1);
+    rb_define_method(c_storage_pool, "volumes_with_info",
+                     libvirt_storage_pool_volumes_with_info, -1);
 #endif
 
 #if HAVE_CONST_VIR_STORAGE_POOL_BUILD_NO_OVERWRITE
@@ -913,13 +1424,28 @@ void ruby_libvirt_storage_init(void)
      */
     c_storage_vol_info = rb_define_class_under(m_libvirt, "StorageVolInfo",
                                                rb_cObject);
-    rb_define_attr(c_storage_vol_info, "type", 1, 0);
-    rb_define_attr(c_storage_vol_info, "capacity", 1, 0);
-    rb_define_attr(c_storage_vol_info, "allocation", 1, 0);
+    rb_define_alloc_func(c_storage_vol_info, vol_info_alloc);
+    rb_define_method(c_storage_vol_info, "type", vol_info_type, 0);
+    rb_define_method(c_storage_vol_info, "capacity", vol_info_capacity, 0);
+    rb_define_method(c_storage_vol_info, "allocation", vol_info_allocation, 0);
 
     c_storage_vol = rb_define_class_under(m_libvirt, "StorageVol",
                                           rb_cObject);
 
+    /*
+     * Class Libvirt::StorageVol::Record
+     */
+    c_storage_vol_record = rb_define_class_under(c_storage_vol, "Record",
+                                                 rb_cObject);
+    rb_define_attr(c_storage_vol_record, "name", 1, 0);
+    rb_define_attr(c_storage_vol_record, "key", 1, 0);
+    rb_define_attr(c_storage_vol_record, "path", 1, 0);
+    rb_define_attr(c_storage_vol_record, "type", 1, 0);
+    rb_define_attr(c_storage_vol_record, "capacity", 1, 0);
+    rb_define_attr(c_storage_vol_record, "allocation", 1, 0);
+    rb_define_attr(c_storage_vol_record, "volume", 1, 0);
+    rb_define_attr(c_storage_vol_record, "error", 1, 0);
+
 #if HAVE_CONST_VIR_STORAGE_XML_INACTIVE
     rb_define_const(c_storage_vol, "XML_INACTIVE",
                     INT2NUM(VIR_STORAGE_XML_INACTIVE));
@@ -1006,6 +1532,18 @@ void ruby_libvirt_storage_init(void)
     rb_define_method(c_storage_vol, "download", libvirt_storage_vol_download,
                      -1);
     rb_define_method(c_storage_vol, "upload", libvirt_storage_vol_upload, -1);
+    rb_define_method(c_storage_vol, "download_to",
+                     libvirt_storage_vol_download_to, -1);
+#if HAVE_CONST_VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM
+    rb_define_const(c_storage_vol, "DOWNLOAD_SPARSE_STREAM",
+                    INT2NUM(VIR_STORAGE_VOL_DOWNLOAD_SPARSE_STREAM));
+#endif
+#if HAVE_CONST_VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM
+    rb_define_const(c_storage_vol, "UPLOAD_SPARSE_STREAM",
+                    INT2NUM(VIR_STORAGE_VOL_UPLOAD_SPARSE_STREAM));
+#endif
+    rb_define_method(c_storage_vol, "upload_from",
+                     libvirt_storage_vol_upload_from, -1);
 #endif
 
 #if HAVE_VIRSTORAGEVOLRESIZE
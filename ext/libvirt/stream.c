@@ -19,7 +19,11 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
 #include <ruby.h>
+#include <ruby/io.h>
 #include <libvirt/libvirt.h>
 #include <libvirt/virterror.h>
 #include "common.h"
@@ -29,10 +33,7 @@
 #if HAVE_TYPE_VIRSTREAMPTR
 static VALUE c_stream;
 
-static void stream_free(void *s)
-{
-    ruby_libvirt_free_struct(Stream, s);
-}
+ruby_libvirt_handle_type(Stream, "Libvirt::Stream")
 
 virStreamPtr ruby_libvirt_stream_get(VALUE s)
 {
@@ -41,27 +42,175 @@ virStreamPtr ruby_libvirt_stream_get(VALUE s)
 
 VALUE ruby_libvirt_stream_new(virStreamPtr s, VALUE conn)
 {
-    return ruby_libvirt_new_class(c_stream, s, conn, stream_free);
+    return ruby_libvirt_new_class(c_stream, &Stream_handle_data_type, s, conn);
+}
+
+ruby_libvirt_declare_nogvl3(int, virStreamSend, virStreamPtr, const char *,
+                            size_t)
+ruby_libvirt_declare_nogvl3(int, virStreamRecv, virStreamPtr, char *, size_t)
+#if HAVE_VIRSTREAMRECVFLAGS
+ruby_libvirt_declare_nogvl4(int, virStreamRecvFlags, virStreamPtr, char *,
+                            size_t, unsigned int)
+#endif
+
+/* Unblocking function for the send and recv calls we make without the GVL.
+ * A blocking stream can sit in virStreamSend or virStreamRecv indefinitely
+ * waiting for the other end, so an interrupt (Thread#raise, Thread#kill,
+ * Ctrl-C) aborts the stream, which wakes the blocked call with an error.
+ * The stream cannot be used for further transfers after that.
+ */
+static void stream_abort_ubf(void *st)
+{
+    virStreamAbort((virStreamPtr)st);
+}
+
+struct stream_buffer_arg {
+    virStreamPtr st;
+    char *data;
+    size_t len;
+    unsigned int flags;
+    int ret;
+};
+
+static VALUE stream_send_buffer_call(VALUE in)
+{
+    struct stream_buffer_arg *arg = (struct stream_buffer_arg *)in;
+    ruby_libvirt_call_nogvl(args, virStreamSend, stream_abort_ubf, arg->st,
+                            arg->st, arg->data, arg->len);
+
+    arg->ret = args.ret;
+
+    return Qnil;
+}
+
+static VALUE stream_recv_buffer_call(VALUE in)
+{
+    struct stream_buffer_arg *arg = (struct stream_buffer_arg *)in;
+
+#if HAVE_VIRSTREAMRECVFLAGS
+    if (arg->flags != 0) {
+        ruby_libvirt_call_nogvl(args, virStreamRecvFlags, stream_abort_ubf,
+                                arg->st, arg->st, arg->data, arg->len,
+                                arg->flags);
+
+        arg->ret = args.ret;
+
+        return Qnil;
+    }
+#endif
+
+    {
+        ruby_libvirt_call_nogvl(args, virStreamRecv, stream_abort_ubf,
+                                arg->st, arg->st, arg->data, arg->len);
+
+        arg->ret = args.ret;
+    }
+
+    return Qnil;
+}
+
+/* Send LEN bytes of the String BUFFER, starting at byte OFFSET, without the
+ * GVL.  The buffer is locked for the duration so that Ruby code running in
+ * other threads cannot modify or free it underneath us.
+ */
+static int stream_send_buffer(virStreamPtr st, VALUE buffer, long offset,
+                              long len)
+{
+    struct stream_buffer_arg arg;
+
+    arg.st = st;
+    arg.data = RSTRING_PTR(buffer) + offset;
+    arg.len = len > INT_MAX ? INT_MAX : len;
+    arg.flags = 0;
+    arg.ret = -1;
+
+    rb_str_locktmp(buffer);
+    rb_ensure(stream_send_buffer_call, (VALUE)&arg, rb_str_unlocktmp, buffer);
+
+    return arg.ret;
+}
+
+/* Receive up to BYTES bytes from the stream straight into the String BUFFER
+ * at byte OFFSET, without the GVL.  The buffer is grown if necessary and, on
+ * success, its length is set to OFFSET plus the number of bytes received.
+ * Non-zero FLAGS are passed on through virStreamRecvFlags.
+ */
+static int stream_recv_buffer(virStreamPtr st, VALUE buffer, long offset,
+                              long bytes, unsigned int flags)
+{
+    struct stream_buffer_arg arg;
+
+    if (bytes > INT_MAX) {
+        bytes = INT_MAX;
+    }
+    if (offset + bytes > RSTRING_LEN(buffer)) {
+        rb_str_modify_expand(buffer, offset + bytes - RSTRING_LEN(buffer));
+    }
+    else {
+        rb_str_modify(buffer);
+    }
+
+    arg.st = st;
+    arg.data = RSTRING_PTR(buffer) + offset;
+    arg.len = bytes;
+    arg.flags = flags;
+    arg.ret = -1;
+
+    rb_str_locktmp(buffer);
+    rb_ensure(stream_recv_buffer_call, (VALUE)&arg, rb_str_unlocktmp, buffer);
+
+    if (arg.ret >= 0) {
+        rb_str_set_len(buffer, offset + arg.ret);
+    }
+
+    return arg.ret;
 }
 
 /*
  * call-seq:
- *   stream.send(buffer) -> Fixnum
+ *   stream.send(buffer, offset=0, length=nil) -> Fixnum
  *
  * Call virStreamSend[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamSend]
- * to send the data in buffer out to the stream.  The return value is the
- * number of bytes sent, which may be less than the size of the buffer.  If
- * an error occurred, -1 is returned.  If the transmit buffers are full and the
- * stream is marked non-blocking, returns -2.
+ * to send the data in buffer out to the stream.  If offset is given, the data
+ * starts at that byte of buffer; if length is given, at most that many bytes
+ * are sent, otherwise everything from offset to the end of buffer is.  This
+ * allows a large buffer to be sent piece by piece without slicing it into new
+ * Strings.  The return value is the number of bytes sent, which may be less
+ * than requested.  If the transmit buffers are full and the stream is marked
+ * non-blocking, returns -2.  If the calling thread is interrupted while
+ * blocked in the send, the stream is aborted.
  */
-static VALUE libvirt_stream_send(VALUE s, VALUE buffer)
+static VALUE libvirt_stream_send(int argc, VALUE *argv, VALUE s)
 {
+    VALUE buffer, offset, length;
+    virStreamPtr st;
+    long off = 0, len;
     int ret;
 
+    rb_scan_args(argc, argv, "12", &buffer, &offset, &length);
+
     StringValue(buffer);
 
-    ret = virStreamSend(ruby_libvirt_stream_get(s), RSTRING_PTR(buffer),
-                        RSTRING_LEN(buffer));
+    if (!NIL_P(offset)) {
+        off = NUM2LONG(offset);
+    }
+    if (off < 0 || off > RSTRING_LEN(buffer)) {
+        rb_raise(rb_eArgError, "offset %ld outside of buffer", off);
+    }
+
+    if (NIL_P(length)) {
+        len = RSTRING_LEN(buffer) - off;
+    }
+    else {
+        len = NUM2LONG(length);
+        if (len < 0 || len > RSTRING_LEN(buffer) - off) {
+            rb_raise(rb_eArgError, "length %ld outside of buffer", len);
+        }
+    }
+
+    st = ruby_libvirt_stream_get(s);
+
+    ret = stream_send_buffer(st, buffer, off, len);
     ruby_libvirt_raise_error_if(ret == -1, e_RetrieveError, "virStreamSend",
                                 ruby_libvirt_connect_get(s));
 
@@ -77,28 +226,134 @@ static VALUE libvirt_stream_send(VALUE s, VALUE buffer)
  * array with two elements; the return code from the virStreamRecv call and
  * the data (as a String) read from the stream.  If an error occurred, the
  * return_value is set to -1.  If there is no data pending and the stream is
- * marked as non-blocking, return_value is set to -2.
+ * marked as non-blocking, return_value is set to -2.  If the calling thread
+ * is interrupted while blocked in the receive, the stream is aborted.  See
+ * stream.recv_into for a variant that reuses a caller-supplied buffer.
  */
 static VALUE libvirt_stream_recv(VALUE s, VALUE bytes)
 {
-    char *data;
-    int ret;
-    VALUE result;
+    VALUE data, result;
+    virStreamPtr st;
+    int ret, len;
 
-    data = alloca(sizeof(char) * NUM2INT(bytes));
+    len = NUM2INT(bytes);
+    if (len < 0) {
+        rb_raise(rb_eArgError, "negative number of bytes (%d)", len);
+    }
+
+    st = ruby_libvirt_stream_get(s);
+    data = rb_str_buf_new(len);
 
-    ret = virStreamRecv(ruby_libvirt_stream_get(s), data, NUM2INT(bytes));
+    ret = stream_recv_buffer(st, data, 0, len, 0);
     ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError, "virStreamRecv",
                                 ruby_libvirt_connect_get(s));
 
     result = rb_ary_new2(2);
 
     rb_ary_store(result, 0, INT2NUM(ret));
-    rb_ary_store(result, 1, rb_str_new(data, ret));
+    rb_ary_store(result, 1, data);
 
     return result;
 }
 
+/*
+ * call-seq:
+ *   stream.recv_into(buffer, offset=0, bytes=nil) -> Fixnum
+ *
+ * Call virStreamRecv[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamRecv]
+ * to receive data from the stream directly into the String buffer, starting
+ * at byte offset.  Up to bytes bytes are received; if bytes is not given, the
+ * spare capacity of buffer after offset is used, so a buffer created with
+ * String.new(capacity: n) can be reused for every call without any further
+ * allocation.  On return buffer is truncated to offset plus the number of
+ * bytes received.  The return value is the number of bytes received, 0 at the
+ * end of the stream, or -2 if there is no data pending and the stream is
+ * marked as non-blocking.  As for stream.recv, an interrupt while blocked
+ * aborts the stream.
+ */
+static VALUE libvirt_stream_recv_into(int argc, VALUE *argv, VALUE s)
+{
+    VALUE buffer, offset, bytes;
+    virStreamPtr st;
+    long off = 0, len;
+    int ret;
+
+    rb_scan_args(argc, argv, "12", &buffer, &offset, &bytes);
+
+    StringValue(buffer);
+
+    if (!NIL_P(offset)) {
+        off = NUM2LONG(offset);
+    }
+    if (off < 0 || off > RSTRING_LEN(buffer)) {
+        rb_raise(rb_eArgError, "offset %ld outside of buffer", off);
+    }
+
+    if (NIL_P(bytes)) {
+        len = rb_str_capacity(buffer) - off;
+        if (len <= 0) {
+            rb_raise(rb_eArgError,
+                     "no room in buffer after offset %ld (pass bytes)", off);
+        }
+    }
+    else {
+        len = NUM2LONG(bytes);
+        if (len < 0) {
+            rb_raise(rb_eArgError, "negative number of bytes (%ld)", len);
+        }
+    }
+
+    st = ruby_libvirt_stream_get(s);
+
+    ret = stream_recv_buffer(st, buffer, off, len, 0);
+    ruby_libvirt_raise_error_if(ret == -1, e_RetrieveError, "virStreamRecv",
+                                ruby_libvirt_connect_get(s));
+
+    return INT2NUM(ret);
+}
+
+#if HAVE_VIRSTREAMRECVFLAGS
+/*
+ * call-seq:
+ *   stream.recv_flags(bytes, flags=0) -> [return_value, data]
+ *
+ * Call virStreamRecvFlags[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamRecvFlags]
+ * to receive up to bytes amount of data from the stream.  The return is the
+ * same as for stream.recv, except that with Libvirt::Stream::RECV_STOP_AT_HOLE
+ * in flags, a return_value of -3 means that the stream is at a hole, whose
+ * length can be retrieved with stream.recv_hole.
+ */
+static VALUE libvirt_stream_recv_flags(int argc, VALUE *argv, VALUE s)
+{
+    VALUE bytes, flags, data, result;
+    virStreamPtr st;
+    int ret, len;
+
+    rb_scan_args(argc, argv, "11", &bytes, &flags);
+
+    len = NUM2INT(bytes);
+    if (len < 0) {
+        rb_raise(rb_eArgError, "negative number of bytes (%d)", len);
+    }
+
+    st = ruby_libvirt_stream_get(s);
+    data = rb_str_buf_new(len);
+
+    ret = stream_recv_buffer(st, data, 0, len,
+                             ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_raise_error_if(ret == -1, e_RetrieveError,
+                                "virStreamRecvFlags",
+                                ruby_libvirt_connect_get(s));
+
+    result = rb_ary_new2(2);
+
+    rb_ary_store(result, 0, INT2NUM(ret));
+    rb_ary_store(result, 1, data);
+
+    return result;
+}
+#endif
+
 static int internal_sendall(virStreamPtr RUBY_LIBVIRT_UNUSED(st), char *data,
                             size_t nbytes, void *opaque)
 {
@@ -177,6 +432,13 @@ static int internal_recvall(virStreamPtr RUBY_LIBVIRT_UNUSED(st),
         rb_raise(rb_eArgError, "wrong type (expected an integer)");
     }
 
+    /* libvirt wants to know how much of the data was consumed, and keeps
+     * calling us with the remainder; the block returns 0 for "all of it"
+     */
+    if (NUM2INT(result) == 0) {
+        return nbytes;
+    }
+
     return NUM2INT(result);
 }
 
@@ -209,10 +471,642 @@ static VALUE libvirt_stream_recvall(int argc, VALUE *argv, VALUE s)
     return Qnil;
 }
 
-static void stream_event_callback(virStreamPtr st, int events, void *opaque)
+#if HAVE_VIRSTREAMSPARSERECVALL || HAVE_VIRSTREAMSPARSESENDALL
+struct stream_sparse_arg {
+    VALUE opaque;
+    VALUE hole_handler;
+    VALUE skip_handler;
+};
+
+static void stream_check_handler(VALUE handler)
+{
+    if (!rb_respond_to(handler, rb_intern("call"))) {
+        rb_raise(rb_eTypeError,
+                 "wrong argument type (expected Proc or Method)");
+    }
+}
+#endif
+
+#if HAVE_VIRSTREAMSPARSERECVALL
+static int internal_sparse_recvall(virStreamPtr st, const char *buf,
+                                   size_t nbytes, void *opaque)
+{
+    struct stream_sparse_arg *arg = (struct stream_sparse_arg *)opaque;
+
+    return internal_recvall(st, buf, nbytes, (void *)arg->opaque);
+}
+
+static int internal_sparse_recvall_hole(virStreamPtr RUBY_LIBVIRT_UNUSED(st),
+                                        long long length, void *opaque)
+{
+    struct stream_sparse_arg *arg = (struct stream_sparse_arg *)opaque;
+
+    return NUM2INT(rb_funcall(arg->hole_handler, rb_intern("call"), 2,
+                              LL2NUM(length), arg->opaque));
+}
+
+/*
+ * call-seq:
+ *   stream.sparse_recvall(hole_handler, opaque=nil){|data, opaque| receive block} -> nil
+ *
+ * Call virStreamSparseRecvAll[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamSparseRecvAll]
+ * to receive the entire data stream, preserving any holes in it.  The receive
+ * block is called for each chunk of data, exactly as for stream.recvall.
+ * Instead of being handed runs of zeros, hole_handler (a Proc or Method) is
+ * called with the length of each hole and the opaque data; it should return
+ * -1 if an error occurred and 0 otherwise.  This is typically used with
+ * Libvirt::StorageVol::DOWNLOAD_SPARSE_STREAM, so that downloading a sparse
+ * volume only moves the allocated data.
+ */
+static VALUE libvirt_stream_sparse_recvall(int argc, VALUE *argv, VALUE s)
+{
+    struct stream_sparse_arg arg;
+    int ret;
+
+    if (!rb_block_given_p()) {
+        rb_raise(rb_eRuntimeError, "A block must be provided");
+    }
+
+    arg.opaque = RUBY_Qnil;
+    arg.skip_handler = RUBY_Qnil;
+    rb_scan_args(argc, argv, "11", &arg.hole_handler, &arg.opaque);
+
+    stream_check_handler(arg.hole_handler);
+
+    ret = virStreamSparseRecvAll(ruby_libvirt_stream_get(s),
+                                 internal_sparse_recvall,
+                                 internal_sparse_recvall_hole, &arg);
+    ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError,
+                                "virStreamSparseRecvAll",
+                                ruby_libvirt_connect_get(s));
+
+    return Qnil;
+}
+#endif
+
+#if HAVE_VIRSTREAMSPARSESENDALL
+static int internal_sparse_sendall(virStreamPtr st, char *data, size_t nbytes,
+                                   void *opaque)
+{
+    struct stream_sparse_arg *arg = (struct stream_sparse_arg *)opaque;
+
+    return internal_sendall(st, data, nbytes, (void *)arg->opaque);
+}
+
+static int internal_sparse_sendall_hole(virStreamPtr RUBY_LIBVIRT_UNUSED(st),
+                                        int *inData, long long *length,
+                                        void *opaque)
 {
-    VALUE passthrough = (VALUE)opaque;
-    VALUE cb, cb_opaque, news, s;
+    struct stream_sparse_arg *arg = (struct stream_sparse_arg *)opaque;
+    VALUE result;
+
+    result = rb_funcall(arg->hole_handler, rb_intern("call"), 1, arg->opaque);
+
+    if (TYPE(result) != T_ARRAY) {
+        rb_raise(rb_eTypeError, "wrong type (expected Array)");
+    }
+
+    if (RARRAY_LEN(result) != 2) {
+        rb_raise(rb_eArgError, "wrong number of arguments (%ld for 2)",
+                 RARRAY_LEN(result));
+    }
+
+    *inData = RTEST(rb_ary_entry(result, 0));
+    *length = NUM2LL(rb_ary_entry(result, 1));
+
+    return 0;
+}
+
+static int internal_sparse_sendall_skip(virStreamPtr RUBY_LIBVIRT_UNUSED(st),
+                                        long long length, void *opaque)
+{
+    struct stream_sparse_arg *arg = (struct stream_sparse_arg *)opaque;
+
+    return NUM2INT(rb_funcall(arg->skip_handler, rb_intern("call"), 2,
+                              LL2NUM(length), arg->opaque));
+}
+
+/*
+ * call-seq:
+ *   stream.sparse_sendall(hole_handler, skip_handler, opaque=nil){|opaque, nbytes| send block} -> nil
+ *
+ * Call virStreamSparseSendAll[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamSparseSendAll]
+ * to send the entire data stream, preserving any holes in it.  The send block
+ * is called to produce each chunk of data, exactly as for stream.sendall.
+ * Before each section, hole_handler (a Proc or Method) is called with the
+ * opaque data to find out where the source currently is; it should return an
+ * array of 2 elements, whether the current position is in data (true) or in a
+ * hole (false), and how many bytes remain in that section.  When a hole is
+ * sent, skip_handler is called with the length of the hole and the opaque
+ * data so that the source can move past it; it should return -1 if an error
+ * occurred and 0 otherwise.  This is typically used with
+ * Libvirt::StorageVol::UPLOAD_SPARSE_STREAM.
+ */
+static VALUE libvirt_stream_sparse_sendall(int argc, VALUE *argv, VALUE s)
+{
+    struct stream_sparse_arg arg;
+    int ret;
+
+    if (!rb_block_given_p()) {
+        rb_raise(rb_eRuntimeError, "A block must be provided");
+    }
+
+    arg.opaque = RUBY_Qnil;
+    rb_scan_args(argc, argv, "21", &arg.hole_handler, &arg.skip_handler,
+                 &arg.opaque);
+
+    stream_check_handler(arg.hole_handler);
+    stream_check_handler(arg.skip_handler);
+
+    ret = virStreamSparseSendAll(ruby_libvirt_stream_get(s),
+                                 internal_sparse_sendall,
+                                 internal_sparse_sendall_hole,
+                                 internal_sparse_sendall_skip, &arg);
+    ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError,
+                                "virStreamSparseSendAll",
+                                ruby_libvirt_connect_get(s));
+
+    return Qnil;
+}
+#endif
+
+#if HAVE_VIRSTREAMRECVHOLE
+/*
+ * call-seq:
+ *   stream.recv_hole(flags=0) -> Fixnum
+ *
+ * Call virStreamRecvHole[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamRecvHole]
+ * to retrieve the length of the hole that stream.recv_flags (with
+ * Libvirt::Stream::RECV_STOP_AT_HOLE) stopped at.
+ */
+static VALUE libvirt_stream_recv_hole(int argc, VALUE *argv, VALUE s)
+{
+    VALUE flags;
+    long long length;
+    int ret;
+
+    rb_scan_args(argc, argv, "01", &flags);
+
+    ret = virStreamRecvHole(ruby_libvirt_stream_get(s), &length,
+                            ruby_libvirt_value_to_uint(flags));
+    ruby_libvirt_raise_error_if(ret < 0, e_RetrieveError, "virStreamRecvHole",
+                                ruby_libvirt_connect_get(s));
+
+    return LL2NUM(length);
+}
+#endif
+
+#if HAVE_VIRSTREAMSENDHOLE
+/*
+ * call-seq:
+ *   stream.send_hole(length, flags=0) -> nil
+ *
+ * Call virStreamSendHole[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamSendHole]
+ * to send a hole of length bytes down the stream, rather than that many
+ * zeros.
+ */
+static VALUE libvirt_stream_send_hole(int argc, VALUE *argv, VALUE s)
+{
+    VALUE length, flags;
+
+    rb_scan_args(argc, argv, "11", &length, &flags);
+
+    ruby_libvirt_generate_call_nil(virStreamSendHole,
+                                   ruby_libvirt_connect_get(s),
+                                   ruby_libvirt_stream_get(s), NUM2LL(length),
+                                   ruby_libvirt_value_to_uint(flags));
+}
+#endif
+
+/* Return the file descriptor behind the IO object io, checked to be open for
+ * writing (or reading).  Since data is then going to move through the
+ * descriptor directly, anything Ruby has buffered for writing is flushed
+ * first, and an IO with buffered read data is rejected.
+ */
+int ruby_libvirt_io_fd(VALUE io, int writing)
+{
+    rb_io_t *fptr;
+
+    io = rb_io_get_io(io);
+    if (writing) {
+        io = rb_io_get_write_io(io);
+    }
+
+    GetOpenFile(io, fptr);
+    if (writing) {
+        rb_io_check_writable(fptr);
+        rb_io_flush(io);
+    }
+    else {
+        rb_io_check_readable(fptr);
+        if (rb_io_read_pending(fptr)) {
+            rb_raise(rb_eIOError, "IO has buffered data that would be skipped");
+        }
+    }
+
+#if HAVE_RB_IO_DESCRIPTOR
+    return rb_io_descriptor(io);
+#else
+    return fptr->fd;
+#endif
+}
+
+struct stream_fd_arg {
+    virStreamPtr st;
+    int fd;
+    int sparse;
+    int ret;
+    int err;
+    int pending_hole;
+    volatile int cancelled;
+    unsigned long long bytes;
+};
+
+static int stream_fd_write(struct stream_fd_arg *arg, const char *buf,
+                           size_t nbytes)
+{
+    size_t done = 0;
+    ssize_t r;
+
+    while (done < nbytes) {
+        if (arg->cancelled) {
+            arg->err = EINTR;
+            return -1;
+        }
+        r = write(arg->fd, buf + done, nbytes - done);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            arg->err = errno;
+            return -1;
+        }
+        done += r;
+    }
+
+    return 0;
+}
+
+static int stream_fd_sink(virStreamPtr RUBY_LIBVIRT_UNUSED(st),
+                          const char *buf, size_t nbytes, void *opaque)
+{
+    struct stream_fd_arg *arg = (struct stream_fd_arg *)opaque;
+
+    if (stream_fd_write(arg, buf, nbytes) < 0) {
+        return -1;
+    }
+
+    arg->pending_hole = 0;
+    arg->bytes += nbytes;
+
+    return nbytes;
+}
+
+static int stream_fd_source(virStreamPtr RUBY_LIBVIRT_UNUSED(st), char *buf,
+                            size_t nbytes, void *opaque)
+{
+    struct stream_fd_arg *arg = (struct stream_fd_arg *)opaque;
+    ssize_t r;
+
+    do {
+        if (arg->cancelled) {
+            arg->err = EINTR;
+            return -1;
+        }
+        r = read(arg->fd, buf, nbytes);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        arg->err = errno;
+        return -1;
+    }
+
+    arg->bytes += r;
+
+    return r;
+}
+
+#if HAVE_VIRSTREAMSPARSERECVALL
+/* a hole arrived: seek past it, leaving a hole in the file, or write out
+ * zeros if the descriptor isn't seekable
+ */
+static int stream_fd_sink_hole(virStreamPtr RUBY_LIBVIRT_UNUSED(st),
+                               long long length, void *opaque)
+{
+    struct stream_fd_arg *arg = (struct stream_fd_arg *)opaque;
+    static const char zeros[65536];
+    long long left;
+
+    if (lseek(arg->fd, length, SEEK_CUR) < 0) {
+        if (errno != ESPIPE) {
+            arg->err = errno;
+            return -1;
+        }
+        for (left = length; left > 0; left -= sizeof(zeros)) {
+            if (stream_fd_write(arg, zeros, left < (long long)sizeof(zeros) ?
+                                (size_t)left : sizeof(zeros)) < 0) {
+                return -1;
+            }
+        }
+    }
+    else {
+        arg->pending_hole = 1;
+    }
+
+    arg->bytes += length;
+
+    return 0;
+}
+#endif
+
+#if HAVE_VIRSTREAMSPARSESENDALL
+/* find out whether the file position is in data or in a hole, and how far
+ * it extends; descriptors that can't tell are treated as all data
+ */
+static int stream_fd_in_data(virStreamPtr RUBY_LIBVIRT_UNUSED(st),
+                             int *inData, long long *length, void *opaque)
+{
+    struct stream_fd_arg *arg = (struct stream_fd_arg *)opaque;
+    off_t cur, end;
+#ifdef SEEK_DATA
+    off_t next;
+#endif
+
+    cur = lseek(arg->fd, 0, SEEK_CUR);
+    if (cur < 0) {
+        if (errno != ESPIPE) {
+            goto error;
+        }
+        /* a pipe or socket; read() will tell us when we get to the end */
+        *inData = 1;
+        *length = LLONG_MAX;
+        return 0;
+    }
+
+    end = lseek(arg->fd, 0, SEEK_END);
+    if (end < 0) {
+        goto error;
+    }
+
+    *inData = cur < end;
+    *length = end - cur;
+
+#ifdef SEEK_DATA
+    if (cur < end) {
+        next = lseek(arg->fd, cur, SEEK_DATA);
+        if (next < 0) {
+            if (errno == ENXIO) {
+                /* nothing but hole from here to the end */
+                *inData = 0;
+            }
+            else if (errno != EINVAL && errno != EOPNOTSUPP) {
+                goto error;
+            }
+        }
+        else if (next > cur) {
+            *inData = 0;
+            *length = next - cur;
+        }
+        else {
+            next = lseek(arg->fd, cur, SEEK_HOLE);
+            if (next < 0) {
+                goto error;
+            }
+            *length = next - cur;
+        }
+    }
+#endif
+
+    if (lseek(arg->fd, cur, SEEK_SET) < 0) {
+        goto error;
+    }
+
+    return 0;
+
+error:
+    arg->err = errno;
+    return -1;
+}
+
+static int stream_fd_skip(virStreamPtr RUBY_LIBVIRT_UNUSED(st),
+                          long long length, void *opaque)
+{
+    struct stream_fd_arg *arg = (struct stream_fd_arg *)opaque;
+
+    if (lseek(arg->fd, length, SEEK_CUR) < 0) {
+        arg->err = errno;
+        return -1;
+    }
+
+    arg->bytes += length;
+
+    return 0;
+}
+#endif
+
+static void *stream_recvall_fd_nogvl(void *p)
+{
+    struct stream_fd_arg *arg = (struct stream_fd_arg *)p;
+    off_t end;
+
+#if HAVE_VIRSTREAMSPARSERECVALL
+    if (arg->sparse) {
+        arg->ret = virStreamSparseRecvAll(arg->st, stream_fd_sink,
+                                          stream_fd_sink_hole, arg);
+    }
+    else
+#endif
+    {
+        arg->ret = virStreamRecvAll(arg->st, stream_fd_sink, arg);
+    }
+
+    /* a trailing hole only moved the file position; make the file that big */
+    if (arg->ret == 0 && arg->pending_hole) {
+        end = lseek(arg->fd, 0, SEEK_CUR);
+        if (end < 0 || ftruncate(arg->fd, end) < 0) {
+            arg->err = errno;
+            arg->ret = -1;
+        }
+    }
+
+    return NULL;
+}
+
+static void *stream_sendall_fd_nogvl(void *p)
+{
+    struct stream_fd_arg *arg = (struct stream_fd_arg *)p;
+
+#if HAVE_VIRSTREAMSPARSESENDALL
+    if (arg->sparse) {
+        arg->ret = virStreamSparseSendAll(arg->st, stream_fd_source,
+                                          stream_fd_in_data, stream_fd_skip,
+                                          arg);
+        return NULL;
+    }
+#endif
+
+    arg->ret = virStreamSendAll(arg->st, stream_fd_source, arg);
+
+    return NULL;
+}
+
+/* called from another thread if the Ruby thread is interrupted.  The
+ * transfer notices the flag the next time it goes to touch the file
+ * descriptor, but it may be blocked in libvirt waiting for the other end
+ * instead, so the stream is aborted as well, as stream_abort_ubf() does
+ */
+static void stream_fd_cancel(void *p)
+{
+    struct stream_fd_arg *arg = (struct stream_fd_arg *)p;
+
+    arg->cancelled = 1;
+    virStreamAbort(arg->st);
+}
+
+static unsigned long long stream_fd_transfer(virStreamPtr st, int fd,
+                                             int sending, int sparse,
+                                             virConnectPtr conn)
+{
+    struct stream_fd_arg arg;
+    const char *func;
+
+#if !HAVE_VIRSTREAMSPARSERECVALL
+    if (sparse && !sending) {
+        rb_raise(rb_eNotImpError, "virStreamSparseRecvAll is not available");
+    }
+#endif
+#if !HAVE_VIRSTREAMSPARSESENDALL
+    if (sparse && sending) {
+        rb_raise(rb_eNotImpError, "virStreamSparseSendAll is not available");
+    }
+#endif
+
+    arg.st = st;
+    arg.fd = fd;
+    arg.sparse = sparse;
+    arg.ret = -1;
+    arg.err = 0;
+    arg.pending_hole = 0;
+    arg.cancelled = 0;
+    arg.bytes = 0;
+
+    ruby_libvirt_without_gvl(sending ? stream_sendall_fd_nogvl :
+                             stream_recvall_fd_nogvl, &arg, stream_fd_cancel,
+                             &arg);
+
+    /* the failure is only the result of the interrupt, so raise that */
+    if (arg.cancelled) {
+        rb_thread_check_ints();
+    }
+
+    if (arg.ret < 0 && arg.err != 0) {
+        errno = arg.err;
+        rb_sys_fail(sending ? "read" : "write");
+    }
+
+    if (sending) {
+        func = sparse ? "virStreamSparseSendAll" : "virStreamSendAll";
+    }
+    else {
+        func = sparse ? "virStreamSparseRecvAll" : "virStreamRecvAll";
+    }
+    ruby_libvirt_raise_error_if(arg.ret < 0, e_RetrieveError, func, conn);
+
+    return arg.bytes;
+}
+
+/* Receive the whole of stream st into fd, without the GVL, and return the
+ * number of bytes written.  If sparse is set, holes in the stream are
+ * recreated as holes in the file.  On failure the stream has already been
+ * aborted.
+ */
+unsigned long long ruby_libvirt_stream_recvall_fd(virStreamPtr st, int fd,
+                                                  int sparse,
+                                                  virConnectPtr conn)
+{
+    return stream_fd_transfer(st, fd, 0, sparse, conn);
+}
+
+/* Send everything that can be read from fd down stream st, without the GVL,
+ * and return the number of bytes sent.  If sparse is set, holes in the file
+ * are sent as holes.  On failure the stream has already been aborted.
+ */
+unsigned long long ruby_libvirt_stream_sendall_fd(virStreamPtr st, int fd,
+                                                  int sparse,
+                                                  virConnectPtr conn)
+{
+    return stream_fd_transfer(st, fd, 1, sparse, conn);
+}
+
+/*
+ * call-seq:
+ *   stream.recvall_to_io(io, sparse=false) -> Fixnum
+ *
+ * Call virStreamRecvAll[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamRecvAll]
+ * to receive the entire data stream and write it to the IO object io.  Unlike
+ * stream.recvall, the data is copied from the stream to the file descriptor
+ * behind io entirely in C with the GVL released, so no Ruby objects are
+ * created per chunk.  If sparse is true, virStreamSparseRecvAll[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamSparseRecvAll]
+ * is used instead, and holes in the stream are left as holes in the file.
+ * Returns the number of bytes written, including any holes.
+ */
+static VALUE libvirt_stream_recvall_to_io(int argc, VALUE *argv, VALUE s)
+{
+    VALUE io, sparse;
+    unsigned long long bytes;
+    int fd;
+
+    rb_scan_args(argc, argv, "11", &io, &sparse);
+
+    fd = ruby_libvirt_io_fd(io, 1);
+    bytes = ruby_libvirt_stream_recvall_fd(ruby_libvirt_stream_get(s), fd,
+                                           RTEST(sparse),
+                                           ruby_libvirt_connect_get(s));
+    RB_GC_GUARD(io);
+
+    return ULL2NUM(bytes);
+}
+
+/*
+ * call-seq:
+ *   stream.sendall_from_io(io, sparse=false) -> Fixnum
+ *
+ * Call virStreamSendAll[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamSendAll]
+ * to send everything that can be read from the IO object io down the stream.
+ * Unlike stream.sendall, the data is copied from the file descriptor behind io
+ * entirely in C with the GVL released, so no Ruby objects are created per
+ * chunk.  If sparse is true, virStreamSparseSendAll[http://www.libvirt.org/html/libvirt-libvirt-stream.html#virStreamSparseSendAll]
+ * is used instead, and holes in the file are sent as holes rather than as
+ * zeros.  Returns the number of bytes sent, including any holes.
+ */
+static VALUE libvirt_stream_sendall_from_io(int argc, VALUE *argv, VALUE s)
+{
+    VALUE io, sparse;
+    unsigned long long bytes;
+    int fd;
+
+    rb_scan_args(argc, argv, "11", &io, &sparse);
+
+    fd = ruby_libvirt_io_fd(io, 0);
+    bytes = ruby_libvirt_stream_sendall_fd(ruby_libvirt_stream_get(s), fd,
+                                           RTEST(sparse),
+                                           ruby_libvirt_connect_get(s));
+    RB_GC_GUARD(io);
+
+    return ULL2NUM(bytes);
+}
+
+struct stream_event_arg {
+    virStreamPtr st;
+    int events;
+    void *opaque;
+};
+
+static void *stream_event_deliver(void *p)
+{
+    struct stream_event_arg *ev = (struct stream_event_arg *)p;
+    VALUE passthrough = (VALUE)ev->opaque;
+    VALUE cb, s, argv[3];
 
     if (TYPE(passthrough) != T_ARRAY) {
         rb_raise(rb_eTypeError,
@@ -225,21 +1119,28 @@ static void stream_event_callback(virStreamPtr st, int events, void *opaque)
     }
 
     cb = rb_ary_entry(passthrough, 0);
-    cb_opaque = rb_ary_entry(passthrough, 1);
     s = rb_ary_entry(passthrough, 2);
 
-    news = ruby_libvirt_stream_new(st, ruby_libvirt_conn_attr(s));
-    if (strcmp(rb_obj_classname(cb), "Symbol") == 0) {
-        rb_funcall(rb_class_of(cb), rb_to_id(cb), 3, news, INT2NUM(events),
-                   cb_opaque);
-    }
-    else if (strcmp(rb_obj_classname(cb), "Proc") == 0) {
-        rb_funcall(cb, rb_intern("call"), 3, news, INT2NUM(events), cb_opaque);
-    }
-    else {
-        rb_raise(rb_eTypeError,
-                 "wrong stream event callback (expected Symbol or Proc)");
-    }
+    /* hand back the Stream that registered the callback, rather than a
+     * new wrapper (which would also virStreamFree the stream when it was
+     * collected)
+     */
+    argv[0] = s;
+    argv[1] = INT2NUM(ev->events);
+    argv[2] = rb_ary_entry(passthrough, 1);
+    ruby_libvirt_event_callback_call(cb, "stream event", 3, argv);
+
+    return NULL;
+}
+
+static void stream_event_callback(virStreamPtr st, int events, void *opaque)
+{
+    struct stream_event_arg ev;
+
+    ev.st = st;
+    ev.events = events;
+    ev.opaque = opaque;
+    ruby_libvirt_event_callback_enter(stream_event_deliver, &ev);
 }
 
 /*
@@ -255,7 +1156,9 @@ static void stream_event_callback(virStreamPtr st, int events, void *opaque)
  * The callback should accept 3 parameters: a pointer to the Stream object
  * itself, the integer that represents the events that actually occurred, and
  * an opaque pointer that was (optionally) passed into
- * stream.event_add_callback to begin with.
+ * stream.event_add_callback to begin with.  The callback is run by the event
+ * loop, which belongs to the main Ractor, so this can only be called from
+ * there.
  */
 static VALUE libvirt_stream_event_add_callback(int argc, VALUE *argv, VALUE s)
 {
@@ -268,6 +1171,7 @@ static VALUE libvirt_stream_event_add_callback(int argc, VALUE *argv, VALUE s)
         rb_raise(rb_eTypeError,
                  "wrong argument type (expected Symbol or Proc)");
     }
+    ruby_libvirt_main_ractor_only("Stream#event_add_callback");
 
     passthrough = rb_ary_new2(3);
     rb_ary_store(passthrough, 0, callback);
@@ -364,7 +1268,7 @@ void ruby_libvirt_stream_init(void)
 #if HAVE_TYPE_VIRSTREAMPTR
     c_stream = rb_define_class_under(m_libvirt, "Stream", rb_cObject);
 
-    rb_define_attr(c_stream, "connection", 1, 0);
+    rb_define_method(c_stream, "connection", ruby_libvirt_handle_connection, 0);
 
     rb_define_const(c_stream, "NONBLOCK", INT2NUM(VIR_STREAM_NONBLOCK));
     rb_define_const(c_stream, "EVENT_READABLE",
@@ -374,10 +1278,36 @@ void ruby_libvirt_stream_init(void)
     rb_define_const(c_stream, "EVENT_ERROR", INT2NUM(VIR_STREAM_EVENT_ERROR));
     rb_define_const(c_stream, "EVENT_HANGUP", INT2NUM(VIR_STREAM_EVENT_HANGUP));
 
-    rb_define_method(c_stream, "send", libvirt_stream_send, 1);
+    rb_define_method(c_stream, "send", libvirt_stream_send, -1);
     rb_define_method(c_stream, "recv", libvirt_stream_recv, 1);
+    rb_define_method(c_stream, "recv_into", libvirt_stream_recv_into, -1);
     rb_define_method(c_stream, "sendall", libvirt_stream_sendall, -1);
     rb_define_method(c_stream, "recvall", libvirt_stream_recvall, -1);
+    rb_define_method(c_stream, "recvall_to_io", libvirt_stream_recvall_to_io,
+                     -1);
+    rb_define_method(c_stream, "sendall_from_io",
+                     libvirt_stream_sendall_from_io, -1);
+#if HAVE_VIRSTREAMRECVFLAGS
+    rb_define_method(c_stream, "recv_flags", libvirt_stream_recv_flags, -1);
+#endif
+#if HAVE_CONST_VIR_STREAM_RECV_STOP_AT_HOLE
+    rb_define_const(c_stream, "RECV_STOP_AT_HOLE",
+                    INT2NUM(VIR_STREAM_RECV_STOP_AT_HOLE));
+#endif
+#if HAVE_VIRSTREAMRECVHOLE
+    rb_define_method(c_stream, "recv_hole", libvirt_stream_recv_hole, -1);
+#endif
+#if HAVE_VIRSTREAMSENDHOLE
+    rb_define_method(c_stream, "send_hole", libvirt_stream_send_hole, -1);
+#endif
+#if HAVE_VIRSTREAMSPARSERECVALL
+    rb_define_method(c_stream, "sparse_recvall", libvirt_stream_sparse_recvall,
+                     -1);
+#endif
+#if HAVE_VIRSTREAMSPARSESENDALL
+    rb_define_method(c_stream, "sparse_sendall", libvirt_stream_sparse_sendall,
+                     -1);
+#endif
 
     rb_define_method(c_stream, "event_add_callback",
                      libvirt_stream_event_add_callback, -1);
@@ -6,4 +6,12 @@ void ruby_libvirt_stream_init(void);
 VALUE ruby_libvirt_stream_new(virStreamPtr s, VALUE conn);
 virStreamPtr ruby_libvirt_stream_get(VALUE s);
 
+int ruby_libvirt_io_fd(VALUE io, int writing);
+unsigned long long ruby_libvirt_stream_recvall_fd(virStreamPtr st, int fd,
+                                                  int sparse,
+                                                  virConnectPtr conn);
+unsigned long long ruby_libvirt_stream_sendall_fd(virStreamPtr st, int fd,
+                                                  int sparse,
+                                                  virConnectPtr conn);
+
 #endif
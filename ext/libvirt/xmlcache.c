@@ -0,0 +1,623 @@
+/*
+ * xmlcache.c: event-invalidated cache of xml_desc results
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <ruby.h>
+#include <libvirt/libvirt.h>
+#include <libvirt/virterror.h>
+#include "common.h"
+#include "connect.h"
+#include "domain.h"
+#include "extconf.h"
+#include "xmlcache.h"
+
+#if RUBY_LIBVIRT_XML_CACHE
+/* The cache is split in two.  The generations live in a malloc'd core that
+ * the libvirt event callbacks (which may run on a thread without the GVL)
+ * bump under its lock: every object hashes to one of XML_CACHE_BUCKETS
+ * counters per kind, and each kind has one more counter that invalidates
+ * all of its objects.  The cached Strings live in an open-addressed table
+ * in the Ruby object, only touched with the GVL held, each stored with the
+ * generation that was current before the XML was fetched; an entry is good
+ * for as long as that generation hasn't moved.  Sharing a bucket between
+ * objects only means the occasional extra fetch.
+ */
+#define XML_CACHE_BUCKETS 1024
+
+struct xml_cache_core {
+    pthread_mutex_t lock;
+    int refs;
+    virConnectPtr conn;
+    unsigned long generations[RUBY_LIBVIRT_XML_NKINDS][XML_CACHE_BUCKETS];
+    unsigned long all[RUBY_LIBVIRT_XML_NKINDS];
+    unsigned long long invalidations;
+};
+
+struct xml_cache_entry {
+    char *key;
+    int kind;
+    unsigned int flags;
+    unsigned long generation;
+    VALUE xml;
+};
+
+struct xml_cache {
+    struct xml_cache_core *core;
+    struct xml_cache_entry *entries;
+    long capacity;
+    long nentries;
+    long max_entries;
+    unsigned long long hits;
+    unsigned long long misses;
+    int domain_ids[8];
+    int ndomain_ids;
+    int network_id;
+};
+
+static ID id_xml_cache;
+
+static unsigned long xml_cache_hash(const char *key)
+{
+    unsigned long h = 2166136261UL;
+
+    while (*key) {
+        h = (h ^ (unsigned char)*key++) * 16777619UL;
+    }
+
+    return h;
+}
+
+static void xml_cache_core_unref(struct xml_cache_core *core)
+{
+    int refs;
+
+    pthread_mutex_lock(&core->lock);
+    refs = --core->refs;
+    pthread_mutex_unlock(&core->lock);
+
+    if (refs > 0) {
+        return;
+    }
+
+    if (core->conn) {
+        virConnectClose(core->conn);
+    }
+    pthread_mutex_destroy(&core->lock);
+    free(core);
+}
+
+static void xml_cache_release(void *opaque)
+{
+    xml_cache_core_unref((struct xml_cache_core *)opaque);
+}
+
+static void xml_cache_bump(struct xml_cache_core *core, int kind,
+                           const char *key)
+{
+    pthread_mutex_lock(&core->lock);
+    if (key) {
+        core->generations[kind][xml_cache_hash(key) % XML_CACHE_BUCKETS]++;
+    }
+    else {
+        core->all[kind]++;
+    }
+    core->invalidations++;
+    pthread_mutex_unlock(&core->lock);
+}
+
+static unsigned long xml_cache_generation(struct xml_cache_core *core,
+                                          int kind, const char *key)
+{
+    unsigned long gen;
+
+    /* both counters only ever go up, so the sum moves if either does */
+    pthread_mutex_lock(&core->lock);
+    gen = core->generations[kind][xml_cache_hash(key) % XML_CACHE_BUCKETS] +
+        core->all[kind] + 1;
+    pthread_mutex_unlock(&core->lock);
+
+    return gen;
+}
+
+/* the domain events that can change what virDomainGetXMLDesc returns; each
+ * signature needs its own callback so that opaque is found in the right
+ * place
+ */
+static void xml_cache_domain_bump(virDomainPtr dom, void *opaque)
+{
+    char uuid[VIR_UUID_STRING_BUFLEN];
+
+    if (virDomainGetUUIDString(dom, uuid) < 0) {
+        virResetLastError();
+        xml_cache_bump((struct xml_cache_core *)opaque,
+                       RUBY_LIBVIRT_XML_DOMAIN, NULL);
+        return;
+    }
+    xml_cache_bump((struct xml_cache_core *)opaque, RUBY_LIBVIRT_XML_DOMAIN,
+                   uuid);
+}
+
+static int xml_cache_domain_lifecycle(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                      virDomainPtr dom,
+                                      int RUBY_LIBVIRT_UNUSED(event),
+                                      int RUBY_LIBVIRT_UNUSED(detail),
+                                      void *opaque)
+{
+    xml_cache_domain_bump(dom, opaque);
+
+    return 0;
+}
+
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_DEVICE_ADDED || HAVE_CONST_VIR_DOMAIN_EVENT_ID_DEVICE_REMOVED
+static void xml_cache_domain_string(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                    virDomainPtr dom,
+                                    const char *RUBY_LIBVIRT_UNUSED(alias),
+                                    void *opaque)
+{
+    xml_cache_domain_bump(dom, opaque);
+}
+#endif
+
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_METADATA_CHANGE
+static void xml_cache_domain_metadata(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                      virDomainPtr dom,
+                                      int RUBY_LIBVIRT_UNUSED(type),
+                                      const char *RUBY_LIBVIRT_UNUSED(nsuri),
+                                      void *opaque)
+{
+    xml_cache_domain_bump(dom, opaque);
+}
+#endif
+
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BALLOON_CHANGE
+static void xml_cache_domain_balloon(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                     virDomainPtr dom,
+                                     unsigned long long RUBY_LIBVIRT_UNUSED(actual),
+                                     void *opaque)
+{
+    xml_cache_domain_bump(dom, opaque);
+}
+#endif
+
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_TRAY_CHANGE
+static void xml_cache_domain_tray(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                  virDomainPtr dom,
+                                  const char *RUBY_LIBVIRT_UNUSED(alias),
+                                  int RUBY_LIBVIRT_UNUSED(reason),
+                                  void *opaque)
+{
+    xml_cache_domain_bump(dom, opaque);
+}
+#endif
+
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_TUNABLE
+static void xml_cache_domain_tunable(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                     virDomainPtr dom,
+                                     virTypedParameterPtr RUBY_LIBVIRT_UNUSED(params),
+                                     int RUBY_LIBVIRT_UNUSED(nparams),
+                                     void *opaque)
+{
+    xml_cache_domain_bump(dom, opaque);
+}
+#endif
+
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2
+/* a finished copy or commit can change a disk's source */
+static void xml_cache_domain_block_job(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                       virDomainPtr dom,
+                                       const char *RUBY_LIBVIRT_UNUSED(disk),
+                                       int RUBY_LIBVIRT_UNUSED(type),
+                                       int RUBY_LIBVIRT_UNUSED(status),
+                                       void *opaque)
+{
+    xml_cache_domain_bump(dom, opaque);
+}
+#endif
+
+static void xml_cache_network_bump(virNetworkPtr net, void *opaque)
+{
+    char uuid[VIR_UUID_STRING_BUFLEN];
+
+    if (virNetworkGetUUIDString(net, uuid) < 0) {
+        virResetLastError();
+        xml_cache_bump((struct xml_cache_core *)opaque,
+                       RUBY_LIBVIRT_XML_NETWORK, NULL);
+        return;
+    }
+    xml_cache_bump((struct xml_cache_core *)opaque, RUBY_LIBVIRT_XML_NETWORK,
+                   uuid);
+}
+
+#if HAVE_VIRCONNECTNETWORKEVENTREGISTERANY
+static void xml_cache_network_lifecycle(virConnectPtr RUBY_LIBVIRT_UNUSED(conn),
+                                        virNetworkPtr net,
+                                        int RUBY_LIBVIRT_UNUSED(event),
+                                        int RUBY_LIBVIRT_UNUSED(detail),
+                                        void *opaque)
+{
+    xml_cache_network_bump(net, opaque);
+}
+#endif
+
+static void xml_cache_clear(struct xml_cache *cache)
+{
+    long i;
+
+    for (i = 0; i < cache->capacity; i++) {
+        xfree(cache->entries[i].key);
+    }
+    memset(cache->entries, 0, cache->capacity * sizeof(*cache->entries));
+    cache->nentries = 0;
+}
+
+static void xml_cache_deregister(struct xml_cache *cache)
+{
+    int i;
+
+    for (i = 0; i < cache->ndomain_ids; i++) {
+        virConnectDomainEventDeregisterAny(cache->core->conn,
+                                           cache->domain_ids[i]);
+    }
+    cache->ndomain_ids = 0;
+#if HAVE_VIRCONNECTNETWORKEVENTREGISTERANY
+    if (cache->network_id >= 0) {
+        virConnectNetworkEventDeregisterAny(cache->core->conn,
+                                            cache->network_id);
+        cache->network_id = -1;
+    }
+#endif
+}
+
+static void xml_cache_mark(void *p)
+{
+    struct xml_cache *cache = (struct xml_cache *)p;
+    long i;
+
+    for (i = 0; i < cache->capacity; i++) {
+        if (cache->entries[i].key) {
+            rb_gc_mark(cache->entries[i].xml);
+        }
+    }
+}
+
+static void xml_cache_free(void *p)
+{
+    struct xml_cache *cache = (struct xml_cache *)p;
+
+    /* the free callbacks drop the references the registrations hold */
+    xml_cache_deregister(cache);
+    xml_cache_clear(cache);
+    xfree(cache->entries);
+    xml_cache_core_unref(cache->core);
+    xfree(cache);
+}
+
+static const rb_data_type_t xml_cache_data_type = {
+    "Libvirt::Connect::XMLCache",
+    { xml_cache_mark, xml_cache_free, NULL, },
+    NULL, NULL, 0
+};
+
+static struct xml_cache *xml_cache_get(VALUE c)
+{
+    VALUE obj;
+    struct xml_cache *cache;
+
+    obj = rb_ivar_get(c, id_xml_cache);
+    if (NIL_P(obj)) {
+        return NULL;
+    }
+    TypedData_Get_Struct(obj, struct xml_cache, &xml_cache_data_type, cache);
+
+    return cache;
+}
+
+static struct xml_cache_entry *xml_cache_slot(struct xml_cache *cache,
+                                              int kind, const char *key,
+                                              unsigned int flags)
+{
+    struct xml_cache_entry *e;
+    long i;
+
+    i = (xml_cache_hash(key) ^ (kind * 31) ^ (flags * 131)) &
+        (cache->capacity - 1);
+    for (;;) {
+        e = &cache->entries[i];
+        if (e->key == NULL ||
+            (e->kind == kind && e->flags == flags && strcmp(e->key, key) == 0)) {
+            return e;
+        }
+        i = (i + 1) & (cache->capacity - 1);
+    }
+}
+
+int ruby_libvirt_xml_cache_enabled(VALUE c)
+{
+    return xml_cache_get(c) != NULL;
+}
+
+static VALUE xml_cache_fetch(VALUE c, int kind, const char *key,
+                             unsigned int flags, unsigned long *token)
+{
+    struct xml_cache *cache = xml_cache_get(c);
+    struct xml_cache_entry *e;
+
+    *token = 0;
+    if (cache == NULL) {
+        return Qnil;
+    }
+
+    *token = xml_cache_generation(cache->core, kind, key);
+    e = xml_cache_slot(cache, kind, key, flags);
+    if (e->key && e->generation == *token) {
+        cache->hits++;
+        return e->xml;
+    }
+    cache->misses++;
+
+    return Qnil;
+}
+
+static VALUE xml_cache_store(VALUE c, int kind, const char *key,
+                             unsigned int flags, unsigned long token,
+                             VALUE xml)
+{
+    struct xml_cache *cache = xml_cache_get(c);
+    struct xml_cache_entry *e;
+    char *copy;
+
+    if (cache == NULL || token == 0) {
+        return xml;
+    }
+
+    rb_obj_freeze(xml);
+
+    e = xml_cache_slot(cache, kind, key, flags);
+    if (e->key == NULL) {
+        if (cache->nentries >= cache->max_entries) {
+            /* rather than track what is least used, start again */
+            xml_cache_clear(cache);
+            e = xml_cache_slot(cache, kind, key, flags);
+        }
+        copy = ruby_xmalloc(strlen(key) + 1);
+        strcpy(copy, key);
+        e->key = copy;
+        e->kind = kind;
+        e->flags = flags;
+        cache->nentries++;
+    }
+    e->generation = token;
+    e->xml = xml;
+
+    return xml;
+}
+
+VALUE ruby_libvirt_xml_cache_call(VALUE c, int kind, const char *key,
+                                  unsigned int flags,
+                                  VALUE (*call)(VALUE, unsigned int),
+                                  VALUE obj)
+{
+    unsigned long token;
+    VALUE xml;
+
+    xml = xml_cache_fetch(c, kind, key, flags, &token);
+    if (!NIL_P(xml)) {
+        return xml;
+    }
+
+    /* token is from before the call, so an event that arrives while it is
+     * in flight leaves the result already stale
+     */
+    return xml_cache_store(c, kind, key, flags, token, call(obj, flags));
+}
+
+static VALUE xml_cache_option(VALUE opts, const char *name, VALUE def)
+{
+    VALUE val;
+
+    if (NIL_P(opts)) {
+        return def;
+    }
+    val = rb_hash_aref(opts, ID2SYM(rb_intern(name)));
+
+    return NIL_P(val) ? def : val;
+}
+
+/* register CB for domain event ID, holding a reference on the core */
+static void xml_cache_register_domain(struct xml_cache *cache, int id,
+                                      virConnectDomainEventGenericCallback cb)
+{
+    int ret;
+
+    pthread_mutex_lock(&cache->core->lock);
+    cache->core->refs++;
+    pthread_mutex_unlock(&cache->core->lock);
+
+    ret = virConnectDomainEventRegisterAny(cache->core->conn, NULL, id, cb,
+                                           cache->core, xml_cache_release);
+    if (ret < 0) {
+        xml_cache_core_unref(cache->core);
+        /* the object's free deregisters whatever did succeed */
+        ruby_libvirt_raise_error_if(1, e_RetrieveError,
+                                    "virConnectDomainEventRegisterAny",
+                                    cache->core->conn);
+    }
+    cache->domain_ids[cache->ndomain_ids++] = ret;
+}
+
+VALUE ruby_libvirt_xml_cache_enable(VALUE c, VALUE opts)
+{
+    struct xml_cache *cache;
+    long max_entries;
+    VALUE obj;
+#if HAVE_VIRCONNECTNETWORKEVENTREGISTERANY
+    int ret;
+#endif
+
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+    }
+    max_entries = NUM2LONG(xml_cache_option(opts, "max_entries",
+                                            INT2NUM(4096)));
+    if (max_entries < 1) {
+        rb_raise(rb_eArgError, "max_entries must be at least 1");
+    }
+
+    if (xml_cache_get(c) != NULL) {
+        ruby_libvirt_xml_cache_disable(c);
+    }
+
+    /* a hidden object: it is only ever reached through the connection */
+    obj = TypedData_Make_Struct(0, struct xml_cache,
+                                &xml_cache_data_type, cache);
+    cache->network_id = -1;
+    cache->max_entries = max_entries;
+    cache->capacity = 16;
+    while (cache->capacity < max_entries * 2) {
+        cache->capacity *= 2;
+    }
+    cache->entries = ALLOC_N(struct xml_cache_entry, cache->capacity);
+    memset(cache->entries, 0, cache->capacity * sizeof(*cache->entries));
+
+    cache->core = calloc(1, sizeof(*cache->core));
+    if (cache->core == NULL) {
+        rb_memerror();
+    }
+    pthread_mutex_init(&cache->core->lock, NULL);
+    cache->core->refs = 1;
+    /* its own reference, so that it can always deregister */
+    cache->core->conn = ruby_libvirt_connect_get(c);
+    virConnectRef(cache->core->conn);
+
+    xml_cache_register_domain(cache, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+                              VIR_DOMAIN_EVENT_CALLBACK(xml_cache_domain_lifecycle));
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_DEVICE_ADDED
+    xml_cache_register_domain(cache, VIR_DOMAIN_EVENT_ID_DEVICE_ADDED,
+                              VIR_DOMAIN_EVENT_CALLBACK(xml_cache_domain_string));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_DEVICE_REMOVED
+    xml_cache_register_domain(cache, VIR_DOMAIN_EVENT_ID_DEVICE_REMOVED,
+                              VIR_DOMAIN_EVENT_CALLBACK(xml_cache_domain_string));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_METADATA_CHANGE
+    xml_cache_register_domain(cache, VIR_DOMAIN_EVENT_ID_METADATA_CHANGE,
+                              VIR_DOMAIN_EVENT_CALLBACK(xml_cache_domain_metadata));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BALLOON_CHANGE
+    xml_cache_register_domain(cache, VIR_DOMAIN_EVENT_ID_BALLOON_CHANGE,
+                              VIR_DOMAIN_EVENT_CALLBACK(xml_cache_domain_balloon));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_TRAY_CHANGE
+    xml_cache_register_domain(cache, VIR_DOMAIN_EVENT_ID_TRAY_CHANGE,
+                              VIR_DOMAIN_EVENT_CALLBACK(xml_cache_domain_tray));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_TUNABLE
+    xml_cache_register_domain(cache, VIR_DOMAIN_EVENT_ID_TUNABLE,
+                              VIR_DOMAIN_EVENT_CALLBACK(xml_cache_domain_tunable));
+#endif
+#if HAVE_CONST_VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2
+    xml_cache_register_domain(cache, VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2,
+                              VIR_DOMAIN_EVENT_CALLBACK(xml_cache_domain_block_job));
+#endif
+
+#if HAVE_VIRCONNECTNETWORKEVENTREGISTERANY
+    pthread_mutex_lock(&cache->core->lock);
+    cache->core->refs++;
+    pthread_mutex_unlock(&cache->core->lock);
+    ret = virConnectNetworkEventRegisterAny(cache->core->conn, NULL,
+                                            VIR_NETWORK_EVENT_ID_LIFECYCLE,
+                                            VIR_NETWORK_EVENT_CALLBACK(xml_cache_network_lifecycle),
+                                            cache->core, xml_cache_release);
+    if (ret < 0) {
+        xml_cache_core_unref(cache->core);
+        ruby_libvirt_raise_error_if(1, e_RetrieveError,
+                                    "virConnectNetworkEventRegisterAny",
+                                    cache->core->conn);
+    }
+    cache->network_id = ret;
+#endif
+
+    rb_ivar_set(c, id_xml_cache, obj);
+
+    return Qnil;
+}
+
+VALUE ruby_libvirt_xml_cache_disable(VALUE c)
+{
+    struct xml_cache *cache = xml_cache_get(c);
+
+    if (cache != NULL) {
+        xml_cache_deregister(cache);
+        xml_cache_clear(cache);
+        rb_ivar_set(c, id_xml_cache, Qnil);
+    }
+
+    return Qnil;
+}
+
+void ruby_libvirt_xml_cache_domain_changed(VALUE d)
+{
+    struct xml_cache *cache = xml_cache_get(ruby_libvirt_conn_attr(d));
+
+    if (cache != NULL) {
+        xml_cache_domain_bump(ruby_libvirt_domain_get(d), cache->core);
+    }
+}
+
+void ruby_libvirt_xml_cache_network_changed(VALUE n, virNetworkPtr net)
+{
+    struct xml_cache *cache = xml_cache_get(ruby_libvirt_conn_attr(n));
+
+    if (cache != NULL) {
+        xml_cache_network_bump(net, cache->core);
+    }
+}
+
+VALUE ruby_libvirt_xml_cache_stats(VALUE c)
+{
+    struct xml_cache *cache = xml_cache_get(c);
+    unsigned long long invalidations;
+    VALUE result;
+
+    if (cache == NULL) {
+        return Qnil;
+    }
+
+    pthread_mutex_lock(&cache->core->lock);
+    invalidations = cache->core->invalidations;
+    pthread_mutex_unlock(&cache->core->lock);
+
+    result = rb_hash_new();
+    rb_hash_aset(result, rb_str_new2("hits"), ULL2NUM(cache->hits));
+    rb_hash_aset(result, rb_str_new2("misses"), ULL2NUM(cache->misses));
+    rb_hash_aset(result, rb_str_new2("entries"), LONG2NUM(cache->nentries));
+    rb_hash_aset(result, rb_str_new2("invalidations"), ULL2NUM(invalidations));
+
+    return result;
+}
+#endif
+
+void ruby_libvirt_xml_cache_init(void)
+{
+#if RUBY_LIBVIRT_XML_CACHE
+    /* no leading @, so the cache is invisible from Ruby */
+    id_xml_cache = rb_intern("xml_cache");
+#endif
+}
@@ -0,0 +1,44 @@
+#ifndef XMLCACHE_H
+#define XMLCACHE_H
+
+void ruby_libvirt_xml_cache_init(void);
+
+/* The opt-in cache of xml_desc results behind conn.enable_xml_cache.  A
+ * getter checks ruby_libvirt_xml_cache_enabled() on its connection, and if
+ * so gets its XML through ruby_libvirt_xml_cache_call() with the object's
+ * UUID: that returns the cached, frozen String if it is still good, and
+ * otherwise calls CALL(OBJ, FLAGS) and caches what it returns.  Storage
+ * pools and volumes are never cached: their XML reports allocation, which
+ * changes with every volume change or guest write and has no event.
+ *
+ * Changes that libvirt raises no event for, such as config-only device or
+ * vcpu changes or a network update, must be reported with
+ * ruby_libvirt_xml_cache_domain_changed() or
+ * ruby_libvirt_xml_cache_network_changed() once they have succeeded.
+ */
+#define RUBY_LIBVIRT_XML_CACHE (HAVE_VIRCONNECTDOMAINEVENTREGISTERANY && \
+                                HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+
+enum {
+    RUBY_LIBVIRT_XML_DOMAIN,
+    RUBY_LIBVIRT_XML_NETWORK,
+    RUBY_LIBVIRT_XML_NKINDS
+};
+
+#if RUBY_LIBVIRT_XML_CACHE
+int ruby_libvirt_xml_cache_enabled(VALUE c);
+VALUE ruby_libvirt_xml_cache_call(VALUE c, int kind, const char *key,
+                                  unsigned int flags,
+                                  VALUE (*call)(VALUE, unsigned int),
+                                  VALUE obj);
+VALUE ruby_libvirt_xml_cache_enable(VALUE c, VALUE opts);
+VALUE ruby_libvirt_xml_cache_disable(VALUE c);
+VALUE ruby_libvirt_xml_cache_stats(VALUE c);
+void ruby_libvirt_xml_cache_domain_changed(VALUE d);
+void ruby_libvirt_xml_cache_network_changed(VALUE n, virNetworkPtr net);
+#else
+#define ruby_libvirt_xml_cache_domain_changed(d) ((void)0)
+#define ruby_libvirt_xml_cache_network_changed(n, net) ((void)0)
+#endif
+
+#endif
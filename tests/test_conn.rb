@@ -82,6 +82,36 @@ expect_too_many_args(conn, "node_get_info", 1)
 
 expect_success(conn, "no args", "node_get_info")
 
+# TESTGROUP: conn.node_max_cpus
+expect_too_many_args(conn, "node_max_cpus", 1, 2)
+
+expect_success(conn, "no args", "node_max_cpus") {|x| x > 0}
+expect_success(conn, "cached count", "node_max_cpus") {|x| x == conn.node_max_cpus}
+expect_success(conn, "refresh arg", "node_max_cpus", true) {|x| x == conn.node_max_cpus}
+
+# TESTGROUP: Libvirt::CPUMap
+cpumap = Libvirt::CPUMap.new(10, [1, 3, 9])
+other = Libvirt::CPUMap.new(12, [3, 4, 11])
+
+expect_too_many_args(cpumap, "popcount", 1)
+expect_invalid_arg_type(cpumap, "&", [1])
+expect_fail(cpumap, ArgumentError, "cpu out of range", "[]=", 10, true)
+
+expect_success(cpumap, "no args", "size") {|x| x == 10}
+expect_success(cpumap, "no args", "popcount") {|x| x == 3}
+expect_success(cpumap, "no args", "cpus") {|x| x == [1, 3, 9]}
+expect_success(cpumap, "no args", "each_set_bit") {|x| x.to_a == [1, 3, 9]}
+expect_success(cpumap, "no args", "to_a") {|x| x.length == 10 && x[9] && !x[8]}
+expect_success(cpumap, "cpumap arg", "&", other) {|x| x.cpus == [3] && x.size == 12}
+expect_success(cpumap, "cpumap arg", "|", other) {|x| x.cpus == [1, 3, 4, 9, 11]}
+expect_success(cpumap, "cpumap arg", "==", Libvirt::CPUMap.new(10, [1, 3, 9])) {|x| x}
+
+# TESTGROUP: conn.node_cpu_bitmap
+expect_too_many_args(conn, "node_cpu_bitmap", 1, 2)
+expect_invalid_arg_type(conn, "node_cpu_bitmap", 'foo')
+
+expect_success(conn, "no args", "node_cpu_bitmap") {|x| x.size == conn.node_max_cpus && x.popcount > 0}
+
 # TESTGROUP: conn.node_free_memory
 expect_too_many_args(conn, "node_free_memory", 1)
 
@@ -196,6 +226,22 @@ expect_invalid_arg_type(conn, "domain_event_register", "hello")
 expect_too_many_args(conn, "domain_event_deregister", 1)
 # expect_success(conn, "no args", "domain_event_deregister")
 
+# TESTGROUP: conn.domain_event_queue
+expect_too_many_args(conn, "domain_event_queue", 1, 2, 3)
+expect_too_few_args(conn, "domain_event_queue")
+expect_invalid_arg_type(conn, "domain_event_queue", "hello")
+expect_invalid_arg_type(conn, "domain_event_queue", Libvirt::Connect::DOMAIN_EVENT_ID_LIFECYCLE, 1)
+expect_invalid_arg_type(conn, "domain_event_queue", Libvirt::Connect::DOMAIN_EVENT_ID_LIFECYCLE, :max_batch => "foo")
+expect_fail(conn, ArgumentError, "invalid event ID", "domain_event_queue", 456789)
+expect_fail(conn, ArgumentError, "empty event ID list", "domain_event_queue", [])
+
+# queue = expect_success(conn, "eventID", "domain_event_queue", Libvirt::Connect::DOMAIN_EVENT_ID_LIFECYCLE)
+# expect_success(queue, "timeout", "pop", 0) {|x| x == []}
+# queue.close
+
+# queue = expect_success(conn, "eventIDs and options", "domain_event_queue", [Libvirt::Connect::DOMAIN_EVENT_ID_LIFECYCLE, Libvirt::Connect::DOMAIN_EVENT_ID_REBOOT], :max_batch => 16, :max_latency => 0.01, :coalesce => true)
+# queue.close
+
 # TESTGROUP: conn.num_of_domains
 expect_too_many_args(conn, "num_of_domains", 1)
 expect_success(conn, "no args", "num_of_domains")
@@ -263,6 +309,18 @@ newdom = conn.define_domain_xml($new_dom_xml)
 expect_success(conn, "name arg for defined domain", "lookup_domain_by_name", "rb-libvirt-test") {|x| x.name == "rb-libvirt-test"}
 newdom.undefine
 
+# TESTGROUP: conn.find_domain_by_name
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(conn, "find_domain_by_name", 1, 2)
+expect_too_few_args(conn, "find_domain_by_name")
+expect_invalid_arg_type(conn, "find_domain_by_name", 1)
+
+expect_success(conn, "non-existent name arg", "find_domain_by_name", "foobarbazsucker") {|x| x.nil?}
+expect_success(conn, "name arg for running domain", "find_domain_by_name", "rb-libvirt-test") {|x| x.name == "rb-libvirt-test"}
+newdom.destroy
+
 # TESTGROUP: conn.lookup_domain_by_id
 newdom = conn.create_domain_xml($new_dom_xml)
 sleep 1
@@ -283,6 +341,15 @@ expect_too_many_args(conn, "lookup_domain_by_uuid", 1, 2)
 expect_too_few_args(conn, "lookup_domain_by_uuid")
 expect_invalid_arg_type(conn, "lookup_domain_by_uuid", 1)
 expect_fail(conn, Libvirt::RetrieveError, "invalid UUID", "lookup_domain_by_uuid", "abcd")
+begin
+  conn.lookup_domain_by_uuid("abcd")
+rescue Libvirt::RetrieveError => e
+  if e.libvirt_function_name == "virDomainLookupByUUID" and !e.libvirt_code.nil?
+    puts_ok "conn.lookup_domain_by_uuid invalid UUID kept the function name and error"
+  else
+    puts_fail "conn.lookup_domain_by_uuid invalid UUID reported #{e.libvirt_function_name}, code #{e.libvirt_code.inspect}"
+  end
+end
 
 expect_success(conn, "UUID arg for running domain", "lookup_domain_by_uuid", newdom.uuid) {|x| x.uuid == $GUEST_UUID}
 newdom.destroy
@@ -291,6 +358,44 @@ newdom = conn.define_domain_xml($new_dom_xml)
 expect_success(conn, "UUID arg for defined domain", "lookup_domain_by_uuid", newdom.uuid) {|x| x.uuid == $GUEST_UUID}
 newdom.undefine
 
+# TESTGROUP: conn.find_domain_by_uuid
+expect_too_many_args(conn, "find_domain_by_uuid", 1, 2)
+expect_too_few_args(conn, "find_domain_by_uuid")
+expect_invalid_arg_type(conn, "find_domain_by_uuid", 1)
+expect_fail(conn, Libvirt::RetrieveError, "invalid UUID", "find_domain_by_uuid", "abcd")
+
+expect_success(conn, "non-existent UUID arg", "find_domain_by_uuid", $GUEST_UUID) {|x| x.nil?}
+
+# TESTGROUP: conn.lookup_domains_by_uuid
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(conn, "lookup_domains_by_uuid", 1, 2, 3)
+expect_too_few_args(conn, "lookup_domains_by_uuid")
+expect_invalid_arg_type(conn, "lookup_domains_by_uuid", 1)
+expect_invalid_arg_type(conn, "lookup_domains_by_uuid", [1])
+expect_invalid_arg_type(conn, "lookup_domains_by_uuid", [], "foo")
+
+expect_success(conn, "empty array", "lookup_domains_by_uuid", []) {|x| x == [{}, {}]}
+expect_success(conn, "found and missing UUIDs", "lookup_domains_by_uuid", [newdom.uuid, "abcd"]) {|x| x[0][newdom.uuid].uuid == $GUEST_UUID and x[1]["abcd"].kind_of?(Libvirt::RetrieveError) and x[1]["abcd"].libvirt_function_name == "virDomainLookupByUUID"}
+expect_success(conn, "UUIDs and threads", "lookup_domains_by_uuid", [newdom.uuid], 1) {|x| x[0].length == 1 and x[1].empty?}
+
+newdom.destroy
+
+# TESTGROUP: conn.lookup_domains_by_name
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(conn, "lookup_domains_by_name", 1, 2, 3)
+expect_too_few_args(conn, "lookup_domains_by_name")
+expect_invalid_arg_type(conn, "lookup_domains_by_name", 1)
+expect_invalid_arg_type(conn, "lookup_domains_by_name", [1])
+
+expect_success(conn, "found and missing names", "lookup_domains_by_name", ["rb-libvirt-test", "foobarbazsucker"]) {|x| x[0]["rb-libvirt-test"].name == "rb-libvirt-test" and x[1]["foobarbazsucker"].libvirt_function_name == "virDomainLookupByName"}
+expect_success(conn, "more threads than the cap", "lookup_domains_by_name", (1..200).map {|i| "rb-libvirt-missing-#{i}"}, 1000) {|x| x[0].empty? and x[1].size == 200}
+
+newdom.destroy
+
 # TESTGROUP: conn.define_domain_xml
 expect_too_many_args(conn, "define_domain_xml", 1, 2, 3)
 expect_too_few_args(conn, "define_domain_xml")
@@ -413,6 +518,17 @@ newnet = conn.define_network_xml($new_net_xml)
 expect_success(conn, "name arg", "lookup_network_by_name", "rb-libvirt-test")
 newnet.undefine
 
+# TESTGROUP: conn.find_network_by_name
+newnet = conn.create_network_xml($new_net_xml)
+
+expect_too_many_args(conn, "find_network_by_name", 1, 2)
+expect_too_few_args(conn, "find_network_by_name")
+expect_invalid_arg_type(conn, "find_network_by_name", 1)
+
+expect_success(conn, "non-existent name arg", "find_network_by_name", "foobarbazsucker") {|x| x.nil?}
+expect_success(conn, "name arg", "find_network_by_name", "rb-libvirt-test") {|x| x.name == "rb-libvirt-test"}
+newnet.destroy
+
 # TESTGROUP: conn.lookup_network_by_uuid
 newnet = conn.create_network_xml($new_net_xml)
 
@@ -599,6 +715,13 @@ newpool = conn.define_storage_pool_xml($new_storage_pool_xml)
 expect_success(conn, "name arg", "lookup_storage_pool_by_name", "rb-libvirt-test")
 newpool.undefine
 
+# TESTGROUP: conn.find_storage_pool_by_name
+expect_too_many_args(conn, "find_storage_pool_by_name", 1, 2)
+expect_too_few_args(conn, "find_storage_pool_by_name")
+expect_invalid_arg_type(conn, "find_storage_pool_by_name", 1)
+
+expect_success(conn, "non-existent name arg", "find_storage_pool_by_name", "foobarbazsucker") {|x| x.nil?}
+
 # TESTGROUP: conn.lookup_storage_pool_by_uuid
 newpool = conn.create_storage_pool_xml($new_storage_pool_xml)
 
@@ -690,6 +813,9 @@ expect_invalid_arg_type(conn, "node_cpu_stats", 'foo')
 expect_invalid_arg_type(conn, "node_cpu_stats", 1, 'bar')
 
 expect_success(conn, "node cpu stats", "node_cpu_stats")
+expect_success(conn, "cached stats count", "node_cpu_stats") {|x| x.length == conn.node_cpu_stats.length}
+expect_success(conn, "frozen keys", "node_cpu_stats") {|x| x.keys.all? {|k| k.frozen?}}
+expect_success(conn, "symbol keys", "node_cpu_stats", -1, 0, :keys => :symbol) {|x| x.keys.all? {|k| k.kind_of?(Symbol)}}
 
 # TESTGROUP: conn.node_memory_stats
 expect_too_many_args(conn, "node_memory_stats", 1, 2, 3)
@@ -793,6 +919,10 @@ expect_too_many_args(conn, "node_memory_parameters", 1, 2)
 expect_invalid_arg_type(conn, "node_memory_parameters", 'foo')
 
 expect_success(conn, "no args", "node_memory_parameters")
+expect_success(conn, "cached parameter count", "node_memory_parameters") {|x| x.length == conn.node_memory_parameters.length}
+expect_success(conn, "symbol keys", "node_memory_parameters", 0, :keys => :symbol) {|x| x.keys.all? {|k| k.kind_of?(Symbol)}}
+expect_fail(conn, ArgumentError, "invalid keys option", "node_memory_parameters", :keys => "symbol")
+expect_fail(conn, ArgumentError, "unknown option", "node_memory_parameters", :key => :symbol)
 
 # TESTGROUP: conn.node_memory_paramters=
 expect_too_many_args(conn, "node_memory_parameters=", 1, 2)
@@ -811,6 +941,215 @@ expect_invalid_arg_type(conn, "keepalive=", [1, 'foo'])
 # FIXME: somehow we need an event loop implementation for this to work
 #expect_success(conn, "interval and count", "keepalive=", 1, 10)
 
+# TESTGROUP: conn.all_domain_stats
+expect_too_many_args(conn, "all_domain_stats", 1, 2, 3)
+expect_invalid_arg_type(conn, "all_domain_stats", "foo")
+expect_invalid_arg_type(conn, "all_domain_stats", 0, "foo")
+
+expect_success(conn, "no args", "all_domain_stats")
+
+# TESTGROUP: conn.domain_list_stats
+expect_too_many_args(conn, "domain_list_stats", [], 1, 2, 3)
+expect_too_few_args(conn, "domain_list_stats")
+expect_invalid_arg_type(conn, "domain_list_stats", "foo")
+expect_invalid_arg_type(conn, "domain_list_stats", [], "foo")
+expect_invalid_arg_type(conn, "domain_list_stats", [], 0, "foo")
+expect_invalid_arg_type(conn, "domain_list_stats", ["foo"])
+expect_success(conn, "empty Array", "domain_list_stats", []) {|x| x == []}
+
+# TESTGROUP: conn.sampler
+expect_too_many_args(conn, "sampler", {}, 1)
+expect_invalid_arg_type(conn, "sampler", 1)
+expect_invalid_arg_type(conn, "sampler", :interval => "foo")
+expect_invalid_arg_type(conn, "sampler", :stats => "foo")
+expect_invalid_arg_type(conn, "sampler", :flags => "foo")
+expect_fail(conn, ArgumentError, "zero interval", "sampler", :interval => 0)
+expect_fail(conn, ArgumentError, "zero capacity", "sampler", :capacity => 0)
+expect_fail(conn, ArgumentError, "unknown option", "sampler", :intervall => 0.05)
+
+sampler = expect_success(conn, "interval and capacity", "sampler", :interval => 0.05, :capacity => 16) {|x| x.class == Libvirt::Sampler and x.running? and x.connection == conn}
+sleep 0.5
+expect_success(sampler, "no args", "samples") {|x| x > 0}
+expect_success(sampler, "no args", "size") {|x| x <= 16}
+expect_success(sampler, "no args", "drain") {|x|
+  uuids, doms, host = x
+  doms.bytesize == uuids.length * Libvirt::Sampler::DOMAIN_FIELDS.length * 8 and
+    host.bytesize % (Libvirt::Sampler::HOST_FIELDS.length * 8) == 0
+}
+expect_success(sampler, "max arg", "drain", 0) {|x| x[0].empty? and x[1].empty? and x[2].empty?}
+expect_fail(sampler, ArgumentError, "negative max", "drain", -1)
+expect_success(sampler, "no args", "stop") {|x| x.nil? and not sampler.running?}
+expect_success(sampler, "after stop", "stop")
+
+sampler = conn.sampler(:interval => 0.05)
+begin
+  [Thread.new { sampler.stop }, Thread.new { sampler.stop }].each {|t| t.join}
+  if sampler.running?
+    puts_fail "sampler.stop from two threads left the sampler running"
+  else
+    puts_ok "sampler.stop from two threads succeeded"
+  end
+rescue => e
+  puts_fail "sampler.stop from two threads expected to succeed, threw #{e.class.to_s}: #{e.to_s}"
+end
+
+# TESTGROUP: conn.console_mux
+expect_too_many_args(conn, "console_mux", {}, 1)
+expect_invalid_arg_type(conn, "console_mux", 1)
+expect_fail(conn, ArgumentError, "zero buffer_size", "console_mux", :buffer_size => 0)
+
+mux = expect_success(conn, "buffer_size", "console_mux", :buffer_size => 4096) {|x| x.class == Libvirt::ConsoleMux and x.connection == conn}
+set_test_object("mux")
+newdom = conn.create_domain_xml($new_dom_xml)
+
+expect_too_many_args(mux, "add", newdom, "pty", {}, 1)
+expect_too_few_args(mux, "add")
+expect_invalid_arg_type(mux, "add", newdom, 1)
+expect_invalid_arg_type(mux, "add", newdom, nil, 1)
+expect_invalid_arg_type(mux, "add", newdom, :fd => "foo")
+expect_invalid_arg_type(mux, "add", newdom, :flags => "foo")
+expect_invalid_arg_type(mux, "add", newdom, 1, :flags => 0)
+
+# the test driver can't open consoles, so this only runs against drivers
+# that can
+begin
+  uuid = mux.add(newdom)
+rescue Libvirt::RetrieveError
+  puts_skipped "mux.add of a domain console is not supported by this driver"
+else
+  expect_success(mux, "domain", "domains") {|x| x == [uuid] and mux.open?(newdom)}
+  expect_success(mux, "domain", "dispatch", 1) {|x| x >= 0}
+  expect_success(mux, "domain", "read", newdom) {|x| x.class == String and x.bytesize <= 4096}
+  expect_success(mux, "UUID", "read", uuid) {|x| x.class == String}
+  expect_fail(mux, ArgumentError, "domain already added", "add", newdom)
+  expect_success(mux, "domain", "remove", newdom) {|x| x.nil? and mux.domains.empty?}
+
+  # the mux writes to its own copy of fd, so closing the caller's is fine
+  rd, wr = IO.pipe
+  expect_success(mux, "fd", "add", newdom, :fd => wr) {|x| x == uuid}
+  wr.close
+  expect_success(mux, "closed fd", "dispatch", 1) {|x| x >= 0}
+  expect_success(mux, "domain", "remove", newdom) {|x| x.nil?}
+  rd.close
+end
+
+expect_fail(mux, ArgumentError, "unknown domain", "read", newdom)
+expect_fail(mux, ArgumentError, "unknown domain", "remove", "no-such-uuid")
+expect_fail(mux, ArgumentError, "unknown domain", "open?", newdom)
+expect_fail(mux, RuntimeError, "no block", "dispatch", 0)
+expect_success(mux, "no args", "domains") {|x| x.empty?}
+expect_success(mux, "no args", "stats") {|x| x.empty?}
+expect_success(mux, "no args", "close") {|x| x.nil?}
+
+newdom.destroy
+set_test_object("connect")
+
+# TESTGROUP: conn.enable_xml_cache
+expect_too_many_args(conn, "enable_xml_cache", {}, 1)
+expect_invalid_arg_type(conn, "enable_xml_cache", 1)
+expect_invalid_arg_type(conn, "enable_xml_cache", :max_entries => "foo")
+expect_fail(conn, ArgumentError, "zero max_entries", "enable_xml_cache", :max_entries => 0)
+expect_too_many_args(conn, "xml_cache_stats", 1)
+expect_success(conn, "no cache", "xml_cache_stats") {|x| x.nil?}
+expect_too_many_args(conn, "disable_xml_cache", 1)
+expect_success(conn, "no cache", "disable_xml_cache") {|x| x.nil?}
+
+# the cache needs an event loop implementation registered before the
+# connection is opened, so use a connection of its own
+Libvirt::event_run_default_impl_in_thread
+cacheconn = Libvirt::open("qemu:///system")
+
+expect_success(cacheconn, "max_entries", "enable_xml_cache", :max_entries => 16) {|x| x.nil?}
+newdom = cacheconn.define_domain_xml($new_dom_xml)
+xml = newdom.xml_desc
+expect_success(newdom, "cached", "xml_desc") {|x| x.frozen? and x.equal?(xml)}
+
+# a config-only change raises no event
+newdom.max_memory = 524288
+expect_success(newdom, "after a config change", "xml_desc") {|x| not x.equal?(xml) and x.include?("524288")}
+
+xml = newdom.xml_desc
+newdom.create
+sleep 1
+expect_success(newdom, "after an event", "xml_desc") {|x| not x.equal?(xml)}
+expect_success(cacheconn, "cache", "xml_cache_stats") {|x| x["hits"] >= 1 and x["invalidations"] > 0}
+newdom.destroy
+newdom.undefine
+
+# a network update raises no event either
+newnet = cacheconn.create_network_xml($new_net_xml)
+xml = newnet.xml_desc
+expect_success(newnet, "cached", "xml_desc") {|x| x.frozen? and x.equal?(xml)}
+newnet.update(Libvirt::Network::NETWORK_UPDATE_COMMAND_ADD_LAST,
+              Libvirt::Network::NETWORK_SECTION_IP_DHCP_HOST, -1,
+              $new_network_dhcp_ip,
+              Libvirt::Network::NETWORK_UPDATE_AFFECT_CURRENT)
+expect_success(newnet, "after an update", "xml_desc") {|x| not x.equal?(xml)}
+newnet.destroy
+
+# pool XML reports allocation, which changes without an event
+newpool = cacheconn.create_storage_pool_xml($new_storage_pool_xml)
+xml = newpool.xml_desc
+expect_success(newpool, "not cached", "xml_desc") {|x| not x.frozen? and not x.equal?(xml)}
+newpool.destroy
+
+expect_success(cacheconn, "cache", "disable_xml_cache") {|x| x.nil? and cacheconn.xml_cache_stats.nil?}
+
+# TESTGROUP: callbacks batched by Libvirt::event_run_default_impl_in_thread
+# the thread is already running, so the same one comes back
+loop_thread = Libvirt::event_run_default_impl_in_thread
+events = []
+cbid = cacheconn.domain_event_register_any(Libvirt::Connect::DOMAIN_EVENT_ID_LIFECYCLE,
+                                           Proc.new {|c, dom, event, detail, opaque| events << [Thread.current, event, opaque]},
+                                           nil, "batched")
+newdom = cacheconn.define_domain_xml($new_dom_xml)
+newdom.undefine
+deadline = Time.now + 5
+sleep 0.1 while events.length < 2 and Time.now < deadline
+if events.map {|t, event, opaque| event} != [Libvirt::Connect::DOMAIN_EVENT_DEFINED, Libvirt::Connect::DOMAIN_EVENT_UNDEFINED]
+  puts_fail "batched lifecycle callbacks expected define and undefine events, got #{events.map {|t, event, opaque| event}.inspect}"
+elsif not events.all? {|t, event, opaque| t == loop_thread and opaque == "batched"}
+  puts_fail "batched lifecycle callbacks did not all run on the event loop thread with their opaque"
+else
+  puts_ok "batched lifecycle callbacks ran on the event loop thread"
+end
+cacheconn.domain_event_deregister_any(cbid)
+
+cacheconn.close
+
+# TESTGROUP: calls made without the GVL
+# interrupting a thread while it is in (or just returning from) calls made
+# with the GVL released delivers the exception, and leaves the connection
+# usable
+class RbLibvirtTestInterrupt < StandardError; end
+
+newdom = conn.define_domain_xml($new_dom_xml)
+ncalls = 0
+th = Thread.new do
+  loop do
+    conn.list_all_domains
+    conn.lookup_domain_by_name("rb-libvirt-test")
+    conn.find_domain_by_name("rb-libvirt-no-such-domain")
+    newdom.xml_desc
+    ncalls += 1
+  end
+end
+sleep 0.5
+th.raise(RbLibvirtTestInterrupt)
+begin
+  th.join
+  puts_fail "interrupted calls without the GVL ended without an exception"
+rescue RbLibvirtTestInterrupt
+  if ncalls > 0 and conn.list_all_domains.is_a?(Array) and newdom.xml_desc.is_a?(String)
+    puts_ok "interrupted calls without the GVL raised the interrupt"
+  else
+    puts_fail "interrupted calls without the GVL made no calls, or left the connection unusable"
+  end
+rescue => e
+  puts_fail "interrupted calls without the GVL expected to raise the interrupt, threw #{e.class.to_s}: #{e.to_s}"
+end
+newdom.undefine
+
 # END TESTS
 
 conn.close
@@ -9,6 +9,8 @@
 $: << File.dirname(__FILE__)
 
 require 'libvirt'
+require 'objspace'
+require 'stringio'
 require 'test_utils.rb'
 
 set_test_object("domain")
@@ -209,6 +211,51 @@ dconn.close
 
 newdom.destroy
 
+# TESTGROUP: dom.migrate3
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+dconn = Libvirt::open("qemu:///system")
+
+expect_too_many_args(newdom, "migrate3", 1, 2, 3, 4)
+expect_too_few_args(newdom, "migrate3")
+expect_invalid_arg_type(newdom, "migrate3", dconn, 'foo')
+expect_invalid_arg_type(newdom, "migrate3", dconn, {}, 'foo')
+expect_fail(newdom, ArgumentError, "unknown parameter", "migrate3", dconn, {"foo" => 1})
+expect_invalid_arg_type(newdom, "migrate3", dconn, {Libvirt::Domain::MIGRATE_PARAM_PARALLEL_CONNECTIONS => 'foo'})
+expect_invalid_arg_type(newdom, "migrate3", dconn, {:"parallel.connections" => [1, 2]})
+
+# FIXME: how can we make this work?
+#expect_success(newdom, "conn, parallel and compression args", "migrate3", dconn, {Libvirt::Domain::MIGRATE_PARAM_PARALLEL_CONNECTIONS => 4, Libvirt::Domain::MIGRATE_PARAM_COMPRESSION => ["zstd"]}, Libvirt::Domain::MIGRATE_LIVE|Libvirt::Domain::MIGRATE_PARALLEL|Libvirt::Domain::MIGRATE_COMPRESSED)
+
+dconn.close
+
+newdom.destroy
+
+# TESTGROUP: dom.migrate_to_uri3
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(newdom, "migrate_to_uri3", 1, 2, 3, 4)
+expect_invalid_arg_type(newdom, "migrate_to_uri3", 1)
+expect_invalid_arg_type(newdom, "migrate_to_uri3", "qemu:///system", 'foo')
+expect_invalid_arg_type(newdom, "migrate_to_uri3", "qemu:///system", {}, 'foo')
+expect_fail(newdom, ArgumentError, "unknown parameter", "migrate_to_uri3", "qemu:///system", {"foo" => 1})
+
+#expect_success(newdom, "URI and parallel args", "migrate_to_uri3", "qemu://remote/system", {Libvirt::Domain::MIGRATE_PARAM_PARALLEL_CONNECTIONS => 4}, Libvirt::Domain::MIGRATE_PEER2PEER|Libvirt::Domain::MIGRATE_PARALLEL)
+
+newdom.destroy
+
+# TESTGROUP: dom.migrate_start_post_copy
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(newdom, "migrate_start_post_copy", 1, 2)
+expect_invalid_arg_type(newdom, "migrate_start_post_copy", 'foo')
+expect_fail(newdom, Libvirt::Error, "while no migration in progress", "migrate_start_post_copy")
+
+newdom.destroy
+
 # TESTGROUP: dom.migrate_set_max_downtime
 newdom = conn.define_domain_xml($new_dom_xml)
 
@@ -341,6 +388,33 @@ expect_success(newdom, "path arg", "save", $GUEST_SAVE)
 
 `rm -f #{$GUEST_SAVE}`
 
+# TESTGROUP: dom.save_params
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(newdom, "save_params", {}, 0, {}, 1)
+expect_too_few_args(newdom, "save_params")
+expect_invalid_arg_type(newdom, "save_params", 1)
+expect_invalid_arg_type(newdom, "save_params", nil)
+expect_invalid_arg_type(newdom, "save_params", {Libvirt::Domain::SAVE_PARAM_FILE => $GUEST_SAVE}, "foo")
+expect_fail(newdom, ArgumentError, "unknown parameter", "save_params", {"foo" => "bar"})
+expect_fail(newdom, ArgumentError, "unknown option", "save_params", {Libvirt::Domain::SAVE_PARAM_FILE => $GUEST_SAVE}, :interval => 100)
+expect_fail(newdom, Libvirt::Error, "non-existent path", "save_params", {Libvirt::Domain::SAVE_PARAM_FILE => "/this/path/does/not/exist"})
+
+samples = []
+begin
+  newdom.save_params({Libvirt::Domain::SAVE_PARAM_FILE => $GUEST_SAVE}, interval_ms: 100) {|p| samples << p}
+  if not samples.all? {|p| p.is_a?(Libvirt::Domain::JobProgress)}
+    puts_fail "domain.save_params with a block passed something other than a JobProgress"
+  else
+    puts_ok "domain.save_params with a block succeeded"
+  end
+rescue => e
+  puts_fail "domain.save_params with a block expected to succeed, threw #{e.class.to_s}: #{e.to_s}"
+end
+
+`rm -f #{$GUEST_SAVE}`
+
 # TESTGROUP: dom.managed_save
 newdom = conn.define_domain_xml($new_dom_xml)
 newdom.create
@@ -438,6 +512,24 @@ expect_success(Libvirt::Domain, "2 args", "restore", conn, $GUEST_SAVE)
 
 `rm -f #{$GUEST_SAVE}`
 
+newdom.destroy
+
+# TESTGROUP: Libvirt::Domain::restore_params
+newdom.create
+sleep 1
+newdom.save_params({Libvirt::Domain::SAVE_PARAM_FILE => $GUEST_SAVE})
+
+expect_too_many_args(Libvirt::Domain, "restore_params", 1, 2, 3, 4)
+expect_too_few_args(Libvirt::Domain, "restore_params", conn)
+expect_fail(Libvirt::Domain, ArgumentError, "invalid connection", "restore_params", 1, {})
+expect_invalid_arg_type(Libvirt::Domain, "restore_params", conn, 2)
+expect_invalid_arg_type(Libvirt::Domain, "restore_params", conn, {}, "foo")
+expect_fail(Libvirt::Domain, Libvirt::Error, "invalid path", "restore_params", conn, {Libvirt::Domain::SAVE_PARAM_FILE => "/this/path/does/not/exist"})
+
+expect_success(Libvirt::Domain, "file param", "restore_params", conn, {Libvirt::Domain::SAVE_PARAM_FILE => $GUEST_SAVE})
+
+`rm -f #{$GUEST_SAVE}`
+
 newdom.destroy
 newdom.undefine
 
@@ -481,7 +573,7 @@ sleep 1
 expect_too_many_args(newdom, "memory_stats", 1, 2)
 expect_invalid_arg_type(newdom, "memory_stats", "foo")
 
-expect_success(newdom, "no args", "memory_stats")
+expect_success(newdom, "no args", "memory_stats") {|x| x.all? {|s| s.tag.is_a?(Integer) and s.value.is_a?(Integer)}}
 
 newdom.destroy
 
@@ -525,6 +617,39 @@ expect_fail(newdom, Libvirt::RetrieveError, "invalid path", "block_peek", "foo",
 
 newdom.destroy
 
+# TESTGROUP: dom.block_peek_into
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(newdom, "block_peek_into", 1, 2, 3, 4, 5, 6, 7)
+expect_too_few_args(newdom, "block_peek_into")
+expect_too_few_args(newdom, "block_peek_into", "foo", 0, 512)
+expect_invalid_arg_type(newdom, "block_peek_into", 1, 2, 3, "")
+expect_invalid_arg_type(newdom, "block_peek_into", "foo", "bar", 3, "")
+expect_invalid_arg_type(newdom, "block_peek_into", "foo", 0, 512, 5)
+expect_invalid_arg_type(newdom, "block_peek_into", "foo", 0, 512, "", "baz")
+expect_invalid_arg_type(newdom, "block_peek_into", "foo", 0, 512, "", 0, 1)
+expect_fail(newdom, Libvirt::RetrieveError, "invalid path", "block_peek_into", "foo", 0, 512, "")
+
+# FIXME: we need a raw disk image on the guest to check the data read
+# expect_success(newdom, "path, offset, size and String args", "block_peek_into", $GUEST_RAW_DISK, 0, 200000, "", chunk_size: 4096) {|x| x.length == 200000}
+
+newdom.destroy
+
+# TESTGROUP: dom.block_peek_each
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(newdom, "block_peek_each", 1, 2, 3, 4, 5, 6)
+expect_too_few_args(newdom, "block_peek_each")
+expect_too_few_args(newdom, "block_peek_each", "foo", 0)
+expect_invalid_arg_type(newdom, "block_peek_each", 1, 2, 3)
+expect_invalid_arg_type(newdom, "block_peek_each", "foo", 0, 512, "baz")
+
+expect_success(newdom, "no block", "block_peek_each", "foo", 0, 512) {|x| x.is_a?(Enumerator)}
+
+newdom.destroy
+
 # TESTGROUP: dom.memory_peek
 newdom = conn.create_domain_xml($new_dom_xml)
 sleep 1
@@ -540,6 +665,41 @@ expect_success(newdom, "offset and size args", "memory_peek", 0, 512)
 
 newdom.destroy
 
+# TESTGROUP: dom.memory_peek_into
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(newdom, "memory_peek_into", 1, 2, 3, 4, 5, 6)
+expect_too_few_args(newdom, "memory_peek_into")
+expect_too_few_args(newdom, "memory_peek_into", 0, 512)
+expect_invalid_arg_type(newdom, "memory_peek_into", "foo", 2, "")
+expect_invalid_arg_type(newdom, "memory_peek_into", 0, "bar", "")
+expect_invalid_arg_type(newdom, "memory_peek_into", 0, 512, 5)
+expect_invalid_arg_type(newdom, "memory_peek_into", 0, 512, "", "baz")
+expect_invalid_arg_type(newdom, "memory_peek_into", 0, 512, "", 0, 1)
+expect_fail(newdom, ArgumentError, "chunk_size 0", "memory_peek_into", 0, 512, "", chunk_size: 0)
+expect_fail(newdom, ArgumentError, "chunk_size over the protocol limit", "memory_peek_into", 0, 512, "", chunk_size: 65537)
+
+expect_success(newdom, "start, size and String args", "memory_peek_into", 0, 512, "") {|x| x.length == 512}
+expect_success(newdom, "String bigger than one chunk", "memory_peek_into", 0, 200000, "", chunk_size: 65536, threads: 2) {|x| x.length == 200000}
+expect_success(newdom, "IO arg", "memory_peek_into", 0, 200000, StringIO.new) {|x| x.string.length == 200000}
+
+newdom.destroy
+
+# TESTGROUP: dom.memory_peek_each
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(newdom, "memory_peek_each", 1, 2, 3, 4, 5)
+expect_too_few_args(newdom, "memory_peek_each")
+expect_too_few_args(newdom, "memory_peek_each", 0)
+expect_invalid_arg_type(newdom, "memory_peek_each", "foo", 2)
+expect_invalid_arg_type(newdom, "memory_peek_each", 0, 512, "baz")
+
+expect_success(newdom, "no block", "memory_peek_each", 0, 200000, chunk_size: 65536) {|x| x.to_a.map {|data, offset| offset} == [0, 65536, 131072, 196608]}
+
+newdom.destroy
+
 # TESTGROUP: dom.get_vcpus
 expect_too_many_args(newdom, "get_vcpus", 1)
 
@@ -599,6 +759,16 @@ expect_success(newdom, "interface arg", "ifinfo", "rl556")
 
 newdom.destroy
 
+# TESTGROUP: dom.connection
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(newdom, "connection", 1)
+
+expect_success(newdom, "no args", "connection") {|x| x == conn}
+
+newdom.destroy
+
 # TESTGROUP: dom.name
 newdom = conn.create_domain_xml($new_dom_xml)
 sleep 1
@@ -718,6 +888,9 @@ expect_invalid_arg_type(newdom, "pin_vcpu", 'foo', [0])
 expect_invalid_arg_type(newdom, "pin_vcpu", 0, 1)
 
 expect_success(newdom, "cpu args", "pin_vcpu", 0, [0])
+expect_success(newdom, "cpumap arg", "pin_vcpu", 0, Libvirt::CPUMap.new(conn.node_max_cpus, [0]))
+expect_fail(newdom, ArgumentError, "cpu out of range", "pin_vcpu", 0, [conn.node_max_cpus])
+expect_success(newdom, "cpu bitmap", "vcpus") {|x| x[0].cpu_bitmap.to_a == x[0].cpumap}
 
 newdom.destroy
 
@@ -853,6 +1026,17 @@ expect_too_many_args(newdom, "free", 1)
 
 expect_success(newdom, "free", "free")
 
+# TESTGROUP: dom handle
+newdom = conn.define_domain_xml($new_dom_xml)
+
+expect_success(ObjectSpace, "domain arg", "memsize_of", newdom) {|x| x > 0}
+GC.compact if GC.respond_to?(:compact)
+expect_success(newdom, "after compaction", "name") {|x| x == "rb-libvirt-test"}
+
+newdom.undefine
+newdom.free
+expect_fail(newdom, ArgumentError, "freed domain", "name")
+
 # TESTGROUP: dom.snapshot_create_xml
 newdom = conn.define_domain_xml($new_dom_xml)
 
@@ -994,6 +1178,34 @@ expect_fail(newdom, Libvirt::Error, "no active job", "abort_job")
 
 newdom.destroy
 
+# TESTGROUP: dom.monitor_job
+newdom = conn.create_domain_xml($new_dom_xml)
+sleep 1
+
+expect_too_many_args(newdom, "monitor_job", 1, 2, 3)
+expect_invalid_arg_type(newdom, "monitor_job", 'foo')
+expect_invalid_arg_type(newdom, "monitor_job", 10, 'foo')
+expect_fail(newdom, RuntimeError, "no block", "monitor_job")
+
+samples = []
+begin
+  last = newdom.monitor_job(10) {|p| samples << p}
+  if samples.length != 1 or last != samples[0] or last.type != Libvirt::Domain::JobInfo::NONE or not last.remaining_time.nil?
+    puts_fail "domain.monitor_job with no job did not return a single idle sample"
+  else
+    puts_ok "domain.monitor_job with no job returned a single idle sample"
+  end
+rescue NoMethodError
+  puts_skipped "domain.monitor_job does not exist"
+end
+
+# FIXME: need to start long running job here
+#samples = []
+#newdom.monitor_job(100) {|p| samples << p}
+#expect_success(samples, "migration running", "last") {|x| x.type == Libvirt::Domain::JobInfo::COMPLETED}
+
+newdom.destroy
+
 # TESTGROUP: dom.scheduler_type
 newdom = conn.define_domain_xml($new_dom_xml)
 
@@ -1116,6 +1328,12 @@ newdom = conn.define_domain_xml($new_dom_xml)
 expect_too_many_args(newdom, "memory_parameters", 1, 2)
 
 expect_success(newdom, "no args", "memory_parameters")
+params = newdom.memory_parameters
+expect_success(newdom, "cached parameter count", "memory_parameters") {|x| x.keys.sort == params.keys.sort}
+expect_success(newdom, "frozen keys", "memory_parameters") {|x| x.keys.all? {|k| k.frozen?}}
+expect_success(newdom, "symbol keys", "memory_parameters", :keys => :symbol) {|x| x.keys.all? {|k| k.kind_of?(Symbol)}}
+expect_fail(newdom, ArgumentError, "invalid keys option", "memory_parameters", :keys => :foo)
+expect_fail(newdom, ArgumentError, "unknown option", "memory_parameters", :keys => :symbol, :flags => 0)
 
 newdom.undefine
 
@@ -1275,6 +1493,31 @@ expect_success(newdom, "no args", "list_all_snapshots")
 newdom.undefine(Libvirt::Domain::UNDEFINE_SNAPSHOTS_METADATA)
 sleep 1
 
+# TESTGROUP: domain.snapshot_tree
+newdom = conn.define_domain_xml($new_dom_xml)
+root = newdom.snapshot_create_xml("<domainsnapshot><name>root</name></domainsnapshot>")
+child = newdom.snapshot_create_xml("<domainsnapshot><name>child &amp; more</name></domainsnapshot>")
+
+expect_too_many_args(newdom, "snapshot_tree", 0, {}, 1)
+expect_invalid_arg_type(newdom, "snapshot_tree", 'foo')
+expect_invalid_arg_type(newdom, "snapshot_tree", 0, 'foo')
+expect_invalid_arg_type(newdom, "snapshot_tree", :threads => 'foo')
+expect_fail(newdom, ArgumentError, "unknown option", "snapshot_tree", :thread => 1)
+
+expect_success(newdom, "no args", "snapshot_tree") {|x|
+  x.length == 1 and x[0].name == "root" and x[0].parent.nil? and
+    x[0].children.length == 1 and x[0].children[0].name == "child & more" and
+    x[0].children[0].parent == "root" and x[0].children[0].current and
+    not x[0].current and x[0].xml.nil? and
+    x[0].snapshot.class == Libvirt::Domain::Snapshot and
+    x[0].creation_time > 0 and x[0].state.class == String
+}
+expect_success(newdom, "flags and options", "snapshot_tree", 0, :threads => 1, :xml => true) {|x| x[0].xml.include?("<name>root</name>")}
+expect_success(newdom, "roots only", "snapshot_tree", Libvirt::Domain::Snapshot::LIST_ROOTS) {|x| x.length == 1 and x[0].children.empty?}
+
+newdom.undefine(Libvirt::Domain::UNDEFINE_SNAPSHOTS_METADATA)
+sleep 1
+
 # TESTGROUP: domain.open_graphics
 newdom = conn.create_domain_xml($new_dom_xml)
 sleep 1
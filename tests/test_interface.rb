@@ -61,6 +61,15 @@ expect_success(newiface, "no args", "active?") {|x| x == false}
 #newiface.destroy
 newiface.undefine
 
+# TESTGROUP: iface.connection
+newiface = conn.define_interface_xml($new_interface_xml)
+
+expect_too_many_args(newiface, "connection", 1)
+
+expect_success(newiface, "no args", "connection") {|x| x == conn}
+
+newiface.undefine
+
 # TESTGROUP: iface.name
 newiface = conn.define_interface_xml($new_interface_xml)
 
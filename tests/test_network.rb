@@ -52,6 +52,15 @@ expect_too_many_args(newnet, "destroy", 1)
 
 expect_success(newnet, "no args", "destroy")
 
+# TESTGROUP: net.connection
+newnet = conn.create_network_xml($new_net_xml)
+
+expect_too_many_args(newnet, "connection", 1)
+
+expect_success(newnet, "no args", "connection") {|x| x == conn}
+
+newnet.destroy
+
 # TESTGROUP: net.name
 newnet = conn.create_network_xml($new_net_xml)
 
@@ -11,6 +11,13 @@ set_test_object("nodedevice")
 
 conn = Libvirt::open(URI)
 
+# TESTGROUP: nodedevice.connection
+testnode = conn.lookup_nodedevice_by_name(conn.list_nodedevices[0])
+
+expect_too_many_args(testnode, "connection", 1)
+
+expect_success(testnode, "no args", "connection") {|x| x == conn}
+
 # TESTGROUP: nodedevice.name
 testnode = conn.lookup_nodedevice_by_name(conn.list_nodedevices[0])
 
@@ -18,6 +18,15 @@ expect_too_many_args(newnw, "undefine", 1)
 
 expect_success(newnw, "no args", "undefine")
 
+# TESTGROUP: nwfilter.connection
+newnw = conn.define_nwfilter_xml($new_nwfilter_xml)
+
+expect_too_many_args(newnw, "connection", 1)
+
+expect_success(newnw, "no args", "connection") {|x| x == conn}
+
+newnw.undefine
+
 # TESTGROUP: nwfilter.name
 newnw = conn.define_nwfilter_xml($new_nwfilter_xml)
 
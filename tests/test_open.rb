@@ -245,6 +245,226 @@ expect_success(Libvirt, "unregister all callbacks", "event_register_impl", nil,
 expect_success(Libvirt, "all Proc callbacks", "event_register_impl", virEventAddHandleProc, virEventUpdateHandleProc, virEventRemoveHandleProc, virEventAddTimerProc, virEventUpdateTimerProc, virEventRemoveTimerProc)
 expect_success(Libvirt, "unregister all callbacks", "event_register_impl")
 
+# TESTGROUP: Libvirt::event_run_default_impl_in_thread
+expect_too_many_args(Libvirt, "event_run_default_impl_in_thread", 1)
+
+# FIXME: this replaces the event implementation for the rest of the process,
+# so it can't be mixed with the event_register_impl tests above
+#expect_success(Libvirt, "no args", "event_run_default_impl_in_thread") {|x| x.alive?}
+
+# TESTGROUP: Libvirt::call_stats
+expect_too_many_args(Libvirt, "call_stats", 1)
+expect_too_many_args(Libvirt, "reset_call_stats", 1)
+expect_too_many_args(Libvirt, "call_stats_enabled?", 1)
+
+expect_success(Libvirt, "no args", "call_stats_enabled?") {|x| x == false}
+expect_success(Libvirt, "no args", "reset_call_stats") {|x| x.nil?}
+Libvirt.call_stats_enabled = true
+expect_success(Libvirt, "no args", "call_stats_enabled?") {|x| x == true}
+
+conn = Libvirt::open(URI)
+conn.capabilities
+expect_fail(conn, Libvirt::RetrieveError, "invalid name", "lookup_domain_by_name", "no-such-domain")
+conn.close
+
+expect_success(Libvirt, "no args", "call_stats") {|x|
+  caps = x["virConnectGetCapabilities"]
+  lookup = x["virDomainLookupByName"]
+  caps["calls"] == 1 and caps["errors"] == 0 and caps["timed_calls"] == 1 and
+    caps["time"] >= caps["max_time"] and
+    caps["histogram"].last[0] == Float::INFINITY and
+    caps["histogram"].map {|b| b[1]}.inject(:+) == 1 and
+    lookup["calls"] == 1 and lookup["errors"] == 1
+}
+
+Libvirt.call_stats_enabled = false
+expect_success(Libvirt, "no args", "reset_call_stats") {|x| x.nil?}
+expect_success(Libvirt, "no args", "call_stats") {|x| x.empty?}
+
+# TESTGROUP: Libvirt::ConnectionPool
+if defined?(Libvirt::ConnectionPool)
+  set_test_object("Libvirt::ConnectionPool")
+  klass = Libvirt::ConnectionPool
+
+  expect_too_many_args(klass, "new", URI, {}, 1)
+  expect_invalid_arg_type(klass, "new", 1)
+  expect_invalid_arg_type(klass, "new", URI, 1)
+  expect_fail(klass, ArgumentError, "zero size", "new", URI, :size => 0)
+  expect_fail(klass, Libvirt::ConnectionError, "invalid driver", "new", "foo://bar.baz/", :size => 1)
+
+  pool = expect_success(klass, "uri and size", "new", URI, :size => 2, :timeout => 0.1) {|x| x.size == 2 and x.available == 2 and x.opened == 2}
+  set_test_object("pool")
+
+  conn = expect_success(pool, "no args", "checkout") {|x| x.class == Libvirt::Connect and pool.available == 1}
+  expect_success(pool, "same thread", "checkout") {|x| x.equal?(conn) and pool.available == 1}
+  pool.checkin
+  expect_success(pool, "no args", "checkin") {|x| x.nil? and pool.available == 2}
+  expect_fail(pool, ArgumentError, "not checked out", "checkin")
+
+  expect_too_many_args(pool, "with", 1)
+  expect_fail(pool, RuntimeError, "no block", "with")
+  pool.with { |c| c.capabilities }
+
+  # a connection closed behind the pool's back is replaced
+  conn = pool.checkout
+  conn.close
+  pool.checkin
+  expect_success(pool, "closed connection", "evicted") {|x| x == 1}
+  pool.with { |c| c.capabilities }
+
+  # a second thread can't get a connection while both are held
+  pool.checkout
+  waiter = Thread.new { pool.with { |c| Thread.new { pool.checkout }.join } }
+  begin
+    waiter.join
+    puts_fail "pool.checkout all in use expected to throw Libvirt::ConnectionError, but threw nothing"
+  rescue Libvirt::ConnectionError
+    puts_ok "pool.checkout all in use threw Libvirt::ConnectionError"
+  end
+  pool.checkin
+
+  set_test_object("Libvirt::ConnectionPool")
+  shared = expect_success(klass, "uri", "shared", URI, :size => 1) {|x| x.class == klass}
+  expect_success(klass, "same uri", "shared", URI) {|x| x.equal?(shared)}
+  expect_success(klass, "read only", "shared", URI, :read_only => true) {|x| not x.equal?(shared)}
+
+  set_test_object("pool")
+  expect_success(pool, "no args", "close") {|x| x.nil? and pool.closed?}
+  expect_fail(pool, ArgumentError, "closed pool", "checkout")
+  set_test_object("Libvirt")
+end
+
+# TESTGROUP: Libvirt::fiber_scheduler_enabled
+expect_too_many_args(Libvirt, "fiber_scheduler_enabled?", 1)
+expect_success(Libvirt, "no args", "fiber_scheduler_enabled?") {|x| x == false}
+Libvirt.fiber_scheduler_enabled = true if Libvirt.respond_to?(:fiber_scheduler_enabled=)
+expect_success(Libvirt, "after enabling", "fiber_scheduler_enabled?") {|x| x == true}
+
+# a plain (blocking) fiber has no scheduler, so calls are made as before
+Fiber.new {
+  conn = Libvirt::open(URI)
+  expect_success(conn, "blocking fiber", "list_all_domains") {|x| x.class == Array}
+  conn.close
+}.resume
+
+# just enough of a Fiber scheduler for the non-blocking path, which waits
+# for the worker's pipe through io_wait
+class TestScheduler
+  def initialize
+    @readable = {}
+    @ready = []
+    @sleeping = {}
+  end
+
+  def io_wait(io, events, timeout)
+    @readable[io] = Fiber.current
+    Fiber.yield
+    events
+  end
+
+  def block(blocker, timeout = nil)
+    if timeout
+      kernel_sleep(timeout)
+    else
+      Fiber.yield
+    end
+  end
+
+  def unblock(blocker, fiber)
+    @ready << fiber
+  end
+
+  def kernel_sleep(duration = nil)
+    @sleeping[Fiber.current] = Time.now + (duration || 0)
+    Fiber.yield
+  end
+
+  def fiber(&block)
+    fiber = Fiber.new(blocking: false, &block)
+    fiber.resume
+    fiber
+  end
+
+  def close
+    until @readable.empty? and @ready.empty? and @sleeping.empty?
+      if not @readable.empty?
+        readable, = IO.select(@readable.keys, nil, nil, 0.01)
+        (readable || []).each {|io| @ready << @readable.delete(io)}
+      end
+      now = Time.now
+      @sleeping.select {|f, t| t <= now}.each_key {|f|
+        @sleeping.delete(f)
+        @ready << f
+      }
+      @ready.shift.resume until @ready.empty?
+    end
+  end
+end
+
+if Fiber.respond_to?(:set_scheduler)
+  conn = Libvirt::open(URI)
+  results = []
+  Thread.new {
+    Fiber.set_scheduler(TestScheduler.new)
+    Fiber.schedule { results << conn.list_all_domains }
+    Fiber.schedule { results << conn.find_domain_by_name("rb-libvirt-no-such-domain") }
+    Fiber.set_scheduler(nil)
+  }.join
+  if results.length == 2 and results.include?(nil) and results.any? {|x| x.is_a?(Array)}
+    puts_ok "Libvirt calls from non-blocking fibers succeeded"
+  else
+    puts_fail "Libvirt calls from non-blocking fibers returned #{results.inspect}"
+  end
+  conn.close
+end
+
+expect_too_many_args(Libvirt, "fiber_scheduler_workers", 1)
+expect_invalid_arg_type(Libvirt, "fiber_scheduler_workers=", "foo")
+expect_fail(Libvirt, ArgumentError, "zero workers", "fiber_scheduler_workers=", 0)
+expect_success(Libvirt, "no args", "fiber_scheduler_workers") {|x| x == 16}
+Libvirt.fiber_scheduler_enabled = false if Libvirt.respond_to?(:fiber_scheduler_enabled=)
+
+# TESTGROUP: Ractor
+if defined?(Ractor)
+  r = Ractor.new(URI) {|uri|
+    conn = Libvirt::open(uri)
+    count = conn.list_all_domains.length
+    begin
+      conn.domain_event_register_any(Libvirt::Connect::DOMAIN_EVENT_ID_LIFECYCLE, proc {})
+      unsafe = false
+    rescue Ractor::UnsafeError
+      unsafe = true
+    end
+    conn.close
+    [count, unsafe]
+  }
+  result = r.respond_to?(:value) ? r.value : r.take
+  if result[0].is_a?(Integer) and result[1] == true
+    puts_ok "Libvirt::open in a Ractor succeeded"
+  else
+    puts_fail "Libvirt::open in a Ractor returned #{result.inspect}"
+  end
+
+  # libvirt would call the Ruby event callbacks from inside the open, so
+  # it has to be refused before libvirt is entered
+  Libvirt::event_register_impl(virEventAddHandleProc, virEventUpdateHandleProc, virEventRemoveHandleProc, virEventAddTimerProc, virEventUpdateTimerProc, virEventRemoveTimerProc)
+  r = Ractor.new(URI) {|uri|
+    begin
+      Libvirt::open(uri).close
+      false
+    rescue Ractor::UnsafeError
+      true
+    end
+  }
+  result = r.respond_to?(:value) ? r.value : r.take
+  Libvirt::event_register_impl
+  if result
+    puts_ok "Libvirt::open in a Ractor with Ruby event callbacks threw Ractor::UnsafeError"
+  else
+    puts_fail "Libvirt::open in a Ractor with Ruby event callbacks expected to throw Ractor::UnsafeError"
+  end
+end
+
 # END TESTS
 
 finish_tests
@@ -11,6 +11,15 @@ set_test_object("secret")
 
 conn = Libvirt::open("qemu:///system")
 
+# TESTGROUP: secret.connection
+newsecret = conn.define_secret_xml($new_secret_xml)
+
+expect_too_many_args(newsecret, "connection", 1)
+
+expect_success(newsecret, "no args", "connection") {|x| x == conn}
+
+newsecret.undefine
+
 # TESTGROUP: secret.uuid
 newsecret = conn.define_secret_xml($new_secret_xml)
 
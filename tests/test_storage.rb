@@ -115,6 +115,15 @@ expect_success(newpool, "no args", "refresh")
 
 newpool.destroy
 
+# TESTGROUP: pool.connection
+newpool = conn.create_storage_pool_xml($new_storage_pool_xml)
+
+expect_too_many_args(newpool, "connection", 1)
+
+expect_success(newpool, "no args", "connection") {|x| x == conn}
+
+newpool.destroy
+
 # TESTGROUP: pool.name
 newpool = conn.create_storage_pool_xml($new_storage_pool_xml)
 
@@ -232,6 +241,20 @@ expect_success(newpool, "name arg", "lookup_volume_by_name", "test.img")
 newvol.delete
 newpool.destroy
 
+# TESTGROUP: pool.find_volume_by_name
+newpool = conn.create_storage_pool_xml($new_storage_pool_xml)
+newvol = newpool.create_volume_xml(new_storage_vol_xml)
+
+expect_too_many_args(newpool, "find_volume_by_name", 1, 2)
+expect_too_few_args(newpool, "find_volume_by_name")
+expect_invalid_arg_type(newpool, "find_volume_by_name", 1);
+
+expect_success(newpool, "non-existent name arg", "find_volume_by_name", "foobarbazsucker") {|x| x.nil?}
+expect_success(newpool, "name arg", "find_volume_by_name", "test.img") {|x| x.name == "test.img"}
+
+newvol.delete
+newpool.destroy
+
 # TESTGROUP: pool.lookup_volume_by_key
 newpool = conn.create_storage_pool_xml($new_storage_pool_xml)
 newvol = newpool.create_volume_xml(new_storage_vol_xml)
@@ -347,6 +370,30 @@ expect_success(newpool, "no args", "list_all_volumes")
 
 newpool.destroy
 
+# TESTGROUP: pool.volumes_with_info
+newpool = conn.create_storage_pool_xml($new_storage_pool_xml)
+sleep 1
+
+expect_too_many_args(newpool, "volumes_with_info", 1, {}, 2)
+expect_invalid_arg_type(newpool, "volumes_with_info", 'foo')
+expect_invalid_arg_type(newpool, "volumes_with_info", [])
+expect_invalid_arg_type(newpool, "volumes_with_info", 0, 'foo')
+expect_invalid_arg_type(newpool, "volumes_with_info", 0, :threads => 'foo')
+expect_fail(newpool, ArgumentError, "unknown option", "volumes_with_info", :refersh => true)
+
+expect_success(newpool, "no args", "volumes_with_info") {|x| x.empty?}
+
+newvol = newpool.create_volume_xml(new_storage_vol_xml)
+
+expect_success(newpool, "no args", "volumes_with_info") {|x| x.length == 1 and x[0].name == "test.img" and x[0].key == newvol.key and x[0].path == newvol.path and x[0].capacity == newvol.info.capacity and x[0].error.nil?}
+expect_success(newpool, "flags arg", "volumes_with_info", 0) {|x| x.length == 1}
+expect_success(newpool, "refresh arg", "volumes_with_info", :refresh => true) {|x| x.length == 1}
+expect_success(newpool, "threads arg", "volumes_with_info", 0, :threads => 1) {|x| x[0].volume.name == "test.img"}
+
+newvol.delete
+
+newpool.destroy
+
 set_test_object("storage_volume")
 
 # TESTGROUP: vol.name
@@ -501,6 +548,52 @@ expect_success(newvol, "stream, offset, and length args", "upload", stream, 0, 1
 newvol.delete
 newpool.destroy
 
+# TESTGROUP: vol.download_to
+newpool = conn.create_storage_pool_xml($new_storage_pool_xml)
+newvol = newpool.create_volume_xml(new_storage_vol_xml)
+
+expect_too_many_args(newvol, "download_to", "/dev/null", 1, 2, 3, 4)
+expect_too_few_args(newvol, "download_to")
+expect_invalid_arg_type(newvol, "download_to", nil)
+expect_invalid_arg_type(newvol, "download_to", 1)
+expect_invalid_arg_type(newvol, "download_to", [])
+expect_invalid_arg_type(newvol, "download_to", "/dev/null", 'foo')
+expect_invalid_arg_type(newvol, "download_to", "/dev/null", 0, 'foo')
+expect_invalid_arg_type(newvol, "download_to", "/dev/null", 0, 0, 'foo')
+expect_fail(newvol, Errno::ENOENT, "nonexistent directory", "download_to", "/nonexistent/dir/vol")
+File.open("/dev/null", "r") do |f|
+  expect_fail(newvol, IOError, "IO not open for writing", "download_to", f)
+end
+
+# FIXME: the test driver doesn't produce any volume data to stream
+#expect_success(newvol, "path arg", "download_to", "/dev/null")
+
+newvol.delete
+newpool.destroy
+
+# TESTGROUP: vol.upload_from
+newpool = conn.create_storage_pool_xml($new_storage_pool_xml)
+newvol = newpool.create_volume_xml(new_storage_vol_xml)
+
+expect_too_many_args(newvol, "upload_from", "/dev/null", 1, 2, 3, 4)
+expect_too_few_args(newvol, "upload_from")
+expect_invalid_arg_type(newvol, "upload_from", nil)
+expect_invalid_arg_type(newvol, "upload_from", 1)
+expect_invalid_arg_type(newvol, "upload_from", [])
+expect_invalid_arg_type(newvol, "upload_from", "/dev/null", 'foo')
+expect_invalid_arg_type(newvol, "upload_from", "/dev/null", 0, 'foo')
+expect_invalid_arg_type(newvol, "upload_from", "/dev/null", 0, 0, 'foo')
+expect_fail(newvol, Errno::ENOENT, "nonexistent file", "upload_from", "/nonexistent/dir/vol")
+File.open("/dev/null", "w") do |f|
+  expect_fail(newvol, IOError, "IO not open for reading", "upload_from", f)
+end
+
+# FIXME: the test driver doesn't accept any volume data over a stream
+#expect_success(newvol, "path arg", "upload_from", "/dev/null")
+
+newvol.delete
+newpool.destroy
+
 # TESTGROUP: vol.upload
 newpool = conn.create_storage_pool_xml($new_storage_pool_xml)
 newvol = newpool.create_volume_xml(new_storage_vol_xml)
@@ -11,15 +11,28 @@ set_test_object("stream")
 
 conn = Libvirt::open(URI)
 
+# TESTGROUP: stream.connection
+st = conn.stream
+
+expect_too_many_args(st, "connection", 1)
+
+expect_success(st, "no args", "connection") {|x| x == conn}
+
+st.free
+
 # TESTGROUP: stream.send
 st = conn.stream
 
-expect_too_many_args(st, "send", 1, 2)
+expect_too_many_args(st, "send", 1, 2, 3, 4)
 expect_too_few_args(st, "send")
 expect_invalid_arg_type(st, "send", 1)
 expect_invalid_arg_type(st, "send", nil)
 expect_invalid_arg_type(st, "send", [])
 expect_invalid_arg_type(st, "send", {})
+expect_invalid_arg_type(st, "send", "foo", "bar")
+expect_invalid_arg_type(st, "send", "foo", 0, "bar")
+expect_fail(st, ArgumentError, "offset past end of buffer", "send", "foo", 4)
+expect_fail(st, ArgumentError, "length past end of buffer", "send", "foo", 1, 3)
 
 # FIXME: we need to setup a proper stream for this to work
 #expect_success(st, "buffer arg", "send", buffer)
@@ -41,6 +54,23 @@ expect_invalid_arg_type(st, "recv", {})
 
 st.free
 
+# TESTGROUP: stream.recv_into
+st = conn.stream
+
+expect_too_many_args(st, "recv_into", "", 1, 2, 3)
+expect_too_few_args(st, "recv_into")
+expect_invalid_arg_type(st, "recv_into", nil)
+expect_invalid_arg_type(st, "recv_into", 1)
+expect_invalid_arg_type(st, "recv_into", "", "foo")
+expect_invalid_arg_type(st, "recv_into", "", 0, "foo")
+expect_fail(st, ArgumentError, "offset past end of buffer", "recv_into", "foo", 4)
+expect_fail(st, ArgumentError, "negative bytes", "recv_into", "", 0, -1)
+
+# FIXME: we need to setup a proper stream for this to work
+#expect_success(st, "buffer arg", "recv_into", String.new(capacity: 4096))
+
+st.free
+
 # TESTGROUP: stream.sendall
 st = conn.stream
 
@@ -87,6 +117,125 @@ expect_fail(st, RuntimeError, "no block given", "recvall")
 
 st.free
 
+# TESTGROUP: stream.recvall_to_io
+st = conn.stream
+
+expect_too_many_args(st, "recvall_to_io", 1, 2, 3)
+expect_too_few_args(st, "recvall_to_io")
+expect_invalid_arg_type(st, "recvall_to_io", nil)
+expect_invalid_arg_type(st, "recvall_to_io", 'foo')
+File.open("/dev/null", "r") do |f|
+  expect_fail(st, IOError, "IO not open for writing", "recvall_to_io", f)
+end
+
+# FIXME: we need to setup a proper stream for this to work
+#File.open("/dev/null", "w") {|f| expect_success(st, "io arg", "recvall_to_io", f)}
+#File.open("/dev/null", "w") {|f| expect_success(st, "io and sparse arg", "recvall_to_io", f, true)}
+
+st.free
+
+# TESTGROUP: stream.sendall_from_io
+st = conn.stream
+
+expect_too_many_args(st, "sendall_from_io", 1, 2, 3)
+expect_too_few_args(st, "sendall_from_io")
+expect_invalid_arg_type(st, "sendall_from_io", nil)
+expect_invalid_arg_type(st, "sendall_from_io", 'foo')
+File.open("/dev/null", "w") do |f|
+  expect_fail(st, IOError, "IO not open for reading", "sendall_from_io", f)
+end
+
+# FIXME: we need to setup a proper stream for this to work
+#File.open("/dev/null", "r") {|f| expect_success(st, "io arg", "sendall_from_io", f)}
+#File.open("/dev/null", "r") {|f| expect_success(st, "io and sparse arg", "sendall_from_io", f, true)}
+
+st.free
+
+# TESTGROUP: stream.recv_flags
+st = conn.stream
+
+expect_too_many_args(st, "recv_flags", 1, 2, 3)
+expect_too_few_args(st, "recv_flags")
+expect_invalid_arg_type(st, "recv_flags", 'foo')
+expect_invalid_arg_type(st, "recv_flags", 4096, 'foo')
+
+# FIXME: we need to setup a proper stream for this to work
+#expect_success(st, "bytes arg", "recv_flags", 4096, Libvirt::Stream::RECV_STOP_AT_HOLE)
+
+st.free
+
+# TESTGROUP: stream.recv_hole
+st = conn.stream
+
+expect_too_many_args(st, "recv_hole", 1, 2)
+expect_invalid_arg_type(st, "recv_hole", 'foo')
+
+# FIXME: we need to setup a proper stream for this to work
+#expect_success(st, "no args", "recv_hole")
+
+st.free
+
+# TESTGROUP: stream.send_hole
+st = conn.stream
+
+expect_too_many_args(st, "send_hole", 1, 2, 3)
+expect_too_few_args(st, "send_hole")
+expect_invalid_arg_type(st, "send_hole", 'foo')
+expect_invalid_arg_type(st, "send_hole", 4096, 'foo')
+
+# FIXME: we need to setup a proper stream for this to work
+#expect_success(st, "length arg", "send_hole", 4096)
+
+st.free
+
+# TESTGROUP: stream.sparse_recvall
+st = conn.stream
+
+# equivalent to expect_too_many_args
+begin
+  st.sparse_recvall(1, 2, 3) {|x,y| x = y}
+rescue NoMethodError
+  puts_skipped "#{$test_object}.sparse_recvall does not exist"
+rescue ArgumentError => e
+  puts_ok "#{$test_object}.sparse_recvall too many args threw #{ArgumentError.to_s}"
+rescue => e
+  puts_fail "#{$test_object}.sparse_recvall too many args expected to throw #{ArgumentError.to_s}, but instead threw #{e.class.to_s}: #{e.to_s}"
+else
+  puts_fail "#{$test_object}.sparse_recvall too many args expected to throw #{ArgumentError.to_s}, but threw nothing"
+end
+
+expect_fail(st, RuntimeError, "no block given", "sparse_recvall",
+            lambda {|length,opaque| 0})
+
+# FIXME: we need to setup a proper stream for this to work
+#st.sparse_recvall(lambda {|length,opaque| 0}) {|data,opaque| data.length}
+
+st.free
+
+# TESTGROUP: stream.sparse_sendall
+st = conn.stream
+
+# equivalent to expect_too_many_args
+begin
+  st.sparse_sendall(1, 2, 3, 4) {|x,y| x = y}
+rescue NoMethodError
+  puts_skipped "#{$test_object}.sparse_sendall does not exist"
+rescue ArgumentError => e
+  puts_ok "#{$test_object}.sparse_sendall too many args threw #{ArgumentError.to_s}"
+rescue => e
+  puts_fail "#{$test_object}.sparse_sendall too many args expected to throw #{ArgumentError.to_s}, but instead threw #{e.class.to_s}: #{e.to_s}"
+else
+  puts_fail "#{$test_object}.sparse_sendall too many args expected to throw #{ArgumentError.to_s}, but threw nothing"
+end
+
+expect_fail(st, RuntimeError, "no block given", "sparse_sendall",
+            lambda {|opaque| [true, 0]}, lambda {|length,opaque| 0})
+
+# FIXME: we need to setup a proper stream for this to work
+#st.sparse_sendall(lambda {|opaque| [true, 0]}, lambda {|length,opaque| 0}) {|opaque,nbytes| [0, ""]}
+
+st.free
+
 # TESTGROUP: stream.event_add_callback
 st_event_callback_proc = lambda {|stream,events,opaque|
 }